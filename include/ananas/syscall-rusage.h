@@ -0,0 +1,21 @@
+#ifndef ANANAS_RUSAGE_H
+#define ANANAS_RUSAGE_H
+
+/* Whose usage to retrieve */
+#define RUSAGE_INFO_SELF	0
+#define RUSAGE_INFO_CHILDREN	1	/* children that were waited for */
+
+/* Memory is in pages; resident pages of children are always zero */
+struct RUSAGE_INFO {
+	size_t		ri_size;		/* must be sizeof(RUSAGE_INFO) */
+
+	unsigned long	ri_anon_pages;		/* resident anonymous pages */
+	unsigned long	ri_file_pages;		/* resident pages of mapped files */
+	unsigned long	ri_max_resident;	/* largest number of resident pages */
+
+	unsigned long	ri_minor_faults;	/* faults resolved without reading */
+	unsigned long	ri_major_faults;	/* faults which had to read from a file */
+	unsigned long	ri_cow_faults;		/* writes which needed a copy of their own */
+};
+
+#endif /* ANANAS_RUSAGE_H */
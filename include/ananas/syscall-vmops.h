@@ -7,6 +7,9 @@ typedef enum {
 
 	/* Removes a mapping - only va_addr/va_len are used */
 	OP_UNMAP,
+
+	/* Advises how a range will be used - vo_flags is a VMOP_ADVICE_... value */
+	OP_ADVISE,
 } VMOP_OPERATION;
 
 /* Permissions, can be combined */
@@ -24,6 +27,13 @@ typedef enum {
 /* If set, force mapping to be placed here */
 #define VMOP_FLAG_FIXED		0x0040
 
+/* Advice for OP_ADVISE */
+#define VMOP_ADVICE_NORMAL	0	/* no special treatment */
+#define VMOP_ADVICE_RANDOM	1	/* expect random access; do not read ahead */
+#define VMOP_ADVICE_SEQUENTIAL	2	/* expect sequential access; read ahead aggressively */
+#define VMOP_ADVICE_WILLNEED	3	/* start reading the range in */
+#define VMOP_ADVICE_DONTNEED	4	/* discard the contents of the range */
+
 struct VMOP_OPTIONS {
 	size_t		vo_size;	/* must be sizeof(VMOP_OPTIONS) */
 	VMOP_OPERATION	vo_op;
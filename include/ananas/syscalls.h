@@ -1,5 +1,6 @@
 #include <ananas/types.h>
 #include <ananas/syscall-vmops.h>
+#include <ananas/syscall-rusage.h>
 #include <ananas/stat.h>
 
 struct utimbuf;
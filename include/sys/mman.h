@@ -26,10 +26,25 @@
 #define MCL_CURRENT	(1 << 0)
 #define MCL_FUTURE	(1 << 1)
 
+#define POSIX_MADV_NORMAL	0
+#define POSIX_MADV_RANDOM	1
+#define POSIX_MADV_SEQUENTIAL	2
+#define POSIX_MADV_WILLNEED	3
+#define POSIX_MADV_DONTNEED	4
+
+/* Not part of POSIX; MADV_DONTNEED discards the contents of the range */
+#define MADV_NORMAL	POSIX_MADV_NORMAL
+#define MADV_RANDOM	POSIX_MADV_RANDOM
+#define MADV_SEQUENTIAL	POSIX_MADV_SEQUENTIAL
+#define MADV_WILLNEED	POSIX_MADV_WILLNEED
+#define MADV_DONTNEED	POSIX_MADV_DONTNEED
+
 __BEGIN_DECLS
 
 void* mmap(void*, size_t, int, int, int, off_t);
 int munmap(void*, size_t);
+int madvise(void*, size_t, int);
+int posix_madvise(void*, size_t, int);
 
 __END_DECLS
 
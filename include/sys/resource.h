@@ -34,6 +34,10 @@ struct rlimit {
 struct rusage {
 	struct timeval ru_utime;
 	struct timeval ru_stime;
+	/* Not part of POSIX */
+	long ru_maxrss;		/* largest resident set size, in kilobytes */
+	long ru_minflt;		/* page faults resolved without I/O */
+	long ru_majflt;		/* page faults which needed I/O */
 };
 
 __BEGIN_DECLS
@@ -11,8 +11,10 @@
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
 #include "kernel/x86/exceptions.h"
+#include "kernel-md/fpu.h"
 #include "kernel-md/frame.h"
 #include "kernel-md/interrupts.h"
+#include "kernel-md/usercopy.h"
 #include "kernel-md/vm.h"
 #include "../sys/syscall.h"
 #include "options.h"
@@ -57,18 +59,14 @@ exception_nm(struct STACKFRAME* sf)
 	 */
 	thread_t* thread = PCPU_GET(curthread);
 	KASSERT(thread != NULL, "curthread is NULL");
-	PCPU_SET(fpu_context, &thread->md_fpu_ctx);
 
 	/*
-	 * Clear the task-switched-flag; this is what triggered this exception in
-	 * the first place. Afterwards, we can safely restore the FPU context and
-	 * continue. The next instruction will no longer cause an exception, and
-	 * the new context will be saved by the scheduler IRQ.
+	 * This clears the task-switched-flag, which is what triggered this
+	 * exception in the first place, and restores the FPU context. The next
+	 * instruction will no longer cause an exception, and the context will be
+	 * saved once the thread is switched out.
 	 */
-	__asm(
-			"clts\n"
-			"frstor (%%rax)\n"
-		: : "a" (&thread->md_fpu_ctx));
+	md_fpu_load(thread);
 }
 
 void
@@ -127,6 +125,17 @@ exception_pf(struct STACKFRAME* sf)
 	else
 		flags |= VM_FLAG_READ;
 
+	/*
+	 * With SMAP, the kernel may only touch userland memory with %rflags.AC set;
+	 * anything else is a bug which the VM code cannot fix for us.
+	 */
+	bool userland = (sf->sf_cs & 3) == SEG_DPL_USER;
+	if (md_smap_enabled && !userland && fault_addr < USERLAND_VA_END &&
+	    (sf->sf_errnum & EXC_PF_FLAG_P) && (sf->sf_rflags & RFLAGS_AC) == 0) {
+		exception_generic(sf);
+		return;
+	}
+
 	// Let the VM code deal with the fault
 	thread_t* curthread = PCPU_GET(curthread);
 	if (curthread != NULL && curthread->t_process != NULL) {
@@ -135,6 +144,15 @@ exception_pf(struct STACKFRAME* sf)
 			return; /* fault handeled */
 	}
 
+	// If the kernel was copying userland memory, make the copy fail
+	if (!userland) {
+		addr_t fixup = md_usercopy_fixup(sf->sf_rip);
+		if (fixup != 0) {
+			sf->sf_rip = fixup;
+			return;
+		}
+	}
+
 	// Couldn't be handled; chain through
 	exception_generic(sf);
 }
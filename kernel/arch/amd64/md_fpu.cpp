@@ -0,0 +1,138 @@
+/*
+ * FPU/SSE state handling.
+ *
+ * A thread only gets its FPU state loaded once it uses the FPU: %cr0.TS is
+ * set while no state is loaded, so the first FPU instruction traps to
+ * exception_nm(). From then on, the PCPU fpu_context refers to the loaded
+ * state, which is saved again as the thread is switched out. Saving right
+ * away rather than on the next trap means the state never lingers on
+ * another CPU once the thread migrates.
+ *
+ * The kernel itself only uses the FPU between kernel_fpu_begin() and
+ * kernel_fpu_end(); see kernel/fpu.h.
+ */
+#include <ananas/types.h>
+#include "kernel/fpu.h"
+#include "kernel/lib.h"
+#include "kernel/pcpu.h"
+#include "kernel/schedule.h"
+#include "kernel/thread.h"
+#include "kernel-md/fpu.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/macro.h"
+#include "kernel-md/vm.h"
+
+namespace {
+
+/* MXCSR with all SIMD exceptions masked; this is what the CPU resets to */
+const uint32_t mxcsr_default = 0x1f80;
+
+inline void
+fpu_save(struct FPUREGS* regs)
+{
+	KASSERT(((addr_t)regs & 15) == 0, "fpu state %p not 16-byte aligned", regs);
+	__asm __volatile("fxsave64 (%0)" : : "r" (regs) : "memory");
+}
+
+inline void
+fpu_restore(const struct FPUREGS* regs)
+{
+	KASSERT(((addr_t)regs & 15) == 0, "fpu state %p not 16-byte aligned", regs);
+	__asm __volatile("fxrstor64 (%0)" : : "r" (regs) : "memory");
+}
+
+inline void
+fpu_enable()
+{
+	__asm __volatile("clts");
+}
+
+inline void
+fpu_disable()
+{
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+} // unnamed namespace
+
+void
+md_fpu_load(thread_t* t)
+{
+	KASSERT(PCPU_GET(fpu_kernel) == 0, "fpu trap within kernel fpu section");
+	KASSERT(PCPU_GET(fpu_context) == NULL, "fpu trap with state loaded");
+
+	fpu_enable();
+	fpu_restore(&t->md_fpu_ctx);
+	PCPU_SET(fpu_context, &t->md_fpu_ctx);
+}
+
+void
+md_fpu_unload()
+{
+	auto ctx = static_cast<struct FPUREGS*>(PCPU_GET(fpu_context));
+	if (ctx == NULL)
+		return; /* nothing loaded, so TS is already set */
+
+	fpu_save(ctx);
+	fpu_disable();
+	PCPU_SET(fpu_context, NULL);
+}
+
+void
+md_fpu_sync(thread_t* t)
+{
+	int state = md_interrupts_save_and_disable();
+	if (PCPU_GET(fpu_context) == &t->md_fpu_ctx)
+		fpu_save(&t->md_fpu_ctx);
+	md_interrupts_restore(state);
+}
+
+void
+kernel_fpu_begin()
+{
+	KASSERT(PCPU_GET(nested_irq) == 0, "kernel fpu section in irq");
+	KASSERT(PCPU_GET(fpu_kernel) == 0, "nested kernel fpu section");
+
+	/*
+	 * Interrupts are off until preemption is, so that we cannot be moved to
+	 * another CPU halfway through.
+	 */
+	int state = md_interrupts_save_and_disable();
+	PCPU_SET(nopreempt, PCPU_GET(nopreempt) + 1);
+	PCPU_SET(fpu_kernel, 1);
+
+	/* Put away the thread's state, if loaded; it'll be restored on next use */
+	auto ctx = static_cast<struct FPUREGS*>(PCPU_GET(fpu_context));
+	if (ctx != NULL) {
+		fpu_save(ctx);
+		PCPU_SET(fpu_context, NULL);
+	} else
+		fpu_enable();
+	md_interrupts_restore(state);
+
+	/* Don't let the caller inherit any state */
+	__asm __volatile(
+		"fninit\n"
+		"ldmxcsr %0\n"
+	: : "m" (mxcsr_default));
+}
+
+void
+kernel_fpu_end()
+{
+	KASSERT(PCPU_GET(fpu_kernel) != 0, "not in a kernel fpu section");
+
+	int state = md_interrupts_save_and_disable();
+	fpu_disable();
+	PCPU_SET(fpu_kernel, 0);
+	int nopreempt = PCPU_GET(nopreempt) - 1;
+	PCPU_SET(nopreempt, nopreempt);
+	md_interrupts_restore(state);
+
+	/* If the timeslice ran out in the meantime, catch up */
+	thread_t* curthread = PCPU_GET(curthread);
+	if (nopreempt == 0 && THREAD_WANT_RESCHEDULE(curthread))
+		schedule();
+}
+
+/* vim:set ts=2 sw=2: */
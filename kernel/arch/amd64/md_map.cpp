@@ -1,4 +1,5 @@
 #include <ananas/types.h>
+#include <ananas/error.h>
 #include <machine/param.h>
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
@@ -6,44 +7,64 @@
 #include "kernel/pcpu.h"
 #include "kernel/process.h"
 #include "kernel/thread.h"
+#include "kernel/trace.h"
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
+#include "kernel-md/tlb.h"
 #include "kernel-md/vm.h"
 
+TRACE_SETUP;
+
 extern uint64_t* kernel_pagedir;
 
-static addr_t
-get_nextpage(vmspace_t* vs, uint64_t page_flags)
+static inline uint64_t*
+pt_resolve_addr(uint64_t entry)
 {
-	KASSERT(vs != NULL, "unmapped page while mapping kernel pages?");
-	struct PAGE* p = page_alloc_single();
-	KASSERT(p != NULL, "out of pages");
+#define ADDR_MASK 0xffffffffff000 /* bits 12 .. 51 */
+	return (uint64_t*)(KMEM_DIRECT_VA_START + (entry & ADDR_MASK));
+}
 
-	/*
-	 * If the page isn't mapped globally, it belongs to a thread and we should
-	 * administer it there so we can free it once the thread is freed.
-	 */
-	if ((page_flags & PE_C_G) == 0)
-		LIST_APPEND(&vs->vs_pages, p);
+/*
+ * Returns the page table *entry refers to, allocating it if needed. Tables
+ * with global mappings are shared between all vmspaces, so we must take care
+ * not to install two tables for the same entry concurrently.
+ */
+static uint64_t*
+get_table(vmspace_t* vs, uint64_t* entry, uint64_t page_flags)
+{
+	if (*entry != 0) {
+		KASSERT((*entry & PE_PS) == 0, "entry %p is a large page", *entry);
+		return pt_resolve_addr(*entry);
+	}
+
+	KASSERT(vs != NULL || (page_flags & PE_C_G) != 0, "allocating non-global kernel page table");
+	struct PAGE* p = page_alloc_single();
+	if (p == NULL)
+		return NULL;
 
-	/* Map this page in kernel-space XXX How do we clean it up? */
 	addr_t phys = page_get_paddr(p);
+	/* Page tables are RAM, so this is in the direct map and cannot recurse */
 	void* va = kmem_map(phys, PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
-	memset(va, 0, PAGE_SIZE);
-	return phys | page_flags;
-}
+	memzero_pages(va, PAGE_SIZE);
 
-static inline uint64_t*
-pt_resolve_addr(uint64_t entry)
-{
-#define ADDR_MASK 0xffffffffff000 /* bits 12 .. 51 */
-	return (uint64_t*)(KMEM_DIRECT_VA_START + (entry & ADDR_MASK));
+	if (page_flags & PE_C_G) {
+		if (!__sync_bool_compare_and_swap(entry, 0, phys | page_flags))
+			page_free(p); /* someone beat us to it */
+	} else {
+		/*
+		 * The page isn't mapped globally, so it belongs to a thread and we should
+		 * administer it there so we can free it once the thread is freed.
+		 */
+		LIST_APPEND(&vs->vs_pages, p);
+		*entry = phys | page_flags;
+	}
+	return pt_resolve_addr(*entry);
 }
 
-void
-md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+/* Converts VM_FLAG_... flags to the flags of the entry mapping the page */
+static uint64_t
+vm_flags_to_pte(int flags)
 {
-	/* Flags for the mapped pages themselves */
 	uint64_t pt_flags = 0;
 	if (flags & VM_FLAG_READ)
 		pt_flags |= PE_P;	/* XXX */
@@ -55,15 +76,29 @@ md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flag
 		pt_flags |= PE_PCD | PE_PWT;
 	if ((flags & VM_FLAG_EXECUTE) == 0)
 		pt_flags |= PE_NX;
+	return pt_flags;
+}
+
+errorcode_t
+md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+{
+	/* Flags for the mapped pages themselves */
+	uint64_t pt_flags = vm_flags_to_pte(flags);
 
 	/* Flags for the page-directory leading up to the mapped page */
 	uint64_t pd_flags = PE_US | PE_P | PE_RW;
 
 	/* XXX we don't yet strip off bits 52-63 yet */
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
+	struct TLB_BATCH tb;
+	tlb_batch_init(&tb, vs);
+	errorcode_t err = ananas_success();
 	while(num_pages--) {
-		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
-			pagedir[(virt >> 39) & 0x1ff] = get_nextpage(vs, pd_flags);
+		uint64_t* pml4e = &pagedir[(virt >> 39) & 0x1ff];
+		uint64_t* pdpe = get_table(vs, pml4e, pd_flags);
+		if (pdpe == NULL) {
+			err = ANANAS_ERROR(OUT_OF_MEMORY);
+			break;
 		}
 
 		/*
@@ -72,74 +107,257 @@ md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flag
 		 *     (KVA, kernel) where this should happen are pre-allocated in startup.c
 		 *     and thus thee is no need to look further...
 		 */
-		if (pagedir[(virt >> 39) & 0x1ff] & PE_C_G) {
+		if (*pml4e & PE_C_G) {
 			pd_flags |= PE_C_G;
 			pt_flags |= PE_G;
 		}
 
-		uint64_t* pdpe = pt_resolve_addr(pagedir[(virt >> 39) & 0x1ff]);
-		if (pdpe[(virt >> 30) & 0x1ff] == 0) {
-			pdpe[(virt >> 30) & 0x1ff] = get_nextpage(vs, pd_flags);
+		uint64_t* pde = get_table(vs, &pdpe[(virt >> 30) & 0x1ff], pd_flags);
+		if (pde == NULL) {
+			err = ANANAS_ERROR(OUT_OF_MEMORY);
+			break;
 		}
-
-		uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-		if (pde[(virt >> 21) & 0x1ff] == 0) {
-			pde[(virt >> 21) & 0x1ff] = get_nextpage(vs, pd_flags);
+		uint64_t* pdee = &pde[(virt >> 21) & 0x1ff];
+		if (*pdee & PE_PS) {
+			/*
+			 * This replaces a large page; its owner is gone as nothing else maps
+			 * over it, so we just drop it and map the range page-by-page.
+			 */
+			KASSERT(vs != NULL, "replacing kernel large page at %p", virt);
+			*pdee = 0;
+			tlb_batch_add(&tb, virt, 1);
+		}
+		uint64_t* pte = get_table(vs, pdee, pd_flags);
+		if (pte == NULL) {
+			err = ANANAS_ERROR(OUT_OF_MEMORY);
+			break;
 		}
 
 		// Ensure we'll flush the mapping if it was already present - it may be in the TLB
-		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
 		bool need_invalidate = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
 		pte[(virt >> 12) & 0x1ff] = (uint64_t)phys | pt_flags;
 		if (need_invalidate)
-			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+			tlb_batch_add(&tb, virt, 1);
 
 		virt += PAGE_SIZE; phys += PAGE_SIZE;
 	}
+	tlb_batch_flush(&tb);
+	return err;
 }
 
 void
 md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
 {
-	thread_t* curthread = PCPU_GET(curthread);
-	int is_cur_vmspace = curthread->t_process != NULL && curthread->t_process->p_vmspace == vs;
-
 	/* XXX we don't yet strip off bits 52-63 yet */
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
-	while(num_pages--) {
-		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
-			panic("vs=%p, virt=%p -> l1 not mapped (%p)", vs, virt, pagedir[(virt >> 39) & 0x1ff]);
+	struct TLB_BATCH tb;
+	tlb_batch_init(&tb, vs);
+	while(num_pages > 0) {
+		/*
+		 * Page tables are only created once something is mapped, so there may be
+		 * nothing to unmap at any level; if so, skip to the next table.
+		 */
+		uint64_t* pdee = NULL;
+		uint64_t entry = pagedir[(virt >> 39) & 0x1ff];
+		if (entry & PE_P) {
+			entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+			if (entry & PE_P)
+				pdee = &pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
 		}
-
-		uint64_t* pdpe = pt_resolve_addr(pagedir[(virt >> 39) & 0x1ff]);
-		if (pdpe[(virt >> 30) & 0x1ff] == 0) {
-			panic("vs=%p, virt=%p -> l2 not mapped (%p)", vs, virt, pagedir[(virt >> 30) & 0x1ff]);
+		if (pdee == NULL || (*pdee & PE_P) == 0) {
+			size_t skip = (PAGE_SIZE_2MB - (virt & (PAGE_SIZE_2MB - 1))) / PAGE_SIZE;
+			if (skip > num_pages)
+				skip = num_pages;
+			virt += skip * PAGE_SIZE;
+			num_pages -= skip;
+			continue;
 		}
 
-		uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-		if (pde[(virt >> 21) & 0x1ff] == 0) {
-			panic("vs=%p, virt=%p -> l3 not mapped (%p)", vs, virt, pagedir[(virt >> 21) & 0x1ff]);
+		/* Large pages can only be unmapped as a whole; md_split_large_page() must be used otherwise */
+		if (*pdee & PE_PS) {
+			KASSERT((virt & (PAGE_SIZE_2MB - 1)) == 0 && num_pages >= PAGE_SIZE_2MB / PAGE_SIZE, "partial unmap of large page at %p", virt);
+			*pdee = 0;
+			tlb_batch_add(&tb, virt, PAGE_SIZE_2MB / PAGE_SIZE);
+			virt += PAGE_SIZE_2MB;
+			num_pages -= PAGE_SIZE_2MB / PAGE_SIZE;
+			continue;
 		}
 
-		/* XXX perhaps we should check if this is actually mapped */
-		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-		int global = (pte[(virt >> 12) & 0x1ff] & PE_G);
+		/*
+		 * Pages that were not present cannot be in any TLB; everything else is
+		 * invalidated in one go once the page tables are updated.
+		 */
+		uint64_t* pte = pt_resolve_addr(*pdee);
+		bool was_present = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
 		pte[(virt >> 12) & 0x1ff] = 0;
-		if (global || is_cur_vmspace) {
-			/*
-			 * We just unmapped a global virtual address or something that belongs to
-			 * the current thread; this means we'll have to * explicitely invalidate it.
-			 */
-			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
-		}
+		if (was_present)
+			tlb_batch_add(&tb, virt, 1);
 		virt += PAGE_SIZE;
+		num_pages--;
 	}
+	tlb_batch_flush(&tb);
 }
 
 void
+md_write_protect_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
+{
+	struct TLB_BATCH tb;
+	tlb_batch_init(&tb, vs);
+	while(num_pages > 0) {
+		/* As with md_unmap_pages(), anything without a page table is skipped */
+		uint64_t* pdee = NULL;
+		uint64_t entry = vs->vs_md_pagedir[(virt >> 39) & 0x1ff];
+		if (entry & PE_P) {
+			entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+			if (entry & PE_P)
+				pdee = &pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
+		}
+		size_t chunk = (PAGE_SIZE_2MB - (virt & (PAGE_SIZE_2MB - 1))) / PAGE_SIZE;
+		if (chunk > num_pages)
+			chunk = num_pages;
+
+		/*
+		 * The CPU may set the accessed and dirty bits behind our back, so the
+		 * write bit must be cleared atomically; only entries which lose it need
+		 * to be flushed.
+		 */
+		if (pdee != NULL && (*pdee & (PE_P | PE_PS)) == (PE_P | PE_PS)) {
+			if (__sync_fetch_and_and(pdee, ~PE_RW) & PE_RW)
+				tlb_batch_add(&tb, virt, 1);
+		} else if (pdee != NULL && (*pdee & PE_P)) {
+			uint64_t* pte = pt_resolve_addr(*pdee);
+			for (unsigned int n = 0; n < chunk; n++) {
+				uint64_t* e = &pte[((virt >> 12) + n) & 0x1ff];
+				if ((*e & (PE_P | PE_RW)) == (PE_P | PE_RW) && (__sync_fetch_and_and(e, ~PE_RW) & PE_RW))
+					tlb_batch_add(&tb, virt + n * PAGE_SIZE, 1);
+			}
+		}
+		virt += chunk * PAGE_SIZE;
+		num_pages -= chunk;
+	}
+	tlb_batch_flush(&tb);
+}
+
+/*
+ * Returns the page directory entry covering virt in vs, allocating tables as
+ * needed; NULL is returned if that isn't possible.
+ */
+static uint64_t*
+get_user_pde(vmspace_t* vs, addr_t virt)
+{
+	KASSERT(vs != NULL, "large pages are only supported for userland");
+	const uint64_t pd_flags = PE_US | PE_P | PE_RW;
+	uint64_t* pdpe = get_table(vs, &vs->vs_md_pagedir[(virt >> 39) & 0x1ff], pd_flags);
+	if (pdpe == NULL)
+		return NULL;
+	uint64_t* pde = get_table(vs, &pdpe[(virt >> 30) & 0x1ff], pd_flags);
+	if (pde == NULL)
+		return NULL;
+	return &pde[(virt >> 21) & 0x1ff];
+}
+
+/* Frees a page table of vs that is no longer referenced; it must be flushed from the TLB */
+static void
+free_user_table(vmspace_t* vs, addr_t phys)
+{
+	LIST_FOREACH(&vs->vs_pages, p, struct PAGE) {
+		if (page_get_paddr(p) != phys)
+			continue;
+		LIST_REMOVE(&vs->vs_pages, p);
+		page_free(p);
+		return;
+	}
+	panic("page table %p not owned by vmspace %p", phys, vs);
+}
+
+errorcode_t
+md_map_large_page(vmspace_t* vs, addr_t virt, addr_t phys, int flags)
+{
+	KASSERT((virt & (PAGE_SIZE_2MB - 1)) == 0 && (phys & (PAGE_SIZE_2MB - 1)) == 0, "misaligned large page %p -> %p", virt, phys);
+
+	uint64_t* pdee = get_user_pde(vs, virt);
+	if (pdee == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	uint64_t old_entry = *pdee;
+	*pdee = phys | PE_PS | vm_flags_to_pte(flags);
+
+	/*
+	 * If there was a page table here (pages around us may have been mapped and
+	 * unmapped), it must be empty as the caller would otherwise lose mappings.
+	 * We can only free it once no CPU can still be walking it.
+	 */
+	struct TLB_BATCH tb;
+	tlb_batch_init(&tb, vs);
+	if (old_entry & PE_P)
+		tlb_batch_add(&tb, virt, 1);
+	tlb_batch_flush(&tb);
+	if ((old_entry & PE_P) && (old_entry & PE_PS) == 0) {
+		uint64_t* pte = pt_resolve_addr(old_entry);
+		for (unsigned int n = 0; n < 512; n++)
+			KASSERT((pte[n] & PE_P) == 0, "large page %p replaces mapping at %p", virt, virt + n * PAGE_SIZE);
+		free_user_table(vs, old_entry & ADDR_MASK);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+md_split_large_page(vmspace_t* vs, addr_t virt)
+{
+	/* Pages are mapped as they are faulted, so the page need not be mapped at all */
+	uint64_t* pdee = get_user_pde(vs, virt);
+	if (pdee == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	uint64_t entry = *pdee;
+	if ((entry & (PE_P | PE_PS)) != (PE_P | PE_PS))
+		return ananas_success();
+
+	/* Create a page table mapping the same pages, using the same permissions */
+	struct PAGE* p = page_alloc_single();
+	if (p == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	auto pte = static_cast<uint64_t*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	addr_t phys = entry & ADDR_MASK & ~(PAGE_SIZE_2MB - 1);
+	uint64_t pt_flags = entry & (PE_P | PE_RW | PE_US | PE_PWT | PE_PCD | PE_A | PE_D | PE_G | PE_NX);
+	for (unsigned int n = 0; n < 512; n++)
+		pte[n] = (phys + n * PAGE_SIZE) | pt_flags;
+	LIST_APPEND(&vs->vs_pages, p);
+
+	/* A single invalidation drops the large TLB entry */
+	*pdee = page_get_paddr(p) | PE_US | PE_P | PE_RW;
+	struct TLB_BATCH tb;
+	tlb_batch_init(&tb, vs);
+	tlb_batch_add(&tb, virt & ~(PAGE_SIZE_2MB - 1), 1);
+	tlb_batch_flush(&tb);
+	return ananas_success();
+}
+
+bool
+md_test_and_clear_accessed(vmspace_t* vs, addr_t virt)
+{
+	uint64_t entry = vs->vs_md_pagedir[(virt >> 39) & 0x1ff];
+	if ((entry & PE_P) == 0)
+		return false;
+	entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+	if ((entry & PE_P) == 0)
+		return false;
+	uint64_t* pte = &pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
+	if ((*pte & (PE_P | PE_PS)) == PE_P)
+		pte = &pt_resolve_addr(*pte)[(virt >> 12) & 0x1ff];
+	if ((*pte & PE_P) == 0)
+		return false;
+
+	/*
+	 * The CPU sets the bit behind our back, so it must be cleared atomically.
+	 * We do not flush the TLB: a cached entry just won't set the bit again until
+	 * it is evicted, which merely makes the page look unused for a while.
+	 */
+	return (__sync_fetch_and_and(pte, ~PE_A) & PE_A) != 0;
+}
+
+errorcode_t
 md_kmap(addr_t phys, addr_t virt, size_t num_pages, int flags)
 {
-	md_map_pages(NULL, virt, phys, num_pages, flags);
+	return md_map_pages(NULL, virt, phys, num_pages, flags);
 }
 
 void
@@ -148,6 +366,29 @@ md_kunmap(addr_t virt, size_t num_pages)
 	md_unmap_pages(NULL, virt, num_pages);
 }
 
+addr_t
+md_kget_phys(addr_t virt)
+{
+	/* The direct map uses 1GB and 2MB pages, so we must check for these */
+	uint64_t entry = kernel_pagedir[(virt >> 39) & 0x1ff];
+	if (entry & PE_P) {
+		entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+		if ((entry & (PE_P | PE_PS)) == (PE_P | PE_PS))
+			return (entry & ADDR_MASK & ~(PAGE_SIZE_1GB - 1)) + (virt & (PAGE_SIZE_1GB - 1));
+		if (entry & PE_P) {
+			entry = pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
+			if ((entry & (PE_P | PE_PS)) == (PE_P | PE_PS))
+				return (entry & ADDR_MASK & ~(PAGE_SIZE_2MB - 1)) + (virt & (PAGE_SIZE_2MB - 1));
+			if (entry & PE_P) {
+				entry = pt_resolve_addr(entry)[(virt >> 12) & 0x1ff];
+				if (entry & PE_P)
+					return (entry & ADDR_MASK) + (virt & (PAGE_SIZE - 1));
+			}
+		}
+	}
+	panic("md_kget_phys(): va=%p not mapped", virt);
+}
+
 void
 vm_init()
 {
@@ -157,7 +398,7 @@ void
 md_map_kernel(vmspace_t* vs)
 {
 	/* We can just copy the entire kernel pagemap over; it's shared with everything else */
-	memcpy(vs->vs_md_pagedir, kernel_pagedir, PAGE_SIZE);
+	memcpy_pages(vs->vs_md_pagedir, kernel_pagedir, PAGE_SIZE);
 }
 
 /* vim:set ts=2 sw=2: */
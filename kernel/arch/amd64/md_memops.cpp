@@ -0,0 +1,289 @@
+/*
+ * amd64 versions of memcpy() and friends; see kernel/memops.h.
+ *
+ * CPUs with Enhanced REP MOVSB/STOSB (ERMS) move memory fastest using 'rep
+ * movsb' and 'rep stosb', as the microcode will use the widest moves it has.
+ * Starting these up takes a while, so short copies are done using a few
+ * overlapping 64-bit moves instead - unless the CPU also has Fast Short REP
+ * MOVSB (FSRM). Without ERMS, the generic versions do better, except for
+ * whole pages, where 'rep movsq' and 'rep stosq' are quick on any CPU.
+ *
+ * Note that nothing here may use a loop to move memory, as the compiler is
+ * free to turn such a loop into a call to memcpy() or memset().
+ */
+#include <ananas/types.h>
+#include <machine/param.h>
+#include "kernel/kdb.h"
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/memops.h"
+#include "kernel/page.h"
+#include "kernel/vm.h"
+#include "kernel/x86/io.h"
+#include "kernel-md/macro.h"
+#include "kernel-md/vm.h"
+#include "options.h"
+
+/* Copies below this many bytes aren't worth starting 'rep movsb' for without FSRM */
+#define MEMOPS_SHORT_LEN 64
+
+namespace {
+
+inline uint64_t
+load64(const char* p)
+{
+	return *(const uint64_t*)p;
+}
+
+inline void
+store64(char* p, uint64_t v)
+{
+	*(uint64_t*)p = v;
+}
+
+/*
+ * Copies len < MEMOPS_SHORT_LEN bytes. Everything is loaded before anything
+ * is stored, so overlapping copies work in either direction.
+ */
+void
+memcpy_short(char* d, const char* s, size_t len)
+{
+	if (len >= 32) {
+		uint64_t a = load64(s), b = load64(s + 8), c = load64(s + 16), e = load64(s + 24);
+		uint64_t f = load64(s + len - 32), g = load64(s + len - 24), h = load64(s + len - 16), i = load64(s + len - 8);
+		store64(d, a); store64(d + 8, b); store64(d + 16, c); store64(d + 24, e);
+		store64(d + len - 32, f); store64(d + len - 24, g); store64(d + len - 16, h); store64(d + len - 8, i);
+	} else if (len >= 16) {
+		uint64_t a = load64(s), b = load64(s + 8);
+		uint64_t c = load64(s + len - 16), e = load64(s + len - 8);
+		store64(d, a); store64(d + 8, b);
+		store64(d + len - 16, c); store64(d + len - 8, e);
+	} else if (len >= 8) {
+		uint64_t a = load64(s), b = load64(s + len - 8);
+		store64(d, a);
+		store64(d + len - 8, b);
+	} else if (len >= 4) {
+		uint32_t a = *(const uint32_t*)s, b = *(const uint32_t*)(s + len - 4);
+		*(uint32_t*)d = a;
+		*(uint32_t*)(d + len - 4) = b;
+	} else if (len > 0) {
+		// 1, 2 or 3 bytes: first, middle and last byte cover them all
+		uint8_t a = s[0], b = s[len / 2], c = s[len - 1];
+		d[0] = a;
+		d[len / 2] = b;
+		d[len - 1] = c;
+	}
+}
+
+/* Sets len < MEMOPS_SHORT_LEN bytes to the pattern v */
+void
+memset_short(char* d, uint64_t v, size_t len)
+{
+	if (len >= 32) {
+		store64(d, v); store64(d + 8, v); store64(d + 16, v); store64(d + 24, v);
+		store64(d + len - 32, v); store64(d + len - 24, v); store64(d + len - 16, v); store64(d + len - 8, v);
+	} else if (len >= 16) {
+		store64(d, v); store64(d + 8, v);
+		store64(d + len - 16, v); store64(d + len - 8, v);
+	} else if (len >= 8) {
+		store64(d, v);
+		store64(d + len - 8, v);
+	} else if (len >= 4) {
+		*(uint32_t*)d = (uint32_t)v;
+		*(uint32_t*)(d + len - 4) = (uint32_t)v;
+	} else if (len > 0) {
+		d[0] = (char)v;
+		d[len / 2] = (char)v;
+		d[len - 1] = (char)v;
+	}
+}
+
+inline void
+rep_movsb(void* dst, const void* src, size_t len)
+{
+	__asm __volatile(
+		"rep movsb\n"
+	: "+D" (dst), "+S" (src), "+c" (len) : : "memory");
+}
+
+inline void
+rep_stosb(void* dst, int c, size_t len)
+{
+	__asm __volatile(
+		"rep stosb\n"
+	: "+D" (dst), "+c" (len) : "a" (c) : "memory");
+}
+
+void*
+memcpy_fsrm(void* dst, const void* src, size_t len)
+{
+	rep_movsb(dst, src, len);
+	return dst;
+}
+
+void*
+memcpy_erms(void* dst, const void* src, size_t len)
+{
+	if (len < MEMOPS_SHORT_LEN)
+		memcpy_short(static_cast<char*>(dst), static_cast<const char*>(src), len);
+	else
+		rep_movsb(dst, src, len);
+	return dst;
+}
+
+void*
+memset_erms(void* b, int c, size_t len)
+{
+	if (len < MEMOPS_SHORT_LEN)
+		memset_short(static_cast<char*>(b), (uint64_t)(uint8_t)c * 0x0101010101010101ULL, len);
+	else
+		rep_stosb(b, c, len);
+	return b;
+}
+
+void
+copy_pages_erms(void* dst, const void* src, size_t len)
+{
+	rep_movsb(dst, src, len);
+}
+
+void
+zero_pages_erms(void* b, size_t len)
+{
+	rep_stosb(b, 0, len);
+}
+
+void
+copy_pages_movsq(void* dst, const void* src, size_t len)
+{
+	size_t count = len / 8;
+	__asm __volatile(
+		"rep movsq\n"
+	: "+D" (dst), "+S" (src), "+c" (count) : : "memory");
+}
+
+void
+zero_pages_stosq(void* b, size_t len)
+{
+	size_t count = len / 8;
+	__asm __volatile(
+		"rep stosq\n"
+	: "+D" (b), "+c" (count) : "a" (0UL) : "memory");
+}
+
+const struct MEMOPS memops_movsq = {
+	.mo_name = "movsq",
+	.mo_memcpy = NULL,
+	.mo_memset = NULL,
+	.mo_copy_pages = &copy_pages_movsq,
+	.mo_zero_pages = &zero_pages_stosq
+};
+
+const struct MEMOPS memops_erms = {
+	.mo_name = "erms",
+	.mo_memcpy = &memcpy_erms,
+	.mo_memset = &memset_erms,
+	.mo_copy_pages = &copy_pages_erms,
+	.mo_zero_pages = &zero_pages_erms
+};
+
+const struct MEMOPS memops_fsrm = {
+	.mo_name = "fsrm",
+	.mo_memcpy = &memcpy_fsrm,
+	.mo_memset = &memset_erms,
+	.mo_copy_pages = &copy_pages_erms,
+	.mo_zero_pages = &zero_pages_erms
+};
+
+} // unnamed namespace
+
+void
+md_memops_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	x86_cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (eax < 7) {
+		memops_select(&memops_movsq);
+		return;
+	}
+
+	x86_cpuid(7, &eax, &ebx, &ecx, &edx);
+	if ((ebx & CPUID_7_EBX_ERMS) == 0)
+		memops_select(&memops_movsq);
+	else if (edx & CPUID_7_EDX_FSRM)
+		memops_select(&memops_fsrm);
+	else
+		memops_select(&memops_erms);
+}
+
+#ifdef OPTION_KDB
+namespace {
+
+/* Buffers are 2^MEMOPS_BENCH_ORDER pages */
+#define MEMOPS_BENCH_ORDER 4
+#define MEMOPS_BENCH_ROUNDS 64
+
+/* Returns the average number of cycles a call of op() takes */
+template<typename Op> uint64_t
+memops_bench_cycles(Op op)
+{
+	op(); // warm up caches and TLB
+	uint64_t start = rdtsc();
+	for (unsigned int n = 0; n < MEMOPS_BENCH_ROUNDS; n++)
+		op();
+	return (rdtsc() - start) / MEMOPS_BENCH_ROUNDS;
+}
+
+} // unnamed namespace
+
+KDB_COMMAND(memops, NULL, "Display and benchmark the memcpy()/memset() implementations")
+{
+	kprintf("using '%s'\n", memops.mo_name);
+
+	const size_t len = PAGE_SIZE << MEMOPS_BENCH_ORDER;
+	struct PAGE* p_src;
+	struct PAGE* p_dst;
+	auto src = static_cast<char*>(page_alloc_order_mapped(MEMOPS_BENCH_ORDER, &p_src, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (src == NULL) {
+		kprintf("out of memory\n");
+		return;
+	}
+	auto dst = static_cast<char*>(page_alloc_order_mapped(MEMOPS_BENCH_ORDER, &p_dst, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (dst == NULL) {
+		kprintf("out of memory\n");
+		kmem_unmap(src, len);
+		page_free(p_src);
+		return;
+	}
+
+	/*
+	 * Every implementation is selected in turn; this is harmless as they all
+	 * do the same thing, so we restore the current one once we are done.
+	 */
+	struct MEMOPS current = memops;
+	const struct MEMOPS* candidates[] = { &memops_generic, &memops_movsq, &memops_erms, &memops_fsrm };
+	kprintf("cycles per call:  cpy 16  cpy 200  cpy 4k(+1) set 200  set 4k  cpy pages  zero pages (%u KB)\n",
+	 (unsigned int)(len / 1024));
+	for (auto ops: candidates) {
+		memops_select(ops);
+		uint64_t c16 = memops_bench_cycles([&]() { memcpy(dst, src, 16); });
+		uint64_t c200 = memops_bench_cycles([&]() { memcpy(dst, src, 200); });
+		uint64_t c4k = memops_bench_cycles([&]() { memcpy(dst, src + 1, PAGE_SIZE); });
+		uint64_t s200 = memops_bench_cycles([&]() { memset(dst, 0x55, 200); });
+		uint64_t s4k = memops_bench_cycles([&]() { memset(dst, 0x55, PAGE_SIZE); });
+		uint64_t cp = memops_bench_cycles([&]() { memcpy_pages(dst, src, len); });
+		uint64_t zp = memops_bench_cycles([&]() { memzero_pages(dst, len); });
+		kprintf("%-16s %6u  %7u  %10u  %7u  %6u  %9u  %10u\n", ops->mo_name,
+		 (unsigned int)c16, (unsigned int)c200, (unsigned int)c4k, (unsigned int)s200,
+		 (unsigned int)s4k, (unsigned int)cp, (unsigned int)zp);
+	}
+	memops_select(&current);
+
+	kmem_unmap(dst, len);
+	page_free(p_dst);
+	kmem_unmap(src, len);
+	page_free(p_src);
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
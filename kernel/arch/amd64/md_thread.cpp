@@ -6,14 +6,19 @@
 #include "kernel/pcpu.h"
 #include "kernel/process.h"
 #include "kernel/thread.h"
+#include "kernel/trace.h"
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
+#include "kernel-md/fpu.h"
 #include "kernel-md/interrupts.h"
 #include "kernel-md/frame.h"
+#include "kernel-md/macro.h"
 #include "kernel-md/param.h"
 #include "kernel-md/vm.h"
 #include "../sys/syscall.h"
 
+TRACE_SETUP;
+
 extern void* kernel_pagedir;
 extern "C" {
 void thread_trampoline();
@@ -22,21 +27,32 @@ void thread_trampoline();
 errorcode_t
 md_thread_init(thread_t* t, int flags)
 {
-	/* Create a stack if we aren't cloning - otherwise, we'll just copy the parent's stack instead */
-	process_t* proc = t->t_process;
-	if ((flags & THREAD_ALLOC_CLONE) == 0) {
-		vmarea_t* va;
-		errorcode_t err = vmspace_mapto(proc->p_vmspace, USERLAND_STACK_ADDR, THREAD_STACK_SIZE, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_FAULT | VM_FLAG_MD, &va);
-		ANANAS_ERROR_RETURN(err);
-	}
-
 	/*
 	 * Create the kernel stack for this thread; we'll grab a few pages for this
 	 * but we won't map all of them to ensure we can catch stack underflow
 	 * and overflow.
 	 */
 	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
+	if (t->md_kstack_page == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
+	/* Create a stack if we aren't cloning - otherwise, we'll just copy the parent's stack instead */
+	process_t* proc = t->t_process;
+	if ((flags & THREAD_ALLOC_CLONE) == 0) {
+		vmarea_t* va;
+		errorcode_t err = vmspace_mapto(proc->p_vmspace, USERLAND_STACK_ADDR, THREAD_STACK_SIZE, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_FAULT | VM_FLAG_MD, &va);
+		if (ananas_is_failure(err)) {
+			page_free(t->md_kstack_page);
+			t->md_kstack_page = NULL;
+			return err;
+		}
+	}
 	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (t->md_kstack == NULL) {
+		page_free(t->md_kstack_page);
+		t->md_kstack_page = NULL;
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
 
 	/* Set up a stackframe so that we can return to the kernel code */
 	struct STACKFRAME* sf = (struct STACKFRAME*)((addr_t)t->md_kstack + KERNEL_STACK_SIZE - sizeof(*sf));
@@ -51,14 +67,19 @@ md_thread_init(thread_t* t, int flags)
 
 	/* Fill out our MD fields */
 	t->md_cr3 = KVTOP((addr_t)proc->p_vmspace->vs_md_pagedir);
+	t->md_vmspace = proc->p_vmspace;
   t->md_rsp = (addr_t)sf;
 	t->md_rsp0 = (addr_t)t->md_kstack + KERNEL_STACK_SIZE;
 	t->md_rip = (addr_t)&thread_trampoline;
 	t->t_frame = sf;
 
-	/* Initialize FPU state similar to what finit would do */
+	/*
+	 * Initialize FPU state similar to what finit would do; note that the tag
+	 * word is abridged in this format and zero means all registers are empty.
+	 */
 	t->md_fpu_ctx.fcw = 0x37f;
-	t->md_fpu_ctx.ftw = 0xffff;
+	t->md_fpu_ctx.ftw = 0;
+	t->md_fpu_ctx.mxcsr = 0x1f80;
 
 	return ananas_success();
 }
@@ -72,7 +93,14 @@ md_kthread_init(thread_t* t, kthread_func_t kfunc, void* arg)
 	 * no kernelthread ever runs userland code.
 	 */
 	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
+	if (t->md_kstack_page == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (t->md_kstack == NULL) {
+		page_free(t->md_kstack_page);
+		t->md_kstack_page = NULL;
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
 	t->t_md_flags = THREAD_MDFLAG_FULLRESTORE;
 
 	/* Set up a stackframe so that we can return to the kernel code */
@@ -89,6 +117,7 @@ md_kthread_init(thread_t* t, kthread_func_t kfunc, void* arg)
 
 	/* Set up the thread context */
 	t->md_cr3 = KVTOP((addr_t)kernel_pagedir);
+	t->md_vmspace = NULL;
   t->md_rsp = (addr_t)sf;
 	t->md_rip = (addr_t)&thread_trampoline;
 
@@ -117,6 +146,10 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
 	KASSERT(!THREAD_IS_ZOMBIE(new_thread), "cannot switch to a zombie thread");
 	KASSERT(new_thread != old_thread, "switching to self?");
 	KASSERT(THREAD_IS_ACTIVE(new_thread), "new thread isn't running?");
+	KASSERT(PCPU_GET(nopreempt) == 0, "switching threads while preemption is disabled");
+
+	/* Save the old thread's FPU state, if loaded; the new thread must trap to get its own */
+	md_fpu_unload();
 
 	/*
 	 * Activate the corresponding kernel stack in the TSS and for the syscall
@@ -126,8 +159,19 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
   tss->rsp0 = new_thread->md_rsp0;
 	PCPU_SET(rsp0, new_thread->md_rsp0);
 
-	/* Activate the new_thread thread's page tables */
-  __asm __volatile("movq %0, %%cr3" : : "r" (new_thread->md_cr3));
+	/*
+	 * Activate the new_thread thread's page tables, unless they already are;
+	 * reloading %cr3 needlessly throws away the TLB. We keep track of which
+	 * CPU's are using a vmspace so that TLB shootdowns can be limited to them.
+	 */
+	if (read_cr3() != new_thread->md_cr3) {
+		uint32_t cpu_bit = 1U << PCPU_GET(cpuid);
+		if (new_thread->md_vmspace != NULL)
+			__sync_fetch_and_or(&new_thread->md_vmspace->vs_md_cpu_mask, cpu_bit);
+		write_cr3(new_thread->md_cr3);
+		if (old_thread->md_vmspace != NULL && old_thread->md_vmspace != new_thread->md_vmspace)
+			__sync_fetch_and_and(&old_thread->md_vmspace->vs_md_cpu_mask, ~cpu_bit);
+	}
 
 	/*
 	 * This will only be called from kernel -> kernel transitions, and the
@@ -161,12 +205,6 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
 	return prev;
 }
 
-void*
-md_map_thread_memory(thread_t* thread, void* ptr, size_t length, int write)
-{
-	return ptr;
-}
-
 void
 md_thread_set_entrypoint(thread_t* thread, addr_t entry)
 {
@@ -186,6 +224,7 @@ md_thread_clone(struct THREAD* t, struct THREAD* parent, register_t retval)
 
 	/* Restore the thread's own page directory */
 	t->md_cr3 = KVTOP((addr_t)t->t_process->p_vmspace->vs_md_pagedir);
+	t->md_vmspace = t->t_process->p_vmspace;
 
 	/*
 	 * We need to copy the the stack frame so we can return return safely to the
@@ -208,6 +247,10 @@ md_thread_clone(struct THREAD* t, struct THREAD* parent, register_t retval)
 
 	/* Update the stack frame with the new return value to the child */
 	sf->sf_rax = retval;
+
+	/* The child inherits the FPU state as well */
+	md_fpu_sync(parent);
+	memcpy(&t->md_fpu_ctx, &parent->md_fpu_ctx, sizeof(struct FPUREGS));
 }
 
 void
@@ -0,0 +1,181 @@
+#include <ananas/types.h>
+#include "kernel/lib.h"
+#include "kernel/pcpu.h"
+#include "kernel/vmspace.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/macro.h"
+#include "kernel-md/tlb.h"
+#include "kernel-md/vm.h"
+#include "options.h"
+#ifdef OPTION_SMP
+#include "kernel/x86/smp.h"
+#endif
+
+/*
+ * Returns whether the TLB of the current CPU may contain mappings of vs; this
+ * is always the case for kernel mappings as they are global.
+ */
+static inline bool
+tlb_is_active(vmspace_t* vs)
+{
+	return vs == NULL || read_cr3() == KVTOP((addr_t)vs->vs_md_pagedir);
+}
+
+static void
+tlb_invalidate_local(const struct TLB_BATCH* tb)
+{
+	if (!tlb_is_active(tb->tb_vs))
+		return;
+
+	if (tb->tb_flush_all) {
+		if (tb->tb_vs == NULL) {
+			/* Toggling PGE is the only way to get rid of global mappings */
+			uint64_t cr4 = read_cr4();
+			write_cr4(cr4 & ~CR4_PGE);
+			write_cr4(cr4);
+		} else {
+			write_cr3(read_cr3());
+		}
+		return;
+	}
+
+	for (unsigned int n = 0; n < tb->tb_num_ranges; n++) {
+		addr_t virt = tb->tb_range[n].tr_virt;
+		for (size_t i = 0; i < tb->tb_range[n].tr_num_pages; i++, virt += PAGE_SIZE)
+			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+	}
+}
+
+#ifdef OPTION_SMP
+/*
+ * There is a single shootdown request in flight at any time; the initiator
+ * fills out tlb_request, bumps tlb_request_gen and interrupts the CPU's in
+ * tlb_request_mask. Every CPU acknowledges by copying the generation to its
+ * tlb_ack_gen slot.
+ *
+ * CPU's waiting for the request slot or for acknowledgements service pending
+ * requests themselves; this ensures two CPU's shooting at each other cannot
+ * deadlock, even if one of them has interrupts disabled.
+ */
+static volatile int tlb_request_busy = 0;
+static struct TLB_BATCH tlb_request;
+static volatile uint32_t tlb_request_mask;
+static volatile uint32_t tlb_request_gen = 0;
+static volatile uint32_t tlb_ack_gen[MAX_CPUS];
+
+static void
+tlb_service_pending()
+{
+	int state = md_interrupts_save_and_disable();
+	unsigned int cpuid = PCPU_GET(cpuid);
+	uint32_t gen = tlb_request_gen;
+	__sync_synchronize();
+	if (tlb_ack_gen[cpuid] != gen && (tlb_request_mask & (1U << cpuid)) != 0) {
+		tlb_invalidate_local(&tlb_request);
+		__sync_synchronize();
+		tlb_ack_gen[cpuid] = gen;
+	}
+	md_interrupts_restore(state);
+}
+
+static void
+tlb_shootdown(const struct TLB_BATCH* tb, uint32_t mask)
+{
+	while (__sync_lock_test_and_set(&tlb_request_busy, 1) != 0)
+		tlb_service_pending();
+
+	memcpy(&tlb_request, tb, sizeof(tlb_request));
+	tlb_request_mask = mask;
+	__sync_synchronize();
+	uint32_t gen = ++tlb_request_gen;
+	__sync_synchronize();
+
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++)
+		if (mask & (1U << cpu))
+			smp_send_ipi(cpu, SMP_IPI_TLB);
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++)
+		if (mask & (1U << cpu))
+			while (tlb_ack_gen[cpu] != gen)
+				tlb_service_pending();
+
+	__sync_lock_release(&tlb_request_busy);
+}
+
+irqresult_t
+md_tlb_shootdown_ipi(Ananas::Device*, void*)
+{
+	tlb_service_pending();
+	return IRQ_RESULT_PROCESSED;
+}
+#endif /* OPTION_SMP */
+
+void
+tlb_batch_init(struct TLB_BATCH* tb, vmspace_t* vs)
+{
+	tb->tb_vs = vs;
+	tb->tb_num_ranges = 0;
+	tb->tb_num_pages = 0;
+	tb->tb_flush_all = false;
+}
+
+void
+tlb_batch_add(struct TLB_BATCH* tb, addr_t virt, size_t num_pages)
+{
+	tb->tb_num_pages += num_pages;
+	if (tb->tb_flush_all)
+		return;
+	if (tb->tb_num_pages > TLB_FLUSH_ALL_PAGES) {
+		tb->tb_flush_all = true;
+		return;
+	}
+
+	/* Try to extend the previous range; unmapping is mostly sequential */
+	if (tb->tb_num_ranges > 0) {
+		struct TLB_RANGE* tr = &tb->tb_range[tb->tb_num_ranges - 1];
+		if (tr->tr_virt + tr->tr_num_pages * PAGE_SIZE == virt) {
+			tr->tr_num_pages += num_pages;
+			return;
+		}
+	}
+	if (tb->tb_num_ranges == TLB_BATCH_RANGES) {
+		tb->tb_flush_all = true;
+		return;
+	}
+
+	struct TLB_RANGE* tr = &tb->tb_range[tb->tb_num_ranges++];
+	tr->tr_virt = virt;
+	tr->tr_num_pages = num_pages;
+}
+
+void
+tlb_batch_flush(struct TLB_BATCH* tb)
+{
+	if (tb->tb_num_pages == 0)
+		return;
+
+	/* Invalidate our own TLB; we mustn't move to another CPU while doing so */
+	int state = md_interrupts_save_and_disable();
+	tlb_invalidate_local(tb);
+#ifdef OPTION_SMP
+	unsigned int cpuid = PCPU_GET(cpuid);
+#endif
+	md_interrupts_restore(state);
+
+#ifdef OPTION_SMP
+	/*
+	 * Only bother CPU's that may have cached the mappings. Those outside of
+	 * vs_md_cpu_mask will reload %cr3 before touching the vmspace, which drops
+	 * all non-global entries anyway.
+	 */
+	uint32_t mask = smp_get_launched_mask();
+	if (tb->tb_vs != NULL)
+		mask &= tb->tb_vs->vs_md_cpu_mask;
+	mask &= ~(1U << cpuid);
+	if (mask != 0)
+		tlb_shootdown(tb, mask);
+#endif
+
+	tlb_batch_init(tb, tb->tb_vs);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,124 @@
+/*
+ * Userland memory access; see kernel/usercopy.h. The routines that actually
+ * touch the memory are in usercopy.S.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include "kernel/lib.h"
+#include "kernel/trace.h"
+#include "kernel/usercopy.h"
+#include "kernel-md/macro.h"
+#include "kernel-md/usercopy.h"
+#include "kernel-md/vm.h"
+
+TRACE_SETUP;
+
+struct FAULT_FIXUP {
+	addr_t	ff_start;
+	addr_t	ff_end;
+	addr_t	ff_fixup;
+};
+
+extern "C" int usercopy_copy(void* dst, const void* src, size_t len);
+extern "C" int usercopy_copystr(char* dst, const void* src, size_t len, size_t* done);
+extern "C" struct FAULT_FIXUP __faultfixups_begin, __faultfixups_end;
+
+bool md_smap_enabled = false;
+
+namespace {
+
+inline bool
+is_user_range(const void* ptr, size_t len)
+{
+	addr_t addr = reinterpret_cast<addr_t>(ptr);
+	return addr < USERLAND_VA_END && len <= USERLAND_VA_END - addr;
+}
+
+inline void
+smap_allow()
+{
+	if (md_smap_enabled)
+		__asm __volatile("stac" : : : "memory");
+}
+
+inline void
+smap_deny()
+{
+	if (md_smap_enabled)
+		__asm __volatile("clac" : : : "memory");
+}
+
+} // unnamed namespace
+
+void
+md_usercopy_init_cpu()
+{
+	uint32_t eax, ebx, ecx, edx;
+	x86_cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (eax < 7)
+		return;
+	x86_cpuid(7, &eax, &ebx, &ecx, &edx);
+	if ((ebx & CPUID_7_EBX_SMAP) == 0)
+		return;
+
+	write_cr4(read_cr4() | CR4_SMAP);
+	md_smap_enabled = true;
+}
+
+addr_t
+md_usercopy_fixup(addr_t rip)
+{
+	for (struct FAULT_FIXUP* ff = &__faultfixups_begin; ff < &__faultfixups_end; ff++)
+		if (rip >= ff->ff_start && rip < ff->ff_end)
+			return ff->ff_fixup;
+	return 0;
+}
+
+errorcode_t
+copyin(void* dst, const void* user_src, size_t len)
+{
+	if (!is_user_range(user_src, len))
+		return ANANAS_ERROR(BAD_ADDRESS);
+
+	smap_allow();
+	int result = usercopy_copy(dst, user_src, len);
+	smap_deny();
+	return result == 0 ? ananas_success() : ANANAS_ERROR(BAD_ADDRESS);
+}
+
+errorcode_t
+copyout(void* user_dst, const void* src, size_t len)
+{
+	if (!is_user_range(user_dst, len))
+		return ANANAS_ERROR(BAD_ADDRESS);
+
+	smap_allow();
+	int result = usercopy_copy(user_dst, src, len);
+	smap_deny();
+	return result == 0 ? ananas_success() : ANANAS_ERROR(BAD_ADDRESS);
+}
+
+errorcode_t
+copyinstr(char* dst, const void* user_src, size_t len, size_t* done)
+{
+	// The string may end well before len, so only the start needs to be sane
+	addr_t src = reinterpret_cast<addr_t>(user_src);
+	if (src >= USERLAND_VA_END)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (len > USERLAND_VA_END - src)
+		len = USERLAND_VA_END - src;
+
+	size_t copied;
+	smap_allow();
+	int result = usercopy_copystr(dst, user_src, len, &copied);
+	smap_deny();
+	if (result == 1)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (result == 2)
+		return ANANAS_ERROR(BAD_LENGTH);
+	if (done != NULL)
+		*done = copied;
+	return ananas_success();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -16,9 +16,10 @@ md_vmspace_init(vmspace_t* vs)
 	if (vs->vs_md_pagedir == NULL)
 		return ANANAS_ERROR(OUT_OF_MEMORY);
 	LIST_APPEND(&vs->vs_pages, pagedir_page);
+	vs->vs_md_cpu_mask = 0;
 
 	/* Map the kernel pages in there */
-	memset(vs->vs_md_pagedir, 0, PAGE_SIZE);
+	memzero_pages(vs->vs_md_pagedir, PAGE_SIZE);
 	md_map_kernel(vs);
 
 	return ananas_success();
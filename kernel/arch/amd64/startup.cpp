@@ -8,6 +8,7 @@
 #include "kernel/init.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/memops.h"
 #include "kernel/pcpu.h"
 #include "kernel/mm.h"
 #include "kernel/vm.h"
@@ -20,6 +21,7 @@
 #include "kernel-md/param.h"
 #include "kernel-md/vm.h"
 #include "kernel-md/thread.h"
+#include "kernel-md/usercopy.h"
 #include "options.h"
 
 /* Pointer to the page directory level 4 */
@@ -121,18 +123,62 @@ calculate_num_pages_required(size_t mem_size, unsigned int* num_pages_needed, un
 	*length_in_pages = num_pte;
 }
 
-struct AVAIL_CTX {
-	addr_t avail_start;
-	addr_t* avail_end;
-};
+/*
+ * Maps RAM [phys_start .. phys_end) in the direct map using the largest pages
+ * possible; the tables needed are taken from *avail. This is only used for
+ * memory which is in the direct map for good, so we never need to split the
+ * large pages.
+ */
+static void
+map_direct_pages(addr_t phys_start, addr_t phys_end, addr_t* avail, bool use_1gb_pages)
+{
+#define ADDR_MASK 0xffffffffff000 /* bits 12 .. 51 */
+	const uint64_t table_flags = PE_RW | PE_P | PE_C_G;
+	const uint64_t leaf_flags = PE_G | PE_RW | PE_P | PE_NX;
 
-static uint64_t
-kva_get_flags(void* ctx, addr_t phys, addr_t virt)
+	addr_t phys = phys_start;
+	while (phys < phys_end) {
+		addr_t virt = PTOKV(phys);
+		uint64_t* pml4e = &kernel_pagedir[(virt >> 39) & 0x1ff];
+		KASSERT(*pml4e != 0, "direct map pml4e for %p not allocated", phys);
+
+		uint64_t* pdpe = &((uint64_t*)(*pml4e & ADDR_MASK))[(virt >> 30) & 0x1ff];
+		if (use_1gb_pages && *pdpe == 0 && (phys & (PAGE_SIZE_1GB - 1)) == 0 && phys + PAGE_SIZE_1GB <= phys_end) {
+			*pdpe = phys | PE_PS | leaf_flags;
+			phys += PAGE_SIZE_1GB;
+			continue;
+		}
+		if (*pdpe == 0)
+			*pdpe = (addr_t)bootstrap_get_pages(avail, 1) | table_flags;
+		KASSERT((*pdpe & PE_PS) == 0, "%p already mapped by a 1GB page", phys);
+
+		uint64_t* pde = &((uint64_t*)(*pdpe & ADDR_MASK))[(virt >> 21) & 0x1ff];
+		if (*pde == 0 && (phys & (PAGE_SIZE_2MB - 1)) == 0 && phys + PAGE_SIZE_2MB <= phys_end) {
+			*pde = phys | PE_PS | leaf_flags;
+			phys += PAGE_SIZE_2MB;
+			continue;
+		}
+		if (*pde == 0)
+			*pde = (addr_t)bootstrap_get_pages(avail, 1) | table_flags;
+		KASSERT((*pde & PE_PS) == 0, "%p already mapped by a 2MB page", phys);
+
+		uint64_t* pte = (uint64_t*)(*pde & ADDR_MASK);
+		pte[(virt >> 12) & 0x1ff] = phys | leaf_flags;
+		phys += PAGE_SIZE;
+	}
+
+#undef ADDR_MASK
+}
+
+static bool
+have_1gb_pages()
 {
-	struct AVAIL_CTX* actx = static_cast<struct AVAIL_CTX*>(ctx);
-	if (phys >= actx->avail_start && phys <= *actx->avail_end)
-		return PE_G | PE_RW | PE_P;
-	return 0;
+	uint32_t eax, ebx, ecx, edx;
+	x86_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	if (eax < 0x80000001)
+		return false;
+	x86_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+	return (edx & CPUID_EXT_EDX_PDPE1GB) != 0;
 }
 
 static uint64_t
@@ -145,27 +191,19 @@ kmem_get_flags(void* ctx, addr_t phys, addr_t virt)
 	return flags;
 }
 
-static uint64_t
-dynkva_get_flags(void* ctx, addr_t phys, addr_t virt)
-{
-	/* We just setup space for mappings; not the actual mappings themselves */
-	return 0;
-}
-
 static void
-setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
+setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size, int num_chunks)
 {
 #define KMAP_KVA_START KMEM_DIRECT_VA_START
 #define KMAP_KVA_END KMEM_DYNAMIC_VA_END
-	addr_t avail_start = *avail;
-
 	/*
 	 * Taking the overview in machine-md/vm.h into account, we want to map the
 	 * following regions:
 	 *
 	 * - KMAP_KVA_START .. KMAP_KVA_END: the kernel's KVA
-	 *   This may be mapped as 4KB pages; however, we can lower the estimate if
-	 *   there is less memory available than the total size of this region.
+	 *   All RAM is mapped here for good, using 1GB/2MB pages where possible.
+	 *   Device memory is mapped using 4KB pages on demand. We only pre-allocate
+	 *   the top-level entries, as these are shared with all vmspaces.
 	 * - KERNBASE ... KERNEND: the kernel code/data
 	 *   We always map this as 4KB pages to ensure we can benefit most optimally
 	 *   from NX.
@@ -181,9 +219,8 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 	if (mem_end < 4UL * 1024 * 1024 * 1024)
 		kmap_kva_end = KMAP_KVA_START + 4UL * 1024 * 1024 * 1024;
 
-	uint64_t kva_size = kmap_kva_end - KMAP_KVA_START;
-	unsigned int kva_pages_needed, kva_size_in_pages;
-	calculate_num_pages_required(kva_size, &kva_pages_needed, &kva_size_in_pages);
+	unsigned int kva_first_pml4e = (KMAP_KVA_START >> 39) & 0x1ff;
+	unsigned int kva_pages_needed = (((kmap_kva_end - 1) >> 39) & 0x1ff) - kva_first_pml4e + 1;
 	addr_t kva_pages = (addr_t)bootstrap_get_pages(avail, kva_pages_needed);
 
 	/* Finally, allocate the kernel pagedir itself */
@@ -211,23 +248,28 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 	addr_t kernel_pages = (addr_t)bootstrap_get_pages(avail, kernel_pages_needed);
 
 	/*
-	 * Calculate the amount we need for dynamic KVA mappings; this is likely a
-	 * gross overstatement because we can typically map everything 1:1 since we
-	 * have address space plenty...
+	 * For the dynamic KVA mappings, we only allocate the top-level entries:
+	 * these are copied to every vmspace, so they cannot be added later on. The
+	 * rest is allocated on demand by md_map_pages().
 	 */
-	unsigned int dyn_kva_pages_needed, dyn_kva_size_in_pages;
-	calculate_num_pages_required(KMEM_DYNAMIC_VA_END - KMEM_DYNAMIC_VA_START, &dyn_kva_pages_needed, &dyn_kva_size_in_pages);
+	unsigned int dyn_kva_first_pml4e = (KMEM_DYNAMIC_VA_START >> 39) & 0x1ff;
+	unsigned int dyn_kva_pages_needed = ((KMEM_DYNAMIC_VA_END >> 39) & 0x1ff) - dyn_kva_first_pml4e + 1;
 	addr_t dyn_kva_pages = (addr_t)bootstrap_get_pages(avail, dyn_kva_pages_needed);
 
 	/*
-	 * Map the KVA - we will only map what we have used for our page tables, to
-	 * ensure we can change them later as necessary. We explicitly won't map the
-	 * kernel page tables here because we never need to change them.
+	 * Map all RAM in the KVA; this includes the page tables we are creating
+	 * here, which lets us change them later as necessary. Note that we do not
+	 * know which pages the kernel will use for tables beforehand, so these are
+	 * allocated as we go.
 	 */
-	struct AVAIL_CTX actx = { avail_start, avail };
-	addr_t kva_avail_ptr = (addr_t)kva_pages;
-	map_kernel_pages(0, KMAP_KVA_START, kva_size_in_pages, &kva_avail_ptr, kva_get_flags, &actx);
-	KASSERT(kva_avail_ptr == (addr_t)kva_pages + kva_pages_needed * PAGE_SIZE, "not all KVA pages used (used %d, expected %d)", (kva_avail_ptr - kva_pages) / PAGE_SIZE, kva_pages);
+	for (unsigned int n = 0; n < kva_pages_needed; n++)
+		kernel_pagedir[kva_first_pml4e + n] = (kva_pages + n * PAGE_SIZE) | PE_RW | PE_P | PE_C_G;
+	bool use_1gb_pages = have_1gb_pages();
+	for (int n = 0; n < num_chunks; n++) {
+		map_direct_pages(phys[n].addr, phys[n].addr + phys[n].len, avail, use_1gb_pages);
+		kmem_mark_direct(phys[n].addr, phys[n].len);
+	}
+	kprintf("direct map: %d chunk(s), using %s pages\n", num_chunks, use_1gb_pages ? "1GB/2MB" : "2MB");
 
 	/* Now map the kernel itself */
 	addr_t kernel_addr = (addr_t)&__entry & ~(PAGE_SIZE - 1);
@@ -237,10 +279,9 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 	map_kernel_pages(kernel_addr & 0x00ffffff, kernel_addr, kernel_size_in_pages, &kernel_avail_ptr, kmem_get_flags, &kernel_text_end);
 	KASSERT(kernel_avail_ptr <= (addr_t)kernel_pages + kernel_pages_needed * PAGE_SIZE, "not all kernel pages used (used %d, expected %d)", (kernel_avail_ptr - kernel_pages) / PAGE_SIZE, kernel_pages_needed);
 
-	/* And map the dynamic KVA pages */
-	addr_t dyn_kva_avail_ptr = dyn_kva_pages;
-	map_kernel_pages(0, KMEM_DYNAMIC_VA_START, dyn_kva_size_in_pages, &dyn_kva_avail_ptr, dynkva_get_flags, NULL);
-	KASSERT(dyn_kva_avail_ptr == (addr_t)dyn_kva_pages + dyn_kva_pages_needed * PAGE_SIZE, "not all dynamic KVA pages used (used %d, expected %d)", (dyn_kva_avail_ptr - dyn_kva_pages) / PAGE_SIZE, dyn_kva_pages_needed);
+	/* And hook up the dynamic KVA pages */
+	for (unsigned int n = 0; n < dyn_kva_pages_needed; n++)
+		kernel_pagedir[dyn_kva_first_pml4e + n] = (dyn_kva_pages + n * PAGE_SIZE) | PE_RW | PE_P | PE_C_G;
 
 	/* Activate our new page tables */
 	kprintf(">>> activating kernel_pagedir = %p\n", kernel_pagedir);
@@ -308,7 +349,7 @@ setup_cpu(addr_t gdt, addr_t pcpu)
                   ((uint64_t)GDT_SEL_KERNEL_CODE << 32L));
 extern void* syscall_handler;
 	wrmsr(MSR_LSTAR, (addr_t)&syscall_handler);
-	wrmsr(MSR_SFMASK, 0x200 /* IF */);
+	wrmsr(MSR_SFMASK, RFLAGS_IF | RFLAGS_AC); /* AC as it could override SMAP */
 
 	/* Enable global pages */
 	write_cr4(read_cr4() | 0x80); /* PGE */
@@ -316,11 +357,17 @@ extern void* syscall_handler;
 	/* Enable FPU use; the kernel will save/restore it as needed */
 	write_cr4(read_cr4() | 0x600); /* OSFXSR | OSXMMEXCPT */
 
+	/* No thread has its FPU state loaded yet, so the first use must trap */
+	write_cr0(read_cr0() | CR0_TS);
+
 	// Enable No-Execute Enable bit XXX we should check to ensure it is supported
 	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | MSR_EFER_NXE);
 
 	// Enable the write-protect bit; this ensures kernel-code can't write to readonly pages
 	write_cr0(read_cr0() | CR0_WP);
+
+	// Prevent the kernel from accessing userland memory by accident, if we can
+	md_usercopy_init_cpu();
 }
 
 #ifdef OPTION_SMP
@@ -392,6 +439,9 @@ md_startup(struct BOOTINFO* bootinfo_ptr)
 	if (bootinfo == NULL)
 		panic("going nowhere without my bootinfo");
 
+	/* Pick the quickest way to move memory around before we start doing so */
+	md_memops_init();
+
 	/*
 	 * Initialize a new Global Descriptor Table; we shouldn't trust what the
 	 * loader gives us and we'll need things like a TSS.
@@ -554,7 +604,7 @@ extern void* bootstrap_stack;
 	kprintf("total physical memory present: %d MB\n", mem_size / 1024);
 
 	uint64_t prev_avail = avail;
-	setup_paging(&avail, mem_end, kernel_to - kernel_from);
+	setup_paging(&avail, mem_end, kernel_to - kernel_from, phys_idx);
 
 	/*
 	 * Now add the physical chunks of memory. Note that phys[] isn't up-to-date
@@ -48,6 +48,8 @@ acpi_smp_init(int* bsp_apic_id)
 	 */
 	KASSERT(madt->Address == LAPIC_BASE, "lapic base unsupported");
 	char* lapic_base = map_device<char*>(madt->Address);
+	if (lapic_base == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	KASSERT((addr_t)lapic_base == PTOKV(madt->Address), "mis-mapped lapic (%p != %p)", lapic_base, PTOKV(madt->Address));
 	/* Fetch our local APIC ID, we need to program it shortly */
 	*bsp_apic_id = (*(volatile uint32_t*)(lapic_base + LAPIC_ID)) >> 24;
@@ -115,6 +117,10 @@ acpi_smp_init(int* bsp_apic_id)
 				kprintf("lapic, acpi id=%u apicid=%u\n", lapic->ProcessorId, lapic->Id);
 				if ((lapic->LapicFlags & ACPI_MADT_ENABLED) == 0)
 					continue; /* skip disabled CPU's */
+				if (cur_cpu == smp_config.cfg_num_cpus) {
+					kprintf("SMP: ignoring CPU with apicid %u, too many CPU's\n", lapic->Id);
+					continue;
+				}
 
 				struct X86_CPU* cpu = &smp_config.cfg_cpu[cur_cpu];
 				cpu->lapic_id = lapic->Id;
@@ -127,6 +133,8 @@ acpi_smp_init(int* bsp_apic_id)
 
 				/* Map the IOAPIC memory; the hairy details are in map_device() */
 				void* ioapic_base = map_device<void*>(apic->Address);
+				if (ioapic_base == NULL)
+					return ANANAS_ERROR(OUT_OF_MEMORY);
 
 				/* Create the associated I/O APIC and hook it up */
 				struct X86_IOAPIC* ioapic = &smp_config.cfg_ioapic[cur_ioapic];
@@ -17,6 +17,7 @@
 #include "kernel-md/interrupts.h"
 #include "kernel-md/macro.h"
 #include "kernel-md/param.h"
+#include "kernel-md/tlb.h"
 #include "kernel-md/vm.h"
 #include "options.h"
 
@@ -39,6 +40,7 @@ struct X86_SMP_CONFIG smp_config;
 static struct PAGE* ap_page;
 static int can_smp_launch = 0;
 extern "C" volatile int num_smp_launched = 1; /* BSP is always launched */
+static volatile uint32_t smp_launched_mask = 1; /* by CPU ID */
 
 static struct IRQ_SOURCE ipi_source = {
 	.is_first = SMP_IPI_FIRST,
@@ -86,6 +88,15 @@ smp_ipi_panic(Ananas::Device*, void* context)
 void
 smp_prepare_config(struct X86_SMP_CONFIG* cfg)
 {
+	/*
+	 * Per-CPU structures are sized by MAX_CPUS; any CPUs beyond that are left
+	 * alone. They are still woken up, but won't find themselves in cfg_cpu.
+	 */
+	if (cfg->cfg_num_cpus > MAX_CPUS) {
+		kprintf("SMP: %d CPU(s) found, ignoring all but the first %d\n", cfg->cfg_num_cpus, MAX_CPUS);
+		cfg->cfg_num_cpus = MAX_CPUS;
+	}
+
 	/* Prepare the CPU structure. CPU #0 is always the BSP */
 	cfg->cfg_cpu = static_cast<struct X86_CPU*>(kmalloc(sizeof(struct X86_CPU) * cfg->cfg_num_cpus));
 	memset(cfg->cfg_cpu, 0, sizeof(struct X86_CPU) * cfg->cfg_num_cpus);
@@ -147,6 +158,8 @@ void
 smp_prepare()
 {
 	ap_page = page_alloc_single();
+	if (ap_page == NULL)
+		panic("smp: no page available for the ap code");
 	KASSERT(page_get_paddr(ap_page) < 0x100000, "ap code must be below 1MB"); /* XXX crude */
 }
 
@@ -168,6 +181,11 @@ smp_init()
 	 */
 	KASSERT(ap_page != NULL, "smp_prepare() not called");
 	void* ap_code = kmem_map(page_get_paddr(ap_page), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_EXECUTE);
+	if (ap_code == NULL) {
+		page_free(ap_page);
+		smp_destroy_ap_pagetable();
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
 	memcpy(ap_code, &__ap_entry, (addr_t)&__ap_entry_end - (addr_t)&__ap_entry);
 	kmem_unmap(ap_code, PAGE_SIZE);
 
@@ -209,6 +227,8 @@ smp_init()
 		panic("can't register ipi");
 	if (ananas_is_failure(irq_register(SMP_IPI_SCHEDULE, NULL, smp_ipi_schedule, IRQ_TYPE_IPI, NULL)))
 		panic("can't register ipi");
+	if (ananas_is_failure(irq_register(SMP_IPI_TLB, NULL, md_tlb_shootdown_ipi, IRQ_TYPE_IPI, NULL)))
+		panic("can't register ipi");
 
 	/*
 	 * Initialize the SMP launch variable; every AP will just spin and check this value. We don't
@@ -270,6 +290,35 @@ smp_broadcast_schedule()
 	*((volatile uint32_t*)(PTOKV(LAPIC_BASE) + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_INC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_SCHEDULE;
 }
 
+/*
+ * Sends an IPI to a single CPU; the CPU is addressed by its physical APIC ID
+ * so that we do not depend on the logical destination setup.
+ */
+void
+smp_send_ipi(unsigned int cpu, int vector)
+{
+	KASSERT(cpu < (unsigned int)smp_config.cfg_num_cpus, "invalid cpu %u", cpu);
+	addr_t lapic_base = PTOKV(LAPIC_BASE);
+
+	/* Ensure nothing on this CPU can send an IPI between programming ICR_HI and ICR_LO */
+	int state = md_interrupts_save_and_disable();
+	while (*(volatile uint32_t*)(lapic_base + LAPIC_ICR_LO) & LAPIC_ICR_STATUS_PENDING)
+		/* wait for the previous IPI to be sent */ ;
+	*(volatile uint32_t*)(lapic_base + LAPIC_ICR_HI) = smp_config.cfg_cpu[cpu].lapic_id << 24;
+	*(volatile uint32_t*)(lapic_base + LAPIC_ICR_LO) = LAPIC_ICR_DEST_FIELD | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | vector;
+	md_interrupts_restore(state);
+}
+
+/*
+ * Returns the mask of CPU's which are running and accept interrupts; IPI's
+ * must not be sent to any CPU outside of this mask.
+ */
+uint32_t
+smp_get_launched_mask()
+{
+	return smp_launched_mask;
+}
+
 /*
  * Called by mp_stub.S for every Application Processor. Should not return.
  */
@@ -298,6 +347,7 @@ mp_ap_startup(uint32_t lapic_id)
 
 	/* We're up and running! Increment the launched count */
 	__asm("lock incl (num_smp_launched)");
+	__sync_fetch_and_or(&smp_launched_mask, 1U << PCPU_GET(cpuid));
 	
 	/* Enable interrupts and become the idle thread; this doesn't return */
 	md_interrupts_enable();
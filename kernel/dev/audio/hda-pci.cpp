@@ -3,14 +3,13 @@
 #include <machine/param.h>
 #include "kernel/dev/pci.h"
 #include "kernel/device.h"
+#include "kernel/dma.h"
 #include "kernel/driver.h"
 #include "kernel/irq.h"
 #include "kernel/lib.h"
 #include "kernel/mm.h"
-#include "kernel/page.h"
 #include "kernel/time.h"
 #include "kernel/trace.h"
-#include "kernel/vm.h"
 #include "hda.h"
 #include "hda-pci.h"
 
@@ -69,7 +68,7 @@ private:
 	int hda_iss, hda_oss, hda_bss;	/* stream counts, per type */
 	int hda_corb_size;
 	int hda_rirb_size;
-	struct PAGE* hda_page;
+	dma_buf_t hda_corb_buf;
 	uint32_t* hda_corb;
 	uint64_t* hda_rirb;
 	int hda_rirb_rp;
@@ -204,29 +203,49 @@ HDAPCIDevice::OpenStream(int tag, int dir, uint16_t fmt, int num_pages, Context*
 
 	/* Setup the stream structure */
 	auto s = static_cast<struct HDA_PCI_STREAM*>(kmalloc(sizeof(struct HDA_PCI_STREAM) + sizeof(struct HDA_PCI_STREAM_PAGE) * num_pages));
+	if (s == NULL) {
+		hda_ss_avail |= 1 << ss;
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
 	s->s_ss = ss;
-	s->s_bdl = static_cast<struct HDA_PCI_BDL_ENTRY*>(page_alloc_single_mapped(&s->s_bdl_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE));
+	errorcode_t err = dma_buf_alloc(d_DMA_tag, PAGE_SIZE, &s->s_bdl_buf);
+	if (ananas_is_failure(err)) {
+		kfree(s);
+		hda_ss_avail |= 1 << ss;
+		return err;
+	}
+	s->s_bdl = static_cast<struct HDA_PCI_BDL_ENTRY*>(dma_buf_get_segment(s->s_bdl_buf, 0)->s_virt);
 	s->s_num_pages = num_pages;
-	hda_stream[ss] = s;
-	*context = s;
 
 	/* Create a page-chain for the same data and place it in the BDL */
 	struct HDA_PCI_BDL_ENTRY* bdl = s->s_bdl;
 	struct HDA_PCI_STREAM_PAGE* sp = &s->s_page[0];
 	for (int n = 0; n < num_pages; n++, bdl++, sp++) {
-		/* XXX use dma system here */
-		sp->sp_ptr = page_alloc_single_mapped(&sp->sp_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
-		bdl->bdl_addr = page_get_paddr(sp->sp_page);
+		err = dma_buf_alloc(d_DMA_tag, PAGE_SIZE, &sp->sp_buf);
+		if (ananas_is_failure(err)) {
+			/* Out of 32-bit addressable memory; undo everything */
+			while (n-- > 0)
+				dma_buf_free(s->s_page[n].sp_buf);
+			dma_buf_free(s->s_bdl_buf);
+			kfree(s);
+			hda_ss_avail |= 1 << ss;
+			return err;
+		}
+		sp->sp_ptr = dma_buf_get_segment(sp->sp_buf, 0)->s_virt;
+		bdl->bdl_addr = dma_buf_get_segment(sp->sp_buf, 0)->s_phys;
 		bdl->bdl_length = PAGE_SIZE;
 		// XXX only give IRQ on each buffer half
 		bdl->bdl_flags = (n == (num_pages/ 2) || n == (num_pages - 1) ? BDL_FLAG_IOC : 0);
 	}
 
+	hda_stream[ss] = s;
+	*context = s;
+
 	/* All set; time to set the stream itself up */
 	HDA_WRITE_4(HDA_REG_xSDnCBL(ss), num_pages * PAGE_SIZE);
 	HDA_WRITE_4(HDA_REG_xSDnLVI(ss), num_pages - 1);
 	HDA_WRITE_2(HDA_REG_xSDnFMT(ss), fmt);
-	HDA_WRITE_4(HDA_REG_xSDnBDPL(ss), page_get_paddr(s->s_bdl_page));
+	HDA_WRITE_4(HDA_REG_xSDnBDPL(ss), dma_buf_get_segment(s->s_bdl_buf, 0)->s_phys);
 	HDA_WRITE_4(HDA_REG_xSDnBDPU(ss), 0); // XXX
 
 	/* Set the stream status up - we don't set the RUN bit just yet */
@@ -250,10 +269,10 @@ HDAPCIDevice::CloseStream(void* context)
 
 	/* Free all stream subpages */
 	for (int n = 0; n < s->s_num_pages; n++)
-		page_free(s->s_page[n].sp_page);
+		dma_buf_free(s->s_page[n].sp_buf);
 
 	/* Free the BDL page */
-	page_free(s->s_bdl_page);
+	dma_buf_free(s->s_bdl_buf);
 
 	/* Free the stream and the context */
 	hda_stream[s->s_ss] = NULL;
@@ -367,7 +386,11 @@ HDAPCIDevice::Attach()
 
 	hda_addr = (addr_t)res_io;
 
-	errorcode_t err = irq_register((uintptr_t)res_irq, this, &IRQWrapper, IRQ_TYPE_DEFAULT, nullptr);
+	/* The controller can only address the low 4GB, and wants 128 byte aligned buffers */
+	errorcode_t err = dma_tag_create(d_Parent->d_DMA_tag, *this, &d_DMA_tag, 128, 0, DMA_ADDR_MAX_32BIT, DMA_SEGS_MAX_ANY, DMA_SEGS_MAX_SIZE);
+	ANANAS_ERROR_RETURN(err);
+
+	err = irq_register((uintptr_t)res_irq, this, &IRQWrapper, IRQ_TYPE_DEFAULT, nullptr);
 	ANANAS_ERROR_RETURN(err);
 
 	/* Enable busmastering; all communication is done by DMA */
@@ -426,9 +449,11 @@ HDAPCIDevice::Attach()
 	 * this means we can just grab a single page use it.
 	 */
 	static_assert(PAGE_SIZE >= 4096, "tiny page size?");
-	hda_corb = static_cast<uint32_t*>(page_alloc_single_mapped(&hda_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE));
+	err = dma_buf_alloc(d_DMA_tag, PAGE_SIZE, &hda_corb_buf);
+	ANANAS_ERROR_RETURN(err);
+	hda_corb = static_cast<uint32_t*>(dma_buf_get_segment(hda_corb_buf, 0)->s_virt);
 	hda_rirb = (uint64_t*)((char*)hda_corb + 1024);
-	addr_t corb_paddr = page_get_paddr(hda_page);
+	addr_t corb_paddr = dma_buf_get_segment(hda_corb_buf, 0)->s_phys;
 	memset(hda_corb, 0, PAGE_SIZE);
 
 	/* Set up the CORB buffer; this is used to transfer commands to a codec */
@@ -442,6 +467,7 @@ HDAPCIDevice::Attach()
 		hda_corb_size = 2; corb_size_val = HDA_CORBSIZE_CORBSIZE_2E;
 	} else {
 		Printf("corb size invalid?! corbsize=%x", x);
+		dma_buf_free(hda_corb_buf);
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 	HDA_WRITE_1(HDA_REG_CORBSIZE, (x & ~HDA_CORBSIZE_CORBSIZE_MASK) | corb_size_val);
@@ -459,6 +485,7 @@ HDAPCIDevice::Attach()
 		hda_rirb_size = 2; corb_size_val = HDA_RIRBSIZE_RIRBSIZE_2E;
 	} else {
 		Printf("rirb size invalid?! rirbsize=%x", x);
+		dma_buf_free(hda_corb_buf);
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 	HDA_WRITE_1(HDA_REG_RIRBSIZE, (x & ~HDA_RIRBSIZE_RIRBSIZE_MASK) | rirb_size_val);
@@ -479,7 +506,7 @@ HDAPCIDevice::Attach()
 		return ananas_success();
 
 	/* XXX we should clean up the tree thus far */
-	page_free(hda_page);
+	dma_buf_free(hda_corb_buf);
 	return err;
 }
 
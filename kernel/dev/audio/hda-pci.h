@@ -126,7 +126,7 @@ struct HDA_PCI_PRIVDATA {
 };
 
 struct HDA_PCI_STREAM_PAGE {
-	struct PAGE* sp_page;
+	dma_buf_t sp_buf;
 	void* sp_ptr;
 };
 
@@ -134,7 +134,7 @@ struct HDA_PCI_STREAM {
 	int s_ss;			/* Stream# in use */
 	int s_num_pages;
 	struct HDA_PCI_BDL_ENTRY* s_bdl;	/* BDL entries */
-	struct PAGE* s_bdl_page;	/* Page for the BDL */
+	dma_buf_t s_bdl_buf;		/* Buffer for the BDL */
 	struct HDA_PCI_STREAM_PAGE s_page[0];
 };
 
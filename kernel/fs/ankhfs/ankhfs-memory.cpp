@@ -0,0 +1,99 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <machine/param.h>
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/mm.h"
+#include "kernel/page.h"
+#include "kernel/slab.h"
+#include "kernel/trace.h"
+#include "kernel/vmpage.h"
+#include "kernel/vfs/core.h"
+#include "kernel/vfs/generic.h"
+#include "memory.h"
+#include "support.h"
+
+TRACE_SETUP;
+
+namespace Ananas {
+namespace AnkhFS {
+namespace {
+
+constexpr unsigned int subPages = 1;
+constexpr unsigned int subSlabs = 2;
+
+constexpr size_t resultLength = PAGE_SIZE;
+
+struct DirectoryEntry memory_entries[] = {
+	{ "pages", make_inum(SS_Memory, 0, subPages) },
+	{ "slabs", make_inum(SS_Memory, 0, subSlabs) },
+	{ NULL, 0 }
+};
+
+class MemorySubSystem : public IAnkhSubSystem
+{
+public:
+	errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len) override
+	{
+		return AnkhFS::HandleReadDir(file, dirents, len, memory_entries[0]);
+	}
+
+	errorcode_t FillInode(struct VFS_INODE* inode, ino_t inum) override
+	{
+		if (inum_to_sub(inum) == 0)
+			inode->i_sb.st_mode |= S_IFDIR;
+		else
+			inode->i_sb.st_mode |= S_IFREG;
+		return ananas_success();
+	}
+
+	errorcode_t HandleRead(struct VFS_FILE* file, void* buf, size_t* len) override
+	{
+		auto result = static_cast<char*>(kmalloc(resultLength));
+		if (result == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		strcpy(result, "???");
+
+		ino_t inum = file->f_dentry->d_inode->i_inum;
+		switch(inum_to_sub(inum)) {
+			case subPages: {
+				unsigned int total_pages, avail_pages;
+				page_get_stats(&total_pages, &avail_pages);
+				unsigned int cached_pages, hits, misses;
+				page_get_magazine_stats(&cached_pages, &hits, &misses);
+				unsigned int zeroed_pages, zero_hits, zero_misses;
+				page_get_zero_stats(&zeroed_pages, &zero_hits, &zero_misses);
+				unsigned int zero_page_mapped, zero_page_promoted;
+				vmpage_get_zero_stats(&zero_page_mapped, &zero_page_promoted);
+				size_t kva_total, kva_inuse;
+				kmem_get_stats(&kva_total, &kva_inuse);
+				snprintf(result, resultLength, "total %u\navail %u\nmagazine_cached %u\nmagazine_hits %u\nmagazine_misses %u\nzero_cached %u\nzero_hits %u\nzero_misses %u\nzero_page_mapped %u\nzero_page_promoted %u\nkva_total_kb %u\nkva_inuse_kb %u\n",
+				 total_pages, avail_pages, cached_pages, hits, misses, zeroed_pages, zero_hits, zero_misses,
+				 zero_page_mapped, zero_page_promoted,
+				 (unsigned int)(kva_total / 1024), (unsigned int)(kva_inuse / 1024));
+				break;
+			}
+			case subSlabs: {
+				slab_get_stats(result, resultLength);
+				break;
+			}
+		}
+
+		errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+		kfree(result);
+		return err;
+	}
+};
+
+} // unnamed namespace
+
+IAnkhSubSystem& GetMemorySubSystem()
+{
+	static MemorySubSystem memorySubSystem;
+	return memorySubSystem;
+}
+
+} // namespace AnkhFS
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
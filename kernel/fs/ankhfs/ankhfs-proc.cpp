@@ -27,10 +27,12 @@ namespace {
 
 constexpr unsigned int subName = 1;
 constexpr unsigned int subVmSpace = 2;
+constexpr unsigned int subMemory = 3;
 
 struct DirectoryEntry proc_entries[] = {
 	{ "name", make_inum(SS_Proc, 0, subName) },
 	{ "vmspace", make_inum(SS_Proc, 0, subVmSpace) },
+	{ "memory", make_inum(SS_Proc, 0, subMemory) },
 	{ NULL, 0 }
 };
 
@@ -116,6 +118,18 @@ public:
 				}
 				break;
 			}
+			case subMemory: {
+				if (p->p_vmspace != nullptr) {
+					const struct VM_SPACE_STATS& stats = p->p_vmspace->vs_stats;
+					snprintf(result, sizeof(result), "anon_kb %u\nfile_kb %u\nmax_resident_kb %u\nminor_faults %u\nmajor_faults %u\ncow_faults %u\n",
+					 (unsigned int)(stats.vss_anon_pages * (PAGE_SIZE / 1024)),
+					 (unsigned int)(stats.vss_file_pages * (PAGE_SIZE / 1024)),
+					 (unsigned int)(stats.vss_max_resident * (PAGE_SIZE / 1024)),
+					 (unsigned int)stats.vss_minor_faults, (unsigned int)stats.vss_major_faults,
+					 (unsigned int)stats.vss_cow_faults);
+				}
+				break;
+			}
 		}
 		result[sizeof(result) - 1] = '\0';
 		process_deref(p);
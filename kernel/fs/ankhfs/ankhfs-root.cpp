@@ -18,6 +18,7 @@ struct DirectoryEntry root_entries[] = {
 	{ "dev", make_inum(SS_Device, 0, Devices::subRoot) },
 	{ "devices", make_inum(SS_Device, 0, Devices::subDevices) },
 	{ "drivers", make_inum(SS_Device, 0, Devices::subDrivers) },
+	{ "memory", make_inum(SS_Memory, 0, 0) },
 	{ NULL,  0 }
 };
 
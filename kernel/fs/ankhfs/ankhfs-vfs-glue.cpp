@@ -8,6 +8,7 @@
 #include "kernel/vfs/mount.h"
 #include "device.h"
 #include "filesystem.h"
+#include "memory.h"
 #include "proc.h"
 #include "root.h"
 #include "support.h"
@@ -72,6 +73,7 @@ ankhfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 	subSystems[static_cast<size_t>(SubSystem::SS_Proc)] = &GetProcSubSystem();
 	subSystems[static_cast<size_t>(SubSystem::SS_FileSystem)] = &GetFileSystemSubSystem();
 	subSystems[static_cast<size_t>(SubSystem::SS_Device)] = &GetDeviceSubSystem();
+	subSystems[static_cast<size_t>(SubSystem::SS_Memory)] = &GetMemorySubSystem();
 
 	errorcode_t err = vfs_get_inode(fs, make_inum(SS_Root, 0, 0), root_inode);
 	KASSERT(ananas_is_success(err), "cannot get root inode of synthetic filesystem (%d)", err);
@@ -0,0 +1,16 @@
+#ifndef ANANAS_ANKFS_MEMORY_H
+#define ANANAS_ANKFS_MEMORY_H
+
+#include <ananas/types.h>
+
+namespace Ananas {
+namespace AnkhFS {
+
+class IAnkhSubSystem;
+
+IAnkhSubSystem& GetMemorySubSystem();
+
+} // namespace AnkhFS
+} // namespace Ananas
+
+#endif // ANANAS_ANKFS_MEMORY_H
@@ -11,6 +11,7 @@ enum SubSystem {
 	SS_Proc,
 	SS_FileSystem,
 	SS_Device,
+	SS_Memory,
 	SS_Last // do not use
 };
 
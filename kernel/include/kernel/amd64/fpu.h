@@ -0,0 +1,15 @@
+#ifndef __AMD64_FPU_H__
+#define __AMD64_FPU_H__
+
+#include <ananas/types.h>
+
+/* Loads the FPU state of thread t, which must be the current thread */
+void md_fpu_load(thread_t* t);
+
+/* Saves the FPU state that is loaded, if any; the next FPU use will trap */
+void md_fpu_unload();
+
+/* Ensures the saved FPU state of the current thread t is up to date */
+void md_fpu_sync(thread_t* t);
+
+#endif /* __AMD64_FPU_H__ */
@@ -119,6 +119,14 @@ wrmsr(uint32_t msr, uint64_t val)
       "c" (msr));
 }
 
+static inline void
+x86_cpuid(uint32_t op, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+	__asm __volatile(
+		"cpuid\n"
+	: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (op), "c" (0));
+}
+
 static inline uint64_t
 read_cr0()
 {
@@ -137,6 +145,24 @@ write_cr0(uint64_t val)
 	: : "a" (val));
 }
 
+static inline uint64_t
+read_cr3()
+{
+	uint64_t r;
+	__asm __volatile(
+		"movq %%cr3, %0\n"
+	: "=a" (r));
+	return r;
+}
+
+static inline void
+write_cr3(uint64_t val)
+{
+	__asm __volatile(
+		"movq %0, %%cr3\n"
+	: : "a" (val) : "memory");
+}
+
 static inline uint64_t
 read_cr4()
 {
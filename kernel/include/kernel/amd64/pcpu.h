@@ -16,7 +16,9 @@
 	 * FPU context, or NULL if there is none. Being non-NULL means the	\
 	 * current thread is using the FPU and thus the context must be saved.	\
 	 */									\
-	void		*fpu_context;
+	void		*fpu_context;						\
+	/* fpu_kernel is set within kernel_fpu_begin() / kernel_fpu_end() */	\
+	int		fpu_kernel;
 
 #define PCPU_TYPE(x) \
 	__typeof(((struct PCPU*)0)->x)
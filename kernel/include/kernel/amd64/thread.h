@@ -76,6 +76,7 @@ struct FPUREGS {
 	register_t	md_rsp0; \
 	register_t	md_rip; \
 	register_t	md_cr3; \
+	vmspace_t*	md_vmspace;	/* vmspace belonging to md_cr3, NULL for kernel threads */ \
 	struct PAGE* md_kstack_page; \
 	struct FPUREGS	md_fpu_ctx __attribute__ ((aligned(16))); \
 	void*		md_stack; \
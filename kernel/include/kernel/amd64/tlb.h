@@ -0,0 +1,43 @@
+#ifndef __AMD64_TLB_H__
+#define __AMD64_TLB_H__
+
+#include <ananas/types.h>
+#include "kernel/irq.h"
+
+/*
+ * TLB invalidation batches. Code that changes or removes mappings adds the
+ * affected ranges to a batch and flushes it once all page tables are updated;
+ * this invalidates the local TLB and sends a single shootdown request to the
+ * other CPU's which may have cached the mappings.
+ *
+ * Kernel mappings are global and thus concern every CPU; for user mappings,
+ * only CPU's which have the vmspace active (vs_md_cpu_mask) are interrupted.
+ * Once a batch exceeds TLB_FLUSH_ALL_PAGES pages, the entire TLB is flushed
+ * instead of invalidating page by page.
+ */
+#define TLB_BATCH_RANGES 8
+#define TLB_FLUSH_ALL_PAGES 32
+
+struct TLB_RANGE {
+	addr_t tr_virt;
+	size_t tr_num_pages;
+};
+
+struct TLB_BATCH {
+	vmspace_t* tb_vs;	/* NULL for kernel mappings */
+	unsigned int tb_num_ranges;
+	size_t tb_num_pages;
+	bool tb_flush_all;
+	struct TLB_RANGE tb_range[TLB_BATCH_RANGES];
+};
+
+void tlb_batch_init(struct TLB_BATCH* tb, vmspace_t* vs);
+void tlb_batch_add(struct TLB_BATCH* tb, addr_t virt, size_t num_pages);
+
+/* Invalidates everything in the batch on all relevant CPU's and empties it */
+void tlb_batch_flush(struct TLB_BATCH* tb);
+
+/* Handles SMP_IPI_TLB */
+irqresult_t md_tlb_shootdown_ipi(Ananas::Device*, void*);
+
+#endif /* __AMD64_TLB_H__ */
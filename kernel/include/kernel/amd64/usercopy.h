@@ -0,0 +1,15 @@
+#ifndef __AMD64_USERCOPY_H__
+#define __AMD64_USERCOPY_H__
+
+#include <ananas/types.h>
+
+/* Set if userland memory is only accessible with %rflags.AC set (SMAP) */
+extern bool md_smap_enabled;
+
+/* Enables SMAP on the current CPU if it is supported */
+void md_usercopy_init_cpu();
+
+/* Returns where to resume after an unresolvable fault at rip, or 0 if there is no such place */
+addr_t md_usercopy_fixup(addr_t rip);
+
+#endif /* __AMD64_USERCOPY_H__ */
@@ -21,8 +21,8 @@
  *                                     +--------------------------+
  * 0xffff 8800 0000 0000               | Kernel virtual addresses | 64TB
  * 0xffff c7ff ffff ffff               +--------------------------+
- * 0xffff c800 0000 0000               | Dynamic KVA mappings     | 4GB
- * 0xffff c800 ffff ffff               +--------------------------+
+ * 0xffff c800 0000 0000               | Dynamic KVA mappings     | 64GB
+ * 0xffff c80f ffff ffff               +--------------------------+
  *                                     | Unused                   |
  *                                     +--------------------------+ ^
  * 0xffff ffff 8000 0000               | Kernel                   | | 2GB
@@ -46,12 +46,22 @@
 #define KMEM_DIRECT_VA_START  0xffff880000000000
 #define KMEM_DIRECT_VA_END    0xffffc7ffffffffff
 
-/* Virtual address range where dynamically-mapped memory resides */
-/* Note that we keep this small (256MB-ish) to avoid wasting pages... */
+/*
+ * Virtual address range where dynamically-mapped memory resides; only the
+ * top-level page table entries are set up in advance, the rest is allocated
+ * as mappings are made.
+ */
 #define KMEM_DYNAMIC_VA_START 0xffffc80000000000
-#define KMEM_DYNAMIC_VA_END   0xffffc8000fffffff
+#define KMEM_DYNAMIC_VA_END   0xffffc80fffffffff
+
+/* Userland addresses are below this, which is the first non-canonical address */
+#define USERLAND_VA_END 0x0000800000000000
 
-/* Physical addresses that can be directly mapped */
+/*
+ * Physical addresses that can be directly mapped; all RAM in this range is
+ * permanently mapped using the largest pages possible, anything else (device
+ * memory) is mapped on demand using 4KB pages.
+ */
 #define KMEM_DIRECT_PA_START	0
 #define KMEM_DIRECT_PA_END		(KMEM_DIRECT_VA_END - KMEM_DIRECT_VA_START)
 
@@ -68,6 +78,18 @@
 #define PE_PAT		(1ULL << 12)
 #define PE_NX		(1ULL << 63)
 
+/* Sizes of the pages mapped by a page directory / page directory pointer entry */
+#define PAGE_SIZE_2MB		(1ULL << 21)
+#define PAGE_SIZE_1GB		(1ULL << 30)
+
+/* CPUID 0x80000001 %edx flags */
+#define CPUID_EXT_EDX_PDPE1GB	(1 << 26)	/* 1GB pages supported */
+
+/* CPUID 7 %ebx / %edx flags */
+#define CPUID_7_EBX_ERMS	(1 << 9)	/* Enhanced REP MOVSB/STOSB */
+#define CPUID_7_EBX_SMAP	(1 << 20)	/* Supervisor Mode Access Prevention */
+#define CPUID_7_EDX_FSRM	(1 << 4)	/* Fast Short REP MOVSB */
+
 /* Custom page entry flags */
 #define PE_C_G (1ULL << 9)	/* avl bit 9: page has global mappings */
 
@@ -98,8 +120,14 @@
 #define CR0_WP      (1 << 16)	/* Write protect */
 
 /* CR4 specific flags */
+#define CR4_PGE			(1 << 7)	/* Page global enable */
 #define CR4_OSFXSR		(1 << 9)	/* OS saves/restores SSE state */
 #define CR4_OSXMMEXCPT		(1 << 10)	/* OS will handle SIMD exceptions */
+#define CR4_SMAP		(1 << 21)	/* Supervisor Mode Access Prevention */
+
+/* %rflags specific flags */
+#define RFLAGS_IF		(1 << 9)	/* Interrupts enabled */
+#define RFLAGS_AC		(1 << 18)	/* Alignment check / SMAP override */
 
 /*
  * GDT entry selectors, which are the offset in the GDT. We don't use indexes
@@ -117,12 +145,37 @@
 /* Maps relevant kernel addresses for a given thread */
 void md_map_kernel(vmspace_t* vs);
 
-/* Maps 'num_pages' at physical address 'phys' to virtual address 'virt' for vmspace 'vs' with flags 'flags' */
-void md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags);
+/*
+ * Maps 'num_pages' at physical address 'phys' to virtual address 'virt' for
+ * vmspace 'vs' with flags 'flags'; fails if a page table can't be allocated,
+ * in which case only part of the range may have been mapped.
+ */
+errorcode_t md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags);
 
 /* Unmaps 'num_pages' at virtual address virt for vmspace 'vs' */
 void md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages);
 
+/*
+ * Removes write access from whatever is mapped in the 'num_pages' at 'virt'
+ * in vmspace 'vs'; this walks the page tables once and never allocates them.
+ */
+void md_write_protect_pages(vmspace_t* vs, addr_t virt, size_t num_pages);
+
+/* Page order of the large pages userland mappings can use */
+#define MD_LARGE_PAGE_ORDER 9
+
+/* Maps the 2MB page at 'phys' to 'virt' in vmspace 'vs'; both must be aligned */
+errorcode_t md_map_large_page(vmspace_t* vs, addr_t virt, addr_t phys, int flags);
+
+/* Replaces the large page mapping 'virt' in vmspace 'vs', if any, by equivalent 4KB mappings */
+errorcode_t md_split_large_page(vmspace_t* vs, addr_t virt);
+
+/*
+ * Clears the accessed bit of the page mapping 'virt' in vmspace 'vs'; returns
+ * whether it was set. This never allocates page tables.
+ */
+bool md_test_and_clear_accessed(vmspace_t* vs, addr_t virt);
+
 #endif
 
 #endif /* __AMD64_VM_H__ */
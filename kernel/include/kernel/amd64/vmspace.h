@@ -2,6 +2,7 @@
 #define ANANAS_AMD64_VMSPACE_H
 
 #define MD_VMSPACE_FIELDS \
-	uint64_t*	vs_md_pagedir;
+	uint64_t*	vs_md_pagedir; \
+	volatile uint32_t vs_md_cpu_mask;	/* CPU's which have this vmspace active */
 
 #endif /* ANANAS_AMD64_VMSPACE_H */
@@ -61,6 +61,7 @@ static inline struct BIO* bio_read(Ananas::Device* device, blocknr_t block, size
 
 struct BIO* bio_get_next(Ananas::Device* device);
 void bio_free(struct BIO* bio);
+void bio_discard(struct BIO* bio);
 void bio_dump();
 
 #endif /* __ANANAS_BIO_H__ */
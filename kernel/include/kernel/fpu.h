@@ -0,0 +1,23 @@
+#ifndef __ANANAS_FPU_H__
+#define __ANANAS_FPU_H__
+
+/*
+ * The kernel is built without FPU/SIMD support, so that the state userland
+ * left behind need not be saved on every kernel entry. Code which would
+ * benefit from vector instructions (bulk copying, checksumming,
+ * decompression) may use them between kernel_fpu_begin() and
+ * kernel_fpu_end(); the state of the current thread is saved first if it is
+ * loaded, and the thread will have it back upon its next FPU use.
+ *
+ * Sections are only allowed in thread context and cannot be nested. The
+ * thread won't be preempted while inside one, and it must not sleep.
+ *
+ * Files which should be compiled with SIMD support are listed in SIMD_OBJS
+ * in conf/Makefile.<arch>. The compiler is free to use SIMD instructions
+ * anywhere in such a file, so it must contain nothing that may run outside
+ * of a section.
+ */
+void kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif /* __ANANAS_FPU_H__ */
@@ -3,18 +3,25 @@
 
 #include <ananas/types.h>
 
+/* Sets up the dynamic KVA range; needs a working page allocator */
+void kmem_init();
+
 /*
- * Per-mapping information structure.
+ * Informs us that RAM [phys .. phys + length) is permanently mapped in the
+ * direct map; kmem_map() will simply hand out these addresses.
  */
-struct KMEM_MAPPING {
-	addr_t kmm_virt;		/* virtual address */
-	addr_t kmm_phys;		/* physical address */
-	size_t kmm_size;		/* size, in bytes */
-	int kmm_flags;			/* flags */
-};
+void kmem_mark_direct(addr_t phys, size_t length);
 
+/*
+ * Maps length bytes at phys to kernel memory; returns NULL if out of KVA or
+ * page tables. RAM is always mapped already, so this cannot fail for pages
+ * of memory unless VM_FLAG_FORCEMAP or VM_FLAG_EXECUTE is used.
+ */
 void* kmem_map(addr_t phys, size_t length, int flags);
 void kmem_unmap(void* virt, size_t length);
 addr_t kmem_get_phys(void* virt);
 
+/* Retrieves the size and usage of the dynamic KVA range, in bytes */
+void kmem_get_stats(size_t* total, size_t* inuse);
+
 #endif /* __ANANAS_KMEM_H__ */
@@ -24,6 +24,9 @@ extern "C" {
 #endif
 void* memcpy(void* dst, const void* src, size_t len) __nonnull;
 void* memset(void* b, int c, size_t len) __nonnull;
+/* Copy/zero len bytes of whole pages; addresses must be page-aligned */
+void memcpy_pages(void* dst, const void* src, size_t len) __nonnull;
+void memzero_pages(void* b, size_t len) __nonnull;
 void vaprintf(const char* fmt, va_list ap);
 int vsnprintf(char* str, size_t len, const char* fmt, va_list ap);
 void kprintf(const char* fmt, ...);
@@ -0,0 +1,37 @@
+#ifndef __ANANAS_MEMOPS_H__
+#define __ANANAS_MEMOPS_H__
+
+#include <ananas/types.h>
+
+/*
+ * Nearly all data the kernel moves around goes through memcpy() and
+ * memset(), so these are worth doing in the way the CPU likes best. The
+ * machine-independent versions use 64-bit words and are always available;
+ * the MD code may supply quicker ones for the CPU it finds itself on by
+ * calling memops_select() during startup, before other CPUs are running.
+ *
+ * Any function left NULL keeps using the machine-independent version, so
+ * the MD code only needs to provide what it can do better. The page
+ * functions are only ever called for whole, page-aligned pages.
+ */
+struct MEMOPS {
+	const char*	mo_name;
+	void*		(*mo_memcpy)(void* dst, const void* src, size_t len);
+	void*		(*mo_memset)(void* b, int c, size_t len);
+	void		(*mo_copy_pages)(void* dst, const void* src, size_t len);
+	void		(*mo_zero_pages)(void* b, size_t len);
+};
+
+/* Functions currently in use */
+extern struct MEMOPS memops;
+
+/* The machine-independent versions; every function is NULL */
+extern const struct MEMOPS memops_generic;
+
+/* Starts using ops */
+void memops_select(const struct MEMOPS* ops);
+
+/* Selects the best functions for the current CPU */
+void md_memops_init();
+
+#endif /* __ANANAS_MEMOPS_H__ */
@@ -8,6 +8,8 @@
 extern "C" {
 #endif
 void* kmalloc(size_t len) __malloc;
+/* Never sleeps and may be used from IRQ context; fails rather than grow */
+void* kmalloc_nowait(size_t len) __malloc;
 void  kfree(void* ptr);
 #ifdef __cplusplus
 }
@@ -6,6 +6,40 @@
 
 #define PAGE_NUM_ORDERS 10
 
+/* Number of pages in the largest block the allocator hands out */
+#define PAGE_ZONE_MAX_BLOCK (1 << (PAGE_NUM_ORDERS - 1))
+
+/*
+ * Number of pages per zone that are made available immediately; the rest is
+ * released in the background in chunks of PAGE_ZONE_DEFER_CHUNK pages. Both
+ * must be a multiple of PAGE_ZONE_MAX_BLOCK.
+ */
+#define PAGE_ZONE_EAGER_PAGES (128 * PAGE_ZONE_MAX_BLOCK)
+#define PAGE_ZONE_DEFER_CHUNK (16 * PAGE_ZONE_MAX_BLOCK)
+
+/* Physical address below which memory is considered DMA32 */
+#define PAGE_DMA32_LIMIT 0x100000000ULL
+
+/*
+ * Amount of low memory reserved for constrained allocations only; requests of
+ * PAGE_CONTIG_MIN_ORDER and up will try this zone first.
+ */
+#define PAGE_CONTIG_RESERVE (8 * 1024 * 1024)
+#define PAGE_CONTIG_MIN_ORDER 2
+
+/*
+ * Number of pre-zeroed pages the page-zero thread tries to keep around; it is
+ * woken up once the pool drops below PAGE_ZERO_POOL_LOW and will not fill the
+ * pool if fewer than PAGE_ZERO_POOL_MIN_AVAIL pages would remain available.
+ */
+#define PAGE_ZERO_POOL_TARGET 256
+#define PAGE_ZERO_POOL_LOW 64
+#define PAGE_ZERO_POOL_MIN_AVAIL 1024
+
+/* Flags for page_alloc_order_flags() */
+#define PAGE_ALLOC_ZERO	1	/* Page contents must be zeroed */
+#define PAGE_ALLOC_TRY	2	/* Return NULL rather than reclaim if nothing is free */
+
 struct PAGE {
 	LIST_FIELDS(struct PAGE);
 
@@ -33,6 +67,14 @@ struct PAGE_ZONE {
 	/* Available number of pages */
 	unsigned int z_avail_pages;
 
+	/* Number of pages, from the start, which have been put on the freelists */
+	unsigned int z_init_pages;
+
+	/* Zone flags */
+	unsigned int z_flags;
+#define PAGE_ZONE_FLAG_DMA32	1	/* Zone resides below PAGE_DMA32_LIMIT */
+#define PAGE_ZONE_FLAG_CONTIG	2	/* Zone is reserved for constrained allocations */
+
 	/* First page address */
 	struct PAGE* z_base;
 
@@ -45,18 +87,50 @@ struct PAGE_ZONE {
 
 LIST_DEFINE(zone_list, struct PAGE_ZONE);
 
+/*
+ * Per-CPU cache of order-0 pages; these are taken from/returned to the zones
+ * in batches so that the zone lock isn't needed for most single page
+ * allocations.
+ */
+#define PAGE_MAGAZINE_SIZE 64
+#define PAGE_MAGAZINE_BATCH 16
+
+struct PAGE_MAGAZINE {
+	/* Lock protecting the magazine; normally only contended during drains */
+	spinlock_t pm_lock;
+
+	/* Number of pages in pm_page[] */
+	unsigned int pm_count;
+	struct PAGE* pm_page[PAGE_MAGAZINE_SIZE];
+
+	/* Statistics */
+	unsigned int pm_hits;
+	unsigned int pm_misses;
+	unsigned int pm_refills;
+	unsigned int pm_drains;
+};
+
 /* Add a chunk of memory to use for page allocation */
 void page_zone_add(addr_t base, size_t length);
 
-/* Allocates a block of 2^order pages */
+/*
+ * Allocates a block of 2^order pages; if nothing is free, cached pages are
+ * reclaimed first. Returns NULL if memory is exhausted.
+ */
 struct PAGE* page_alloc_order(int order);
 
+/* Allocates a block of 2^order pages using PAGE_ALLOC_... flags */
+struct PAGE* page_alloc_order_flags(int order, int flags);
+
 /* Allocates a single page */
 inline static struct PAGE* page_alloc_single() {
 	return page_alloc_order(0);
 }
 void page_free(struct PAGE* p);
 
+/* Turns an allocated block of 2^order pages into 2^order individually freeable pages */
+void page_split(struct PAGE* p);
+
 /* Retrieves the physical address of page p */
 addr_t page_get_paddr(struct PAGE* p);
 
@@ -68,6 +142,15 @@ inline static void* page_alloc_single_mapped(struct PAGE** p, int vm_flags) {
 	return page_alloc_order_mapped(0, p, vm_flags);
 }
 
+/*
+ * Allocates 2^order pages residing within [min_addr, max_addr] which are
+ * aligned to alignment bytes; returns NULL if this cannot be satisfied.
+ */
+struct PAGE* page_alloc_order_constrained(int order, addr_t min_addr, addr_t max_addr, size_t alignment);
+
+/* Allocates enough constrained pages to hold length bytes and maps it to kernel memory */
+void* page_alloc_length_constrained_mapped(size_t length, addr_t min_addr, addr_t max_addr, size_t alignment, struct PAGE** p, int vm_flags);
+
 /* Allocates enough pages to hold length bytes */
 struct PAGE* page_alloc_length(size_t length);
 
@@ -77,4 +160,13 @@ void* page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags);
 /* Retrieve the page statistics */
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages);
 
+/* Retrieve the per-CPU page magazine statistics, summed over all CPU's */
+void page_get_magazine_stats(unsigned int* cached_pages, unsigned int* hits, unsigned int* misses);
+
+/* Retrieve the pre-zeroed page pool statistics */
+void page_get_zero_stats(unsigned int* zeroed_pages, unsigned int* hits, unsigned int* misses);
+
+/* Returns all pages cached by the per-CPU magazines to their zones; returns the amount */
+unsigned int page_drain_magazines();
+
 #endif /* __ANANAS_PAGE_H__ */
@@ -0,0 +1,62 @@
+#ifndef __ANANAS_PAGEOUT_H__
+#define __ANANAS_PAGEOUT_H__
+
+#include <ananas/types.h>
+
+/*
+ * Pageout frees page cache pages once memory runs low. These pages are kept
+ * on two lists: new pages start out inactive and are activated once they turn
+ * out to be referenced, either because they were looked up or because the
+ * MMU marked one of their mappings as accessed. Active pages which have not
+ * been referenced by the time pageout looks at them again are deactivated.
+ * Only inactive pages which are not mapped can be evicted; as writes go
+ * through to the disk, cached pages are never dirty.
+ *
+ * If swap is in use, anonymous pages are put on the lists once they are
+ * mapped. Inactive ones are swapped out by the pageout thread, but only once
+ * there is nothing left to evict: cached pages can be thrown away for free,
+ * whereas swapping means writing the page out and reading it back later.
+ * Large pages are split by the pageout thread once they become inactive, so
+ * that their pieces can be swapped out individually.
+ *
+ * The pageout thread is woken once fewer than the low watermark of pages are
+ * available and keeps going until the high watermark is reached; the low
+ * watermark is 1/PAGEOUT_LOW_DIVISOR of memory, but at least PAGEOUT_LOW_MIN
+ * pages, and the high watermark is twice that. Should memory run out anyway,
+ * the allocator will evict pages itself; as it cannot swap, it may then wait
+ * for the pageout thread to do so.
+ */
+#define PAGEOUT_LOW_DIVISOR 64
+#define PAGEOUT_LOW_MIN 128
+
+/* Number of pages pageout tries to evict per pass */
+#define PAGEOUT_BATCH 32
+
+struct VM_PAGE;
+
+/* Adds page cache page vp to the inactive list */
+void pageout_insert(struct VM_PAGE* vp);
+
+/* Adds locked anonymous page vp to the active list, unless it is already listed */
+void pageout_insert_anonymous(struct VM_PAGE* vp);
+
+/* Removes page vp from the list it is on, if any; called when vp is freed */
+void pageout_remove(struct VM_PAGE* vp);
+
+/*
+ * Tries to evict count inactive pages; returns the number of pages evicted.
+ * This never blocks, so it can be called from the allocator.
+ */
+unsigned int pageout_reclaim(unsigned int count);
+
+/*
+ * Waits for the pageout thread to free memory by swapping; returns false if
+ * this is impossible or nothing could be freed. This is for the allocator,
+ * once everything else failed.
+ */
+bool pageout_wait();
+
+/* Wakes up the pageout thread if memory is running low */
+void pageout_wakeup();
+
+#endif /* __ANANAS_PAGEOUT_H__ */
@@ -5,6 +5,9 @@
 #include "kernel/thread.h"
 #include "kernel-md/pcpu.h"
 
+/* Maximum number of CPU's for which per-CPU data is kept */
+#define MAX_CPUS 32
+
 /* Per-CPU information pointer */
 struct PCPU {
 	MD_PCPU_FIELDS				/* Machine-dependant data */
@@ -12,6 +15,7 @@ struct PCPU {
 	thread_t* curthread;			/* current thread */
 	thread_t* idlethread;			/* idle thread */
 	int nested_irq;				/* number of nested IRQ functions */
+	int nopreempt;				/* if non-zero, curthread must not be preempted */
 };
 
 /* Retrieve the size of the machine-dependant structure */
@@ -4,6 +4,7 @@
 #include <ananas/limits.h>
 #include "kernel/list.h"
 #include "kernel/lock.h"
+#include "kernel/vmspace.h"
 
 struct DENTRY;
 struct PROCINFO;
@@ -36,6 +37,7 @@ struct PROCESS {
 	struct DENTRY* p_cwd;		/* Current path */
 
 	struct PROCESS_QUEUE	p_children;	/* Queue of this process' children */
+	struct VM_SPACE_STATS	p_child_stats;	/* Totals of children that were waited for */
 
         LIST_FIELDS_IT(struct PROCESS, all);
         LIST_FIELDS_IT(struct PROCESS, children);
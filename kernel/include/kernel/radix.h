@@ -0,0 +1,54 @@
+#ifndef __ANANAS_RADIX_H__
+#define __ANANAS_RADIX_H__
+
+#include <ananas/types.h>
+
+/*
+ * Radix tree; this is a sparse array of pointers indexed by an unsigned long,
+ * mainly used to locate pages by their offset. Every node holds
+ * RADIX_NODE_SLOTS entries and the tree is only as high as is needed to store
+ * the largest index inserted, so lookups of small indices are cheap.
+ *
+ * Nodes are allocated as items are inserted and freed once they become empty.
+ * The tree does no locking of its own.
+ */
+#define RADIX_NODE_SHIFT 6
+#define RADIX_NODE_SLOTS (1 << RADIX_NODE_SHIFT)
+#define RADIX_MAX_HEIGHT ((sizeof(unsigned long) * 8 + RADIX_NODE_SHIFT - 1) / RADIX_NODE_SHIFT)
+
+struct RADIX_NODE {
+	void* rn_slot[RADIX_NODE_SLOTS];
+	unsigned int rn_count;	/* number of non-NULL slots */
+};
+
+struct RADIX_TREE {
+	struct RADIX_NODE* rt_root;
+	unsigned int rt_height;	/* 0 if the tree is empty */
+};
+
+#define RADIX_EMPTY(tree) \
+	((tree)->rt_root == NULL)
+
+void radix_tree_init(struct RADIX_TREE* tree);
+
+/* Returns the item stored at index, or NULL */
+void* radix_lookup(struct RADIX_TREE* tree, unsigned long index);
+
+/* Stores item at index, which must be unused */
+void radix_insert(struct RADIX_TREE* tree, unsigned long index, void* item);
+
+/* Removes and returns the item at index, or NULL if there was none */
+void* radix_remove(struct RADIX_TREE* tree, unsigned long index);
+
+/*
+ * Returns the item with the lowest index >= index and stores that index in
+ * found_index; returns NULL if there is no such item. This is used to walk
+ * through a range:
+ *
+ *   for (p = radix_next(t, first, &i); p != NULL && i <= last; p = radix_next(t, i + 1, &i))
+ *
+ * (beware of i + 1 wrapping when last is the final index)
+ */
+void* radix_next(struct RADIX_TREE* tree, unsigned long index, unsigned long* found_index);
+
+#endif /* __ANANAS_RADIX_H__ */
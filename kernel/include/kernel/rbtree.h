@@ -0,0 +1,61 @@
+#ifndef __ANANAS_RBTREE_H__
+#define __ANANAS_RBTREE_H__
+
+/*
+ * Intrusive red-black tree; nodes are embedded in the items to store, which
+ * avoids any memory allocation. The tree does not know about keys: insertion
+ * is a matter of walking down the tree to the proper position (which the
+ * caller does, as only it knows how to compare items) and then handing the
+ * spot to rb_insert(), which rebalances.
+ *
+ * An optional augment callback may be provided; it is responsible for
+ * recalculating per-node data derived from the node's children (a subtree
+ * maximum, for example). The tree invokes it on every node whose subtree
+ * changes, children first, so that the data is valid after every operation.
+ *
+ * Insertion, removal and lookup take O(log n); rb_next/rb_prev take O(log n)
+ * worst case but O(1) amortized.
+ */
+struct RB_NODE {
+	struct RB_NODE* rb_parent;
+	struct RB_NODE* rb_left;
+	struct RB_NODE* rb_right;
+	int rb_red;
+};
+
+typedef void (*rb_augment_t)(struct RB_NODE* node);
+
+struct RB_TREE {
+	struct RB_NODE* rb_root;
+	rb_augment_t rb_augment;
+};
+
+/* Obtains the item containing node; node may be NULL */
+#define RB_ITEM(node, TYPE, field) \
+	((node) != NULL ? (TYPE*)((char*)(node) - __builtin_offsetof(TYPE, field)) : (TYPE*)NULL)
+
+#define RB_EMPTY(tree) \
+	((tree)->rb_root == NULL)
+
+/* Initializes an empty tree; augment may be NULL */
+void rb_tree_init(struct RB_TREE* tree, rb_augment_t augment);
+
+/*
+ * Inserts node as a child of parent; link must be the &parent->rb_left or
+ * &parent->rb_right pointer to fill (or &tree->rb_root if the tree is empty)
+ */
+void rb_insert(struct RB_TREE* tree, struct RB_NODE* node, struct RB_NODE* parent, struct RB_NODE** link);
+
+/* Removes node from the tree */
+void rb_remove(struct RB_TREE* tree, struct RB_NODE* node);
+
+/* Re-runs the augment callback from node up to the root; used if node's own data changes */
+void rb_propagate(struct RB_TREE* tree, struct RB_NODE* node);
+
+/* In-order iteration; these return NULL if there is no such node */
+struct RB_NODE* rb_first(struct RB_TREE* tree);
+struct RB_NODE* rb_last(struct RB_TREE* tree);
+struct RB_NODE* rb_next(struct RB_NODE* node);
+struct RB_NODE* rb_prev(struct RB_NODE* node);
+
+#endif /* __ANANAS_RBTREE_H__ */
@@ -0,0 +1,115 @@
+#ifndef __ANANAS_SLAB_H__
+#define __ANANAS_SLAB_H__
+
+#include <ananas/types.h>
+#include "kernel/list.h"
+#include "kernel/lock.h"
+#include "kernel/pcpu.h"
+
+/*
+ * Object caches; these hand out fixed-size objects which are carved from
+ * slabs of pages. Every cache has a per-CPU front which is refilled from and
+ * drained to the slabs in batches, so the common case only touches the
+ * current CPU's front.
+ *
+ * Objects are constructed once, when their slab is created; callers must hand
+ * them back in constructed state. This allows expensive initialization (locks
+ * and such) to be skipped on every allocation.
+ *
+ * All locks used here disable interrupts; allocating from interrupt context is
+ * possible using SLAB_ALLOC_NOWAIT, which fails rather than grow the cache.
+ */
+#define SLAB_CPU_CACHE_SIZE 16
+#define SLAB_CPU_CACHE_BATCH (SLAB_CPU_CACHE_SIZE / 2)
+
+/* Alignment of all objects; caches cannot be used for types requiring more */
+#define SLAB_ALIGN 16
+
+/* Minimum number of objects per slab; the slab size is grown to honor this */
+#define SLAB_MIN_OBJECTS 8
+
+/* Number of completely empty slabs a cache keeps around before freeing them */
+#define SLAB_MAX_EMPTY 1
+
+/* Allocation flags */
+#define SLAB_ALLOC_NOWAIT	1	/* Do not grow the cache; may be used from IRQ context */
+
+struct SLAB_CACHE;
+struct PAGE;
+
+typedef void (*slab_ctor_t)(void* obj);
+typedef void (*slab_reclaim_t)(struct SLAB_CACHE* cache);
+
+struct SLAB {
+	LIST_FIELDS(struct SLAB);
+
+	struct SLAB_CACHE* s_cache;
+	struct PAGE* s_page;
+
+	/* Number of objects handed out */
+	unsigned int s_inuse;
+
+	/* First free object slot, or NULL if the slab is full */
+	void** s_free;
+};
+
+LIST_DEFINE(SLAB_LIST, struct SLAB);
+
+struct SLAB_CPU_CACHE {
+	spinlock_t cc_lock;
+	unsigned int cc_count;
+	void* cc_obj[SLAB_CPU_CACHE_SIZE];
+
+	/* Statistics; misses are allocations which needed a refill */
+	unsigned int cc_allocs;
+	unsigned int cc_frees;
+	unsigned int cc_misses;
+};
+
+struct SLAB_CACHE {
+	LIST_FIELDS(struct SLAB_CACHE);
+
+	const char* sc_name;
+	size_t sc_obj_size;
+	size_t sc_slot_size;
+	unsigned int sc_slab_order;
+	unsigned int sc_objs_per_slab;
+	slab_ctor_t sc_ctor;
+	slab_reclaim_t sc_reclaim;
+
+	/* Protects the slab lists */
+	spinlock_t sc_lock;
+	struct SLAB_LIST sc_partial;
+	struct SLAB_LIST sc_full;
+	struct SLAB_LIST sc_empty;
+	unsigned int sc_num_slabs;
+	unsigned int sc_num_empty;
+
+	/* Number of allocations which could not be satisfied */
+	unsigned int sc_failures;
+
+	struct SLAB_CPU_CACHE sc_cpu[MAX_CPUS];
+};
+
+LIST_DEFINE(SLAB_CACHE_LIST, struct SLAB_CACHE);
+
+/* Initializes and registers a cache for objects of obj_size bytes; ctor and reclaim may be NULL */
+void slab_cache_init(struct SLAB_CACHE* cache, const char* name, size_t obj_size, slab_ctor_t ctor, slab_reclaim_t reclaim);
+
+/* Allocates an object from the cache; returns NULL on failure */
+void* slab_alloc(struct SLAB_CACHE* cache, int flags = 0);
+
+/* Returns an object, in constructed state, to its cache */
+void slab_free(struct SLAB_CACHE* cache, void* obj);
+
+/*
+ * Returns as much memory as possible to the page allocator; this invokes the
+ * reclaim hooks of all caches, so it must be called from thread context.
+ * Returns the number of pages freed.
+ */
+unsigned int slab_reclaim();
+
+/* Writes per-cache statistics to buf, one line per cache */
+void slab_get_stats(char* buf, size_t len);
+
+#endif /* __ANANAS_SLAB_H__ */
@@ -0,0 +1,57 @@
+#ifndef __ANANAS_SWAP_H__
+#define __ANANAS_SWAP_H__
+
+#include <ananas/types.h>
+
+/*
+ * Swap gives anonymous memory a place to go once memory runs low: pageout
+ * writes private pages which have not been used for a while to a swap device
+ * and frees them. A swapped out page keeps its VM_PAGE, which records the
+ * slot it was written to; the page is read back once it is faulted.
+ *
+ * Up to SWAP_MAX_DEVICES block devices can be used for swap. Each is divided
+ * in page-sized slots; pageout swaps out pages in clusters of up to
+ * SWAP_CLUSTER pages, which are given consecutive slots so that they are
+ * written sequentially.
+ */
+#define SWAP_MAX_DEVICES 4
+#define SWAP_CLUSTER 16
+
+/* Swap slots hold the device index in the upper bits and the slot number below */
+typedef uint32_t swapslot_t;
+#define SWAP_SLOT_DEVICE_SHIFT 28
+#define SWAP_SLOT_INDEX_MASK ((1U << SWAP_SLOT_DEVICE_SHIFT) - 1)
+
+namespace Ananas {
+class Device;
+}
+
+struct PAGE;
+struct VM_PAGE;
+
+/* Starts swapping to the first size bytes of device dev */
+errorcode_t swap_on(Ananas::Device* dev, size_t size);
+
+/* Stops swapping to device dev; everything swapped out to it is read back first */
+errorcode_t swap_off(Ananas::Device* dev);
+
+/* Returns whether any swap device is in use */
+bool swap_available();
+
+/*
+ * Reserves up to count consecutive slots for the locked pages in vps, which
+ * become the owners of the slots; returns the number of slots reserved and
+ * sets *slot to the first one.
+ */
+unsigned int swap_alloc(struct VM_PAGE** vps, unsigned int count, swapslot_t* slot);
+
+/* Releases a slot obtained using swap_alloc() */
+void swap_free(swapslot_t slot);
+
+/* Writes page p to slot */
+errorcode_t swap_write(swapslot_t slot, struct PAGE* p);
+
+/* Reads slot into page p */
+errorcode_t swap_read(swapslot_t slot, struct PAGE* p);
+
+#endif /* __ANANAS_SWAP_H__ */
@@ -57,6 +57,7 @@ struct THREAD {
 
 	int t_priority;			/* priority (0 highest) */
 #define THREAD_PRIORITY_DEFAULT	200
+#define THREAD_PRIORITY_BACKGROUND	254	/* only runs if the CPU would otherwise idle */
 #define THREAD_PRIORITY_IDLE	255
 	int t_affinity;			/* thread CPU */
 #define THREAD_AFFINITY_ANY -1
@@ -73,6 +74,10 @@ struct THREAD {
 	/* Scheduler specific information */
 	struct SCHED_PRIV t_sched_priv;
 
+	/* Last area found by vmspace_lookup_area(); only valid if the generation matches */
+	struct VM_AREA* t_va_cache;
+	unsigned long t_va_cache_gen;
+
 	LIST_FIELDS(thread_t);
 };
 
@@ -107,7 +112,6 @@ void md_thread_set_entrypoint(thread_t* thread, addr_t entry);
 void md_thread_set_argument(thread_t* thread, addr_t arg);
 void* md_thread_map(thread_t* thread, void* to, void* from, size_t length, int flags);
 errorcode_t thread_unmap(thread_t* t, addr_t virt, size_t len);
-void* md_map_thread_memory(thread_t* thread, void* ptr, size_t length, int write);
 void md_thread_clone(thread_t* t, thread_t* parent, register_t retval);
 errorcode_t md_thread_unmap(thread_t* thread, addr_t virt, size_t length);
 int md_thread_peek_32(thread_t* thread, addr_t virt, uint32_t* val);
@@ -0,0 +1,27 @@
+#ifndef __ANANAS_USERCOPY_H__
+#define __ANANAS_USERCOPY_H__
+
+#include <ananas/types.h>
+
+/*
+ * Moves data between the kernel and the userland memory of the current
+ * thread. User memory is accessed directly, so faults are resolved as they
+ * would be for the thread itself; should that fail, the copy is aborted and
+ * BAD_ADDRESS is returned. Ranges which aren't completely within userland
+ * are rejected right away.
+ *
+ * If the CPU supports it, the kernel is not allowed to touch userland memory
+ * in any other way (SMAP); this includes the buffers of read() and write(),
+ * which are passed to filesystems and drivers using kernel buffers.
+ */
+errorcode_t copyin(void* dst, const void* user_src, size_t len);
+errorcode_t copyout(void* user_dst, const void* src, size_t len);
+
+/*
+ * Copies a \0-terminated string of at most len bytes, including the \0; if
+ * there is no \0 in time, BAD_LENGTH is returned. done, if not NULL, is set
+ * to the length of the string.
+ */
+errorcode_t copyinstr(char* dst, const void* user_src, size_t len, size_t* done);
+
+#endif /* __ANANAS_USERCOPY_H__ */
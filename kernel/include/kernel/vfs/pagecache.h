@@ -0,0 +1,44 @@
+#ifndef __ANANAS_VFS_PAGECACHE_H__
+#define __ANANAS_VFS_PAGECACHE_H__
+
+#include <ananas/types.h>
+
+/*
+ * The page cache holds file data in full pages, indexed by file offset in
+ * the inode's i_pages. It is shared by read(), write() and mappings of the
+ * file; the latter map the cached pages directly.
+ *
+ * Pages of inodes with a block_map operation are filled block-by-block
+ * without going through the inode's read operation, so that read() can be
+ * built on top of the cache. Other inodes are filled using vfs_read().
+ */
+struct DENTRY;
+struct VFS_INODE;
+struct VM_PAGE;
+
+/* Returns whether regular read()/write() calls on the inode go through the page cache */
+bool vfs_pagecache_is_used(struct VFS_INODE* inode);
+
+/*
+ * Reads file pages [first, last) into the cache using as few reads as
+ * possible; resident pages are skipped. vp_flags are the VM_PAGE_FLAG_...
+ * flags for new pages.
+ */
+errorcode_t vfs_pagecache_fill(struct DENTRY* dentry, off_t first, off_t last, int vp_flags);
+
+/* Retrieves the page at offs, reading it if needed; the page is returned locked */
+errorcode_t vfs_pagecache_get(struct DENTRY* dentry, off_t offs, int vp_flags, struct VM_PAGE** vp_out);
+
+/* Copies buf to the resident pages covering [offs, offs + len); missing pages are skipped */
+void vfs_pagecache_update(struct VFS_INODE* inode, off_t offs, const void* buf, size_t len);
+
+/*
+ * Evicts the pages covering [first, last) which aren't mapped or being read;
+ * as cached pages are never dirty, nothing is lost.
+ */
+void vfs_pagecache_drop(struct VFS_INODE* inode, off_t first, off_t last);
+
+/* Drops all pages of an inode; none of them may be mapped */
+void vfs_pagecache_purge(struct VFS_INODE* inode);
+
+#endif /* __ANANAS_VFS_PAGECACHE_H__ */
@@ -17,12 +17,15 @@
 /* Force a specific mapping to be made */
 #define VM_FLAG_FORCEMAP	 (1 << 16)
 
-/* Maps a piece of memory for kernel use */
-void md_kmap(addr_t phys, addr_t virt, size_t num_pages, int flags);
+/* Maps a piece of memory for kernel use; fails if page tables can't be allocated */
+errorcode_t md_kmap(addr_t phys, addr_t virt, size_t num_pages, int flags);
 
 /* Unmaps a piece of kernel memory */
 void md_kunmap(addr_t virt, size_t num_pages);
 
+/* Resolves a mapped kernel virtual address to its physical address */
+addr_t md_kget_phys(addr_t virt);
+
 /* Initialize the memory manager */
 void vm_init();
 
@@ -0,0 +1,88 @@
+#ifndef __ANANAS_VMEM_H__
+#define __ANANAS_VMEM_H__
+
+#include <ananas/types.h>
+#include "kernel/list.h"
+#include "kernel/lock.h"
+#include "kernel/pcpu.h"
+
+/*
+ * Resource arena allocator, modelled after Bonwick's vmem. An arena hands out
+ * quantum-aligned ranges of an integer space (usually addresses) which it does
+ * not touch itself; all administration lives in boundary tags.
+ *
+ * Free segments are kept on power-of-two freelists, which allows most
+ * allocations to be satisfied by simply picking the head of a list that is
+ * guaranteed to fit. Allocated segments are kept in a hash table so that they
+ * can be located on free.
+ *
+ * Small allocations (up to vm_qcache_max quanta) are cached per CPU and per
+ * size, so repeated allocation and freeing of these does not touch the arena.
+ */
+#define VMEM_NUM_FREELISTS 64
+#define VMEM_HASH_SIZE 64
+#define VMEM_QCACHE_MAX 8
+#define VMEM_CPU_CACHE_SIZE 8
+
+struct VMEM_TAG {
+	/* Segment list, ordered by address */
+	LIST_FIELDS_IT(struct VMEM_TAG, seg);
+	/* Freelist if free, hash chain if allocated, tag pool if unused */
+	LIST_FIELDS_IT(struct VMEM_TAG, fl);
+
+	addr_t vt_start;
+	size_t vt_size;
+	int vt_type;
+#define VMEM_TAG_FREE		0
+#define VMEM_TAG_ALLOC	1
+#define VMEM_TAG_SPAN		2	/* Range added using vmem_add(); never coalesced across */
+};
+
+LIST_DEFINE(VMEM_TAG_LIST, struct VMEM_TAG);
+
+struct VMEM_CPU_CACHE {
+	spinlock_t cc_lock;
+	unsigned int cc_count[VMEM_QCACHE_MAX];
+	addr_t cc_addr[VMEM_QCACHE_MAX][VMEM_CPU_CACHE_SIZE];
+};
+
+struct VMEM {
+	const char* vm_name;
+	size_t vm_quantum;
+	unsigned int vm_qcache_max;
+
+	/* Protects everything except the per-CPU caches */
+	spinlock_t vm_lock;
+	struct VMEM_TAG_LIST vm_segs;
+	struct VMEM_TAG_LIST vm_freelist[VMEM_NUM_FREELISTS];
+	struct VMEM_TAG_LIST vm_hash[VMEM_HASH_SIZE];
+	struct VMEM_TAG_LIST vm_tags;
+	unsigned int vm_num_free_tags;
+
+	/* Statistics, in bytes */
+	size_t vm_size;
+	size_t vm_inuse;
+	unsigned int vm_failures;
+
+	struct VMEM_CPU_CACHE vm_cpu[MAX_CPUS];
+};
+
+/* Initializes arena vm; qcache_max is the number of quanta up to which allocations are cached */
+void vmem_init(struct VMEM* vm, const char* name, size_t quantum, unsigned int qcache_max);
+
+/* Adds [base .. base + size) to the arena; returns false if out of memory */
+bool vmem_add(struct VMEM* vm, addr_t base, size_t size);
+
+/* Allocates size bytes from the arena; returns 0 on failure */
+addr_t vmem_alloc(struct VMEM* vm, size_t size);
+
+/* Frees an allocation; size must be identical to the size that was allocated */
+void vmem_free(struct VMEM* vm, addr_t addr, size_t size);
+
+/* Retrieves the arena statistics, in bytes */
+void vmem_get_stats(struct VMEM* vm, size_t* total, size_t* inuse);
+
+/* Prints all segments of the arena */
+void vmem_dump(struct VMEM* vm);
+
+#endif /* __ANANAS_VMEM_H__ */
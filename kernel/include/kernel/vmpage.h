@@ -5,6 +5,9 @@
 #include <machine/param.h>
 #include "kernel/list.h"
 #include "kernel/lock.h"
+#include "kernel/radix.h"
+#include "kernel/swap.h"
+#include "kernel-md/vm.h"
 
 struct PAGE;
 
@@ -13,10 +16,33 @@ struct PAGE;
 #define VM_PAGE_FLAG_COW       (1 << 2)  /* page must be copied on write */
 #define VM_PAGE_FLAG_PENDING   (1 << 3)  /* page is pending a read */
 #define VM_PAGE_FLAG_LINK      (1 << 4)  /* link to another page */
+#define VM_PAGE_FLAG_LARGE     (1 << 5)  /* page covers 2^MD_LARGE_PAGE_ORDER pages */
+#define VM_PAGE_FLAG_REFERENCED (1 << 6) /* page was used since pageout last looked at it */
+#define VM_PAGE_FLAG_SWAPPED   (1 << 7)  /* page contents are in swap slot vp_swap */
 
-struct VM_PAGE {
-	LIST_FIELDS(struct VM_PAGE);
+/* Which pageout list a page is on */
+#define VM_PAGE_LRU_NONE       0
+#define VM_PAGE_LRU_ACTIVE     1
+#define VM_PAGE_LRU_INACTIVE   2
 
+/*
+ * VM pages are indexed by the radix tree of their owner: areas index their
+ * pages by virtual page number (a large page only occupies the index of its
+ * first page), inodes by the page number of the file offset. A page can be
+ * indexed by several areas, as fork shares pages rather than copying them;
+ * every area holds a reference and vp_vmarea is merely one of them, if any.
+ *
+ * Every page knows the links pointing to it, so that pageout can find out
+ * whether it was accessed through any of them.
+ *
+ * Anonymous pages which only a single area uses can be swapped out; they are
+ * then no longer mapped and have no backing page, but remain indexed by
+ * their area until they are faulted and read back.
+ */
+struct VM_PAGE;
+LIST_DEFINE(VM_PAGE_LINKS, struct VM_PAGE);
+
+struct VM_PAGE {
 	mutex_t vp_mtx;
 	vmarea_t* vp_vmarea;
 
@@ -34,12 +60,21 @@ struct VM_PAGE {
 	/* Virtual address mapped to */
 	addr_t vp_vaddr;
 
+	/* Swap slot holding our contents, if swapped out */
+	swapslot_t vp_swap;
+
 	/* Backing inode and offset */
 	struct VFS_INODE* vp_inode;
 	off_t vp_offset;
-};
 
-LIST_DEFINE(VM_PAGE_LIST, struct VM_PAGE);
+	/* Links to us (protected by vp_mtx), or our position in that list if we are a link */
+	struct VM_PAGE_LINKS vp_links;
+	LIST_FIELDS_IT(struct VM_PAGE, link);
+
+	/* Pageout list we are on (protected by the pageout lock) */
+	int vp_lru;
+	LIST_FIELDS_IT(struct VM_PAGE, lru);
+};
 
 #define vmpage_lock(vp) \
 	mutex_lock(&(vp)->vp_mtx)
@@ -54,15 +89,93 @@ void vmpage_ref(struct VM_PAGE* vmpage);
 void vmpage_deref(struct VM_PAGE* vmpage);
 
 struct VM_PAGE* vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs);
+struct VM_PAGE* vmpage_lookup_inode_locked(struct VFS_INODE* inode, off_t offs);
 struct VM_PAGE* vmpage_lookup_vaddr_locked(vmarea_t* va, addr_t vaddr);
-struct VM_PAGE* vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags);
-struct VM_PAGE* vmpage_create_private(vmarea_t* va, int flags);
+/* Returns the page of va with the lowest address >= vaddr, or nullptr; the page is not locked */
+struct VM_PAGE* vmpage_lookup_next(vmarea_t* va, addr_t vaddr);
+/*
+ * Hooks up to *count new page cache pages of inode from offs onwards, up to
+ * the first page which is already present; *count is set to the number of
+ * pages created. These are stored in vps, locked and with VM_PAGE_FLAG_PENDING
+ * set: the caller must fill them and clear the flag before unlocking them, or
+ * call vmpage_abort_pending(). Fails only if no page could be allocated.
+ */
+errorcode_t vmpage_create_pending(struct VFS_INODE* inode, off_t offs, unsigned int* count, int flags, struct VM_PAGE** vps);
+/* Removes pending page vp, which couldn't be filled, from its inode; vp is unlocked */
+void vmpage_abort_pending(struct VM_PAGE* vp);
+/*
+ * Throws page cache page vp out of its inode and frees it; both must be locked
+ * and the inode must hold the only reference to vp. vp is unlocked and freed.
+ */
+void vmpage_evict(struct VM_PAGE* vp);
+/* Returns whether the inode has a page for offset offs */
+bool vmpage_is_cached(struct VFS_INODE* inode, off_t offs);
+/*
+ * Creates a page for va, mapped at vaddr. page_flags are PAGE_ALLOC_... flags
+ * used to allocate the backing page. Returns nullptr if the vmpage or its
+ * page cannot be allocated; PAGE_ALLOC_TRY makes this happen without
+ * attempting to reclaim memory first.
+ */
+struct VM_PAGE* vmpage_create_private(vmarea_t* va, addr_t vaddr, int flags, int page_flags = 0);
 struct PAGE* vmpage_get_page(struct VM_PAGE* vp);
 
-struct VM_PAGE* vmpage_clone(vmspace_t* vs, vmarea_t* va_source, vmarea_t* va_dest, struct VM_PAGE* vp);
-struct VM_PAGE* vmpage_link(vmarea_t* va, struct VM_PAGE* vp);
-void vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
-void vmpage_zero(vmspace_t* vs, struct VM_PAGE* vp);
+/*
+ * Returns whether locked page vp can be swapped out; if allow_large is set,
+ * large pages qualify as well, but these must be split first.
+ */
+bool vmpage_swappable(struct VM_PAGE* vp, bool allow_large = false);
+/*
+ * Writes locked page vp to slot, which it must own, and frees its backing
+ * page; vp is unmapped first. Should this fail, vp is left as it was.
+ */
+errorcode_t vmpage_swapout(struct VM_PAGE* vp, swapslot_t slot);
+/* Reads locked page vp back from swap, if it is swapped out; it is not mapped */
+errorcode_t vmpage_swapin(struct VM_PAGE* vp);
+
+/* Number of bytes mapped by vp */
+static inline size_t
+vmpage_size(const struct VM_PAGE* vp)
+{
+#ifdef MD_LARGE_PAGE_ORDER
+	if (vp->vp_flags & VM_PAGE_FLAG_LARGE)
+		return PAGE_SIZE << MD_LARGE_PAGE_ORDER;
+#endif
+	return PAGE_SIZE;
+}
+
+/*
+ * Breaks large page vp of va up in individual pages; vp will cover the first
+ * one and is unlocked. If vp is shared, va gets copies of the pages instead.
+ * Should we run out of memory, vp is unlocked but otherwise left as it was.
+ */
+errorcode_t vmpage_split(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
+
+/* Creates a private copy of vp for va_dest; the copy is returned locked, or nullptr if out of memory */
+struct VM_PAGE* vmpage_clone(vmarea_t* va_dest, struct VM_PAGE* vp);
+/*
+ * Adds vp to va_dest at the same address, which gains a reference to it. If
+ * cow is set, the page becomes copy-on-write for everyone; the caller must
+ * take away write access from existing mappings.
+ */
+void vmpage_share(vmarea_t* va_dest, struct VM_PAGE* vp, bool cow);
+/* Creates a page for va at vaddr linked to vp; returns nullptr if no vmpage is available */
+struct VM_PAGE* vmpage_link(vmarea_t* va, struct VM_PAGE* vp, addr_t vaddr);
+/*
+ * Creates a copy-on-write page for va at vaddr which refers to the global
+ * zero page, so that memory which is only read takes up no page of its own;
+ * once written, it is replaced by a zeroed page. The page is returned locked,
+ * or nullptr is returned if no vmpage is available.
+ */
+struct VM_PAGE* vmpage_create_zero(vmarea_t* va, addr_t vaddr);
+/* Retrieves how often the zero page was mapped and how often it was written to */
+void vmpage_get_zero_stats(unsigned int* mapped, unsigned int* promoted);
+
+/* Maps locked page vp of va into vs; fails if page tables can't be allocated */
+errorcode_t vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
+/*
+ * Gives va a writable private page for COW page vp, which is returned locked;
+ * if we run out of memory, nullptr is returned and vp remains as it was.
+ */
 struct VM_PAGE* vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
 
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix);
@@ -92,7 +205,7 @@ void vmpage_copy_extended(struct VM_PAGE* vp_src, struct VM_PAGE* vp_dst, size_t
 static inline void
 vmpage_copy(struct VM_PAGE* vp_src, struct VM_PAGE* vp_dst)
 {
-  vmpage_copy_extended(vp_src, vp_dst, PAGE_SIZE);
+  vmpage_copy_extended(vp_src, vp_dst, vmpage_size(vp_dst));
 }
 
 #endif // ANANAS_VM_PAGE_H
@@ -4,6 +4,7 @@
 #include <ananas/types.h>
 #include "kernel/list.h"
 #include "kernel/page.h"
+#include "kernel/rbtree.h"
 #include "kernel/vmpage.h"
 #include "kernel-md/vmspace.h"
 
@@ -26,22 +27,52 @@
  *
  * Note that we'll only fault one page at a time.
  *
+ * Besides being listed, areas are kept in a tree ordered by address. Every
+ * area knows the size of the unmapped gap before it, and the tree keeps track
+ * of the largest gap within every subtree; this allows both locating an
+ * address and finding a free range to be done in O(log n).
  */
 struct VM_AREA {
+	vmspace_t*		va_vmspace;		/* vmspace we belong to */
 	unsigned int		va_flags;		/* flags, combination of VM_FLAG_... */
 	addr_t			va_virt;		/* userland address */
 	size_t			va_len;			/* length */
-	struct VM_PAGE_LIST	va_pages;		/* backing pages */
+	struct RADIX_TREE	va_pages;		/* backing pages, by virtual page */
 	/* dentry-specific mapping fields */
 	struct DENTRY* 		va_dentry;		/* backing dentry, if any */
 	off_t			va_doffset;		/* dentry offset */
 	size_t			va_dlength;		/* dentry length */
+	/* readahead state, in dentry offsets */
+	off_t			va_ra_prev;		/* offset of the previous fault */
+	off_t			va_ra_next;		/* end of what the previous fault made resident */
+	off_t			va_ra_end;		/* end of what has been read ahead */
+	unsigned int		va_ra_pages;		/* readahead window; 0 if faults aren't sequential */
+	int			va_advice;		/* expected access pattern, VM_ADVICE_... */
+
+	struct RB_NODE		va_rb;			/* node in vs_area_tree */
+	size_t			va_gap;			/* unmapped bytes between the previous area and us */
+	size_t			va_subtree_gap;		/* largest va_gap in our subtree */
 
 	LIST_FIELDS(struct VM_AREA);
 };
 
 LIST_DEFINE(VM_AREA_LIST, struct VM_AREA);
 
+/*
+ * Memory and fault accounting of a vmspace. Pages count as resident as long
+ * as an area holds them, whether they are mapped yet or not; pages shared
+ * with another vmspace count for both, and the zero page doesn't count at
+ * all. Faults need not hold vs_mutex, so the counters are updated atomically.
+ */
+struct VM_SPACE_STATS {
+	unsigned long		vss_anon_pages;		/* resident anonymous pages */
+	unsigned long		vss_file_pages;		/* resident pages of the page cache */
+	unsigned long		vss_max_resident;	/* peak of the above combined */
+	unsigned long		vss_minor_faults;	/* faults resolved without reading */
+	unsigned long		vss_major_faults;	/* faults which had to read from a file */
+	unsigned long		vss_cow_faults;		/* writes which needed a copy of their own */
+};
+
 /*
  * VM space describes a thread's complete overview of memory.
  */
@@ -49,6 +80,14 @@ struct VM_SPACE {
 	mutex_t vs_mutex; /* protects all fields and sub-areas */
 
 	struct VM_AREA_LIST	vs_areas;
+	struct RB_TREE		vs_area_tree;		/* areas, by address */
+
+	/*
+	 * Changed whenever an area is removed or shrunk; threads use this to
+	 * validate their cached area lookup. Values are never re-used, not even
+	 * across vmspaces.
+	 */
+	unsigned long		vs_area_gen;
 
 	/*
 	 * Contains pages allocated to the space that aren't part of a mapping; this
@@ -56,25 +95,55 @@ struct VM_SPACE {
 	 */
 	struct page_list vs_pages;
 
-	addr_t			vs_next_mapping;	/* address of next mapping */
+	struct VM_SPACE_STATS	vs_stats;
 
 	MD_VMSPACE_FIELDS
 };
 
 #define VMSPACE_CLONE_EXEC 1
 
+/*
+ * Advice on how a range will be used; the first three are remembered by the
+ * area and tune readahead and fault-around, the others are acted upon right
+ * away.
+ */
+#define VM_ADVICE_NORMAL 0
+#define VM_ADVICE_RANDOM 1		/* only fault in the page that is needed */
+#define VM_ADVICE_SEQUENTIAL 2		/* read ahead as far as possible */
+#define VM_ADVICE_WILLNEED 3		/* start reading the file-backed pages in */
+#define VM_ADVICE_DONTNEED 4		/* throw the pages away */
+
 addr_t vmspace_determine_va(vmspace_t* vs, size_t len);
 errorcode_t vmspace_create(vmspace_t** vs);
+vmarea_t* vmspace_lookup_area(vmspace_t* vs, addr_t virt);
 void vmspace_cleanup(vmspace_t* vs); /* frees all mappings, but not MD-things */
 void vmspace_destroy(vmspace_t* vs);
 errorcode_t vmspace_mapto(vmspace_t* vs, addr_t virt, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
 errorcode_t vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, size_t vlength, struct DENTRY* dentry, off_t doffset, size_t dlength, int flags, vmarea_t** va_out);
 errorcode_t vmspace_map(vmspace_t* vs, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
+/*
+ * Removes everything mapped in [virt, virt + len); areas are trimmed or split
+ * as needed. virt must be page-aligned. Areas which are not cloned are
+ * maintained by the kernel and cannot be unmapped.
+ */
+errorcode_t vmspace_unmap(vmspace_t* vs, addr_t virt, size_t len /* bytes */);
+/*
+ * Applies advice to [virt, virt + len); areas are split as needed to
+ * remember it. virt must be page-aligned. Dropping pages is only possible
+ * for areas which are filled by faulting.
+ */
+errorcode_t vmspace_advise(vmspace_t* vs, addr_t virt, size_t len /* bytes */, int advice);
 errorcode_t vmspace_area_resize(vmspace_t* vs, vmarea_t* va, size_t new_length /* in bytes */);
 errorcode_t vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags);
+/* Queues the file pages backing [virt, end) of va for reading */
+void vmspace_area_prefetch(vmarea_t* va, addr_t virt, addr_t end);
 errorcode_t vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags);
 void vmspace_area_free(vmspace_t* vs, vmarea_t* va);
 void vmspace_dump(vmspace_t* vs);
+/* Accounts for area va gaining (delta > 0) or losing (delta < 0) page vp */
+void vmspace_account_page(vmarea_t* va, struct VM_PAGE* vp, int delta);
+/* Adds the fault counters of src to dst, which keeps the largest peak of both */
+void vmspace_add_stats(struct VM_SPACE_STATS* dst, const struct VM_SPACE_STATS* src);
 
 /* MD initialization/cleanup bits */
 errorcode_t md_vmspace_init(vmspace_t* vs);
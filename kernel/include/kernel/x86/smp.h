@@ -4,6 +4,7 @@
 #define SMP_IPI_FIRST		0xf0
 #define SMP_IPI_COUNT		4
 #define SMP_IPI_PANIC		0xf0	/* IPI used to trigger panic situation on other CPU's */
+#define SMP_IPI_TLB		0xf1	/* IPI used to request a TLB shootdown */
 #define SMP_IPI_SCHEDULE	0xf2	/* IPI used to trigger re-schedule */
 
 #ifndef ASM
@@ -50,6 +51,8 @@ void smp_prepare();
 void smp_prepare_config(struct X86_SMP_CONFIG* cfg);
 void smp_panic_others();
 void smp_broadcast_schedule();
+void smp_send_ipi(unsigned int cpu, int vector);
+uint32_t smp_get_launched_mask();
 #endif
 
 #endif /* __X86_SMP_H__ */
@@ -5,6 +5,7 @@
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
+#include "kernel/slab.h"
 #include "kernel/trace.h"
 #include "options.h"
 
@@ -18,6 +19,8 @@ LIST_DEFINE(BIO_CHAIN, struct BIO);
 static struct BIO_CHAIN bio_freelist;
 static struct BIO_CHAIN bio_usedlist;
 static struct BIO_BUCKET bio_bucket[BIO_BUCKET_SIZE];
+static struct SLAB_CACHE bio_cache;
+static unsigned int bio_num_buffers;
 static unsigned int bio_bitmap_size;
 static uint8_t* bio_bitmap = NULL;
 static uint8_t* bio_data = NULL;
@@ -25,6 +28,51 @@ static uint8_t* bio_data = NULL;
 static spinlock_t spl_bio_lists;
 static spinlock_t spl_bio_bitmap;
 
+static void
+bio_ctor(void* obj)
+{
+	auto bio = static_cast<struct BIO*>(obj);
+	memset(bio, 0, sizeof(*bio));
+	sem_init(&bio->sem, 1);
+}
+
+/* Hands all bio's on the freelist back to the slab cache */
+static void
+bio_reclaim(struct SLAB_CACHE* cache)
+{
+	spinlock_lock(&spl_bio_lists);
+	while (!LIST_EMPTY(&bio_freelist)) {
+		struct BIO* bio = LIST_HEAD(&bio_freelist);
+		LIST_POP_HEAD_IP(&bio_freelist, chain);
+		slab_free(&bio_cache, bio);
+		bio_num_buffers--;
+	}
+	spinlock_unlock(&spl_bio_lists);
+}
+
+/*
+ * Adds a fresh bio to the freelist, provided we haven't reached the limit yet;
+ * returns false if this was not possible.
+ */
+static bool
+bio_grow()
+{
+	auto bio = static_cast<struct BIO*>(slab_alloc(&bio_cache));
+	if (bio == NULL)
+		return false;
+
+	spinlock_lock(&spl_bio_lists);
+	if (bio_num_buffers >= BIO_NUM_BUFFERS) {
+		spinlock_unlock(&spl_bio_lists);
+		slab_free(&bio_cache, bio);
+		return false;
+	}
+	bio_num_buffers++;
+	LIST_APPEND_IP(&bio_freelist, chain, bio);
+	spinlock_unlock(&spl_bio_lists);
+	return true;
+}
+
 static errorcode_t
 bio_init()
 {
@@ -47,13 +95,10 @@ bio_init()
 		spinlock_init(&bio_bucket[i].spl_bucket);
 	}
 
-	/* Initialize bio buffers and hook them up to the freelist */
-	struct BIO* bios = new BIO[BIO_NUM_BUFFERS];
+	/* bio buffers are allocated as needed, up to BIO_NUM_BUFFERS */
+	slab_cache_init(&bio_cache, "bio", sizeof(struct BIO), bio_ctor, bio_reclaim);
 	LIST_INIT(&bio_freelist);
-	for (unsigned int i = 0; i < BIO_NUM_BUFFERS; i++, bios++) {
-		sem_init(&bios->sem, 1);
-		LIST_APPEND_IP(&bio_freelist, chain, bios);
-	}
+	bio_num_buffers = 0;
 
 	/*
 	 * Construct the BIO bitmap; we need to mark all items as clear except those
@@ -227,10 +272,11 @@ bio_restart:
 	}
 
 	if (bio == NULL) {
-		/* No bio's available; clean up some */
+		/* No bio's available; try to allocate one, or clean up some if we can't */
 		spinlock_unlock(&spl_bio_lists);
 		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		bio_cleanup();
+		if (!bio_grow())
+			bio_cleanup();
 		goto bio_restart;
 	}
 
@@ -299,6 +345,21 @@ bio_free(struct BIO* bio)
 	TRACE(BIO, FUNC, "bio=%p", bio);
 }
 
+/*
+ * Called instead of bio_free() by consumers which have copied the data
+ * elsewhere and won't need the block again soon; the buffer is moved to the
+ * end of the used list, so that it is the first to be recycled.
+ */
+void
+bio_discard(struct BIO* bio)
+{
+	TRACE(BIO, FUNC, "bio=%p", bio);
+	spinlock_lock(&spl_bio_lists);
+	LIST_REMOVE_IP(&bio_usedlist, chain, bio);
+	LIST_APPEND_IP(&bio_usedlist, chain, bio);
+	spinlock_unlock(&spl_bio_lists);
+}
+
 struct BIO*
 bio_get(Ananas::Device* device, blocknr_t block, size_t len, int flags)
 {
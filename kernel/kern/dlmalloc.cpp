@@ -551,7 +551,8 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define LACKS_TIME_H
 #define LACKS_UNISTD_H
 
-#define MALLOC_FAILURE_ACTION panic("out of memory")
+/* kmalloc() hands out NULL to its callers if we run out of memory */
+#define MALLOC_FAILURE_ACTION
 #define ABORT panic("abort")
 #define USE_DL_PREFIX
 
@@ -1705,7 +1706,8 @@ ananas_get_memory(size_t len)
 {
 	struct PAGE* p;
 	void* v = page_alloc_length_mapped(len, &p, VM_FLAG_READ | VM_FLAG_WRITE);
-	KASSERT(v != NULL, "out of memory allocating %u bytes", len);
+	if (v == NULL)
+		return MFAIL;
 	/* XXX We should store 'p' in a list so we can find it when freeing stuff */
 	return v;
 }
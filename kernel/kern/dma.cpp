@@ -117,6 +117,8 @@ dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 
 	/* Allocate the buffer itself... */
 	auto b = static_cast<struct DMA_BUFFER*>(kmalloc(sizeof(struct DMA_BUFFER) + num_segs * sizeof(struct DMA_BUFFER_SEGMENT)));
+	if (b == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	memset(b, 0, sizeof(*b) + num_segs * sizeof(struct DMA_BUFFER_SEGMENT));
 	b->db_tag = tag;
 	b->db_size = size;
@@ -128,7 +130,7 @@ dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 	errorcode_t err = ananas_success();
 	for (unsigned int n = 0; ananas_is_success(err) && n < num_segs; n++) {
 		struct DMA_BUFFER_SEGMENT* s = &b->db_seg[n];
-		s->s_virt = page_alloc_length_mapped(seg_size, &s->s_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+		s->s_virt = page_alloc_length_constrained_mapped(seg_size, tag->t_min_addr, tag->t_max_addr, tag->t_alignment, &s->s_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
 		if (s->s_virt == NULL) {
 			err = ANANAS_ERROR(OUT_OF_MEMORY);
 			break;
@@ -253,11 +253,16 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t*
 		*exec_arg = va->va_virt;
 
 		// Now assign a page to there and map it into the vmspae
-		struct VM_PAGE* vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_READONLY);
-		vp->vp_vaddr = ELFINFO_BASE;
+		struct VM_PAGE* vp = vmpage_create_private(va, ELFINFO_BASE, VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_READONLY);
+		if (vp == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
 		auto elf_info = static_cast<struct ANANAS_ELF_INFO*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), sizeof(struct ANANAS_ELF_INFO), VM_FLAG_READ | VM_FLAG_WRITE));
-		vmpage_map(vs, va, vp);
+		err = vmpage_map(vs, va, vp);
 		vmpage_unlock(vp);
+		if (ananas_is_failure(err)) {
+			kmem_unmap(elf_info, sizeof(struct ANANAS_ELF_INFO));
+			return err;
+		}
 
 		// And fill it out
 		memset(elf_info, 0, PAGE_SIZE);
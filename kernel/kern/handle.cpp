@@ -7,33 +7,31 @@
 #include "kernel/mm.h"
 #include "kernel/lock.h"
 #include "kernel/process.h"
+#include "kernel/slab.h"
 #include "kernel/trace.h"
 
 TRACE_SETUP;
 
-#define NUM_HANDLES 500 /* XXX shouldn't be static */
-
-static struct HANDLE_QUEUE handle_freelist;
-static spinlock_t spl_handlequeue;
+static struct SLAB_CACHE handle_cache;
 static struct HANDLE_TYPES handle_types;
 static spinlock_t spl_handletypes;
 
+static void
+handle_ctor(void* obj)
+{
+	/* Unused handles are all-zero and unlocked; handle_free() restores this state */
+	auto handle = static_cast<struct HANDLE*>(obj);
+	memset(handle, 0, sizeof(struct HANDLE));
+	mutex_init(&handle->h_mutex, "handle");
+}
+
 void
 handle_init()
 {
-	spinlock_init(&spl_handlequeue);
 	spinlock_init(&spl_handletypes);
 	LIST_INIT(&handle_types);
 
-	auto pool = new HANDLE[NUM_HANDLES];
-	memset(pool, 0, sizeof(struct HANDLE) * NUM_HANDLES);
-
-	/* Add all handles to the queue one by one */
-	LIST_INIT(&handle_freelist);
-	for (unsigned int i = 0; i < NUM_HANDLES; i++) {
-		struct HANDLE* h = &pool[i];
-		LIST_APPEND(&handle_freelist, h);
-	}
+	slab_cache_init(&handle_cache, "handle", sizeof(struct HANDLE), handle_ctor, NULL);
 }
 
 errorcode_t
@@ -54,21 +52,15 @@ handle_alloc(int type, process_t* proc, handleindex_t index_from, struct HANDLE*
 	if (htype == NULL)
 		return ANANAS_ERROR(BAD_TYPE);
 
-	/* Grab a handle from the pool */
-	spinlock_lock(&spl_handlequeue);
-	if (LIST_EMPTY(&handle_freelist)) {
-		/* XXX should we wait for a new handle, or just give an error? */
-		panic("out of handles");
-	}
-	struct HANDLE* handle = LIST_HEAD(&handle_freelist);
-	LIST_POP_HEAD(&handle_freelist);
-	spinlock_unlock(&spl_handlequeue);
+	/* Grab a handle from the cache */
+	auto handle = static_cast<struct HANDLE*>(slab_alloc(&handle_cache));
+	if (handle == NULL)
+		return ANANAS_ERROR(OUT_OF_HANDLES);
 
 	/* Sanity checks */
 	KASSERT(handle->h_type == HANDLE_TYPE_UNUSED, "handle from pool must be unused");
 
 	/* Initialize the handle */
-	mutex_init(&handle->h_mutex, "handle");
 	handle->h_type = type;
 	handle->h_process = proc;
 	handle->h_hops = htype->ht_hops;
@@ -158,10 +150,8 @@ handle_free(struct HANDLE* handle)
 	 */
 	mutex_unlock(&handle->h_mutex);
 
-	/* Hand it back to the the pool */
-	spinlock_lock(&spl_handlequeue);
-	LIST_APPEND(&handle_freelist, handle);
-	spinlock_unlock(&spl_handlequeue);
+	/* Hand it back to the the cache */
+	slab_free(&handle_cache, handle);
 	return ananas_success();
 }
 
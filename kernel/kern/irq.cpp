@@ -279,9 +279,13 @@ irq_handler(unsigned int no)
 	irq_nestcount--;
 	PCPU_SET(nested_irq, irq_nestcount);
 
-	/* If the IRQ handler resulted in a reschedule of the current thread, handle it */
+	/*
+	 * If the IRQ handler resulted in a reschedule of the current thread, handle
+	 * it - unless the thread cannot be preempted right now; it will pick up the
+	 * request once it can.
+	 */
 	thread_t* curthread = PCPU_GET(curthread);
-	if (irq_nestcount == 0 && THREAD_WANT_RESCHEDULE(curthread))
+	if (irq_nestcount == 0 && PCPU_GET(nopreempt) == 0 && THREAD_WANT_RESCHEDULE(curthread))
 		schedule();
 }
 
@@ -17,31 +17,79 @@
  *
  * The overal idea of this code is, when mapping physical address 'pa':
  *
- * - (1) KMEM_DIRECT_PA_START <= pa <= KMEM_DIRECT_PA_END can be mapped 1:1 to kernel
- *       virtual address 'va' where 'va = PA_TO_DIRECT_VA(pa)'
- * - (2) Addresses outside (1) are dynamically mapped using by finding an
+ * - (1) RAM which the MD startup code has mapped permanently (using
+ *       kmem_mark_direct()) needs no mapping at all: we just return
+ *       'va = PA_TO_DIRECT_VA(pa)'
+ * - (2) Other KMEM_DIRECT_PA_START <= pa <= KMEM_DIRECT_PA_END can be mapped
+ *       1:1 to kernel virtual address 'va' where 'va = PA_TO_DIRECT_VA(pa)';
+ *       this is mostly device memory.
+ * - (3) Addresses outside (2) are dynamically mapped using by finding an
  *       appropriate va which satisfies KMEM_DYNAMIC_VA_START <= va <=
  *       KMEM_DYNAMIC_VA_END
  *
+ * The dynamic range is managed by a vmem arena; we do not keep track of the
+ * mappings ourselves as the page tables already know where everything goes.
  */
+#include <ananas/error.h>
 #include <machine/param.h>
 #include "kernel/mm.h"
 #include "kernel/kdb.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
-#include "kernel/lock.h"
-#include "kernel/page.h"
 #include "kernel/vm.h"
+#include "kernel/vmem.h"
 #include "kernel-md/vm.h"
 #include "options.h"
 
 #define KMEM_DEBUG(...) (void)0
 
-static spinlock_t kmem_lock = SPINLOCK_DEFAULT_INIT;
-static struct PAGE* kmem_page;
-static struct KMEM_MAPPING* kmem_mappings = NULL;
+/* Mappings of up to this many pages are cached per CPU */
+#define KMEM_QCACHE_PAGES 8
 
-#define KMEM_NUM_MAPPINGS (PAGE_SIZE / sizeof(struct KMEM_MAPPING))
+static struct VMEM kmem_arena;
+
+/* RAM ranges which are permanently mapped; these are set up before anything else runs */
+#define KMEM_DIRECT_MAX_RANGES 32
+static struct KMEM_DIRECT_RANGE {
+	addr_t dr_start;
+	addr_t dr_end;
+} kmem_direct_range[KMEM_DIRECT_MAX_RANGES];
+static unsigned int kmem_num_direct_ranges = 0;
+
+void
+kmem_mark_direct(addr_t phys, size_t length)
+{
+	KASSERT(kmem_num_direct_ranges < KMEM_DIRECT_MAX_RANGES, "too many direct ranges");
+	KASSERT(phys >= KMEM_DIRECT_PA_START && phys + length <= KMEM_DIRECT_PA_END, "range %p-%p cannot be directly mapped", phys, phys + length);
+	struct KMEM_DIRECT_RANGE* dr = &kmem_direct_range[kmem_num_direct_ranges++];
+	dr->dr_start = phys;
+	dr->dr_end = phys + length;
+}
+
+static inline bool
+kmem_is_direct_ram(addr_t pa, size_t num_pages)
+{
+	for (unsigned int n = 0; n < kmem_num_direct_ranges; n++) {
+		struct KMEM_DIRECT_RANGE* dr = &kmem_direct_range[n];
+		if (pa >= dr->dr_start && pa + num_pages * PAGE_SIZE <= dr->dr_end)
+			return true;
+	}
+	return false;
+}
+
+void
+kmem_init()
+{
+	vmem_init(&kmem_arena, "kva", PAGE_SIZE, KMEM_QCACHE_PAGES);
+	if (!vmem_add(&kmem_arena, KMEM_DYNAMIC_VA_START, KMEM_DYNAMIC_VA_END - KMEM_DYNAMIC_VA_START + 1))
+		panic("kmem_init(): cannot set up kva arena");
+}
+
+static inline bool
+kmem_is_direct_va(addr_t va)
+{
+	return va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END);
+}
 
 void*
 kmem_map(addr_t phys, size_t length, int flags)
@@ -53,94 +101,41 @@ kmem_map(addr_t phys, size_t length, int flags)
 	size_t size = (length + offset + PAGE_SIZE - 1) / PAGE_SIZE;
 
 	/*
-	 * First step is to see if we can directly map this; if this is the case,
+	 * RAM is always mapped, so this is just a matter of calculating the address.
+	 * The direct map is never executable, so mappings that need to be go through
+	 * the regular path.
+	 */
+	if ((flags & (VM_FLAG_FORCEMAP | VM_FLAG_EXECUTE)) == 0 && kmem_is_direct_ram(pa, size))
+		return (void*)(PA_TO_DIRECT_VA(pa) + offset);
+
+	/*
+	 * Next step is to see if we can directly map this; if this is the case,
 	 * there is no need to allocate a specific mapping.
 	 */
 	if (pa >= KMEM_DIRECT_PA_START && pa < KMEM_DIRECT_PA_END &&
-	   (flags & VM_FLAG_FORCEMAP) == 0) {
+	   (flags & VM_FLAG_FORCEMAP) == 0 && !kmem_is_direct_ram(pa, 1)) {
 		addr_t va = PTOKV(pa);
 		KMEM_DEBUG("kmem_map(): doing direct map: pa=%p va=%p size=%d\n", pa, va, size);
-		md_kmap(pa, va, size, flags);
-		return (void*)(va + offset);
-	}
-
-	if (kmem_mappings == NULL) {
-		/*
-		 * Chicken-and-egg problem here: we need a page to store our administration,
-		 * but allocating one could invoke kmem_map() to allocate a mapping.
-		 *
-		 * XXX We just hope that this won't happen for now
-		 */
-		kmem_mappings = static_cast<struct KMEM_MAPPING*>(page_alloc_single_mapped(&kmem_page, VM_FLAG_READ | VM_FLAG_WRITE));
-		memset(kmem_mappings, 0, PAGE_SIZE);
-	}
-
-	/*
-	 * Try to locate a sensible location for this mapping; we keep kmem_mappings sorted so we can
-	 * easily reclaim virtual space in between.
-	 */
-	spinlock_lock(&kmem_lock);
-	addr_t virt = KMEM_DYNAMIC_VA_START;
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	unsigned int n = 0;
-	for (/* nothing */; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-		if (virt + size <= kmm->kmm_virt)
-			break; /* fits here */
-
-		/*
-		 * Only reject exact mappings; it's not up to us to determine how the
-		 * caller should behave.
-		 */
-		if (pa == kmm->kmm_phys && size == kmm->kmm_size) {
-			/* Already mapped */
-			spinlock_unlock(&kmem_lock);
-
-			panic("XXX range %p-%p already mapped (%p-%p) -> %p",
-			 pa, pa + size, kmm->kmm_phys, kmm->kmm_phys + size, kmm->kmm_virt);
+		if (ananas_is_failure(md_kmap(pa, va, size, flags)))
 			return NULL;
-		}
-
-		/*
-		 * No fit here; try to place it after this mapping (this is an attempt to
-		 * fill up holes)
-		 */
-		virt = kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE;
-	}
-
-	if (virt + size >= KMEM_DYNAMIC_VA_END) {
-		/* Out of KVA! XXX This shouldn't panic, but it's weird all-right */
-		spinlock_unlock(&kmem_lock);
-		panic("out of kva (%p + %x >= %p)", virt, size, KMEM_DYNAMIC_VA_END);
-		return NULL;
+		return (void*)(va + offset);
 	}
 
-	/*
-	 * XXX I wonder how realistic this is and whether it's worth bothering to come up with
-	 *     something more clever (there is no reason we couldn't move kmem_mappings)
-	 */
-	if (n == KMEM_NUM_MAPPINGS) {
-		spinlock_unlock(&kmem_lock);
-		/* XXX This shouldn't panic either */
-		panic("out of kva mappings!!");
+	addr_t virt = vmem_alloc(&kmem_arena, size * PAGE_SIZE);
+	if (virt == 0) {
+		kprintf("kmem_map(): out of kva mapping pa=%p, %u pages\n", pa, (unsigned int)size);
 		return NULL;
 	}
 
-	/*
-	 * Need to insert the mapping at position n.
-	 */
-	memmove(&kmem_mappings[n + 1], &kmem_mappings[n], KMEM_NUM_MAPPINGS - n);
-	kmm->kmm_phys = pa;
-	kmm->kmm_size = size;
-	kmm->kmm_flags = flags;
-	kmm->kmm_virt = virt;
-	spinlock_unlock(&kmem_lock);
-
 	/* Now perform the actual mapping and we're set */
 	KMEM_DEBUG(">>> DID outside kmem map: pa=%p virt=%p size=%d\n", pa, virt, size);
 
-	md_kmap(pa, virt, size, flags);
+	if (ananas_is_failure(md_kmap(pa, virt, size, flags))) {
+		kprintf("kmem_map(): out of page tables mapping pa=%p, %u pages\n", pa, (unsigned int)size);
+		md_kunmap(virt, size);
+		vmem_free(&kmem_arena, virt, size * PAGE_SIZE);
+		return NULL;
+	}
 	return (void*)(virt + offset);
 }
 
@@ -152,8 +147,11 @@ kmem_unmap(void* virt, size_t length)
 	size_t size = (length + offset + PAGE_SIZE - 1) / PAGE_SIZE;
 	KMEM_DEBUG("kmem_unmap(): virt=%p len=%d\n", virt, length);
 
-	/* If this is a direct mapping, we can just as easily undo it */
-	if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END)) {
+	/* If this is a direct mapping, we can just as easily undo it - unless it's RAM, which stays */
+	if (kmem_is_direct_va(va)) {
+		if (kmem_is_direct_ram(va - PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START), size))
+			return;
+
 		KMEM_DEBUG("kmem_unmap(): direct removed: virt=%p len=%d (range %p-%p)\n", virt, length,
 		 PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START), PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END));
 
@@ -161,34 +159,10 @@ kmem_unmap(void* virt, size_t length)
 		return;
 	}
 
-	/* We only allow exact mappings to be unmapped */
-	spinlock_lock(&kmem_lock);
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-		if (va != kmm->kmm_virt || size != kmm->kmm_size)
-			continue;
-	
-		KMEM_DEBUG("kmem_unmap(): unmapping: virt=%p len=%d\n", virt, length);
-
-		memmove(&kmem_mappings[n], &kmem_mappings[n + 1], KMEM_NUM_MAPPINGS - n);
-		/* And free the final one... */
-		for (unsigned int m = KMEM_NUM_MAPPINGS - 1; m > n; m--) {
-			struct KMEM_MAPPING* kmm = &kmem_mappings[m];
-			if (kmm->kmm_size == 0)
-				continue;
-			memset(kmm, 0, sizeof(*kmm));
-			break;
-		}
-		spinlock_unlock(&kmem_lock);
-
-		md_kunmap(va, size);
-		return;
-	}
-	spinlock_unlock(&kmem_lock);
-
-	panic("kmem_unmap(): virt=%p length=%d not mapped", virt, length);
+	/* The arena verifies that only exact mappings are unmapped */
+	KASSERT(va >= KMEM_DYNAMIC_VA_START && va < KMEM_DYNAMIC_VA_END, "kmem_unmap(): virt=%p length=%d not mapped", virt, length);
+	md_kunmap(va, size);
+	vmem_free(&kmem_arena, va, size * PAGE_SIZE);
 }
 
 addr_t
@@ -198,45 +172,23 @@ kmem_get_phys(void* virt)
 	addr_t offset = (addr_t)virt & (PAGE_SIZE - 1);
 
 	/* If this is a direct mapping, we needn't look it up at all */
-	if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END))
+	if (kmem_is_direct_va(va))
 		return (va - PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START)) + offset;
 
-	/* Walk through the mappings */
-	spinlock_lock(&kmem_lock);
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-
-		if (va < kmm->kmm_virt)
-			continue;
-		if (va > kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE)
-			continue;
-
-		addr_t phys = kmm->kmm_phys + ((addr_t)virt - (addr_t)kmm->kmm_virt);
-		spinlock_unlock(&kmem_lock);
-		return phys;
-	}
-
-	spinlock_unlock(&kmem_lock);
+	/* Let the page tables tell us */
+	return md_kget_phys(va) + offset;
+}
 
-	panic("kmem_get_phys(): va=%p not mapped", va);
+void
+kmem_get_stats(size_t* total, size_t* inuse)
+{
+	vmem_get_stats(&kmem_arena, total, inuse);
 }
 
 #ifdef OPTION_KDB
 KDB_COMMAND(kmappings, NULL, "Display kernel memory mappings")
 {
-	if (kmem_mappings == NULL)
-		return;
-
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break;
-		size_t len = kmm->kmm_size * PAGE_SIZE;
-		kprintf("mapping: va %p-%p pa %p-%p\n",
-		 kmm->kmm_virt, kmm->kmm_virt + len - 1, kmm->kmm_phys, kmm->kmm_phys + len - 1);
-	}
+	vmem_dump(&kmem_arena);
 }
 #endif
 
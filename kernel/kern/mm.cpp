@@ -1,7 +1,22 @@
+/*
+ * Kernel memory allocator.
+ *
+ * Small allocations are served from a set of size-class slab caches, which
+ * have per-CPU fronts and only use spinlocks - these can be used from any
+ * context. Large allocations go straight to the page allocator. Anything in
+ * between is handed to dlmalloc, which is protected by a mutex.
+ *
+ * Every allocation is prefixed by a KMALLOC_HEADER so that kfree() knows where
+ * the memory came from; the header is sized such that the returned pointer
+ * remains 16-byte aligned.
+ */
 #include <ananas/types.h>
+#include "kernel/kmem.h"
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
+#include "kernel/page.h"
+#include "kernel/slab.h"
 #include "kernel/vm.h"
 #include "kernel-md/vm.h"
 
@@ -12,28 +27,149 @@ void* dlmalloc(size_t);
 void dlfree(void*);
 }
 
+#define KMALLOC_MAGIC 0x6b6d0000
+#define KMALLOC_MAGIC_MASK 0xffff0000
+#define KMALLOC_TYPE_MASK 0x0000ffff
+#define KMALLOC_TYPE_LARGE 0xfffe	/* Allocated using the page allocator */
+#define KMALLOC_TYPE_DL 0xffff		/* Allocated using dlmalloc */
+
+struct KMALLOC_HEADER {
+	struct PAGE* kh_page;		/* Only for KMALLOC_TYPE_LARGE */
+	uint32_t kh_size;				/* Only for KMALLOC_TYPE_LARGE; in pages */
+	uint32_t kh_type;				/* Magic | type or size class */
+};
+
+static_assert(sizeof(struct KMALLOC_HEADER) == 16, "header must preserve alignment");
+static_assert(SLAB_ALIGN >= 16, "size classes must be 16-byte aligned");
+
+#define KMALLOC_HEADER_SIZE sizeof(struct KMALLOC_HEADER)
+
+/*
+ * Usable sizes of the size classes; each object also contains the header, so
+ * the memory handed out is as aligned as the slab objects are.
+ */
+static const size_t kmalloc_class_size[] = {
+	16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048
+};
+#define KMALLOC_NUM_CLASSES (sizeof(kmalloc_class_size) / sizeof(kmalloc_class_size[0]))
+#define KMALLOC_MAX_CLASS_SIZE 2048
+
+/* Allocations where the page rounding wastes less than 25% use the page allocator */
+#define KMALLOC_LARGE_MIN (4 * PAGE_SIZE)
+
+static struct SLAB_CACHE kmalloc_cache[KMALLOC_NUM_CLASSES];
+static char kmalloc_cache_name[KMALLOC_NUM_CLASSES][16];
+
+/* Maps (size - 1) / 16 to the size class; this avoids searching on allocation */
+static uint8_t kmalloc_class_index[KMALLOC_MAX_CLASS_SIZE / 16];
+
 void
 mm_init()
 {
 	mutex_init(&mtx_mm, "mm");
+	kmem_init();
+
+	unsigned int cls = 0;
+	for (unsigned int n = 0; n < KMALLOC_MAX_CLASS_SIZE / 16; n++) {
+		if ((n + 1) * 16 > kmalloc_class_size[cls])
+			cls++;
+		kmalloc_class_index[n] = cls;
+	}
+
+	for (unsigned int n = 0; n < KMALLOC_NUM_CLASSES; n++) {
+		snprintf(kmalloc_cache_name[n], sizeof(kmalloc_cache_name[n]), "kmalloc-%u", (unsigned int)kmalloc_class_size[n]);
+		slab_cache_init(&kmalloc_cache[n], kmalloc_cache_name[n], kmalloc_class_size[n] + KMALLOC_HEADER_SIZE, NULL, NULL);
+	}
+}
+
+static inline struct KMALLOC_HEADER*
+kmalloc_get_header(void* ptr)
+{
+	return reinterpret_cast<struct KMALLOC_HEADER*>(static_cast<char*>(ptr) - KMALLOC_HEADER_SIZE);
 }
 
+static void*
+kmalloc_small(size_t len, int flags)
+{
+	unsigned int cls = kmalloc_class_index[len > 0 ? (len - 1) / 16 : 0];
+	char* obj = static_cast<char*>(slab_alloc(&kmalloc_cache[cls], flags));
+	if (obj == NULL)
+		return NULL;
+
+	auto hdr = reinterpret_cast<struct KMALLOC_HEADER*>(obj);
+	hdr->kh_page = NULL;
+	hdr->kh_size = 0;
+	hdr->kh_type = KMALLOC_MAGIC | cls;
+	return hdr + 1;
+}
+
+static void*
+kmalloc_large(size_t len)
+{
+	struct PAGE* p;
+	size_t num_pages = (len + KMALLOC_HEADER_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+	auto hdr = static_cast<struct KMALLOC_HEADER*>(page_alloc_length_mapped(num_pages * PAGE_SIZE, &p, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (hdr == NULL)
+		return NULL;
+	hdr->kh_page = p;
+	hdr->kh_size = num_pages;
+	hdr->kh_type = KMALLOC_MAGIC | KMALLOC_TYPE_LARGE;
+	return hdr + 1;
+}
 
 void*
 kmalloc(size_t len)
 {
+	if (len <= KMALLOC_MAX_CLASS_SIZE)
+		return kmalloc_small(len, 0);
+	if (len + KMALLOC_HEADER_SIZE > KMALLOC_LARGE_MIN)
+		return kmalloc_large(len);
+
 	mutex_lock(&mtx_mm);
-	void* ptr = dlmalloc(len);
+	auto hdr = static_cast<struct KMALLOC_HEADER*>(dlmalloc(len + KMALLOC_HEADER_SIZE));
 	mutex_unlock(&mtx_mm);
-	return ptr;
+	if (hdr == NULL)
+		return NULL;
+	hdr->kh_type = KMALLOC_MAGIC | KMALLOC_TYPE_DL;
+	return hdr + 1;
+}
+
+void*
+kmalloc_nowait(size_t len)
+{
+	/* Only the size classes can be used without sleeping */
+	if (len > KMALLOC_MAX_CLASS_SIZE)
+		return NULL;
+	return kmalloc_small(len, SLAB_ALLOC_NOWAIT);
 }
 
 void
 kfree(void* addr)
 {
-	mutex_lock(&mtx_mm);
-	dlfree(addr);
-	mutex_unlock(&mtx_mm);
+	if (addr == NULL)
+		return;
+
+	struct KMALLOC_HEADER* hdr = kmalloc_get_header(addr);
+	KASSERT((hdr->kh_type & KMALLOC_MAGIC_MASK) == KMALLOC_MAGIC, "freeing %p, which was not allocated by kmalloc", addr);
+	unsigned int type = hdr->kh_type & KMALLOC_TYPE_MASK;
+	switch(type) {
+		case KMALLOC_TYPE_LARGE: {
+			struct PAGE* p = hdr->kh_page;
+			kmem_unmap(hdr, hdr->kh_size * PAGE_SIZE);
+			page_free(p);
+			break;
+		}
+		case KMALLOC_TYPE_DL:
+			hdr->kh_type = 0;
+			mutex_lock(&mtx_mm);
+			dlfree(hdr);
+			mutex_unlock(&mtx_mm);
+			break;
+		default:
+			KASSERT(type < KMALLOC_NUM_CLASSES, "freeing %p with corrupt header %x", addr, hdr->kh_type);
+			slab_free(&kmalloc_cache[type], hdr);
+			break;
+	}
 }
 
 void*
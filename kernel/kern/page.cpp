@@ -1,9 +1,14 @@
 #include <machine/param.h>
+#include <ananas/error.h>
+#include "kernel/init.h"
 #include "kernel/kdb.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
 #include "kernel/list.h"
 #include "kernel/page.h"
+#include "kernel/pageout.h"
+#include "kernel/pcpu.h"
+#include "kernel/thread.h"
 #include "kernel/vm.h"
 #include "options.h"
 
@@ -16,6 +21,7 @@
 #endif
 
 static struct zone_list zones;
+static struct PAGE_MAGAZINE page_magazine[MAX_CPUS];
 
 static inline void
 page_assert_sane(struct PAGE* p)
@@ -57,14 +63,12 @@ bytes2order(size_t length)
 	return order;
 }
 
-void
-page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
+static void
+page_free_index_locked(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
 	struct PAGE* p = &z->z_base[index];
 	DPRINTF("page_free_index(): order=%u index=%u -> p=%p\n", order, index, p);
 
-	spinlock_lock(&z->z_lock);
-
 	/* Clear the current index; it is available */
 	clear_bit(z->z_bitmap, index);
 	z->z_avail_pages += 1 << order;
@@ -97,35 +101,28 @@ page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 		LIST_APPEND(&z->z_free[order], &z->z_base[index]);
 		z->z_base[index].p_order = order;
 	}
-
-	spinlock_unlock(&z->z_lock);
 }
 
 void
-page_free(struct PAGE* p)
+page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
-	page_assert_sane(p);
-
-	struct PAGE_ZONE* z = p->p_zone;
-	page_free_index(z, p->p_order, p - z->z_base);
+	spinlock_lock(&z->z_lock);
+	page_free_index_locked(z, order, index);
+	spinlock_unlock(&z->z_lock);
 }
 
-struct PAGE*
-page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
+static struct PAGE*
+page_alloc_zone_locked(struct PAGE_ZONE* z, unsigned int order)
 {
 	DPRINTF("page_alloc_zone(): z=%p, order=%u\n", z, order);
 
-	spinlock_lock(&z->z_lock);
-
 	/* First step is to figure out the initial order we need to use */
 	unsigned int alloc_order = order;
 	while (alloc_order < PAGE_NUM_ORDERS && LIST_EMPTY(&z->z_free[alloc_order]))
 		alloc_order++; /* nothing free here */
 	DPRINTF("page_alloc_zone(): z=%p, order=%u -> alloc_order=%u\n", z, order, alloc_order);
-	if (alloc_order == PAGE_NUM_ORDERS) {
-		spinlock_unlock(&z->z_lock);
+	if (alloc_order == PAGE_NUM_ORDERS)
 		return NULL;
-	}
 
 	/* Now we need to keep splitting each block from alloc_order .. order */
 	for (unsigned int n = alloc_order; n >= order; n--) {
@@ -149,7 +146,6 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 			set_bit(z->z_bitmap, index);
 			DPRINTF("page_alloc_zone(): got page=%p, index %u\n", p, index);
 			z->z_avail_pages -= 1 << order;
-			spinlock_unlock(&z->z_lock);
 			return p;
 		}
 
@@ -168,8 +164,282 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 	return NULL;
 }
 
+struct PAGE*
+page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
+{
+	spinlock_lock(&z->z_lock);
+	struct PAGE* p = page_alloc_zone_locked(z, order);
+	spinlock_unlock(&z->z_lock);
+	return p;
+}
+
+/*
+ * Returns a batch of pages to their zones; the zone lock is only re-acquired
+ * if the zone changes.
+ */
+static void
+page_free_batch(struct PAGE** pages, unsigned int count)
+{
+	struct PAGE_ZONE* locked_zone = NULL;
+	for (unsigned int n = 0; n < count; n++) {
+		struct PAGE* p = pages[n];
+		page_assert_sane(p);
+
+		struct PAGE_ZONE* z = p->p_zone;
+		if (z != locked_zone) {
+			if (locked_zone != NULL)
+				spinlock_unlock(&locked_zone->z_lock);
+			spinlock_lock(&z->z_lock);
+			locked_zone = z;
+		}
+		page_free_index_locked(z, p->p_order, p - z->z_base);
+	}
+	if (locked_zone != NULL)
+		spinlock_unlock(&locked_zone->z_lock);
+}
+
+/* Obtains up to count order-0 pages from the zones; returns the amount obtained */
+static unsigned int
+page_alloc_batch(struct PAGE** pages, unsigned int count)
+{
+	unsigned int n = 0;
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		if (z->z_flags & PAGE_ZONE_FLAG_CONTIG)
+			continue;
+		spinlock_lock(&z->z_lock);
+		for (/* nothing */; n < count; n++) {
+			struct PAGE* p = page_alloc_zone_locked(z, 0);
+			if (p == NULL)
+				break;
+			pages[n] = p;
+		}
+		spinlock_unlock(&z->z_lock);
+		if (n == count)
+			break;
+	}
+	return n;
+}
+
+static inline struct PAGE_MAGAZINE*
+page_get_magazine()
+{
+	unsigned int cpuid = PCPU_GET(cpuid);
+	if (cpuid >= MAX_CPUS)
+		return NULL;
+	return &page_magazine[cpuid];
+}
+
+static struct PAGE*
+page_alloc_magazine()
+{
+	struct PAGE_MAGAZINE* pm = page_get_magazine();
+	if (pm == NULL)
+		return NULL;
+
+	spinlock_lock(&pm->pm_lock);
+	if (pm->pm_count > 0) {
+		struct PAGE* p = pm->pm_page[--pm->pm_count];
+		pm->pm_hits++;
+		spinlock_unlock(&pm->pm_lock);
+		return p;
+	}
+	pm->pm_misses++;
+	spinlock_unlock(&pm->pm_lock);
+
+	/*
+	 * The magazine is empty; grab a batch from the zones. We do this without
+	 * holding the magazine lock, so we must cope with the magazine being
+	 * refilled in the meantime.
+	 */
+	struct PAGE* batch[PAGE_MAGAZINE_BATCH];
+	unsigned int count = page_alloc_batch(batch, PAGE_MAGAZINE_BATCH);
+	if (count == 0)
+		return NULL;
+	pageout_wakeup();
+
+	/* Keep the first page for the caller; the remainder goes in the magazine */
+	unsigned int n = 1;
+	spinlock_lock(&pm->pm_lock);
+	pm->pm_refills++;
+	for (/* nothing */; n < count && pm->pm_count < PAGE_MAGAZINE_SIZE; n++)
+		pm->pm_page[pm->pm_count++] = batch[n];
+	spinlock_unlock(&pm->pm_lock);
+
+	page_free_batch(&batch[n], count - n);
+	return batch[0];
+}
+
+static bool
+page_free_magazine(struct PAGE* p)
+{
+	struct PAGE_MAGAZINE* pm = page_get_magazine();
+	if (pm == NULL)
+		return false;
+
+	struct PAGE* batch[PAGE_MAGAZINE_BATCH];
+	unsigned int count = 0;
+	spinlock_lock(&pm->pm_lock);
+	if (pm->pm_count == PAGE_MAGAZINE_SIZE) {
+		/*
+		 * Magazine is full; drain the oldest batch to make room. The most
+		 * recently freed pages are kept as they are most likely to be cache-hot.
+		 */
+		count = PAGE_MAGAZINE_BATCH;
+		for (unsigned int n = 0; n < count; n++)
+			batch[n] = pm->pm_page[n];
+		for (unsigned int n = count; n < PAGE_MAGAZINE_SIZE; n++)
+			pm->pm_page[n - count] = pm->pm_page[n];
+		pm->pm_count -= count;
+		pm->pm_drains++;
+	}
+	pm->pm_page[pm->pm_count++] = p;
+	spinlock_unlock(&pm->pm_lock);
+
+	page_free_batch(batch, count);
+	return true;
+}
+
+unsigned int
+page_drain_magazines()
+{
+	unsigned int drained = 0;
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct PAGE_MAGAZINE* pm = &page_magazine[cpu];
+		while (1) {
+			struct PAGE* batch[PAGE_MAGAZINE_BATCH];
+			unsigned int count = 0;
+			spinlock_lock(&pm->pm_lock);
+			while (pm->pm_count > 0 && count < PAGE_MAGAZINE_BATCH)
+				batch[count++] = pm->pm_page[--pm->pm_count];
+			if (count > 0)
+				pm->pm_drains++;
+			spinlock_unlock(&pm->pm_lock);
+			if (count == 0)
+				break;
+
+			page_free_batch(batch, count);
+			drained += count;
+		}
+	}
+	return drained;
+}
+
 void
-page_zone_add(addr_t base, size_t length)
+page_free(struct PAGE* p)
+{
+	page_assert_sane(p);
+
+	/*
+	 * Single pages go to the per-CPU magazine if possible; pages from the
+	 * contiguous zone must not end up there as anyone could grab them.
+	 */
+	struct PAGE_ZONE* z = p->p_zone;
+	if (p->p_order == 0 && (z->z_flags & PAGE_ZONE_FLAG_CONTIG) == 0 && page_free_magazine(p))
+		return;
+
+	page_free_index(z, p->p_order, p - z->z_base);
+}
+
+void
+page_split(struct PAGE* p)
+{
+	page_assert_sane(p);
+
+	/*
+	 * Only the first page of an allocated block is marked in the bitmap; we must
+	 * mark all of them or freeing one could merge it with its still-allocated
+	 * neighbours.
+	 */
+	struct PAGE_ZONE* z = p->p_zone;
+	unsigned int index = p - z->z_base;
+	spinlock_lock(&z->z_lock);
+	for (unsigned int n = 0; n < (1U << p->p_order); n++)
+		set_bit(z->z_bitmap, index + n);
+	for (unsigned int n = 1U << p->p_order; n > 0; n--)
+		p[n - 1].p_order = 0;
+	spinlock_unlock(&z->z_lock);
+}
+
+/*
+ * Makes pages [first .. last) of zone z available; the caller must hold the
+ * zone lock unless the zone isn't yet visible. Rather than freeing every page
+ * individually, this directly constructs the largest blocks that fit. first
+ * must be aligned to the largest block size so that no block built here can
+ * be merged with a block that is already on the freelist.
+ */
+static void
+page_zone_release(struct PAGE_ZONE* z, unsigned int first, unsigned int last)
+{
+	KASSERT((first & (PAGE_ZONE_MAX_BLOCK - 1)) == 0, "first index %u not aligned", first);
+
+	/* Clear the bitmap; partial bytes at the edges are done bit-by-bit */
+	unsigned int n = first;
+	for (/* nothing */; n < last && (n & 7) != 0; n++)
+		clear_bit(z->z_bitmap, n);
+	if (n < last) {
+		unsigned int num_bytes = (last - n) / 8;
+		memset(&z->z_bitmap[n / 8], 0, num_bytes);
+		for (n += num_bytes * 8; n < last; n++)
+			clear_bit(z->z_bitmap, n);
+	}
+
+	for (n = first; n < last; /* nothing */) {
+		/* Find the largest order block which is aligned and fits */
+		unsigned int order = PAGE_NUM_ORDERS - 1;
+		while ((n & ((1 << order) - 1)) != 0 || n + (1 << order) > last)
+			order--;
+
+		struct PAGE* p = &z->z_base[n];
+		for (unsigned int i = 0; i < (1U << order); i++) {
+			p[i].p_zone = z;
+			p[i].p_order = 0;
+		}
+		p->p_order = order;
+		LIST_APPEND(&z->z_free[order], p);
+		z->z_avail_pages += 1 << order;
+		n += 1 << order;
+	}
+}
+
+/*
+ * Releases a chunk of deferred pages from zone z; returns false if there was
+ * nothing left to release.
+ */
+static bool
+page_zone_release_deferred(struct PAGE_ZONE* z)
+{
+	spinlock_lock(&z->z_lock);
+	if (z->z_init_pages == z->z_num_pages) {
+		spinlock_unlock(&z->z_lock);
+		return false;
+	}
+
+	unsigned int first = z->z_init_pages;
+	unsigned int last = first + PAGE_ZONE_DEFER_CHUNK;
+	if (last > z->z_num_pages)
+		last = z->z_num_pages;
+	page_zone_release(z, first, last);
+	z->z_init_pages = last;
+	spinlock_unlock(&z->z_lock);
+	return true;
+}
+
+/*
+ * Releases a chunk of deferred pages from the first zone that has any; returns
+ * false if there was nothing left to release.
+ */
+static bool
+page_release_deferred()
+{
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		if (page_zone_release_deferred(z))
+			return true;
+	}
+	return false;
+}
+
+static void
+page_zone_add_range(addr_t base, size_t length, unsigned int flags)
 {
 	/*
 	 * We'll need the following:
@@ -195,28 +465,213 @@ page_zone_add(addr_t base, size_t length)
 		LIST_INIT(&z->z_free[n]);
 	memset(z->z_bitmap, 0xff, bitmap_size);
 	z->z_base = (struct PAGE*)(mem + bitmap_size + sizeof(*z));
-	z->z_num_pages = num_pages - num_admin_pages;
 	z->z_avail_pages = 0;
-	z->z_phys_addr = base + num_admin_pages * PAGE_SIZE;
+	z->z_flags = flags;
 
-	/* Create the page structures; we mark everything as a order 0 page */
-	struct PAGE* p = z->z_base;
-	for (unsigned int n = 0; n < z->z_num_pages; n++, p++) {
-		p->p_zone = z;
-		p->p_order = 0;
+	/*
+	 * Blocks are aligned to their size relative to the start of the zone; if
+	 * the zone is large enough, align the start so that blocks are physically
+	 * aligned as well. This allows alignment constraints to be honored.
+	 */
+	addr_t phys_addr = base + num_admin_pages * PAGE_SIZE;
+	const addr_t block_size = PAGE_ZONE_MAX_BLOCK * PAGE_SIZE;
+	if (num_pages - num_admin_pages >= 4 * PAGE_ZONE_MAX_BLOCK)
+		phys_addr = (phys_addr + block_size - 1) & ~(block_size - 1);
+	z->z_phys_addr = phys_addr;
+	z->z_num_pages = num_pages - (phys_addr - base) / PAGE_SIZE;
+
+	/*
+	 * Build the freelists for the first part of the zone right away; anything
+	 * beyond that is left allocated and released in the background by the
+	 * page-init thread (or on demand, should we run out before then)
+	 */
+	z->z_init_pages = z->z_num_pages;
+	if (z->z_init_pages > PAGE_ZONE_EAGER_PAGES)
+		z->z_init_pages = PAGE_ZONE_EAGER_PAGES;
+	page_zone_release(z, 0, z->z_init_pages);
+
+	/*
+	 * Add the zone to the list XXX there should be some lock on zones; we keep
+	 * zones that aren't DMA32 in front so that ordinary allocations do not
+	 * eat up the low memory devices need.
+	 */
+	if (flags & (PAGE_ZONE_FLAG_DMA32 | PAGE_ZONE_FLAG_CONTIG))
+		LIST_APPEND(&zones, z);
+	else
+		LIST_PREPEND(&zones, z);
+}
+
+void
+page_zone_add(addr_t base, size_t length)
+{
+	/* Zones never straddle the DMA32 limit */
+	if (base < PAGE_DMA32_LIMIT && base + length > PAGE_DMA32_LIMIT) {
+		size_t low_length = PAGE_DMA32_LIMIT - base;
+		page_zone_add(base, low_length);
+		page_zone_add(PAGE_DMA32_LIMIT, length - low_length);
+		return;
+	}
+
+	if (base >= PAGE_DMA32_LIMIT) {
+		page_zone_add_range(base, length, 0);
+		return;
 	}
 
 	/*
-	 * Now, free all chunks of memory. This is slow, we could do better but for
-	 * now it'll help guarantee that the implementation is correct.
+	 * Carve the contiguous zone from the top of the first sizable chunk of low
+	 * memory; it's only used for constrained allocations so that large device
+	 * buffers remain available even if everything else is fragmented.
 	 */
-	for (int n = 0; n < z->z_num_pages; n++)
-		page_free_index(z, 0, n);
+	static bool contig_reserved = false;
+	if (!contig_reserved && length >= 4 * PAGE_CONTIG_RESERVE) {
+		contig_reserved = true;
+		length -= PAGE_CONTIG_RESERVE;
+		page_zone_add_range(base + length, PAGE_CONTIG_RESERVE, PAGE_ZONE_FLAG_DMA32 | PAGE_ZONE_FLAG_CONTIG);
+	}
+	page_zone_add_range(base, length, PAGE_ZONE_FLAG_DMA32);
+}
+
+static thread_t page_init_thread;
+
+static void
+page_init_deferred(void* context)
+{
+	while (page_release_deferred())
+		/* keep going */ ;
+	thread_exit(0);
+}
+
+static errorcode_t
+start_page_init()
+{
+	/* Only bother with a thread if we deferred anything */
+	bool deferred = false;
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		if (z->z_init_pages < z->z_num_pages)
+			deferred = true;
+	}
+	if (!deferred)
+		return ananas_success();
+
+	kthread_init(&page_init_thread, "page-init", &page_init_deferred, NULL);
+	thread_resume(&page_init_thread);
+	return ananas_success();
+}
+
+INIT_FUNCTION(start_page_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+/*
+ * Pool of pre-zeroed pages; this is kept filled by the page-zero thread, which
+ * runs at background priority so it only gets to do its job if the CPU would
+ * otherwise be idle. The thread is woken up once the pool drops below
+ * PAGE_ZERO_POOL_LOW pages.
+ */
+static spinlock_t page_zero_lock = SPINLOCK_DEFAULT_INIT;
+static struct page_list page_zero_pool;
+static unsigned int page_zero_count;
+static unsigned int page_zero_hits, page_zero_misses;
+static bool page_zero_sleeping = false;
+static semaphore_t page_zero_sem;
+static thread_t page_zero_thread;
+
+static void
+page_zero(struct PAGE* p, int order)
+{
+	size_t len = PAGE_SIZE << order;
+	void* va = kmem_map(page_get_paddr(p), len, VM_FLAG_READ | VM_FLAG_WRITE);
+	memzero_pages(va, len);
+	kmem_unmap(va, len);
+}
+
+static struct PAGE*
+page_zero_pool_get()
+{
+	struct PAGE* p = NULL;
+	spinlock_lock(&page_zero_lock);
+	if (!LIST_EMPTY(&page_zero_pool)) {
+		p = LIST_HEAD(&page_zero_pool);
+		LIST_POP_HEAD(&page_zero_pool);
+		page_zero_count--;
+		page_zero_hits++;
+	} else
+		page_zero_misses++;
+	bool wakeup = page_zero_sleeping && page_zero_count < PAGE_ZERO_POOL_LOW;
+	if (wakeup)
+		page_zero_sleeping = false;
+	spinlock_unlock(&page_zero_lock);
+
+	if (wakeup)
+		sem_signal(&page_zero_sem);
+	return p;
+}
 
-	/* Add the zone to the list XXX there should be some lock on zones */
-	LIST_APPEND(&zones, z);
+/* Returns all pre-zeroed pages to the allocator; returns the amount */
+static unsigned int
+page_zero_pool_drain()
+{
+	struct page_list pages;
+	spinlock_lock(&page_zero_lock);
+	pages = page_zero_pool;
+	LIST_INIT(&page_zero_pool);
+	unsigned int count = page_zero_count;
+	page_zero_count = 0;
+	spinlock_unlock(&page_zero_lock);
+
+	while (!LIST_EMPTY(&pages)) {
+		struct PAGE* p = LIST_HEAD(&pages);
+		LIST_POP_HEAD(&pages);
+		page_free(p);
+	}
+	return count;
 }
 
+static void
+page_zero_fill(void* context)
+{
+	while(1) {
+		/* Don't hoard pages if memory is becoming scarce */
+		unsigned int total_pages, avail_pages;
+		page_get_stats(&total_pages, &avail_pages);
+
+		spinlock_lock(&page_zero_lock);
+		if (page_zero_count >= PAGE_ZERO_POOL_TARGET || avail_pages < page_zero_count + PAGE_ZERO_POOL_MIN_AVAIL) {
+			page_zero_sleeping = true;
+			spinlock_unlock(&page_zero_lock);
+			sem_wait(&page_zero_sem);
+			continue;
+		}
+		spinlock_unlock(&page_zero_lock);
+
+		struct PAGE* p = page_alloc_order_flags(0, PAGE_ALLOC_TRY);
+		if (p == NULL) {
+			/* Memory ran out after all; wait until the pool is used up again */
+			spinlock_lock(&page_zero_lock);
+			page_zero_sleeping = true;
+			spinlock_unlock(&page_zero_lock);
+			sem_wait(&page_zero_sem);
+			continue;
+		}
+		page_zero(p, 0);
+
+		spinlock_lock(&page_zero_lock);
+		LIST_APPEND(&page_zero_pool, p);
+		page_zero_count++;
+		spinlock_unlock(&page_zero_lock);
+	}
+}
+
+static errorcode_t
+start_page_zero()
+{
+	sem_init(&page_zero_sem, 0);
+	kthread_init(&page_zero_thread, "page-zero", &page_zero_fill, NULL);
+	page_zero_thread.t_priority = THREAD_PRIORITY_BACKGROUND;
+	thread_resume(&page_zero_thread);
+	return ananas_success();
+}
+
+INIT_FUNCTION(start_page_zero, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
 addr_t
 page_get_paddr(struct PAGE* p)
 {
@@ -227,6 +682,22 @@ page_get_paddr(struct PAGE* p)
 	return z->z_phys_addr + index * PAGE_SIZE;
 }
 
+/* Allocates from the first general-purpose zone that can satisfy the request */
+static struct PAGE*
+page_alloc_zones(int order)
+{
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		if (z->z_flags & PAGE_ZONE_FLAG_CONTIG)
+			continue;
+		struct PAGE* page = page_alloc_zone(z, order);
+		if (page != NULL) {
+			pageout_wakeup();
+			return page;
+		}
+	}
+	return NULL;
+}
+
 struct PAGE*
 page_alloc_order(int order)
 {
@@ -235,13 +706,64 @@ page_alloc_order(int order)
 	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
 	KASSERT(!LIST_EMPTY(&zones), "no zones");
 
-	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
-		struct PAGE* page = page_alloc_zone(z, order);
+	if (order == 0) {
+		struct PAGE* page = page_alloc_magazine();
+		if (page != NULL)
+			return page;
+	}
+
+	/*
+	 * Try the zones; if this fails, pages may still be hiding in the per-CPU
+	 * magazines (or keep higher-order blocks from merging) or may not have
+	 * been released by the page-init thread yet - so take care of those and
+	 * retry. As a last resort, evict cached file pages ourselves; these are
+	 * freed to the magazines, which is why we drain them again afterwards.
+	 * Should even that fail, we can wait for pageout to swap something out.
+	 */
+	while(1) {
+		struct PAGE* page = page_alloc_zones(order);
 		if (page != NULL)
 			return page;
+		if (!page_release_deferred() && page_drain_magazines() == 0 && page_zero_pool_drain() == 0 &&
+		    pageout_reclaim(PAGEOUT_BATCH) == 0 && !pageout_wait())
+			break;
 	}
 
-	panic("page_alloc(): failed for order %d", order);
+	DPRINTF("page_alloc(): failed for order %d\n", order);
+	return NULL;
+}
+
+struct PAGE*
+page_alloc_order_flags(int order, int flags)
+{
+	if ((flags & PAGE_ALLOC_ZERO) && order == 0) {
+		struct PAGE* p = page_zero_pool_get();
+		if (p != NULL)
+			return p;
+	}
+
+	/*
+	 * Opportunistic callers have a fallback, so we needn't go through the
+	 * trouble of freeing up memory for them.
+	 */
+	struct PAGE* p;
+	if (flags & PAGE_ALLOC_TRY) {
+		KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
+		p = (order == 0) ? page_alloc_magazine() : NULL;
+		if (p == NULL)
+			p = page_alloc_zones(order);
+		if (p == NULL)
+			return NULL;
+	} else {
+		p = page_alloc_order(order);
+		if (p == NULL)
+			return NULL;
+	}
+
+	/* Nothing pre-zeroed available; we'll have to do it ourselves */
+	if (flags & PAGE_ALLOC_ZERO)
+		page_zero(p, order);
+	return p;
 }
 
 void*
@@ -250,7 +772,72 @@ page_alloc_order_mapped(int order, struct PAGE** p, int vm_flags)
 	*p = page_alloc_order(order);
 	if (*p == NULL)
 		return NULL;
-	return kmem_map(page_get_paddr(*p), PAGE_SIZE << order, vm_flags);
+	void* va = kmem_map(page_get_paddr(*p), PAGE_SIZE << order, vm_flags);
+	if (va == NULL) {
+		page_free(*p);
+		*p = NULL;
+	}
+	return va;
+}
+
+static bool
+page_zone_fits(struct PAGE_ZONE* z, addr_t min_addr, addr_t max_addr, size_t alignment)
+{
+	addr_t zone_end = z->z_phys_addr + (addr_t)z->z_num_pages * PAGE_SIZE - 1;
+	if (z->z_phys_addr < min_addr || zone_end > max_addr)
+		return false;
+	return (z->z_phys_addr & (alignment - 1)) == 0;
+}
+
+struct PAGE*
+page_alloc_order_constrained(int order, addr_t min_addr, addr_t max_addr, size_t alignment)
+{
+	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
+	if (alignment < PAGE_SIZE)
+		alignment = PAGE_SIZE;
+	KASSERT((alignment & (alignment - 1)) == 0, "alignment %p not a power of two", alignment);
+
+	/* Blocks are aligned to their size, so grow the request to satisfy the alignment */
+	while ((PAGE_SIZE << order) < alignment && order < PAGE_NUM_ORDERS - 1)
+		order++;
+	if ((PAGE_SIZE << order) < alignment)
+		return NULL;
+
+	/*
+	 * Large requests try the contiguous zone first so they don't fragment the
+	 * other zones; small requests only use it as a last resort.
+	 */
+	for (int pass = 0; pass < 2; pass++) {
+		bool want_contig = (pass == 0) == (order >= PAGE_CONTIG_MIN_ORDER);
+		LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+			if (((z->z_flags & PAGE_ZONE_FLAG_CONTIG) != 0) != want_contig)
+				continue;
+			if (!page_zone_fits(z, min_addr, max_addr, alignment))
+				continue;
+
+			struct PAGE* page;
+			do {
+				page = page_alloc_zone(z, order);
+			} while (page == NULL && page_zone_release_deferred(z));
+			if (page != NULL)
+				return page;
+		}
+	}
+	return NULL;
+}
+
+void*
+page_alloc_length_constrained_mapped(size_t length, addr_t min_addr, addr_t max_addr, size_t alignment, struct PAGE** p, int vm_flags)
+{
+	*p = page_alloc_order_constrained(bytes2order(length), min_addr, max_addr, alignment);
+	if (*p == NULL)
+		return NULL;
+	void* va = kmem_map(page_get_paddr(*p), PAGE_SIZE << (*p)->p_order, vm_flags);
+	if (va == NULL) {
+		page_free(*p);
+		*p = NULL;
+	}
+	return va;
 }
 
 struct PAGE*
@@ -275,17 +862,52 @@ page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		spinlock_lock(&z->z_lock);
 		*total_pages += z->z_num_pages;
-		*avail_pages += z->z_avail_pages;
+		*avail_pages += z->z_avail_pages + (z->z_num_pages - z->z_init_pages);
 		spinlock_unlock(&z->z_lock);
 	}
+
+	/* Pages in the magazines are free as well */
+	unsigned int cached_pages, hits, misses;
+	page_get_magazine_stats(&cached_pages, &hits, &misses);
+	*avail_pages += cached_pages;
+
+	/* And so are the pre-zeroed pages; these can be reclaimed */
+	*avail_pages += page_zero_count;
+}
+
+void
+page_get_zero_stats(unsigned int* zeroed_pages, unsigned int* hits, unsigned int* misses)
+{
+	spinlock_lock(&page_zero_lock);
+	*zeroed_pages = page_zero_count;
+	*hits = page_zero_hits;
+	*misses = page_zero_misses;
+	spinlock_unlock(&page_zero_lock);
+}
+
+void
+page_get_magazine_stats(unsigned int* cached_pages, unsigned int* hits, unsigned int* misses)
+{
+	*cached_pages = 0; *hits = 0; *misses = 0;
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct PAGE_MAGAZINE* pm = &page_magazine[cpu];
+		spinlock_lock(&pm->pm_lock);
+		*cached_pages += pm->pm_count;
+		*hits += pm->pm_hits;
+		*misses += pm->pm_misses;
+		spinlock_unlock(&pm->pm_lock);
+	}
 }
 
 #ifdef OPTION_KDB
 static void
 page_dump(struct PAGE_ZONE* z)
 {
-	kprintf("page_dump: zone=%p total=%u avail=%u (%u KB of %u KB in use)\n",
-	 z, z->z_num_pages, z->z_avail_pages,
+	kprintf("page_dump: zone=%p phys=%p%s%s total=%u avail=%u deferred=%u (%u KB of %u KB in use)\n",
+	 z, z->z_phys_addr,
+	 (z->z_flags & PAGE_ZONE_FLAG_DMA32) ? " dma32" : "",
+	 (z->z_flags & PAGE_ZONE_FLAG_CONTIG) ? " contig" : "",
+	 z->z_num_pages, z->z_avail_pages, z->z_num_pages - z->z_init_pages,
 	 (z->z_num_pages - z->z_avail_pages) * (PAGE_SIZE / 1024),
 	 z->z_num_pages * (PAGE_SIZE / 1024));
 	for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
@@ -311,6 +933,15 @@ KDB_COMMAND(pages, NULL, "Display page zones")
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		page_dump(z);
 	}
+
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct PAGE_MAGAZINE* pm = &page_magazine[cpu];
+		if (pm->pm_hits == 0 && pm->pm_misses == 0 && pm->pm_count == 0)
+			continue;
+		kprintf("magazine cpu%u: %u pages cached, %u hits, %u misses, %u refills, %u drains\n",
+		 cpu, pm->pm_count, pm->pm_hits, pm->pm_misses, pm->pm_refills, pm->pm_drains);
+	}
+	kprintf("zero pool: %u pages, %u hits, %u misses\n", page_zero_count, page_zero_hits, page_zero_misses);
 }
 #endif
 
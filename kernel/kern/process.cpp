@@ -72,12 +72,16 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 
 	// Now hook the process info structure up to it
 	{
-		// XXX we should have a separate vmpage_create_...() for this that sets vp_vaddr
-		struct VM_PAGE* vp = vmpage_create_private(va, 0);
-		vp->vp_vaddr = va->va_virt;
+		struct VM_PAGE* vp = vmpage_create_private(va, va->va_virt, 0);
+		if (vp == NULL) {
+			err = ANANAS_ERROR(OUT_OF_MEMORY);
+			goto fail;
+		}
 		p->p_info = static_cast<struct PROCINFO*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), sizeof(struct PROCINFO), VM_FLAG_READ | VM_FLAG_WRITE));
-		vmpage_map(p->p_vmspace, va, vp);
+		err = vmpage_map(p->p_vmspace, va, vp);
 		vmpage_unlock(vp);
+		if (ananas_is_failure(err))
+			goto fail;
 	}
 
 	/* Initialize process information structure */
@@ -225,8 +229,10 @@ process_wait_and_lock(process_t* parent, int flags, process_t** p_out)
 		LIST_FOREACH_IP(&parent->p_children, children, child, struct PROCESS) {
 			process_lock(child);
 			if (child->p_state == PROCESS_STATE_ZOMBIE) {
-				/* Found one; remove it from the parent's list */
+				/* Found one; remove it from the parent's list and account for it */
 				LIST_REMOVE_IP(&parent->p_children, children, child);
+				vmspace_add_stats(&parent->p_child_stats, &child->p_vmspace->vs_stats);
+				vmspace_add_stats(&parent->p_child_stats, &child->p_child_stats);
 				process_unlock(parent);
 
 				/* Note that we give our ref to the caller! */
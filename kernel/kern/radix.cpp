@@ -0,0 +1,183 @@
+/*
+ * Radix tree; see kernel/radix.h for an overview.
+ *
+ * Nodes come from a slab cache; as nodes are only freed once all their slots
+ * are empty, they are always handed back in their constructed all-zero state.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include "kernel/init.h"
+#include "kernel/lib.h"
+#include "kernel/radix.h"
+#include "kernel/slab.h"
+
+namespace {
+
+struct SLAB_CACHE radix_node_cache;
+
+void
+radix_node_ctor(void* obj)
+{
+	memset(obj, 0, sizeof(struct RADIX_NODE));
+}
+
+struct RADIX_NODE*
+radix_node_alloc()
+{
+	auto node = static_cast<struct RADIX_NODE*>(slab_alloc(&radix_node_cache));
+	KASSERT(node != nullptr, "out of radix nodes");
+	return node;
+}
+
+/* Returns the largest index a tree of the given height can hold */
+inline unsigned long
+radix_max_index(unsigned int height)
+{
+	if (height * RADIX_NODE_SHIFT >= sizeof(unsigned long) * 8)
+		return ~0UL;
+	return (1UL << (height * RADIX_NODE_SHIFT)) - 1;
+}
+
+/* Slot of index in a node at the given level; leaves are level 1 */
+inline unsigned int
+radix_slot(unsigned long index, unsigned int level)
+{
+	return (index >> ((level - 1) * RADIX_NODE_SHIFT)) & (RADIX_NODE_SLOTS - 1);
+}
+
+/* Locates the first item >= index in the subtree of node, which starts at base */
+void*
+radix_next_in(struct RADIX_NODE* node, unsigned int level, unsigned long base, unsigned long index, unsigned long* found_index)
+{
+	unsigned int shift = (level - 1) * RADIX_NODE_SHIFT;
+	unsigned int slot = index > base ? (index - base) >> shift : 0;
+	for (/* nothing */; slot < RADIX_NODE_SLOTS; slot++) {
+		void* child = node->rn_slot[slot];
+		if (child == nullptr)
+			continue;
+
+		unsigned long child_base = base + ((unsigned long)slot << shift);
+		if (level == 1) {
+			*found_index = child_base;
+			return child;
+		}
+		void* item = radix_next_in(static_cast<struct RADIX_NODE*>(child), level - 1, child_base, index, found_index);
+		if (item != nullptr)
+			return item;
+	}
+	return nullptr;
+}
+
+errorcode_t
+radix_init()
+{
+	slab_cache_init(&radix_node_cache, "radix", sizeof(struct RADIX_NODE), radix_node_ctor, NULL);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+INIT_FUNCTION(radix_init, SUBSYSTEM_PROCESS, ORDER_FIRST);
+
+void
+radix_tree_init(struct RADIX_TREE* tree)
+{
+	tree->rt_root = nullptr;
+	tree->rt_height = 0;
+}
+
+void*
+radix_lookup(struct RADIX_TREE* tree, unsigned long index)
+{
+	if (tree->rt_height == 0 || index > radix_max_index(tree->rt_height))
+		return nullptr;
+
+	struct RADIX_NODE* node = tree->rt_root;
+	for (unsigned int level = tree->rt_height; level > 1; level--) {
+		node = static_cast<struct RADIX_NODE*>(node->rn_slot[radix_slot(index, level)]);
+		if (node == nullptr)
+			return nullptr;
+	}
+	return node->rn_slot[radix_slot(index, 1)];
+}
+
+void
+radix_insert(struct RADIX_TREE* tree, unsigned long index, void* item)
+{
+	KASSERT(item != nullptr, "inserting NULL item");
+	if (tree->rt_height == 0) {
+		tree->rt_root = radix_node_alloc();
+		tree->rt_height = 1;
+	}
+
+	// Grow the tree until index fits; the current root becomes the first child
+	while (index > radix_max_index(tree->rt_height)) {
+		struct RADIX_NODE* node = radix_node_alloc();
+		node->rn_slot[0] = tree->rt_root;
+		node->rn_count = 1;
+		tree->rt_root = node;
+		tree->rt_height++;
+	}
+
+	struct RADIX_NODE* node = tree->rt_root;
+	for (unsigned int level = tree->rt_height; level > 1; level--) {
+		void** slot = &node->rn_slot[radix_slot(index, level)];
+		if (*slot == nullptr) {
+			*slot = radix_node_alloc();
+			node->rn_count++;
+		}
+		node = static_cast<struct RADIX_NODE*>(*slot);
+	}
+
+	void** slot = &node->rn_slot[radix_slot(index, 1)];
+	KASSERT(*slot == nullptr, "index %lu already in use", index);
+	*slot = item;
+	node->rn_count++;
+}
+
+void*
+radix_remove(struct RADIX_TREE* tree, unsigned long index)
+{
+	if (tree->rt_height == 0 || index > radix_max_index(tree->rt_height))
+		return nullptr;
+
+	// Record the path so that we can free nodes that become empty
+	struct RADIX_NODE* path[RADIX_MAX_HEIGHT + 1];
+	struct RADIX_NODE* node = tree->rt_root;
+	for (unsigned int level = tree->rt_height; level > 1; level--) {
+		path[level] = node;
+		node = static_cast<struct RADIX_NODE*>(node->rn_slot[radix_slot(index, level)]);
+		if (node == nullptr)
+			return nullptr;
+	}
+	path[1] = node;
+
+	void* item = node->rn_slot[radix_slot(index, 1)];
+	if (item == nullptr)
+		return nullptr;
+
+	for (unsigned int level = 1; level <= tree->rt_height; level++) {
+		node = path[level];
+		node->rn_slot[radix_slot(index, level)] = nullptr;
+		if (--node->rn_count > 0)
+			break;
+
+		slab_free(&radix_node_cache, node);
+		if (level == tree->rt_height) {
+			tree->rt_root = nullptr;
+			tree->rt_height = 0;
+			break;
+		}
+	}
+	return item;
+}
+
+void*
+radix_next(struct RADIX_TREE* tree, unsigned long index, unsigned long* found_index)
+{
+	if (tree->rt_height == 0 || index > radix_max_index(tree->rt_height))
+		return nullptr;
+	return radix_next_in(tree->rt_root, tree->rt_height, 0, index, found_index);
+}
+
+/* vim:set ts=2 sw=2: */
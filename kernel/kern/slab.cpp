@@ -0,0 +1,351 @@
+/*
+ * Slab object caches.
+ *
+ * Every object slot is prefixed by a hidden pointer: while the object is in
+ * use, it points to the slab the object belongs to (this allows us to find the
+ * slab in O(1) on free). While the object is free, it links to the next free
+ * slot in the slab - the object itself is never touched so that it remains in
+ * constructed state.
+ *
+ * Objects are SLAB_ALIGN-aligned: slots are a multiple of SLAB_ALIGN bytes and
+ * the hidden pointer is placed right in front of the object, at the end of the
+ * first SLAB_ALIGN bytes of the slot.
+ */
+#include <ananas/types.h>
+#include "kernel/kdb.h"
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/page.h"
+#include "kernel/pcpu.h"
+#include "kernel/slab.h"
+#include "kernel/vm.h"
+#include "options.h"
+
+#define SLAB_MAX_ORDER 3
+#define SLAB_HEADER_SIZE ROUND_UP(sizeof(struct SLAB), SLAB_ALIGN)
+
+static spinlock_t spl_slab_caches = SPINLOCK_DEFAULT_INIT;
+static struct SLAB_CACHE_LIST slab_caches;
+
+void
+slab_cache_init(struct SLAB_CACHE* cache, const char* name, size_t obj_size, slab_ctor_t ctor, slab_reclaim_t reclaim)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->sc_name = name;
+	cache->sc_obj_size = obj_size;
+	cache->sc_slot_size = SLAB_ALIGN + ROUND_UP(obj_size, SLAB_ALIGN);
+	cache->sc_ctor = ctor;
+	cache->sc_reclaim = reclaim;
+
+	/* Use the smallest slab that fits enough objects */
+	unsigned int order = 0;
+	while (order < SLAB_MAX_ORDER && ((PAGE_SIZE << order) - SLAB_HEADER_SIZE) / cache->sc_slot_size < SLAB_MIN_OBJECTS)
+		order++;
+	cache->sc_slab_order = order;
+	cache->sc_objs_per_slab = ((PAGE_SIZE << order) - SLAB_HEADER_SIZE) / cache->sc_slot_size;
+	KASSERT(cache->sc_objs_per_slab > 0, "cache '%s': object size %u too large", name, obj_size);
+
+	spinlock_init(&cache->sc_lock);
+	LIST_INIT(&cache->sc_partial);
+	LIST_INIT(&cache->sc_full);
+	LIST_INIT(&cache->sc_empty);
+	for (unsigned int n = 0; n < MAX_CPUS; n++)
+		spinlock_init(&cache->sc_cpu[n].cc_lock);
+
+	spinlock_lock(&spl_slab_caches);
+	LIST_APPEND(&slab_caches, cache);
+	spinlock_unlock(&spl_slab_caches);
+}
+
+/* Creates a new slab and constructs all objects in it; called without locks held */
+static struct SLAB*
+slab_create(struct SLAB_CACHE* cache)
+{
+	struct PAGE* page;
+	char* mem = static_cast<char*>(page_alloc_order_mapped(cache->sc_slab_order, &page, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (mem == NULL)
+		return NULL;
+
+	auto slab = reinterpret_cast<struct SLAB*>(mem);
+	slab->s_cache = cache;
+	slab->s_page = page;
+	slab->s_inuse = 0;
+	slab->s_free = NULL;
+
+	/* Chain the slots together backwards, so that the first slot is handed out first */
+	char* slots = mem + SLAB_HEADER_SIZE;
+	for (int n = cache->sc_objs_per_slab - 1; n >= 0; n--) {
+		auto slot = reinterpret_cast<void**>(slots + n * cache->sc_slot_size + SLAB_ALIGN - sizeof(void*));
+		*slot = slab->s_free;
+		slab->s_free = slot;
+		if (cache->sc_ctor != NULL)
+			cache->sc_ctor(slot + 1);
+	}
+	return slab;
+}
+
+static void
+slab_destroy_list(struct SLAB_CACHE* cache, struct SLAB_LIST* list)
+{
+	while (!LIST_EMPTY(list)) {
+		struct SLAB* slab = LIST_HEAD(list);
+		LIST_POP_HEAD(list);
+
+		struct PAGE* page = slab->s_page;
+		kmem_unmap(slab, PAGE_SIZE << cache->sc_slab_order);
+		page_free(page);
+	}
+}
+
+/* Takes up to count objects from the slabs; returns the number obtained */
+static unsigned int
+slab_take_locked(struct SLAB_CACHE* cache, void** objs, unsigned int count)
+{
+	unsigned int n = 0;
+	while (n < count) {
+		struct SLAB* slab;
+		if (!LIST_EMPTY(&cache->sc_partial)) {
+			slab = LIST_HEAD(&cache->sc_partial);
+		} else if (!LIST_EMPTY(&cache->sc_empty)) {
+			slab = LIST_HEAD(&cache->sc_empty);
+			LIST_POP_HEAD(&cache->sc_empty);
+			cache->sc_num_empty--;
+			LIST_APPEND(&cache->sc_partial, slab);
+		} else
+			break;
+
+		while (n < count && slab->s_free != NULL) {
+			void** slot = slab->s_free;
+			slab->s_free = static_cast<void**>(*slot);
+			*slot = slab;
+			slab->s_inuse++;
+			objs[n++] = slot + 1;
+		}
+
+		if (slab->s_free == NULL) {
+			LIST_REMOVE(&cache->sc_partial, slab);
+			LIST_APPEND(&cache->sc_full, slab);
+		}
+	}
+	return n;
+}
+
+/* Hands count objects back to their slabs */
+static void
+slab_put_locked(struct SLAB_CACHE* cache, void** objs, unsigned int count)
+{
+	for (unsigned int n = 0; n < count; n++) {
+		auto slot = static_cast<void**>(objs[n]) - 1;
+		auto slab = static_cast<struct SLAB*>(*slot);
+		KASSERT(slab->s_cache == cache, "object %p does not belong to cache '%s'", objs[n], cache->sc_name);
+		KASSERT(slab->s_inuse > 0, "object %p freed to empty slab", objs[n]);
+
+		if (slab->s_free == NULL) {
+			LIST_REMOVE(&cache->sc_full, slab);
+			LIST_APPEND(&cache->sc_partial, slab);
+		}
+		*slot = slab->s_free;
+		slab->s_free = slot;
+
+		if (--slab->s_inuse == 0) {
+			LIST_REMOVE(&cache->sc_partial, slab);
+			LIST_PREPEND(&cache->sc_empty, slab);
+			cache->sc_num_empty++;
+		}
+	}
+}
+
+/* Moves all but 'keep' empty slabs to 'list' so they can be freed once unlocked */
+static void
+slab_trim_locked(struct SLAB_CACHE* cache, unsigned int keep, struct SLAB_LIST* list)
+{
+	while (cache->sc_num_empty > keep) {
+		struct SLAB* slab = LIST_TAIL(&cache->sc_empty);
+		LIST_POP_TAIL(&cache->sc_empty);
+		cache->sc_num_empty--;
+		cache->sc_num_slabs--;
+		LIST_APPEND(list, slab);
+	}
+}
+
+static inline struct SLAB_CPU_CACHE*
+slab_get_cpu_cache(struct SLAB_CACHE* cache)
+{
+	unsigned int cpuid = PCPU_GET(cpuid);
+	KASSERT(cpuid < MAX_CPUS, "cpu %u out of range", cpuid);
+	return &cache->sc_cpu[cpuid];
+}
+
+void*
+slab_alloc(struct SLAB_CACHE* cache, int flags)
+{
+	struct SLAB_CPU_CACHE* cc = slab_get_cpu_cache(cache);
+	register_t state = spinlock_lock_unpremptible(&cc->cc_lock);
+	cc->cc_allocs++;
+	while (cc->cc_count == 0) {
+		/* Our front is empty; refill it from the slabs */
+		cc->cc_misses++;
+		register_t cstate = spinlock_lock_unpremptible(&cache->sc_lock);
+		cc->cc_count = slab_take_locked(cache, cc->cc_obj, SLAB_CPU_CACHE_BATCH);
+		spinlock_unlock_unpremptible(&cache->sc_lock, cstate);
+		if (cc->cc_count > 0)
+			break;
+
+		/*
+		 * We need to grow the cache; this can only be done if we were called with
+		 * interrupts enabled as the page allocator cannot be used otherwise.
+		 */
+		cc->cc_allocs--;
+		spinlock_unlock_unpremptible(&cc->cc_lock, state);
+		struct SLAB* slab = NULL;
+		if ((flags & SLAB_ALLOC_NOWAIT) == 0 && state)
+			slab = slab_create(cache);
+
+		cstate = spinlock_lock_unpremptible(&cache->sc_lock);
+		if (slab == NULL) {
+			cache->sc_failures++;
+			spinlock_unlock_unpremptible(&cache->sc_lock, cstate);
+			return NULL;
+		}
+		LIST_APPEND(&cache->sc_empty, slab);
+		cache->sc_num_empty++;
+		cache->sc_num_slabs++;
+		spinlock_unlock_unpremptible(&cache->sc_lock, cstate);
+
+		/* Note that we may be on a different CPU by now */
+		cc = slab_get_cpu_cache(cache);
+		state = spinlock_lock_unpremptible(&cc->cc_lock);
+		cc->cc_allocs++;
+	}
+
+	void* obj = cc->cc_obj[--cc->cc_count];
+	spinlock_unlock_unpremptible(&cc->cc_lock, state);
+	return obj;
+}
+
+void
+slab_free(struct SLAB_CACHE* cache, void* obj)
+{
+	struct SLAB_LIST released;
+	LIST_INIT(&released);
+
+	struct SLAB_CPU_CACHE* cc = slab_get_cpu_cache(cache);
+	register_t state = spinlock_lock_unpremptible(&cc->cc_lock);
+	cc->cc_frees++;
+	if (cc->cc_count == SLAB_CPU_CACHE_SIZE) {
+		/* Our front is full; hand the oldest half back to the slabs */
+		register_t cstate = spinlock_lock_unpremptible(&cache->sc_lock);
+		slab_put_locked(cache, cc->cc_obj, SLAB_CPU_CACHE_BATCH);
+		if (state)
+			slab_trim_locked(cache, SLAB_MAX_EMPTY, &released);
+		spinlock_unlock_unpremptible(&cache->sc_lock, cstate);
+
+		for (unsigned int n = SLAB_CPU_CACHE_BATCH; n < SLAB_CPU_CACHE_SIZE; n++)
+			cc->cc_obj[n - SLAB_CPU_CACHE_BATCH] = cc->cc_obj[n];
+		cc->cc_count -= SLAB_CPU_CACHE_BATCH;
+	}
+	cc->cc_obj[cc->cc_count++] = obj;
+	spinlock_unlock_unpremptible(&cc->cc_lock, state);
+
+	slab_destroy_list(cache, &released);
+}
+
+static unsigned int
+slab_cache_reclaim(struct SLAB_CACHE* cache)
+{
+	/* Let the owner give back whatever it is caching */
+	if (cache->sc_reclaim != NULL)
+		cache->sc_reclaim(cache);
+
+	struct SLAB_LIST released;
+	LIST_INIT(&released);
+	for (unsigned int n = 0; n < MAX_CPUS; n++) {
+		struct SLAB_CPU_CACHE* cc = &cache->sc_cpu[n];
+		register_t state = spinlock_lock_unpremptible(&cc->cc_lock);
+		register_t cstate = spinlock_lock_unpremptible(&cache->sc_lock);
+		slab_put_locked(cache, cc->cc_obj, cc->cc_count);
+		cc->cc_count = 0;
+		spinlock_unlock_unpremptible(&cache->sc_lock, cstate);
+		spinlock_unlock_unpremptible(&cc->cc_lock, state);
+	}
+
+	register_t state = spinlock_lock_unpremptible(&cache->sc_lock);
+	slab_trim_locked(cache, 0, &released);
+	spinlock_unlock_unpremptible(&cache->sc_lock, state);
+
+	unsigned int num_pages = 0;
+	LIST_FOREACH(&released, slab, struct SLAB) {
+		num_pages += 1 << cache->sc_slab_order;
+	}
+	slab_destroy_list(cache, &released);
+	return num_pages;
+}
+
+unsigned int
+slab_reclaim()
+{
+	/*
+	 * Caches are never removed, so we only need the lock to walk the list; we
+	 * can't hold it while reclaiming as the hooks may need to sleep.
+	 */
+	unsigned int num_pages = 0;
+	spinlock_lock(&spl_slab_caches);
+	struct SLAB_CACHE* cache = LIST_HEAD(&slab_caches);
+	spinlock_unlock(&spl_slab_caches);
+	while (cache != NULL) {
+		num_pages += slab_cache_reclaim(cache);
+
+		spinlock_lock(&spl_slab_caches);
+		cache = LIST_NEXT(cache);
+		spinlock_unlock(&spl_slab_caches);
+	}
+	return num_pages;
+}
+
+static void
+slab_cache_get_counters(struct SLAB_CACHE* cache, unsigned int* inuse, unsigned int* allocs, unsigned int* misses)
+{
+	*inuse = 0; *allocs = 0; *misses = 0;
+	unsigned int frees = 0;
+	for (unsigned int n = 0; n < MAX_CPUS; n++) {
+		struct SLAB_CPU_CACHE* cc = &cache->sc_cpu[n];
+		*allocs += cc->cc_allocs;
+		*misses += cc->cc_misses;
+		frees += cc->cc_frees;
+	}
+	*inuse = *allocs - frees;
+}
+
+void
+slab_get_stats(char* buf, size_t len)
+{
+	char* r = buf;
+	*r = '\0';
+	spinlock_lock(&spl_slab_caches);
+	LIST_FOREACH(&slab_caches, cache, struct SLAB_CACHE) {
+		unsigned int inuse, allocs, misses;
+		slab_cache_get_counters(cache, &inuse, &allocs, &misses);
+		snprintf(r, len - (r - buf), "%s %u %u %u %u %u %u\n",
+		 cache->sc_name, (unsigned int)cache->sc_obj_size, inuse,
+		 cache->sc_num_slabs * cache->sc_objs_per_slab, allocs, misses, cache->sc_failures);
+		r += strlen(r);
+	}
+	spinlock_unlock(&spl_slab_caches);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(slabs, NULL, "Display slab caches")
+{
+	kprintf("name             size   inuse   total  slabs     allocs  misses  fail\n");
+	LIST_FOREACH(&slab_caches, cache, struct SLAB_CACHE) {
+		unsigned int inuse, allocs, misses;
+		slab_cache_get_counters(cache, &inuse, &allocs, &misses);
+		kprintf("%-16s %4u %7u %7u %6u %10u %7u %5u\n",
+		 cache->sc_name, (unsigned int)cache->sc_obj_size, inuse,
+		 cache->sc_num_slabs * cache->sc_objs_per_slab, cache->sc_num_slabs,
+		 allocs, misses, cache->sc_failures);
+	}
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
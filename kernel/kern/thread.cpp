@@ -19,6 +19,7 @@
 #include <ananas/error.h>
 #include <ananas/procinfo.h>
 #include "kernel/device.h"
+#include "kernel/init.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
 #include "kernel/mm.h"
@@ -26,6 +27,7 @@
 #include "kernel/process.h"
 #include "kernel/reaper.h"
 #include "kernel/schedule.h"
+#include "kernel/slab.h"
 #include "kernel/time.h"
 #include "kernel/trace.h"
 #include "kernel/thread.h"
@@ -36,12 +38,15 @@ TRACE_SETUP;
 
 static spinlock_t spl_threadqueue = SPINLOCK_DEFAULT_INIT;
 static struct THREAD_QUEUE thread_queue;
+static struct SLAB_CACHE thread_cache;
 
 errorcode_t
 thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 {
 	/* First off, allocate the thread itself */
-	auto t = new THREAD;
+	auto t = static_cast<thread_t*>(slab_alloc(&thread_cache));
+	if (t == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	memset(t, 0, sizeof(struct THREAD));
 	process_ref(p);
 	t->t_process = p;
@@ -54,7 +59,12 @@ thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 	t->t_affinity = THREAD_AFFINITY_ANY;
 
 	/* Ask machine-dependant bits to initialize our thread data */
-	md_thread_init(t, flags);
+	errorcode_t err = md_thread_init(t, flags);
+	if (ananas_is_failure(err)) {
+		process_deref(p);
+		slab_free(&thread_cache, t);
+		return err;
+	}
 	md_thread_set_argument(t, p->p_info_va);
 
 	/* If we don't yet have a main thread, this thread will become the main */
@@ -88,7 +98,8 @@ kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg)
 	thread_set_name(t, name);
 
 	/* Initialize MD-specifics */
-	md_kthread_init(t, func, arg);
+	errorcode_t err = md_kthread_init(t, func, arg);
+	ANANAS_ERROR_RETURN(err);
 
 	/* Initialize scheduler-specific parts */
 	scheduler_init_thread(t);
@@ -146,7 +157,7 @@ thread_destroy(thread_t* t)
 	}
 
 	if (t->t_flags & THREAD_FLAG_MALLOC)
-		kfree(t);
+		slab_free(&thread_cache, t);
 	else
 		memset(t, 0, sizeof(*t));
 }
@@ -339,4 +350,15 @@ idle_thread(void*)
 	}
 }
 
+static errorcode_t
+thread_init()
+{
+	// The FPU context is saved in-place, which needs it to be 16-byte aligned
+	static_assert(alignof(struct THREAD) <= SLAB_ALIGN, "threads are over-aligned for the slab allocator");
+	slab_cache_init(&thread_cache, "thread", sizeof(struct THREAD), NULL, NULL);
+	return ananas_success();
+}
+
+INIT_FUNCTION(thread_init, SUBSYSTEM_THREAD, ORDER_FIRST);
+
 /* vim:set ts=2 sw=2: */
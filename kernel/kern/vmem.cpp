@@ -0,0 +1,341 @@
+/*
+ * Resource arena allocator; see kernel/vmem.h for an overview.
+ *
+ * Boundary tags are carved from pages which are taken from the page allocator
+ * and never returned; an operation needs at most two new tags, which are
+ * ensured to be available when the arena lock is taken.
+ */
+#include <ananas/types.h>
+#include "kernel/lib.h"
+#include "kernel/page.h"
+#include "kernel/pcpu.h"
+#include "kernel/vm.h"
+#include "kernel/vmem.h"
+
+/* Returns the index of the highest bit set in n, which must be non-zero */
+static inline unsigned int
+vmem_highbit(size_t n)
+{
+	return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(n);
+}
+
+static inline struct VMEM_TAG_LIST*
+vmem_hash_bucket(struct VMEM* vm, addr_t addr)
+{
+	return &vm->vm_hash[(addr / vm->vm_quantum) % VMEM_HASH_SIZE];
+}
+
+static inline struct VMEM_TAG_LIST*
+vmem_freelist(struct VMEM* vm, size_t size)
+{
+	return &vm->vm_freelist[vmem_highbit(size / vm->vm_quantum)];
+}
+
+void
+vmem_init(struct VMEM* vm, const char* name, size_t quantum, unsigned int qcache_max)
+{
+	KASSERT((quantum & (quantum - 1)) == 0, "quantum %u not a power of two", quantum);
+	KASSERT(qcache_max <= VMEM_QCACHE_MAX, "qcache_max %u too large", qcache_max);
+
+	memset(vm, 0, sizeof(*vm));
+	vm->vm_name = name;
+	vm->vm_quantum = quantum;
+	vm->vm_qcache_max = qcache_max;
+	spinlock_init(&vm->vm_lock);
+	LIST_INIT(&vm->vm_segs);
+	for (unsigned int n = 0; n < VMEM_NUM_FREELISTS; n++)
+		LIST_INIT(&vm->vm_freelist[n]);
+	for (unsigned int n = 0; n < VMEM_HASH_SIZE; n++)
+		LIST_INIT(&vm->vm_hash[n]);
+	LIST_INIT(&vm->vm_tags);
+	for (unsigned int n = 0; n < MAX_CPUS; n++)
+		spinlock_init(&vm->vm_cpu[n].cc_lock);
+}
+
+/*
+ * Locks the arena, ensuring at least num_tags boundary tags are available; as
+ * we need the page allocator to obtain more, these can only be added unlocked.
+ * Returns false, with the arena unlocked, if no page is available for them.
+ */
+static bool
+vmem_lock_with_tags(struct VMEM* vm, unsigned int num_tags)
+{
+	while(1) {
+		spinlock_lock(&vm->vm_lock);
+		if (vm->vm_num_free_tags >= num_tags)
+			return true;
+		spinlock_unlock(&vm->vm_lock);
+
+		struct PAGE* p;
+		auto tags = static_cast<struct VMEM_TAG*>(page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE));
+		if (tags == NULL)
+			return false;
+		spinlock_lock(&vm->vm_lock);
+		for (unsigned int n = 0; n < PAGE_SIZE / sizeof(struct VMEM_TAG); n++) {
+			LIST_APPEND_IP(&vm->vm_tags, fl, &tags[n]);
+			vm->vm_num_free_tags++;
+		}
+		spinlock_unlock(&vm->vm_lock);
+	}
+}
+
+static struct VMEM_TAG*
+vmem_tag_get_locked(struct VMEM* vm)
+{
+	KASSERT(!LIST_EMPTY(&vm->vm_tags), "arena '%s' out of tags", vm->vm_name);
+	struct VMEM_TAG* vt = LIST_HEAD(&vm->vm_tags);
+	LIST_POP_HEAD_IP(&vm->vm_tags, fl);
+	vm->vm_num_free_tags--;
+	return vt;
+}
+
+static void
+vmem_tag_put_locked(struct VMEM* vm, struct VMEM_TAG* vt)
+{
+	LIST_PREPEND_IP(&vm->vm_tags, fl, vt);
+	vm->vm_num_free_tags++;
+}
+
+/* Inserts vt in the segment list directly after pos */
+static void
+vmem_seg_insert_after_locked(struct VMEM* vm, struct VMEM_TAG* pos, struct VMEM_TAG* vt)
+{
+	struct VMEM_TAG* next = LIST_NEXT_IP(pos, seg);
+	if (next != NULL) {
+		LIST_INSERT_BEFORE_IP(&vm->vm_segs, seg, next, vt);
+	} else {
+		LIST_APPEND_IP(&vm->vm_segs, seg, vt);
+	}
+}
+
+bool
+vmem_add(struct VMEM* vm, addr_t base, size_t size)
+{
+	KASSERT((base & (vm->vm_quantum - 1)) == 0, "base %p not aligned", base);
+	KASSERT((size & (vm->vm_quantum - 1)) == 0, "size %p not aligned", size);
+
+	if (!vmem_lock_with_tags(vm, 2))
+		return false;
+	struct VMEM_TAG* span = vmem_tag_get_locked(vm);
+	span->vt_type = VMEM_TAG_SPAN;
+	span->vt_start = base;
+	span->vt_size = size;
+
+	struct VMEM_TAG* vt = vmem_tag_get_locked(vm);
+	vt->vt_type = VMEM_TAG_FREE;
+	vt->vt_start = base;
+	vt->vt_size = size;
+
+	/* Keep the segment list sorted; spans are never removed */
+	struct VMEM_TAG* pos = NULL;
+	LIST_FOREACH_IP(&vm->vm_segs, seg, it, struct VMEM_TAG) {
+		if (it->vt_type == VMEM_TAG_SPAN && it->vt_start > base) {
+			pos = it;
+			break;
+		}
+	}
+	if (pos != NULL) {
+		LIST_INSERT_BEFORE_IP(&vm->vm_segs, seg, pos, span);
+	} else {
+		LIST_APPEND_IP(&vm->vm_segs, seg, span);
+	}
+	vmem_seg_insert_after_locked(vm, span, vt);
+	LIST_APPEND_IP(vmem_freelist(vm, size), fl, vt);
+	vm->vm_size += size;
+	spinlock_unlock(&vm->vm_lock);
+	return true;
+}
+
+static addr_t
+vmem_xalloc_locked(struct VMEM* vm, size_t size)
+{
+	/*
+	 * Instant fit: every segment on freelist n is at least 2^n quanta, so the
+	 * head of the first non-empty list beyond our own size class always fits.
+	 * Only if there is none, we'll have to search our own size class.
+	 */
+	size_t num_quanta = size / vm->vm_quantum;
+	unsigned int first = vmem_highbit(num_quanta);
+	if ((num_quanta & (num_quanta - 1)) != 0)
+		first++;
+
+	struct VMEM_TAG* vt = NULL;
+	for (unsigned int n = first; vt == NULL && n < VMEM_NUM_FREELISTS; n++)
+		vt = LIST_HEAD(&vm->vm_freelist[n]);
+	if (vt == NULL) {
+		LIST_FOREACH_IP(vmem_freelist(vm, size), fl, it, struct VMEM_TAG) {
+			if (it->vt_size >= size) {
+				vt = it;
+				break;
+			}
+		}
+	}
+	if (vt == NULL)
+		return 0;
+
+	LIST_REMOVE_IP(vmem_freelist(vm, vt->vt_size), fl, vt);
+	if (vt->vt_size > size) {
+		/* Split off the remainder and put it back on the freelist */
+		struct VMEM_TAG* rest = vmem_tag_get_locked(vm);
+		rest->vt_type = VMEM_TAG_FREE;
+		rest->vt_start = vt->vt_start + size;
+		rest->vt_size = vt->vt_size - size;
+		vmem_seg_insert_after_locked(vm, vt, rest);
+		LIST_APPEND_IP(vmem_freelist(vm, rest->vt_size), fl, rest);
+		vt->vt_size = size;
+	}
+
+	vt->vt_type = VMEM_TAG_ALLOC;
+	LIST_APPEND_IP(vmem_hash_bucket(vm, vt->vt_start), fl, vt);
+	vm->vm_inuse += size;
+	return vt->vt_start;
+}
+
+static void
+vmem_xfree_locked(struct VMEM* vm, addr_t addr, size_t size)
+{
+	struct VMEM_TAG_LIST* bucket = vmem_hash_bucket(vm, addr);
+	struct VMEM_TAG* vt = NULL;
+	LIST_FOREACH_IP(bucket, fl, it, struct VMEM_TAG) {
+		if (it->vt_start == addr) {
+			vt = it;
+			break;
+		}
+	}
+	KASSERT(vt != NULL, "arena '%s': freeing unallocated %p", vm->vm_name, addr);
+	KASSERT(vt->vt_size == size, "arena '%s': freeing %p with size %p, allocated %p", vm->vm_name, addr, size, vt->vt_size);
+	LIST_REMOVE_IP(bucket, fl, vt);
+	vt->vt_type = VMEM_TAG_FREE;
+	vm->vm_inuse -= size;
+
+	/* Coalesce with our neighbours; span tags are never free, so we won't cross them */
+	struct VMEM_TAG* next = LIST_NEXT_IP(vt, seg);
+	if (next != NULL && next->vt_type == VMEM_TAG_FREE) {
+		LIST_REMOVE_IP(vmem_freelist(vm, next->vt_size), fl, next);
+		LIST_REMOVE_IP(&vm->vm_segs, seg, next);
+		vt->vt_size += next->vt_size;
+		vmem_tag_put_locked(vm, next);
+	}
+	struct VMEM_TAG* prev = LIST_PREV_IP(vt, seg);
+	if (prev != NULL && prev->vt_type == VMEM_TAG_FREE) {
+		LIST_REMOVE_IP(vmem_freelist(vm, prev->vt_size), fl, prev);
+		LIST_REMOVE_IP(&vm->vm_segs, seg, vt);
+		prev->vt_size += vt->vt_size;
+		vmem_tag_put_locked(vm, vt);
+		vt = prev;
+	}
+	LIST_APPEND_IP(vmem_freelist(vm, vt->vt_size), fl, vt);
+}
+
+static inline struct VMEM_CPU_CACHE*
+vmem_get_cpu_cache(struct VMEM* vm)
+{
+	unsigned int cpuid = PCPU_GET(cpuid);
+	KASSERT(cpuid < MAX_CPUS, "cpu %u out of range", cpuid);
+	return &vm->vm_cpu[cpuid];
+}
+
+/* Returns all per-CPU cached allocations to the arena; returns true if there were any */
+static bool
+vmem_drain_caches(struct VMEM* vm)
+{
+	bool drained = false;
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct VMEM_CPU_CACHE* cc = &vm->vm_cpu[cpu];
+		spinlock_lock(&cc->cc_lock);
+		spinlock_lock(&vm->vm_lock);
+		for (unsigned int n = 0; n < vm->vm_qcache_max; n++) {
+			for (unsigned int i = 0; i < cc->cc_count[n]; i++)
+				vmem_xfree_locked(vm, cc->cc_addr[n][i], (n + 1) * vm->vm_quantum);
+			drained |= cc->cc_count[n] > 0;
+			cc->cc_count[n] = 0;
+		}
+		spinlock_unlock(&vm->vm_lock);
+		spinlock_unlock(&cc->cc_lock);
+	}
+	return drained;
+}
+
+addr_t
+vmem_alloc(struct VMEM* vm, size_t size)
+{
+	size = ROUND_UP(size, vm->vm_quantum);
+	KASSERT(size > 0, "zero-sized allocation");
+
+	unsigned int qc = size / vm->vm_quantum - 1;
+	if (qc < vm->vm_qcache_max) {
+		struct VMEM_CPU_CACHE* cc = vmem_get_cpu_cache(vm);
+		spinlock_lock(&cc->cc_lock);
+		if (cc->cc_count[qc] > 0) {
+			addr_t addr = cc->cc_addr[qc][--cc->cc_count[qc]];
+			spinlock_unlock(&cc->cc_lock);
+			return addr;
+		}
+		spinlock_unlock(&cc->cc_lock);
+	}
+
+	/*
+	 * Go to the arena; if that fails, there may still be space hiding in the
+	 * per-CPU caches (which can also prevent coalescing) so try once more.
+	 */
+	addr_t addr = 0;
+	if (vmem_lock_with_tags(vm, 1)) {
+		addr = vmem_xalloc_locked(vm, size);
+		spinlock_unlock(&vm->vm_lock);
+	}
+	if (addr == 0 && vmem_drain_caches(vm) && vmem_lock_with_tags(vm, 1)) {
+		addr = vmem_xalloc_locked(vm, size);
+		spinlock_unlock(&vm->vm_lock);
+	}
+	if (addr == 0) {
+		spinlock_lock(&vm->vm_lock);
+		vm->vm_failures++;
+		spinlock_unlock(&vm->vm_lock);
+	}
+	return addr;
+}
+
+void
+vmem_free(struct VMEM* vm, addr_t addr, size_t size)
+{
+	size = ROUND_UP(size, vm->vm_quantum);
+
+	unsigned int qc = size / vm->vm_quantum - 1;
+	if (qc < vm->vm_qcache_max) {
+		struct VMEM_CPU_CACHE* cc = vmem_get_cpu_cache(vm);
+		spinlock_lock(&cc->cc_lock);
+		if (cc->cc_count[qc] < VMEM_CPU_CACHE_SIZE) {
+			cc->cc_addr[qc][cc->cc_count[qc]++] = addr;
+			spinlock_unlock(&cc->cc_lock);
+			return;
+		}
+		spinlock_unlock(&cc->cc_lock);
+	}
+
+	spinlock_lock(&vm->vm_lock);
+	vmem_xfree_locked(vm, addr, size);
+	spinlock_unlock(&vm->vm_lock);
+}
+
+void
+vmem_get_stats(struct VMEM* vm, size_t* total, size_t* inuse)
+{
+	spinlock_lock(&vm->vm_lock);
+	*total = vm->vm_size;
+	*inuse = vm->vm_inuse;
+	spinlock_unlock(&vm->vm_lock);
+}
+
+void
+vmem_dump(struct VMEM* vm)
+{
+	static const char* type[] = { "free", "alloc", "span" };
+	kprintf("arena '%s': quantum %u, %u KB of %u KB in use, %u failures\n",
+	 vm->vm_name, (unsigned int)vm->vm_quantum,
+	 (unsigned int)(vm->vm_inuse / 1024), (unsigned int)(vm->vm_size / 1024), vm->vm_failures);
+	LIST_FOREACH_IP(&vm->vm_segs, seg, vt, struct VMEM_TAG) {
+		kprintf(" %-5s %p-%p\n", type[vt->vt_type], vt->vt_start, vt->vt_start + vt->vt_size - 1);
+	}
+}
+
+/* vim:set ts=2 sw=2: */
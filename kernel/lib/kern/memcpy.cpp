@@ -1,17 +1,22 @@
 #include <ananas/types.h>
 #include "kernel/lib.h"
+#include "kernel/memops.h"
 
 /*
  * The naive implementation is easy but slow; we can do much better by
- * attempting to copy 32-bit chunks in a single go every time - this results in
- * a massive speedup (we choose 32-bit chunks because most CPU's seem to like
- * that)
+ * copying 64-bit words, several at a time so that the loads can overlap.
+ * The destination is aligned first, as unaligned stores tend to hurt more
+ * than unaligned loads. This is only used if the MD code didn't select
+ * something better, see kernel/memops.h.
  */
 #undef NAIVE_IMPLEMENTATION
 
 void*
 memcpy(void* dst, const void* src, size_t len)
 {
+	if (memops.mo_memcpy != NULL)
+		return memops.mo_memcpy(dst, src, len);
+
 #ifdef NAIVE_IMPLEMENTATION
 	char* d = (char*)dst;
 	const char* s = (const char*)src;
@@ -24,7 +29,7 @@ memcpy(void* dst, const void* src, size_t len)
 		do { \
 			size_t x = (size_t)sz; \
 			while (x >= sizeof(T)) { \
-				*(T*)d = *(T*)s; \
+				*(T*)d = *(const T*)s; \
 				x -= sizeof(T); \
 				s += sizeof(T); \
 				d += sizeof(T); \
@@ -35,14 +40,31 @@ memcpy(void* dst, const void* src, size_t len)
 	auto d = static_cast<char*>(dst);
 	auto s = static_cast<const char*>(src);
 
-	/* First of all, attempt to align to 32-bit boundary */
-	if (len >= 4 && ((addr_t)dst & 3))
-		DO_COPY(uint8_t, len & 3);
+	/* First of all, attempt to align to 64-bit boundary */
+	if (len >= 8 && ((addr_t)dst & 7))
+		DO_COPY(uint8_t, 8 - ((addr_t)dst & 7));
 
-	/* Attempt to copy everything using 4 bytes at a time */
-	DO_COPY(uint32_t, len);
+	/*
+	 * Copy 32 bytes at a time; everything is loaded before it is stored, so
+	 * copying to a lower, overlapping address still works (memmove() relies on
+	 * this)
+	 */
+	while (len >= 32) {
+		uint64_t a = ((const uint64_t*)s)[0];
+		uint64_t b = ((const uint64_t*)s)[1];
+		uint64_t c = ((const uint64_t*)s)[2];
+		uint64_t e = ((const uint64_t*)s)[3];
+		((uint64_t*)d)[0] = a;
+		((uint64_t*)d)[1] = b;
+		((uint64_t*)d)[2] = c;
+		((uint64_t*)d)[3] = e;
+		s += 32;
+		d += 32;
+		len -= 32;
+	}
 
 	/* Cover the leftovers */
+	DO_COPY(uint64_t, len);
 	DO_COPY(uint8_t, len);
 
 #undef DO_COPY
@@ -50,4 +72,13 @@ memcpy(void* dst, const void* src, size_t len)
 	return dst;
 }
 
+void
+memcpy_pages(void* dst, const void* src, size_t len)
+{
+	if (memops.mo_copy_pages != NULL)
+		memops.mo_copy_pages(dst, src, len);
+	else
+		memcpy(dst, src, len);
+}
+
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,38 @@
+/*
+ * Selection of the memcpy()/memset() implementations; see kernel/memops.h.
+ */
+#include <ananas/types.h>
+#include "kernel/lib.h"
+#include "kernel/memops.h"
+
+const struct MEMOPS memops_generic = {
+	.mo_name = "generic",
+	.mo_memcpy = NULL,
+	.mo_memset = NULL,
+	.mo_copy_pages = NULL,
+	.mo_zero_pages = NULL
+};
+
+struct MEMOPS memops = {
+	.mo_name = "generic",
+	.mo_memcpy = NULL,
+	.mo_memset = NULL,
+	.mo_copy_pages = NULL,
+	.mo_zero_pages = NULL
+};
+
+void
+memops_select(const struct MEMOPS* ops)
+{
+	/*
+	 * Every function is fine to use on its own, so it doesn't matter if
+	 * another CPU sees a mix of the old and new functions for a while.
+	 */
+	memops.mo_memcpy = ops->mo_memcpy;
+	memops.mo_memset = ops->mo_memset;
+	memops.mo_copy_pages = ops->mo_copy_pages;
+	memops.mo_zero_pages = ops->mo_zero_pages;
+	memops.mo_name = ops->mo_name;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,24 +1,27 @@
 #include <ananas/types.h>
 #include "kernel/lib.h"
+#include "kernel/memops.h"
 
 /*
  * The naive implementation is easy but slow; we can do much better by
- * attempting to copy 32-bit chunks in a single go every time - this results in
- * a massive speedup (we choose 32-bit chunks because most CPU's seem to like
- * that)
+ * setting 64-bit words, several at a time. This is only used if the MD code
+ * didn't select something better, see kernel/memops.h.
  */
 #undef NAIVE_IMPLEMENTATION
 
 void*
 memset(void* b, int c, size_t len)
 {
+	if (memops.mo_memset != NULL)
+		return memops.mo_memset(b, c, len);
+
 #ifdef NAIVE_IMPLEMENTATION
 	char* ptr = (char*)b;
 	while (len--) {
 		*ptr++ = c;
 	}
 #else
-	void* d = b;
+	auto d = static_cast<char*>(b);
 
 	/* Sets sz bytes of variable type T-sized data */
 #define DO_SET(T, sz, v) \
@@ -27,19 +30,28 @@ memset(void* b, int c, size_t len)
 			while (x >= sizeof(T)) { \
 				*(T*)d = (T)v; \
 				x -= sizeof(T); \
-				d = static_cast<void*>(static_cast<char*>(d) + sizeof(T)); \
+				d += sizeof(T); \
 				len -= sizeof(T);  \
 			} \
 		} while(0)
 
-	/* First of all, attempt to align to 32-bit boundary */
-	if (len >= 4 && ((addr_t)b & 3))
-		DO_SET(uint8_t, len & 3, c);
+	/* First of all, attempt to align to 64-bit boundary */
+	if (len >= 8 && ((addr_t)b & 7))
+		DO_SET(uint8_t, 8 - ((addr_t)b & 7), c);
 
-	/* Attempt to set everything using 4 bytes at a time */
-	DO_SET(uint32_t, len, ((uint32_t)c << 24 | (uint32_t)c << 16 | (uint32_t)c << 8 | (uint32_t)c));
+	/* Set 32 bytes at a time */
+	const uint64_t v = (uint64_t)(uint8_t)c * 0x0101010101010101ULL;
+	while (len >= 32) {
+		((uint64_t*)d)[0] = v;
+		((uint64_t*)d)[1] = v;
+		((uint64_t*)d)[2] = v;
+		((uint64_t*)d)[3] = v;
+		d += 32;
+		len -= 32;
+	}
 
 	/* Handle the leftovers */
+	DO_SET(uint64_t, len, v);
 	DO_SET(uint8_t, len, c);
 
 #undef DO_SET
@@ -47,4 +59,13 @@ memset(void* b, int c, size_t len)
 	return b;
 }
 
+void
+memzero_pages(void* b, size_t len)
+{
+	if (memops.mo_zero_pages != NULL)
+		memops.mo_zero_pages(b, len);
+	else
+		memset(b, 0, len);
+}
+
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,296 @@
+/*
+ * Red-black tree; see kernel/rbtree.h for an overview.
+ *
+ * Rebalancing follows the classic algorithm (as in BSD's tree.h); the only
+ * addition is that rotations recalculate the augmented data of both nodes
+ * involved, lower node first. Rotations never change the set of nodes below
+ * the rotated pair, so nodes above it remain valid.
+ */
+#include <ananas/types.h>
+#include "kernel/lib.h"
+#include "kernel/rbtree.h"
+
+static inline bool
+rb_is_red(struct RB_NODE* node)
+{
+	return node != NULL && node->rb_red;
+}
+
+static inline void
+rb_augment(struct RB_TREE* tree, struct RB_NODE* node)
+{
+	if (tree->rb_augment != NULL)
+		tree->rb_augment(node);
+}
+
+/* Makes parent point to new_child rather than old_child */
+static inline void
+rb_replace_child(struct RB_TREE* tree, struct RB_NODE* parent, struct RB_NODE* old_child, struct RB_NODE* new_child)
+{
+	if (parent == NULL)
+		tree->rb_root = new_child;
+	else if (parent->rb_left == old_child)
+		parent->rb_left = new_child;
+	else
+		parent->rb_right = new_child;
+}
+
+static void
+rb_rotate_left(struct RB_TREE* tree, struct RB_NODE* node)
+{
+	struct RB_NODE* right = node->rb_right;
+	node->rb_right = right->rb_left;
+	if (right->rb_left != NULL)
+		right->rb_left->rb_parent = node;
+	right->rb_parent = node->rb_parent;
+	rb_replace_child(tree, node->rb_parent, node, right);
+	right->rb_left = node;
+	node->rb_parent = right;
+
+	rb_augment(tree, node);
+	rb_augment(tree, right);
+}
+
+static void
+rb_rotate_right(struct RB_TREE* tree, struct RB_NODE* node)
+{
+	struct RB_NODE* left = node->rb_left;
+	node->rb_left = left->rb_right;
+	if (left->rb_right != NULL)
+		left->rb_right->rb_parent = node;
+	left->rb_parent = node->rb_parent;
+	rb_replace_child(tree, node->rb_parent, node, left);
+	left->rb_right = node;
+	node->rb_parent = left;
+
+	rb_augment(tree, node);
+	rb_augment(tree, left);
+}
+
+void
+rb_tree_init(struct RB_TREE* tree, rb_augment_t augment)
+{
+	tree->rb_root = NULL;
+	tree->rb_augment = augment;
+}
+
+void
+rb_propagate(struct RB_TREE* tree, struct RB_NODE* node)
+{
+	if (tree->rb_augment == NULL)
+		return;
+	for (/* nothing */; node != NULL; node = node->rb_parent)
+		tree->rb_augment(node);
+}
+
+void
+rb_insert(struct RB_TREE* tree, struct RB_NODE* node, struct RB_NODE* parent, struct RB_NODE** link)
+{
+	node->rb_parent = parent;
+	node->rb_left = NULL;
+	node->rb_right = NULL;
+	node->rb_red = 1;
+	*link = node;
+	rb_propagate(tree, node);
+
+	while ((parent = node->rb_parent) != NULL && parent->rb_red) {
+		struct RB_NODE* gparent = parent->rb_parent; /* must exist as the root is black */
+		if (parent == gparent->rb_left) {
+			struct RB_NODE* uncle = gparent->rb_right;
+			if (rb_is_red(uncle)) {
+				uncle->rb_red = 0;
+				parent->rb_red = 0;
+				gparent->rb_red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_right) {
+				rb_rotate_left(tree, parent);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = 0;
+			gparent->rb_red = 1;
+			rb_rotate_right(tree, gparent);
+		} else {
+			struct RB_NODE* uncle = gparent->rb_left;
+			if (rb_is_red(uncle)) {
+				uncle->rb_red = 0;
+				parent->rb_red = 0;
+				gparent->rb_red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_left) {
+				rb_rotate_right(tree, parent);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = 0;
+			gparent->rb_red = 1;
+			rb_rotate_left(tree, gparent);
+		}
+	}
+	tree->rb_root->rb_red = 0;
+}
+
+/* Restores the red-black properties after a black node was removed above node (which may be NULL) */
+static void
+rb_remove_fixup(struct RB_TREE* tree, struct RB_NODE* parent, struct RB_NODE* node)
+{
+	while (!rb_is_red(node) && node != tree->rb_root) {
+		if (parent->rb_left == node) {
+			struct RB_NODE* sibling = parent->rb_right;
+			if (sibling->rb_red) {
+				sibling->rb_red = 0;
+				parent->rb_red = 1;
+				rb_rotate_left(tree, parent);
+				sibling = parent->rb_right;
+			}
+			if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right)) {
+				sibling->rb_red = 1;
+				node = parent;
+				parent = node->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(sibling->rb_right)) {
+				sibling->rb_left->rb_red = 0;
+				sibling->rb_red = 1;
+				rb_rotate_right(tree, sibling);
+				sibling = parent->rb_right;
+			}
+			sibling->rb_red = parent->rb_red;
+			parent->rb_red = 0;
+			if (sibling->rb_right != NULL)
+				sibling->rb_right->rb_red = 0;
+			rb_rotate_left(tree, parent);
+		} else {
+			struct RB_NODE* sibling = parent->rb_left;
+			if (sibling->rb_red) {
+				sibling->rb_red = 0;
+				parent->rb_red = 1;
+				rb_rotate_right(tree, parent);
+				sibling = parent->rb_left;
+			}
+			if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right)) {
+				sibling->rb_red = 1;
+				node = parent;
+				parent = node->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(sibling->rb_left)) {
+				sibling->rb_right->rb_red = 0;
+				sibling->rb_red = 1;
+				rb_rotate_left(tree, sibling);
+				sibling = parent->rb_left;
+			}
+			sibling->rb_red = parent->rb_red;
+			parent->rb_red = 0;
+			if (sibling->rb_left != NULL)
+				sibling->rb_left->rb_red = 0;
+			rb_rotate_right(tree, parent);
+		}
+		node = tree->rb_root;
+		break;
+	}
+	if (node != NULL)
+		node->rb_red = 0;
+}
+
+void
+rb_remove(struct RB_TREE* tree, struct RB_NODE* node)
+{
+	struct RB_NODE* child;
+	struct RB_NODE* parent;
+	int red;
+
+	if (node->rb_left != NULL && node->rb_right != NULL) {
+		/*
+		 * Two children; unlink our successor (which has no left child) and put it
+		 * in our place instead.
+		 */
+		struct RB_NODE* succ = node->rb_right;
+		while (succ->rb_left != NULL)
+			succ = succ->rb_left;
+
+		child = succ->rb_right;
+		parent = succ->rb_parent;
+		red = succ->rb_red;
+		if (child != NULL)
+			child->rb_parent = parent;
+		rb_replace_child(tree, parent, succ, child);
+		if (parent == node)
+			parent = succ;
+
+		succ->rb_parent = node->rb_parent;
+		succ->rb_left = node->rb_left;
+		succ->rb_right = node->rb_right;
+		succ->rb_red = node->rb_red;
+		rb_replace_child(tree, node->rb_parent, node, succ);
+		succ->rb_left->rb_parent = succ;
+		if (succ->rb_right != NULL)
+			succ->rb_right->rb_parent = succ;
+	} else {
+		child = node->rb_left != NULL ? node->rb_left : node->rb_right;
+		parent = node->rb_parent;
+		red = node->rb_red;
+		if (child != NULL)
+			child->rb_parent = parent;
+		rb_replace_child(tree, parent, node, child);
+	}
+
+	/* Everything that changed is on the path from parent to the root */
+	rb_propagate(tree, parent);
+	if (!red)
+		rb_remove_fixup(tree, parent, child);
+}
+
+struct RB_NODE*
+rb_first(struct RB_TREE* tree)
+{
+	struct RB_NODE* node = tree->rb_root;
+	if (node != NULL)
+		while (node->rb_left != NULL)
+			node = node->rb_left;
+	return node;
+}
+
+struct RB_NODE*
+rb_last(struct RB_TREE* tree)
+{
+	struct RB_NODE* node = tree->rb_root;
+	if (node != NULL)
+		while (node->rb_right != NULL)
+			node = node->rb_right;
+	return node;
+}
+
+struct RB_NODE*
+rb_next(struct RB_NODE* node)
+{
+	if (node->rb_right != NULL) {
+		node = node->rb_right;
+		while (node->rb_left != NULL)
+			node = node->rb_left;
+		return node;
+	}
+	while (node->rb_parent != NULL && node == node->rb_parent->rb_right)
+		node = node->rb_parent;
+	return node->rb_parent;
+}
+
+struct RB_NODE*
+rb_prev(struct RB_NODE* node)
+{
+	if (node->rb_left != NULL) {
+		node = node->rb_left;
+		while (node->rb_right != NULL)
+			node = node->rb_right;
+		return node;
+	}
+	while (node->rb_parent != NULL && node == node->rb_parent->rb_left)
+		node = node->rb_parent;
+	return node->rb_parent;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,22 +1,27 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vm.h"
 
 TRACE_SETUP;
 
 errorcode_t
-sys_chdir(thread_t* t, const char* path)
+sys_chdir(thread_t* t, const char* user_path)
 {
+	char path[PATH_MAX];
+	errorcode_t err = copyinstr(path, user_path, sizeof(path), NULL);
+	ANANAS_ERROR_RETURN(err);
 	TRACE(SYSCALL, FUNC, "t=%p, path='%s'", t, path);
 	process_t* proc = t->t_process;
 	struct DENTRY* cwd = proc->p_cwd;
 
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, cwd, &file);
+	err = vfs_open(path, cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	/* XXX Check if file has a directory */
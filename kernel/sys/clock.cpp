@@ -3,6 +3,7 @@
 #include <ananas/syscalls.h>
 #include "kernel/time.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 
 #include "kernel/lib.h"
 
@@ -24,8 +25,8 @@ sys_clock_gettime(thread_t* t, int id, struct timespec* tp)
 		case CLOCK_MONOTONIC:
 			break;
 		case CLOCK_REALTIME: {
-			*tp = Ananas::Time::GetTime();
-			return ananas_success();
+			struct timespec ts = Ananas::Time::GetTime();
+			return copyout(tp, &ts, sizeof(ts));
 		}
 		case CLOCK_SECONDS:
 			break;
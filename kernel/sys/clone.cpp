@@ -3,6 +3,7 @@
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 
 TRACE_SETUP;
 
@@ -22,17 +23,22 @@ sys_clone(thread_t* t, int flags, pid_t* out_pid)
 	err = process_clone(proc, 0, &new_proc);
 	ANANAS_ERROR_RETURN(err);
 
+	/* Hand the new pid to the caller; this can fail, so do it before the thread exists */
+	pid_t new_pid = new_proc->p_pid;
+	err = copyout(out_pid, &new_pid, sizeof(new_pid));
+	if (ananas_is_failure(err))
+		goto fail;
+
 	/* Now clone the handle to the new process */
 	thread_t* new_thread;
 	err = thread_clone(new_proc, &new_thread);
 	if (ananas_is_failure(err))
 		goto fail;
-	*out_pid = new_proc->p_pid;
 
 	/* Resume the cloned thread - it'll have a different return value from ours */
 	thread_resume(new_thread);
 
-	TRACE(SYSCALL, FUNC, "t=%p, success, new pid=%u", t, *out_pid);
+	TRACE(SYSCALL, FUNC, "t=%p, success, new pid=%u", t, new_pid);
 	return err;
 
 fail:
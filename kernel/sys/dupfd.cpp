@@ -3,6 +3,7 @@
 #include <ananas/handle-options.h>
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 
 TRACE_SETUP;
 
@@ -14,7 +15,8 @@ sys_dupfd(thread_t* t, handleindex_t index, int flags, handleindex_t* out)
 	process_t* process = t->t_process;
 	handleindex_t new_idx = 0;
 	if (flags & HANDLE_DUPFD_TO) {
-		new_idx = *out;
+		errorcode_t err = copyin(&new_idx, out, sizeof(new_idx));
+		ANANAS_ERROR_RETURN(err);
 		sys_close(t, new_idx); /* ensure it is available; not an error if this fails */
 	}
 
@@ -23,7 +25,11 @@ sys_dupfd(thread_t* t, handleindex_t index, int flags, handleindex_t* out)
 	errorcode_t err = handle_clone(process, index, NULL, process, &handle_out, new_idx, &hidx_out);
 	ANANAS_ERROR_RETURN(err);
 
-	*out = hidx_out;
+	err = copyout(out, &hidx_out, sizeof(hidx_out));
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(process, hidx_out);
+		return err;
+	}
 	return ananas_success();
 }
 
@@ -1,11 +1,13 @@
 #include <ananas/syscalls.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include <ananas/procinfo.h>
 #include "kernel/exec.h"
 #include "kernel/lib.h"
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vmspace.h"
 
@@ -21,19 +23,24 @@ set_proc_attribute(process_t* process, enum SET_PROC_ATTR attr, const char** lis
 {
 	char buf[PROCINFO_ENV_LENGTH];
 
-	/* Convert list to a \0-separated string, \0\0-terminated */
-	int arg_len = 2; /* \0\0-terminator */
-	for (const char** p = list; *p != NULL; p++) {
-		arg_len += strlen(*p) + 1; /* \0 */
-	}
-	KASSERT(arg_len < sizeof(buf), "buffer too large (calculated %d, have %d)", arg_len, sizeof(buf));
-
-	/* Copy the items over */
-	int pos = 0;
+	/*
+	 * Convert list to a \0-separated string, \0\0-terminated; both the list and
+	 * the strings are in userland memory. The final \0 must always fit, so
+	 * there is one byte less available for the strings.
+	 */
+	size_t pos = 0;
 	memset(buf, 0, sizeof(buf));
-	for (const char** p = list; *p != NULL; p++) {
-		strcpy(&buf[pos], *p);
-		pos += strlen(*p) + 1;
+	for (const char** p = list; /* nothing */; p++) {
+		const char* item;
+		errorcode_t err = copyin(&item, p, sizeof(item));
+		ANANAS_ERROR_RETURN(err);
+		if (item == NULL)
+			break;
+
+		size_t len;
+		err = copyinstr(&buf[pos], item, sizeof(buf) - pos - 1, &len);
+		ANANAS_ERROR_RETURN(err);
+		pos += len + 1; /* \0 */
 	}
 
 	switch(attr) {
@@ -47,14 +54,17 @@ set_proc_attribute(process_t* process, enum SET_PROC_ATTR attr, const char** lis
 }
 
 errorcode_t
-sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
+sys_execve(thread_t* t, const char* user_path, const char** argv, const char** envp)
 {
+	char path[PATH_MAX];
+	errorcode_t err = copyinstr(path, user_path, sizeof(path), NULL);
+	ANANAS_ERROR_RETURN(err);
 	TRACE(SYSCALL, FUNC, "t=%p, path='%s'", t, path);
 	process_t* proc = t->t_process;
 
 	/* First step is to open the file */
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, proc->p_cwd, &file);
+	err = vfs_open(path, proc->p_cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	/*
@@ -104,12 +114,9 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	if (ananas_is_failure(err))
 		goto fail;
 
-	/*
-	 * Loading went okay; we can now set the new thread name (we won't be able to
-	 * access argv after the vmspace_clone() so best do it here)
-	 */
-	if (argv != NULL && argv[0] != NULL)
-		thread_set_name(t, argv[0]);
+	/* Loading went okay; we can now set the new thread name, which is argv[0] */
+	if (argv != NULL && proc->p_info->pi_args[0] != '\0')
+		thread_set_name(t, proc->p_info->pi_args);
 
 	/* Copy the new vmspace to the destination */
 	err = vmspace_clone(vmspace, proc->p_vmspace, VMSPACE_CLONE_EXEC);
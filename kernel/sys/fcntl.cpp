@@ -2,6 +2,7 @@
 #include <ananas/error.h>
 #include <ananas/flags.h>
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "syscall.h"
 
 TRACE_SETUP;
@@ -22,22 +23,25 @@ sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
 
 	switch(cmd) {
 		case F_DUPFD: {
-			int min_fd = (int)(uintptr_t)out;
+			int min_fd = (int)(uintptr_t)in;
 			struct HANDLE* handle_out;
 			handleindex_t hidx_out;
 			err = handle_clone(process, hindex, NULL, process, &handle_out, min_fd, &hidx_out);
 			ANANAS_ERROR_RETURN(err);
-			*(int*)out = hidx_out;
+			int fd = hidx_out;
+			err = copyout(out, &fd, sizeof(fd));
+			if (ananas_is_failure(err)) {
+				handle_free_byindex(process, hidx_out);
+				return err;
+			}
 			break;
 		}
 		case F_GETFD:
+		case F_GETFL: {
 			/* TODO */
-			*(int*)out = 0;
-			break;
-		case F_GETFL:
-			/* TODO */
-			*(int*)out = 0;
-			break;
+			int flags = 0;
+			return copyout(out, &flags, sizeof(flags));
+		}
 		case F_SETFD: {
 			int fd = (int)(uintptr_t)out;
 			/* TODO */
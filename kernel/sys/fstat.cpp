@@ -2,6 +2,7 @@
 #include <ananas/error.h>
 #include "kernel/lib.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "syscall.h"
 
 TRACE_SETUP;
@@ -19,7 +20,8 @@ sys_fstat(thread_t* t, handleindex_t hindex, struct stat* buf)
 
         struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	if (file->f_dentry != NULL) {
-		memcpy(buf, &file->f_dentry->d_inode->i_sb, sizeof(struct stat));
+		err = copyout(buf, &file->f_dentry->d_inode->i_sb, sizeof(struct stat));
+		ANANAS_ERROR_RETURN(err);
 	} else {
 		err = ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 	}
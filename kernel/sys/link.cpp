@@ -6,7 +6,7 @@ TRACE_SETUP;
 
 errorcode_t sys_link(thread_t* t, const char* oldpath, const char* newpath)
 {
-	TRACE(SYSCALL, FUNC, "t=%p, oldpath='%s' newpath='%s'", t, oldpath, newpath);
+	TRACE(SYSCALL, FUNC, "t=%p, oldpath=%p newpath=%p", t, oldpath, newpath);
 
 	return ANANAS_ERROR(UNKNOWN);
 }
@@ -1,16 +1,20 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/flags.h>
+#include <ananas/limits.h>
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 
 TRACE_SETUP;
 
 errorcode_t
-sys_open(thread_t* t, const char* path, int flags, int mode, handleindex_t* out)
+sys_open(thread_t* t, const char* user_path, int flags, int mode, handleindex_t* out)
 {
+	char path[PATH_MAX];
+	errorcode_t err = copyinstr(path, user_path, sizeof(path), NULL);
+	ANANAS_ERROR_RETURN(err);
 	TRACE(SYSCALL, FUNC, "t=%p, path='%s', flags=%d, mode=%o", t, path, flags, mode);
-	errorcode_t err;
 	process_t* proc = t->t_process;
 
 	/* Obtain a new handle */
@@ -30,12 +34,13 @@ sys_open(thread_t* t, const char* path, int flags, int mode, handleindex_t* out)
 			err = ANANAS_ERROR(BAD_OPERATION);
 	}
 
+	if (ananas_is_success(err))
+		err = copyout(out, &index_out, sizeof(index_out));
 	if (ananas_is_failure(err)) {
 		/* Open failed - destroy the handle */
 		handle_free_byindex(proc, index_out);
 		return err;
 	}
-	*out = index_out;
 	TRACE(SYSCALL, FUNC, "t=%p, success, hindex=%u", t, index_out);
 	return err;
 }
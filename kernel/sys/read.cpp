@@ -1,6 +1,9 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include "kernel/handle.h"
+#include "kernel/page.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vm.h"
 #include "syscall.h"
 
@@ -22,22 +25,59 @@ sys_read(thread_t* t, handleindex_t hindex, void* buf, size_t* len)
 	err = syscall_fetch_size(t, len, &size);
 	ANANAS_ERROR_RETURN(err);
 
-	/* Attempt to map the buffer write-only */
-	void* buffer;
-	err = syscall_map_buffer(t, buf, size, VM_FLAG_WRITE, &buffer);
+	if (h->h_hops->hop_read == NULL)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	/*
+	 * Once data is read, it cannot be given back; make sure the user can take
+	 * it beforehand, so that a bad buffer doesn't make us lose anything.
+	 */
+	err = syscall_check_buffer(t, buf, size, VM_FLAG_WRITE);
 	ANANAS_ERROR_RETURN(err);
 
-	/* And read data to it */
-	if (h->h_hops->hop_read != NULL)
-		err = h->h_hops->hop_read(t, hindex, h, buf, &size);
-	else
-		err = ANANAS_ERROR(BAD_OPERATION);
+	/* Read the data in chunks, each of which is copied out to the user */
+	size_t buf_size = (size < SYSCALL_BOUNCE_SIZE) ? size : SYSCALL_BOUNCE_SIZE;
+	struct PAGE* kbuf_page;
+	void* kbuf = page_alloc_single_mapped(&kbuf_page, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (kbuf == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	size_t total = 0;
+	do {
+		size_t chunk_len = size - total;
+		if (chunk_len > buf_size)
+			chunk_len = buf_size;
+		size_t amount = chunk_len;
+		off_t prev_offset = h->h_data.d_vfs_file.f_offset;
+		err = h->h_hops->hop_read(t, hindex, h, kbuf, &amount);
+		if (ananas_is_failure(err))
+			break;
+		err = copyout(static_cast<char*>(buf) + total, kbuf, amount);
+		if (ananas_is_failure(err)) {
+			/* Files can still be rewound so that this chunk is read again */
+			if (h->h_type == HANDLE_TYPE_FILE)
+				h->h_data.d_vfs_file.f_offset = prev_offset;
+			break;
+		}
+		total += amount;
+
+		/*
+		 * Stop once we get less than we asked for; only files are asked for more,
+		 * as other handles would block until more data shows up.
+		 */
+		if (amount < chunk_len || h->h_type != HANDLE_TYPE_FILE)
+			break;
+	} while (total < size);
+	page_free(kbuf_page);
+
+	/* If we read anything, report that; the error will show up again next time */
+	if (total == 0)
+		ANANAS_ERROR_RETURN(err);
 
 	/* Finally, inform the user of the length read - the read went OK */
-	err = syscall_set_size(t, len, size);
+	err = syscall_set_size(t, len, total);
 	ANANAS_ERROR_RETURN(err);
 
-	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, size);
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, total);
 	return err;
 }
 
@@ -1,21 +1,28 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vfs/core.h"
 
 TRACE_SETUP;
 
 errorcode_t
-sys_rename(thread_t* t, const char* oldpath, const char* newpath)
+sys_rename(thread_t* t, const char* user_oldpath, const char* user_newpath)
 {
+	char oldpath[PATH_MAX], newpath[PATH_MAX];
+	errorcode_t err = copyinstr(oldpath, user_oldpath, sizeof(oldpath), NULL);
+	ANANAS_ERROR_RETURN(err);
+	err = copyinstr(newpath, user_newpath, sizeof(newpath), NULL);
+	ANANAS_ERROR_RETURN(err);
 	TRACE(SYSCALL, FUNC, "t=%p, oldpath='%s' newpath='%s'", t, oldpath, newpath);
 	process_t* proc = t->t_process;
 	struct DENTRY* cwd = proc->p_cwd;
 
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(oldpath, cwd, &file);
+	err = vfs_open(oldpath, cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	err = vfs_rename(&file, proc->p_cwd, newpath);
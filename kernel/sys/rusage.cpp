@@ -0,0 +1,50 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include "kernel/lib.h"
+#include "kernel/process.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
+#include "kernel/usercopy.h"
+#include "kernel/vmspace.h"
+#include "syscall.h"
+
+TRACE_SETUP;
+
+errorcode_t
+sys_rusage(thread_t* t, int who, struct RUSAGE_INFO* ri)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, who=%d, ri=%p", t, who, ri);
+
+	struct RUSAGE_INFO info;
+	errorcode_t err = copyin(&info, ri, sizeof(info));
+	ANANAS_ERROR_RETURN(err);
+	if (info.ri_size != sizeof(info))
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	process_t* p = t->t_process;
+	struct VM_SPACE_STATS stats;
+	process_lock(p);
+	switch(who) {
+		case RUSAGE_INFO_SELF:
+			stats = p->p_vmspace->vs_stats;
+			break;
+		case RUSAGE_INFO_CHILDREN:
+			stats = p->p_child_stats;
+			break;
+		default:
+			process_unlock(p);
+			return ANANAS_ERROR(BAD_FLAG);
+	}
+	process_unlock(p);
+
+	info.ri_anon_pages = stats.vss_anon_pages;
+	info.ri_file_pages = stats.vss_file_pages;
+	info.ri_max_resident = stats.vss_max_resident;
+	info.ri_minor_faults = stats.vss_minor_faults;
+	info.ri_major_faults = stats.vss_major_faults;
+	info.ri_cow_faults = stats.vss_cow_faults;
+	return copyout(ri, &info, sizeof(info));
+}
+
+/* vim:set ts=2 sw=2: */
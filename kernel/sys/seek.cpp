@@ -21,17 +21,21 @@ sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
 	if (file->f_dentry == NULL)
 		return ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 
+	off_t offs;
+	err = syscall_fetch_offset(t, offset, &offs);
+	ANANAS_ERROR_RETURN(err);
+
 	/* Update the offset */
 	off_t new_offset;
 	switch(whence) {
 		case HCTL_SEEK_WHENCE_SET:
-			new_offset = *offset;
+			new_offset = offs;
 			break;
 		case HCTL_SEEK_WHENCE_CUR:
-			new_offset = file->f_offset + *offset;
+			new_offset = file->f_offset + offs;
 			break;
 		case HCTL_SEEK_WHENCE_END:
-			new_offset = file->f_dentry->d_inode->i_sb.st_size - *offset;
+			new_offset = file->f_dentry->d_inode->i_sb.st_size - offs;
 			break;
 		default:
 			return ANANAS_ERROR(BAD_TYPE);
@@ -44,6 +48,5 @@ sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
 		ANANAS_ERROR_RETURN(err);
 	}
 	file->f_offset = new_offset;
-	*offset = new_offset;
-	return ananas_success();
+	return syscall_set_offset(t, offset, new_offset);
 }
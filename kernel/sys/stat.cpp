@@ -1,24 +1,34 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include "kernel/lib.h"
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vfs/core.h"
 
 TRACE_SETUP;
 
 errorcode_t
-sys_stat(thread_t* t, const char* path, struct stat* buf)
+sys_stat(thread_t* t, const char* user_path, struct stat* buf)
 {
 	process_t* proc = t->t_process;
 
+	char path[PATH_MAX];
+	errorcode_t err = copyinstr(path, user_path, sizeof(path), NULL);
+	ANANAS_ERROR_RETURN(err);
+
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, proc->p_cwd, &file);
+	err = vfs_open(path, proc->p_cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	if (file.f_dentry != NULL) {
-		memcpy(buf, &file.f_dentry->d_inode->i_sb, sizeof(struct stat));
+		err = copyout(buf, &file.f_dentry->d_inode->i_sb, sizeof(struct stat));
+		if (ananas_is_failure(err)) {
+			vfs_close(&file);
+			return err;
+		}
 	} else {
 		err = ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 	}
@@ -2,9 +2,12 @@
 #include <ananas/error.h>
 #include "kernel/handle.h"
 #include "kernel/lib.h"
+#include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vm.h"
+#include "kernel/vmspace.h"
 
 TRACE_SETUP;
 
@@ -30,86 +33,58 @@ syscall_get_file(thread_t* t, handleindex_t hindex, struct VFS_FILE** out)
 }
 
 errorcode_t
-syscall_map_string(thread_t* t, const void* ptr, const char** out)
+syscall_check_buffer(thread_t* t, const void* ptr, size_t len, int flags)
 {
-	auto x = static_cast<const char*>(md_map_thread_memory(t, (void*)ptr, PAGE_SIZE, VM_FLAG_READ));
-	if (x == NULL)
+	addr_t virt = (addr_t)ptr;
+	if (virt + len < virt)
 		return ANANAS_ERROR(BAD_ADDRESS);
 
-	/* ensure it's zero terminated */
-	for(int i = 0; i < PAGE_SIZE /* XXX */; i++)
-		if (x[i] == '\0') {
-			*out = x;
-			return ananas_success();
-		}
-
-	return ANANAS_ERROR(BAD_ADDRESS);
+	/* Every byte must be covered by an area that allows the access */
+	vmspace_t* vs = t->t_process->p_vmspace;
+	addr_t end = virt + len;
+	while (virt < end) {
+		vmarea_t* va = vmspace_lookup_area(vs, virt);
+		if (va == NULL || (va->va_flags & flags) != flags)
+			return ANANAS_ERROR(BAD_ADDRESS);
+		virt = va->va_virt + va->va_len;
+	}
+	return ananas_success();
 }
 
 errorcode_t
-syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** out)
+syscall_fetch_string(thread_t* t, const void* ptr, char* buf, size_t len)
 {
-	void* x = md_map_thread_memory(t, (void*)ptr, len, flags);
-	if (x == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = x;
-	return ananas_success();
+	return copyinstr(buf, ptr, len, NULL);
 }
 
 errorcode_t
 syscall_fetch_size(thread_t* t, const void* ptr, size_t* out)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_READ));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *s;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_size(thread_t* t, void* ptr, size_t len)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*s = len;
-	return ananas_success();
+	return copyout(ptr, &len, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_handleindex(thread_t* t, handleindex_t* ptr, handleindex_t index)
 {
-	auto p = static_cast<handleindex_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(handleindex_t), VM_FLAG_WRITE));
-	if (p == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*p = index;
-	return ananas_success();
+	return copyout(ptr, &index, sizeof(handleindex_t));
 }
 
 errorcode_t
 syscall_fetch_offset(thread_t* t, const void* ptr, off_t* out)
 {
-	auto o = static_cast<off_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(off_t), VM_FLAG_READ));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *o;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(off_t));
 }
 
 errorcode_t
 syscall_set_offset(thread_t* t, void* ptr, off_t len)
 {
-	auto o = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*o = len;
-	return ananas_success();
+	return copyout(ptr, &len, sizeof(off_t));
 }
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,50 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include "kernel/device.h"
+#include "kernel/swap.h"
+#include "kernel/trace.h"
+#include "kernel/usercopy.h"
+
+TRACE_SETUP;
+
+namespace {
+
+errorcode_t
+swap_lookup_device(const char* user_device, Ananas::Device*& dev)
+{
+	char name[sizeof(Ananas::Device::d_Name)];
+	errorcode_t err = copyinstr(name, user_device, sizeof(name), NULL);
+	ANANAS_ERROR_RETURN(err);
+
+	dev = Ananas::DeviceManager::FindDevice(name);
+	if (dev == nullptr)
+		return ANANAS_ERROR(NO_DEVICE);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+errorcode_t
+sys_swapon(thread_t* t, const char* device, size_t size)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, device=%p, size=%u", t, device, (int)size);
+
+	Ananas::Device* dev;
+	errorcode_t err = swap_lookup_device(device, dev);
+	ANANAS_ERROR_RETURN(err);
+	return swap_on(dev, size);
+}
+
+errorcode_t
+sys_swapoff(thread_t* t, const char* device)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, device=%p", t, device);
+
+	Ananas::Device* dev;
+	errorcode_t err = swap_lookup_device(device, dev);
+	ANANAS_ERROR_RETURN(err);
+	return swap_off(dev);
+}
+
+/* vim:set ts=2 sw=2: */
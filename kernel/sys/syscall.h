@@ -12,12 +12,21 @@ struct SYSCALL_ARGS {
 struct HANDLE;
 struct VFS_FILE;
 
+/*
+ * read() and write() pass their data through a kernel buffer of at most this
+ * many bytes, so that filesystems and drivers never touch userland memory;
+ * it is a single page, so that it needn't come from the kernel heap.
+ */
+#define SYSCALL_BOUNCE_SIZE PAGE_SIZE
+
 register_t syscall(struct SYSCALL_ARGS* args);
 
 errorcode_t syscall_get_handle(thread_t* t, handleindex_t handle, struct HANDLE** out);
 errorcode_t syscall_get_file(thread_t* t, handleindex_t handle, struct VFS_FILE** out);
-errorcode_t syscall_map_string(thread_t* t, const void* ptr, const char** out);
-errorcode_t syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** out);
+/* Verifies that [ptr, ptr + len) is mapped in t's vmspace with at least flags */
+errorcode_t syscall_check_buffer(thread_t* t, const void* ptr, size_t len, int flags);
+/* Copies a \0-terminated string of at most len bytes, including the \0, to buf */
+errorcode_t syscall_fetch_string(thread_t* t, const void* ptr, char* buf, size_t len);
 errorcode_t syscall_fetch_size(thread_t* t, const void* ptr, size_t* out);
 errorcode_t syscall_set_size(thread_t* t, void* ptr, size_t len);
 errorcode_t syscall_set_handleindex(thread_t* t, handleindex_t* ptr, handleindex_t index);
@@ -7,7 +7,7 @@ TRACE_SETUP;
 errorcode_t
 sys_unlink(thread_t* t, const char* path)
 {
-	TRACE(SYSCALL, FUNC, "t=%p, path='%s'", t, path);
+	TRACE(SYSCALL, FUNC, "t=%p, path=%p", t, path);
 
 	/* TODO */
 	return ANANAS_ERROR(BAD_OPERATION);
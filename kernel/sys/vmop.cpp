@@ -4,6 +4,7 @@
 #include <ananas/syscall-vmops.h>
 #include "kernel/process.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
 #include "syscall.h"
@@ -60,8 +61,42 @@ sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 static errorcode_t
 sys_vmop_unmap(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 {
-	/* XXX implement me */
-	return ANANAS_ERROR(BAD_OPERATION);
+	if (vo->vo_len == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	vmspace_t* vs = curthread->t_process->p_vmspace;
+	return vmspace_unmap(vs, reinterpret_cast<addr_t>(vo->vo_addr), vo->vo_len);
+}
+
+static errorcode_t
+sys_vmop_advise(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
+{
+	if (vo->vo_len == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	int advice;
+	switch(vo->vo_flags) {
+		case VMOP_ADVICE_NORMAL:
+			advice = VM_ADVICE_NORMAL;
+			break;
+		case VMOP_ADVICE_RANDOM:
+			advice = VM_ADVICE_RANDOM;
+			break;
+		case VMOP_ADVICE_SEQUENTIAL:
+			advice = VM_ADVICE_SEQUENTIAL;
+			break;
+		case VMOP_ADVICE_WILLNEED:
+			advice = VM_ADVICE_WILLNEED;
+			break;
+		case VMOP_ADVICE_DONTNEED:
+			advice = VM_ADVICE_DONTNEED;
+			break;
+		default:
+			return ANANAS_ERROR(BAD_FLAG);
+	}
+
+	vmspace_t* vs = curthread->t_process->p_vmspace;
+	return vmspace_advise(vs, reinterpret_cast<addr_t>(vo->vo_addr), vo->vo_len, advice);
 }
 
 errorcode_t
@@ -71,17 +106,22 @@ sys_vmop(ARG_CURTHREAD struct VMOP_OPTIONS* opts)
 	errorcode_t err;
 
 	/* Opbtain options */
-	struct VMOP_OPTIONS* vmop_opts;
-	err = syscall_map_buffer(curthread, opts, sizeof(*vmop_opts), VM_FLAG_READ | VM_FLAG_WRITE, (void**)&vmop_opts);
+	struct VMOP_OPTIONS vmop_opts;
+	err = copyin(&vmop_opts, opts, sizeof(vmop_opts));
 	ANANAS_ERROR_RETURN(err);
-	if (vmop_opts->vo_size != sizeof(*vmop_opts))
+	if (vmop_opts.vo_size != sizeof(vmop_opts))
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	switch(vmop_opts->vo_op) {
+	switch(vmop_opts.vo_op) {
 		case OP_MAP:
-			return sys_vmop_map(curthread, vmop_opts);
+			err = sys_vmop_map(curthread, &vmop_opts);
+			ANANAS_ERROR_RETURN(err);
+			/* Hand the resulting address and length back */
+			return copyout(opts, &vmop_opts, sizeof(vmop_opts));
 		case OP_UNMAP:
-			return sys_vmop_unmap(curthread, vmop_opts);
+			return sys_vmop_unmap(curthread, &vmop_opts);
+		case OP_ADVISE:
+			return sys_vmop_advise(curthread, &vmop_opts);
 		default:
 			return ANANAS_ERROR(BAD_OPERATION);
 	}
@@ -1,6 +1,9 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include "kernel/handle.h"
+#include "kernel/page.h"
 #include "kernel/trace.h"
+#include "kernel/usercopy.h"
 #include "kernel/vm.h"
 #include "syscall.h"
 
@@ -22,22 +25,42 @@ sys_write(thread_t* t, handleindex_t hindex, const void* buf, size_t* len)
 	err = syscall_fetch_size(t, len, &size);
 	ANANAS_ERROR_RETURN(err);
 
-	/* Attempt to map the buffer readonly */
-	void* buffer;
-	err = syscall_map_buffer(t, buf, size, VM_FLAG_READ, &buffer);
-	ANANAS_ERROR_RETURN(err);
+	if (h->h_hops->hop_write == NULL)
+		return ANANAS_ERROR(BAD_OPERATION);
 
-	/* And write data from to it */
-	if (h->h_hops->hop_write != NULL)
-		err = h->h_hops->hop_write(t, hindex, h, buf, &size);
-	else
-		err = ANANAS_ERROR(BAD_OPERATION);
-	ANANAS_ERROR_RETURN(err);
+	/* Copy the data in from the user in chunks, and write each of them */
+	size_t buf_size = (size < SYSCALL_BOUNCE_SIZE) ? size : SYSCALL_BOUNCE_SIZE;
+	struct PAGE* kbuf_page;
+	void* kbuf = page_alloc_single_mapped(&kbuf_page, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (kbuf == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	size_t total = 0;
+	do {
+		size_t chunk_len = size - total;
+		if (chunk_len > buf_size)
+			chunk_len = buf_size;
+		err = copyin(kbuf, static_cast<const char*>(buf) + total, chunk_len);
+		if (ananas_is_failure(err))
+			break;
+		size_t amount = chunk_len;
+		err = h->h_hops->hop_write(t, hindex, h, kbuf, &amount);
+		if (ananas_is_failure(err))
+			break;
+		total += amount;
+		if (amount < chunk_len)
+			break;
+	} while (total < size);
+	page_free(kbuf_page);
 
-	/* Finally, inform the user of the length read - the read went OK */
-	err = syscall_set_size(t, len, size);
+	/* If we wrote anything, report that; the error will show up again next time */
+	if (total == 0)
+		ANANAS_ERROR_RETURN(err);
+
+	/* Finally, inform the user of the length written */
+	err = syscall_set_size(t, len, total);
 	ANANAS_ERROR_RETURN(err);
 
-	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, size);
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, total);
 	return err;
 }
+
@@ -14,6 +14,7 @@
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
+#include "kernel/slab.h"
 #include "kernel/trace.h"
 #include "kernel/vfs/types.h"
 #include "kernel/vfs/mount.h"
@@ -26,6 +27,8 @@ namespace {
 mutex_t dcache_mtx;
 struct DENTRY_QUEUE	dcache_inuse;
 struct DENTRY_QUEUE	dcache_free;
+struct SLAB_CACHE dcache_cache;
+unsigned int dcache_num_items;
 
 inline void dcache_lock()
 {
@@ -42,6 +45,31 @@ inline void dcache_assert_locked()
 	mutex_assert(&dcache_mtx, MTX_LOCKED);
 }
 
+void
+dcache_ctor(void* obj)
+{
+	memset(obj, 0, sizeof(struct DENTRY));
+}
+
+/*
+ * Called when memory is tight; throws away all unused dentries and hands the
+ * free ones back to the slab cache.
+ */
+void
+dcache_reclaim(struct SLAB_CACHE* cache)
+{
+	dcache_purge_old_entries();
+
+	dcache_lock();
+	while (!LIST_EMPTY(&dcache_free)) {
+		struct DENTRY* d = LIST_HEAD(&dcache_free);
+		LIST_POP_HEAD(&dcache_free);
+		slab_free(&dcache_cache, d);
+		dcache_num_items--;
+	}
+	dcache_unlock();
+}
+
 errorcode_t
 dcache_init()
 {
@@ -49,17 +77,9 @@ dcache_init()
 	LIST_INIT(&dcache_inuse);
 	LIST_INIT(&dcache_free);
 
-	/*
-	 * Make an empty cache; we allocate one big pool and set up pointers to the
-	 * items as necessary.
-	 */
-	{
-		auto dentry = static_cast<struct DENTRY*>(kmalloc(DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY)));
-		memset(dentry, 0, DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY));
-		for (int i = 0; i < DCACHE_ITEMS_PER_FS; i++, dentry++)
-			LIST_APPEND(&dcache_free, dentry);
-	}
-
+	/* Start with an empty cache; entries are allocated as needed */
+	slab_cache_init(&dcache_cache, "dentry", sizeof(struct DENTRY), dcache_ctor, dcache_reclaim);
+	dcache_num_items = 0;
 	return ananas_success();
 }
 
@@ -74,6 +94,15 @@ dcache_find_entry_to_use()
 			return d;
 	}
 
+	/* Grow the cache if we are allowed to */
+	if (dcache_num_items < DCACHE_ITEMS_PER_FS) {
+		auto d = static_cast<struct DENTRY*>(slab_alloc(&dcache_cache));
+		if (d != nullptr) {
+			dcache_num_items++;
+			return d;
+		}
+	}
+
 	/*
 	 * Our dcache is ordered from old-to-new, so we'll start at the back and
 	 * take anything which has no refs and isn't a root dentry.
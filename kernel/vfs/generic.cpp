@@ -2,10 +2,15 @@
 #include <ananas/error.h>
 #include "kernel/bio.h"
 #include "kernel/device.h"
+#include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/page.h"
 #include "kernel/trace.h"
+#include "kernel/vm.h"
+#include "kernel/vmpage.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/generic.h"
+#include "kernel/vfs/pagecache.h"
 
 TRACE_SETUP;
 
@@ -62,8 +67,9 @@ vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const ch
 	}
 }
 
-errorcode_t
-vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
+/* Reads file data using the block I/O layer; used for anything not kept in the page cache */
+static errorcode_t
+vfs_generic_read_bio(struct VFS_FILE* file, void* buf, size_t* len)
 {
 	struct VFS_INODE* inode = file->f_dentry->d_inode;
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
@@ -71,8 +77,6 @@ vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 	size_t left = *len;
 	struct BIO* bio = NULL;
 
-	KASSERT(inode->i_iops->block_map != NULL, "called without block_map implementation");
-
 	/* Adjust left so that we don't attempt to read beyond the end of the file */
 	if ((inode->i_sb.st_size - file->f_offset) < left) {
 		left = inode->i_sb.st_size - file->f_offset;
@@ -114,6 +118,64 @@ vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 	return ananas_success();
 }
 
+errorcode_t
+vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	struct DENTRY* dentry = file->f_dentry;
+	struct VFS_INODE* inode = dentry->d_inode;
+	size_t read = 0;
+	size_t left = *len;
+
+	KASSERT(inode->i_iops->block_map != NULL, "called without block_map implementation");
+	if (!vfs_pagecache_is_used(inode))
+		return vfs_generic_read_bio(file, buf, len);
+
+	/* Adjust left so that we don't attempt to read beyond the end of the file */
+	if ((inode->i_sb.st_size - file->f_offset) < left) {
+		left = inode->i_sb.st_size - file->f_offset;
+	}
+
+	while(left > 0) {
+		if (!vfs_is_filesystem_sane(inode->i_fs))
+			return ANANAS_ERROR(IO);
+
+		/*
+		 * Pages are created read-only as they may end up being mapped as-is; writes
+		 * never go through the mappings.
+		 */
+		off_t page_offset = file->f_offset & ~(off_t)(PAGE_SIZE - 1);
+		struct VM_PAGE* vp;
+		errorcode_t err = vfs_pagecache_get(dentry, page_offset, VM_PAGE_FLAG_READONLY, &vp);
+		ANANAS_ERROR_RETURN(err);
+
+		/*
+		 * Hold a reference so the page stays alive, but unlock it: copying to buf
+		 * may fault and the fault handler could need this page.
+		 */
+		struct PAGE* p = vmpage_get_page(vp);
+		vmpage_ref(vp);
+		vmpage_unlock(vp);
+
+		/* Copy as much from the current page as we can */
+		off_t cur_offset = file->f_offset - page_offset;
+		size_t chunk_len = PAGE_SIZE - cur_offset;
+		if (chunk_len > left)
+			chunk_len = left;
+		auto data = static_cast<char*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ));
+		memcpy(buf, data + cur_offset, chunk_len);
+		kmem_unmap(data, PAGE_SIZE);
+		vmpage_lock(vp);
+		vmpage_deref(vp);
+
+		read += chunk_len;
+		buf = static_cast<void*>(static_cast<char*>(buf) + chunk_len);
+		left -= chunk_len;
+		file->f_offset += chunk_len;
+	}
+	*len = read;
+	return ananas_success();
+}
+
 errorcode_t
 vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 {
@@ -124,6 +186,7 @@ vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 	struct BIO* bio = NULL;
 
 	KASSERT(inode->i_iops->block_map != NULL, "called without block_map implementation");
+	bool pagecache = vfs_pagecache_is_used(inode);
 
 	int inode_dirty = 0;
 	blocknr_t cur_block = 0;
@@ -161,6 +224,10 @@ vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 		memcpy((void*)(static_cast<char*>(BIO_DATA(bio)) + cur_offset), buf, chunk_len);
 		bio_set_dirty(bio);
 
+		/* Writes go through to the block; keep any cached copy in sync */
+		if (pagecache)
+			vfs_pagecache_update(inode, file->f_offset, static_cast<char*>(BIO_DATA(bio)) + cur_offset, chunk_len);
+
 		/* Update the offsets and sizes */
 		written += chunk_len;
 		buf = static_cast<const void*>(static_cast<const char*>(buf) + chunk_len);
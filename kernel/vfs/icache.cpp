@@ -6,10 +6,12 @@
 #include "kernel/lock.h"
 #include "kernel/mm.h"
 #include "kernel/schedule.h" // XXX
+#include "kernel/slab.h"
 #include "kernel/trace.h"
 #include "kernel/vmpage.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/icache.h"
+#include "kernel/vfs/pagecache.h"
 #include "options.h"
 
 TRACE_SETUP;
@@ -27,6 +29,8 @@ LIST_DEFINE(INODE_LIST, struct VFS_INODE);
 mutex_t icache_mtx;
 struct INODE_LIST icache_inuse;
 struct INODE_LIST icache_free;
+struct SLAB_CACHE icache_cache;
+unsigned int icache_num_items;
 
 inline void icache_lock()
 {
@@ -43,6 +47,32 @@ inline void icache_assert_locked()
 	mutex_assert(&icache_mtx, MTX_LOCKED);
 }
 
+void
+icache_ctor(void* obj)
+{
+	// Inodes keep their mutex initialized while they are in the slab cache
+	auto inode = static_cast<struct VFS_INODE*>(obj);
+	memset(inode, 0, sizeof(struct VFS_INODE));
+	mutex_init(&inode->i_mutex, "inode");
+}
+
+void icache_purge_old_entries();
+
+// Called when memory is tight; hands all inodes we can do without back
+void
+icache_reclaim(struct SLAB_CACHE* cache)
+{
+	icache_lock();
+	icache_purge_old_entries();
+	while (!LIST_EMPTY(&icache_free)) {
+		struct VFS_INODE* inode = LIST_HEAD(&icache_free);
+		LIST_POP_HEAD(&icache_free);
+		slab_free(&icache_cache, inode);
+		icache_num_items--;
+	}
+	icache_unlock();
+}
+
 errorcode_t
 icache_init()
 {
@@ -50,17 +80,9 @@ icache_init()
 	LIST_INIT(&icache_inuse);
 	LIST_INIT(&icache_free);
 
-	// Allocate inodes - we can set up some basic information here
-	// XXX we could use a slab allocator for this
-	{
-		auto inode = static_cast<struct VFS_INODE*>(kmalloc(ICACHE_ITEMS * sizeof(struct VFS_INODE)));
-		memset(inode, 0, ICACHE_ITEMS * sizeof(struct VFS_INODE));
-		for (int i = 0; i < ICACHE_ITEMS; i++, inode++) {
-			mutex_init(&inode->i_mutex, "inode");
-			LIST_APPEND(&icache_free, inode);
-		}
-	}
-
+	// Inodes are allocated on demand, up to ICACHE_ITEMS
+	slab_cache_init(&icache_cache, "inode", sizeof(struct VFS_INODE), icache_ctor, icache_reclaim);
+	icache_num_items = 0;
 	return ananas_success();
 }
 
@@ -89,7 +111,8 @@ icache_purge_old_entries()
 			continue;
 		}
 
-		// Throw the actual inode away
+		// Throw the actual inode away, along with its cached pages
+		vfs_pagecache_purge(inode);
 		struct VFS_MOUNTED_FS* fs = inode->i_fs;
 		if (fs->fs_fsops->discard_inode != NULL)
 			fs->fs_fsops->discard_inode(inode);
@@ -118,6 +141,15 @@ icache_find_item_to_use()
 			return inode;
 		}
 
+		// Grow the cache if we are allowed to
+		if (icache_num_items < ICACHE_ITEMS) {
+			auto inode = static_cast<struct VFS_INODE*>(slab_alloc(&icache_cache));
+			if (inode != nullptr) {
+				icache_num_items++;
+				return inode;
+			}
+		}
+
 		/* Freelist is empty; we need to sacrifice an item from the cache */
 		icache_purge_old_entries();
 
@@ -313,9 +345,9 @@ vfs_dump_inode(struct VFS_INODE* inode)
 	kprintf("  uid/gid = %u:%u\n", sb->st_uid, sb->st_gid);
 	kprintf("  size    = %u\n", (uint32_t)sb->st_size); /* XXX for now */
 	kprintf("  blksize = %u\n", sb->st_blksize);
-	LIST_FOREACH(&inode->i_pages, vp, struct VM_PAGE) {
-		vmpage_dump(vp, "    ");
-	}
+	unsigned long index;
+	for (void* vp = radix_next(&inode->i_pages, 0, &index); vp != NULL; vp = radix_next(&inode->i_pages, index + 1, &index))
+		vmpage_dump(static_cast<struct VM_PAGE*>(vp), "    ");
 }
 
 #ifdef OPTION_KDB
@@ -0,0 +1,268 @@
+/*
+ * Page cache; see kernel/vfs/pagecache.h for an overview.
+ *
+ * Cached pages are VM pages hooked to the inode, which holds a reference to
+ * each of them. They live until pageout evicts them or the inode is thrown
+ * out of the inode cache, at which point nothing can map them anymore.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include "kernel/bio.h"
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/page.h"
+#include "kernel/trace.h"
+#include "kernel/vm.h"
+#include "kernel/vmpage.h"
+#include "kernel/vfs/core.h"
+#include "kernel/vfs/pagecache.h"
+#include "kernel/vfs/types.h"
+
+TRACE_SETUP;
+
+/* Largest block of pages, as an order, that is filled in one go */
+#define PAGECACHE_FILL_MAX_ORDER 6
+
+namespace {
+
+/*
+ * Reads file data using the inode's block map; this bypasses the cache. The
+ * data ends up in the page cache, so the block buffers are discarded to
+ * avoid keeping it twice.
+ */
+errorcode_t
+pagecache_read_blocks(struct VFS_INODE* inode, char* buf, off_t offset, size_t len)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	while (len > 0) {
+		if (!vfs_is_filesystem_sane(fs))
+			return ANANAS_ERROR(IO);
+
+		blocknr_t block;
+		errorcode_t err = inode->i_iops->block_map(inode, offset / (blocknr_t)fs->fs_block_size, &block, 0);
+		ANANAS_ERROR_RETURN(err);
+
+		struct BIO* bio;
+		err = vfs_bread(fs, block, &bio);
+		ANANAS_ERROR_RETURN(err);
+
+		size_t cur_offset = offset % (blocknr_t)fs->fs_block_size;
+		size_t chunk_len = fs->fs_block_size - cur_offset;
+		if (chunk_len > len)
+			chunk_len = len;
+		memcpy(buf, static_cast<char*>(BIO_DATA(bio)) + cur_offset, chunk_len);
+		bio_discard(bio);
+
+		buf += chunk_len;
+		offset += chunk_len;
+		len -= chunk_len;
+	}
+	return ananas_success();
+}
+
+/* Reads file data using vfs_read(); only to be used if the inode's read() doesn't use the cache */
+errorcode_t
+pagecache_read_file(struct DENTRY* dentry, char* buf, off_t offset, size_t len)
+{
+	struct VFS_FILE f;
+	memset(&f, 0, sizeof(f));
+	f.f_dentry = dentry;
+
+	errorcode_t err = vfs_seek(&f, offset);
+	ANANAS_ERROR_RETURN(err);
+
+	size_t amount = len;
+	err = vfs_read(&f, buf, &amount);
+	ANANAS_ERROR_RETURN(err);
+
+	if (amount != len)
+		return ANANAS_ERROR(SHORT_READ);
+	return ananas_success();
+}
+
+/*
+ * Reads up to num_pages file pages starting at first into block p, which must
+ * be large enough, and hooks them up to the inode; p is freed. The pages are
+ * hooked up before they are read, so that anyone looking them up (such as a
+ * write updating the cache) waits until they are filled: a write which races
+ * with the read cannot leave a stale page behind. Reading stops at the first
+ * page which is resident already; num_pages is set to the number of pages
+ * handled, including that one.
+ */
+errorcode_t
+pagecache_fill_block(struct DENTRY* dentry, off_t first, unsigned int& num_pages, struct PAGE* p, int vp_flags)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	unsigned int order = p->p_order;
+
+	struct VM_PAGE* vps[1U << PAGECACHE_FILL_MAX_ORDER];
+	KASSERT(num_pages <= (1U << PAGECACHE_FILL_MAX_ORDER), "filling too many pages (%u)", num_pages);
+	unsigned int num_pending = num_pages;
+	errorcode_t err = vmpage_create_pending(inode, first, &num_pending, vp_flags, vps);
+	if (ananas_is_failure(err))
+		num_pending = 0;
+	page_split(p);
+	for (unsigned int n = num_pending; n < (1U << order); n++)
+		page_free(p + n);
+	ANANAS_ERROR_RETURN(err);
+	if (num_pending == 0) {
+		// Someone else read the first page in the meantime; keep theirs
+		num_pages = 1;
+		return ananas_success();
+	}
+	num_pages = num_pending;
+
+	auto buf = static_cast<char*>(kmem_map(page_get_paddr(p), num_pending * PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	size_t len = num_pending * PAGE_SIZE;
+	size_t read_length = len;
+	if (first + read_length > inode->i_sb.st_size) {
+		// This inode is simply not long enough to cover our read - adjust XXX what when it grows?
+		read_length = inode->i_sb.st_size - first;
+		// Zero out everything after the part we will read so we don't leak any data
+		memset(buf + read_length, 0, len - read_length);
+	}
+
+	if (vfs_pagecache_is_used(inode))
+		err = pagecache_read_blocks(inode, buf, first, read_length);
+	else
+		err = pagecache_read_file(dentry, buf, first, read_length);
+	kmem_unmap(buf, num_pending * PAGE_SIZE);
+
+	for (unsigned int n = 0; n < num_pending; n++) {
+		struct VM_PAGE* vp = vps[n];
+		if (ananas_is_failure(err)) {
+			page_free(p + n);
+			vmpage_abort_pending(vp);
+			continue;
+		}
+		vp->vp_page = p + n;
+		vp->vp_flags &= ~VM_PAGE_FLAG_PENDING;
+		vmpage_unlock(vp);
+	}
+	return err;
+}
+
+} // unnamed namespace
+
+bool
+vfs_pagecache_is_used(struct VFS_INODE* inode)
+{
+	/*
+	 * Directories are left alone as filesystems modify them using the block
+	 * I/O layer directly.
+	 */
+	return S_ISREG(inode->i_sb.st_mode) && inode->i_iops->block_map != NULL;
+}
+
+errorcode_t
+vfs_pagecache_fill(struct DENTRY* dentry, off_t first, off_t last, int vp_flags)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	while (first < last) {
+		if (vmpage_is_cached(inode, first)) {
+			first += PAGE_SIZE;
+			continue;
+		}
+
+		// Find the run of missing pages; these can be read in one go
+		off_t run_end = first + PAGE_SIZE;
+		while (run_end < last && run_end - first < (PAGE_SIZE << PAGECACHE_FILL_MAX_ORDER) && !vmpage_is_cached(inode, run_end))
+			run_end += PAGE_SIZE;
+
+		unsigned int num_pages = (run_end - first) / PAGE_SIZE;
+		unsigned int order = 0;
+		while ((1U << order) < num_pages)
+			order++;
+
+		// A large block is merely convenient; settle for less if memory is fragmented
+		struct PAGE* p = nullptr;
+		while (order > 0 && (p = page_alloc_order_flags(order, PAGE_ALLOC_TRY)) == nullptr)
+			order--;
+		if (p == nullptr)
+			p = page_alloc_single();
+		if (p == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		if (num_pages > (1U << order))
+			num_pages = 1U << order;
+
+		errorcode_t err = pagecache_fill_block(dentry, first, num_pages, p, vp_flags);
+		ANANAS_ERROR_RETURN(err);
+		first += num_pages * PAGE_SIZE;
+	}
+	return ananas_success();
+}
+
+errorcode_t
+vfs_pagecache_get(struct DENTRY* dentry, off_t offs, int vp_flags, struct VM_PAGE** vp_out)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	struct VM_PAGE* vp;
+	while ((vp = vmpage_lookup_inode_locked(inode, offs)) == nullptr) {
+		// Note that the page may be evicted before we can look it up; if so, retry
+		errorcode_t err = vfs_pagecache_fill(dentry, offs, offs + PAGE_SIZE, vp_flags);
+		ANANAS_ERROR_RETURN(err);
+	}
+	*vp_out = vp;
+	return ananas_success();
+}
+
+void
+vfs_pagecache_update(struct VFS_INODE* inode, off_t offs, const void* buf, size_t len)
+{
+	auto src = static_cast<const char*>(buf);
+	while (len > 0) {
+		off_t page_offs = offs & ~(off_t)(PAGE_SIZE - 1);
+		size_t cur_offset = offs - page_offs;
+		size_t chunk_len = PAGE_SIZE - cur_offset;
+		if (chunk_len > len)
+			chunk_len = len;
+
+		struct VM_PAGE* vp = vmpage_lookup_inode_locked(inode, page_offs);
+		if (vp != nullptr) {
+			auto data = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+			memcpy(data + cur_offset, src, chunk_len);
+			kmem_unmap(data, PAGE_SIZE);
+			vmpage_unlock(vp);
+		}
+
+		src += chunk_len;
+		offs += chunk_len;
+		len -= chunk_len;
+	}
+}
+
+void
+vfs_pagecache_drop(struct VFS_INODE* inode, off_t first, off_t last)
+{
+	INODE_LOCK(inode);
+	unsigned long index;
+	void* item;
+	unsigned long next = first / PAGE_SIZE;
+	const unsigned long end = (last + PAGE_SIZE - 1) / PAGE_SIZE;
+	while ((item = radix_next(&inode->i_pages, next, &index)) != nullptr && index < end) {
+		next = index + 1;
+		auto vp = static_cast<struct VM_PAGE*>(item);
+		vmpage_lock(vp);
+		if (vp->vp_refcount == 1 && (vp->vp_flags & VM_PAGE_FLAG_PENDING) == 0)
+			vmpage_evict(vp);
+		else
+			vmpage_unlock(vp);
+	}
+	INODE_UNLOCK(inode);
+}
+
+void
+vfs_pagecache_purge(struct VFS_INODE* inode)
+{
+	unsigned long index;
+	void* item;
+	while ((item = radix_next(&inode->i_pages, 0, &index)) != nullptr) {
+		radix_remove(&inode->i_pages, index);
+		auto vp = static_cast<struct VM_PAGE*>(item);
+		vmpage_lock(vp);
+		KASSERT(vp->vp_refcount == 1, "purging page %p which is still in use (refcount %d)", vp, vp->vp_refcount);
+		vmpage_deref(vp);
+	}
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,499 @@
+/*
+ * Page cache reclaim and swapping; see kernel/pageout.h for an overview.
+ *
+ * The lists are protected by spl_pageout, which is innermost: it is taken
+ * while holding inode and page locks. Pages are therefore only locked using
+ * mutex_trylock() while the lists are locked; anything we can't lock right
+ * away is simply skipped. A page we took off a list and locked cannot be
+ * freed under our nose, as that requires its lock.
+ *
+ * Anonymous pages to be swapped out are collected in clusters, which are
+ * given consecutive swap slots; the pages stay locked until written.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include "kernel/init.h"
+#include "kernel/kdb.h"
+#include "kernel/lib.h"
+#include "kernel/list.h"
+#include "kernel/lock.h"
+#include "kernel/page.h"
+#include "kernel/pageout.h"
+#include "kernel/pcpu.h"
+#include "kernel/slab.h"
+#include "kernel/swap.h"
+#include "kernel/thread.h"
+#include "kernel/vmpage.h"
+#include "kernel/vmspace.h"
+#include "kernel/vfs/types.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/vm.h"
+#include "options.h"
+
+namespace {
+
+LIST_DEFINE(VM_PAGE_LRU, struct VM_PAGE);
+
+spinlock_t spl_pageout = SPINLOCK_DEFAULT_INIT;
+struct VM_PAGE_LRU pageout_active;
+struct VM_PAGE_LRU pageout_inactive;
+unsigned int pageout_num_active = 0;
+unsigned int pageout_num_inactive = 0;
+
+/* Watermarks, in pages; set once the thread is started */
+unsigned int pageout_low = 0;
+unsigned int pageout_high = 0;
+
+bool pageout_sleeping = false;
+semaphore_t pageout_sem;
+thread_t pageout_thread;
+
+/* Threads waiting for a pass to complete, and the number of pages freed by all passes */
+unsigned int pageout_num_waiters = 0;
+unsigned int pageout_freed_total = 0;
+semaphore_t pageout_done_sem;
+
+/* Statistics */
+unsigned int pageout_wakeups = 0;
+unsigned int pageout_evicted = 0;
+unsigned int pageout_activated = 0;
+unsigned int pageout_deactivated = 0;
+unsigned int pageout_swapped = 0;
+unsigned int pageout_split = 0;
+
+/* Puts vp in front of the given list; spl_pageout must be held */
+void
+pageout_list(struct VM_PAGE* vp, int lru)
+{
+	KASSERT(vp->vp_lru == VM_PAGE_LRU_NONE, "page %p already listed", vp);
+	vp->vp_lru = lru;
+	if (lru == VM_PAGE_LRU_ACTIVE) {
+		LIST_PREPEND_IP(&pageout_active, lru, vp);
+		pageout_num_active++;
+	} else {
+		LIST_PREPEND_IP(&pageout_inactive, lru, vp);
+		pageout_num_inactive++;
+	}
+}
+
+/* Removes vp from the list it is on; spl_pageout must be held */
+void
+pageout_unlist(struct VM_PAGE* vp)
+{
+	if (vp->vp_lru == VM_PAGE_LRU_ACTIVE) {
+		LIST_REMOVE_IP(&pageout_active, lru, vp);
+		pageout_num_active--;
+	} else {
+		KASSERT(vp->vp_lru == VM_PAGE_LRU_INACTIVE, "page %p not listed", vp);
+		LIST_REMOVE_IP(&pageout_inactive, lru, vp);
+		pageout_num_inactive--;
+	}
+	vp->vp_lru = VM_PAGE_LRU_NONE;
+}
+
+/*
+ * Takes the least recently used page of list and locks it; returns nullptr if
+ * the list is empty. If the page cannot be locked, it is rotated to the front
+ * of the list and *skipped is set.
+ */
+struct VM_PAGE*
+pageout_take(struct VM_PAGE_LRU* list, bool* skipped)
+{
+	*skipped = false;
+	spinlock_lock(&spl_pageout);
+	struct VM_PAGE* vp = LIST_TAIL(list);
+	if (vp == nullptr) {
+		spinlock_unlock(&spl_pageout);
+		return nullptr;
+	}
+
+	int lru = vp->vp_lru;
+	pageout_unlist(vp);
+	if (!mutex_trylock(&vp->vp_mtx)) {
+		pageout_list(vp, lru);
+		*skipped = true;
+	}
+	spinlock_unlock(&spl_pageout);
+	return vp;
+}
+
+/* Puts locked page vp on the given list and unlocks it; counter, if any, is incremented */
+void
+pageout_put(struct VM_PAGE* vp, int lru, unsigned int* counter = nullptr)
+{
+	spinlock_lock(&spl_pageout);
+	pageout_list(vp, lru);
+	if (counter != nullptr)
+		(*counter)++;
+	spinlock_unlock(&spl_pageout);
+	vmpage_unlock(vp);
+}
+
+/*
+ * Returns whether locked page vp was referenced since we last looked; this
+ * resets the referenced state, both ours and that of the mappings of vp.
+ */
+bool
+pageout_referenced(struct VM_PAGE* vp)
+{
+	bool referenced = (vp->vp_flags & VM_PAGE_FLAG_REFERENCED) != 0;
+	vp->vp_flags &= ~VM_PAGE_FLAG_REFERENCED;
+
+	// Anonymous pages are mapped by their own area
+	vmarea_t* va = vp->vp_vmarea;
+	if (va != nullptr && md_test_and_clear_accessed(va->va_vmspace, vp->vp_vaddr))
+		referenced = true;
+
+	/*
+	 * Links cannot be freed without locking us, so their area and vmspace are
+	 * still around; an area which is being freed clears vp_vmarea first.
+	 */
+	LIST_FOREACH_IP(&vp->vp_links, link, vp_link, struct VM_PAGE) {
+		va = vp_link->vp_vmarea;
+		if (va != nullptr && md_test_and_clear_accessed(va->va_vmspace, vp_link->vp_vaddr))
+			referenced = true;
+	}
+	return referenced;
+}
+
+/* Moves up to count unreferenced active pages to the inactive list */
+void
+pageout_deactivate(unsigned int count)
+{
+	for (unsigned int n = 0; n < count && pageout_num_inactive < pageout_num_active; n++) {
+		bool skipped;
+		struct VM_PAGE* vp = pageout_take(&pageout_active, &skipped);
+		if (vp == nullptr)
+			break;
+		if (skipped)
+			continue;
+
+		if (pageout_referenced(vp)) {
+			pageout_put(vp, VM_PAGE_LRU_ACTIVE);
+			continue;
+		}
+		pageout_put(vp, VM_PAGE_LRU_INACTIVE, &pageout_deactivated);
+	}
+}
+
+/*
+ * Considers locked anonymous page vp, taken off the inactive list. If it is
+ * to be swapped out and swap_candidate is set, it is stored there and stays
+ * locked; large pages are split up instead.
+ */
+void
+pageout_scan_anonymous(struct VM_PAGE* vp, struct VM_PAGE** swap_candidate)
+{
+	if (!vmpage_swappable(vp, true)) {
+		// Pages shared by a fork may become swappable once unshared; anything else is dropped
+		if (vp->vp_refcount > 1)
+			pageout_put(vp, VM_PAGE_LRU_ACTIVE);
+		else
+			vmpage_unlock(vp);
+		return;
+	}
+	if (pageout_referenced(vp)) {
+		pageout_put(vp, VM_PAGE_LRU_ACTIVE, &pageout_activated);
+		return;
+	}
+	if (swap_candidate == nullptr) {
+		pageout_put(vp, VM_PAGE_LRU_INACTIVE);
+		return;
+	}
+#ifdef MD_LARGE_PAGE_ORDER
+	if (vp->vp_flags & VM_PAGE_FLAG_LARGE) {
+		/*
+		 * Large pages are swapped out piece by piece; splitting them puts the
+		 * pieces on the active list, where they age like any other page. If we
+		 * cannot, the page is listed again as it was.
+		 */
+		vmarea_t* va = vp->vp_vmarea;
+		if (ananas_is_success(vmpage_split(va->va_vmspace, va, vp)))
+			pageout_split++;
+		return;
+	}
+#endif
+	*swap_candidate = vp;
+}
+
+/*
+ * Considers the least recently used inactive page; returns false if there is
+ * none. *evicted is set if the page was freed. Anonymous pages can only be
+ * swapped out, which is left to the caller: if swap_candidate is set, such a
+ * page may be stored there, locked.
+ */
+bool
+pageout_scan_inactive(bool* evicted, struct VM_PAGE** swap_candidate)
+{
+	*evicted = false;
+	bool skipped;
+	struct VM_PAGE* vp = pageout_take(&pageout_inactive, &skipped);
+	if (vp == nullptr)
+		return false;
+	if (skipped)
+		return true;
+
+	struct VFS_INODE* inode = vp->vp_inode;
+	if (inode == nullptr) {
+		pageout_scan_anonymous(vp, swap_candidate);
+		return true;
+	}
+
+	// Mapped pages cannot be evicted as we do not know where; keep them active
+	if (pageout_referenced(vp) || vp->vp_refcount > 1) {
+		pageout_put(vp, VM_PAGE_LRU_ACTIVE, &pageout_activated);
+		return true;
+	}
+	if ((vp->vp_flags & VM_PAGE_FLAG_PENDING) || !mutex_trylock(&inode->i_mutex)) {
+		pageout_put(vp, VM_PAGE_LRU_INACTIVE);
+		return true;
+	}
+
+	vmpage_evict(vp);
+	INODE_UNLOCK(inode);
+	*evicted = true;
+	return true;
+}
+
+/*
+ * Swaps out the count locked pages in vps, which are unlocked; returns the
+ * number of pages swapped out. Anything which cannot be swapped out goes back
+ * on a list.
+ */
+unsigned int
+pageout_swap_out(struct VM_PAGE** vps, unsigned int count)
+{
+	unsigned int swapped = 0;
+	unsigned int n = 0;
+	while (n < count) {
+		swapslot_t slot;
+		unsigned int num = swap_alloc(&vps[n], count - n, &slot);
+		if (num == 0)
+			break; // swap is full
+		for (unsigned int i = 0; i < num; i++, n++) {
+			struct VM_PAGE* vp = vps[n];
+			if (ananas_is_success(vmpage_swapout(vp, slot + i))) {
+				vmpage_unlock(vp);
+				swapped++;
+			} else {
+				// The page is mapped again once it is faulted; leave it be for a while
+				swap_free(slot + i);
+				pageout_put(vp, VM_PAGE_LRU_ACTIVE);
+			}
+		}
+	}
+	for (/* nothing */; n < count; n++)
+		pageout_put(vps[n], VM_PAGE_LRU_INACTIVE);
+	return swapped;
+}
+
+/*
+ * Tries to free count inactive pages by evicting them or, if may_swap is
+ * set, by swapping them out; returns the number of pages freed.
+ */
+unsigned int
+pageout_reclaim_pages(unsigned int count, bool may_swap)
+{
+	// Age the active list so that the inactive list holds candidates
+	pageout_deactivate(count);
+
+	/*
+	 * Every page on the inactive list will be looked at once at most, so that
+	 * we do not keep spinning if nothing can be evicted.
+	 */
+	unsigned int evicted = 0, swapped = 0;
+	struct VM_PAGE* cluster[SWAP_CLUSTER];
+	unsigned int cluster_len = 0;
+	for (unsigned int scan = pageout_num_inactive; evicted + swapped + cluster_len < count && scan > 0; scan--) {
+		bool page_evicted;
+		struct VM_PAGE* vp = nullptr;
+		if (!pageout_scan_inactive(&page_evicted, may_swap ? &vp : nullptr))
+			break;
+		if (page_evicted)
+			evicted++;
+		if (vp == nullptr)
+			continue;
+
+		cluster[cluster_len++] = vp;
+		if (cluster_len == SWAP_CLUSTER) {
+			swapped += pageout_swap_out(cluster, cluster_len);
+			cluster_len = 0;
+		}
+	}
+	if (cluster_len > 0)
+		swapped += pageout_swap_out(cluster, cluster_len);
+
+	spinlock_lock(&spl_pageout);
+	pageout_evicted += evicted;
+	pageout_swapped += swapped;
+	spinlock_unlock(&spl_pageout);
+	return evicted + swapped;
+}
+
+/* Lets everyone waiting for a pass know it is done; freed is what it freed */
+void
+pageout_release_waiters(unsigned int freed)
+{
+	spinlock_lock(&spl_pageout);
+	pageout_freed_total += freed;
+	unsigned int waiters = pageout_num_waiters;
+	pageout_num_waiters = 0;
+	spinlock_unlock(&spl_pageout);
+
+	for (/* nothing */; waiters > 0; waiters--)
+		sem_signal(&pageout_done_sem);
+}
+
+void
+pageout_thread_func(void* context)
+{
+	while (1) {
+		unsigned int total_pages, avail_pages;
+		page_get_stats(&total_pages, &avail_pages);
+
+		/*
+		 * Evict cached file pages first; if there are none left, make the slab
+		 * caches hand back whatever they can (this throws out unused inodes and
+		 * their pages, too). Swapping out anonymous memory is the last resort.
+		 * Threads waiting for memory keep us going even if the high watermark
+		 * has been reached, as the pages we free may be taken right away.
+		 */
+		unsigned int freed = 0;
+		if (avail_pages < pageout_high || pageout_num_waiters > 0) {
+			freed = pageout_reclaim_pages(PAGEOUT_BATCH, false);
+			if (freed == 0)
+				freed = slab_reclaim();
+			if (freed == 0 && swap_available())
+				freed = pageout_reclaim_pages(PAGEOUT_BATCH, true);
+		}
+		pageout_release_waiters(freed);
+		if (freed > 0)
+			continue;
+
+		// Anyone who started waiting after we looked needs another pass
+		spinlock_lock(&spl_pageout);
+		bool sleep = pageout_num_waiters == 0;
+		pageout_sleeping = sleep;
+		spinlock_unlock(&spl_pageout);
+		if (sleep)
+			sem_wait(&pageout_sem);
+	}
+}
+
+errorcode_t
+start_pageout()
+{
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	pageout_low = total_pages / PAGEOUT_LOW_DIVISOR;
+	if (pageout_low < PAGEOUT_LOW_MIN)
+		pageout_low = PAGEOUT_LOW_MIN;
+	pageout_high = 2 * pageout_low;
+
+	sem_init(&pageout_sem, 0);
+	sem_init(&pageout_done_sem, 0);
+	kthread_init(&pageout_thread, "pageout", &pageout_thread_func, NULL);
+	thread_resume(&pageout_thread);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+INIT_FUNCTION(start_pageout, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+void
+pageout_insert(struct VM_PAGE* vp)
+{
+	spinlock_lock(&spl_pageout);
+	pageout_list(vp, VM_PAGE_LRU_INACTIVE);
+	spinlock_unlock(&spl_pageout);
+}
+
+void
+pageout_insert_anonymous(struct VM_PAGE* vp)
+{
+	vmpage_assert_locked(vp);
+
+	spinlock_lock(&spl_pageout);
+	if (vp->vp_lru == VM_PAGE_LRU_NONE)
+		pageout_list(vp, VM_PAGE_LRU_ACTIVE);
+	spinlock_unlock(&spl_pageout);
+}
+
+void
+pageout_remove(struct VM_PAGE* vp)
+{
+	spinlock_lock(&spl_pageout);
+	if (vp->vp_lru != VM_PAGE_LRU_NONE)
+		pageout_unlist(vp);
+	spinlock_unlock(&spl_pageout);
+}
+
+unsigned int
+pageout_reclaim(unsigned int count)
+{
+	// Swapping blocks, so this is left to the pageout thread
+	return pageout_reclaim_pages(count, false);
+}
+
+bool
+pageout_wait()
+{
+	/*
+	 * Without swap, the thread can do nothing we can't. Otherwise, we must be
+	 * able to sleep - and we mustn't be the one who'd wake us up.
+	 */
+	if (!swap_available() || PCPU_GET(nested_irq) > 0 || !md_interrupts_save())
+		return false;
+	if (PCPU_GET(curthread) == &pageout_thread)
+		return false;
+
+	spinlock_lock(&spl_pageout);
+	unsigned int freed_total = pageout_freed_total;
+	pageout_num_waiters++;
+	bool wakeup = pageout_sleeping;
+	pageout_sleeping = false;
+	if (wakeup)
+		pageout_wakeups++;
+	spinlock_unlock(&spl_pageout);
+
+	if (wakeup)
+		sem_signal(&pageout_sem);
+	sem_wait(&pageout_done_sem);
+	return pageout_freed_total != freed_total;
+}
+
+void
+pageout_wakeup()
+{
+	// This is called often, so only look at the statistics if it can matter
+	if (!pageout_sleeping)
+		return;
+
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	if (avail_pages >= pageout_low)
+		return;
+
+	spinlock_lock(&spl_pageout);
+	bool wakeup = pageout_sleeping;
+	pageout_sleeping = false;
+	if (wakeup)
+		pageout_wakeups++;
+	spinlock_unlock(&spl_pageout);
+
+	if (wakeup)
+		sem_signal(&pageout_sem);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(pageout, NULL, "Display pageout statistics")
+{
+	kprintf("lists: %u active, %u inactive\n", pageout_num_active, pageout_num_inactive);
+	kprintf("watermarks: low %u, high %u pages\n", pageout_low, pageout_high);
+	kprintf("%u wakeups, %u evicted, %u swapped, %u activated, %u deactivated, %u large pages split\n",
+	 pageout_wakeups, pageout_evicted, pageout_swapped, pageout_activated, pageout_deactivated, pageout_split);
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,366 @@
+/*
+ * Swap device handling; see kernel/swap.h for an overview.
+ *
+ * Every device keeps the page owning each of its slots, which is what lets
+ * swap_off() find the pages it must read back. This table is split in
+ * chunks so that no large contiguous allocation is needed. It is protected by
+ * swap_mtx, which is taken while holding page locks: swap_off() can thus
+ * only try to lock the owners and has to back off if that fails. A page
+ * cannot be freed without releasing its slot, so an owner we found stays
+ * around as long as we hold swap_mtx.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include "kernel/bio.h"
+#include "kernel/device.h"
+#include "kernel/init.h"
+#include "kernel/kdb.h"
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/lock.h"
+#include "kernel/mm.h"
+#include "kernel/page.h"
+#include "kernel/swap.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
+#include "kernel/vm.h"
+#include "kernel/vmpage.h"
+#include "options.h"
+
+TRACE_SETUP;
+
+namespace {
+
+#define SWAP_DEVICE_FLAG_DRAINING 1 /* being removed; no new slots are handed out */
+
+/* Number of slots per owner table chunk; these are small enough for kmalloc() size classes */
+#define SWAP_OWNER_CHUNK (2048 / sizeof(struct VM_PAGE*))
+
+/* Limits the chunk directory to 64KB, which allows for 8GB of swap per device */
+#define SWAP_MAX_SLOTS (SWAP_OWNER_CHUNK * 8192)
+
+struct SWAP_DEVICE {
+	Ananas::Device* sd_device;	/* nullptr if unused */
+	int sd_flags;
+	unsigned int sd_num_slots;
+	unsigned int sd_num_used;
+	unsigned int sd_next;		/* where the next search for free slots starts */
+	struct VM_PAGE*** sd_owner;	/* page owning each slot, if any, per chunk */
+};
+
+mutex_t swap_mtx;
+struct SWAP_DEVICE swap_device[SWAP_MAX_DEVICES];
+
+/* Number of devices slots can be allocated from; read without the lock as a hint */
+unsigned int swap_num_active = 0;
+
+/* Statistics */
+unsigned int swap_outs = 0;
+unsigned int swap_ins = 0;
+unsigned int swap_failures = 0;
+
+inline struct SWAP_DEVICE*
+swap_get_device(swapslot_t slot)
+{
+	unsigned int n = slot >> SWAP_SLOT_DEVICE_SHIFT;
+	KASSERT(n < SWAP_MAX_DEVICES && swap_device[n].sd_device != nullptr, "invalid swap slot %x", slot);
+	return &swap_device[n];
+}
+
+inline struct VM_PAGE*&
+swap_owner(struct SWAP_DEVICE* sd, unsigned int index)
+{
+	return sd->sd_owner[index / SWAP_OWNER_CHUNK][index % SWAP_OWNER_CHUNK];
+}
+
+unsigned int
+swap_owner_num_chunks(unsigned int num_slots)
+{
+	return (num_slots + SWAP_OWNER_CHUNK - 1) / SWAP_OWNER_CHUNK;
+}
+
+void
+swap_owner_free(struct VM_PAGE*** owner, unsigned int num_slots)
+{
+	for (unsigned int n = 0; n < swap_owner_num_chunks(num_slots); n++)
+		kfree(owner[n]);
+	kfree(owner);
+}
+
+/* Allocates an empty owner table for num_slots slots; returns nullptr if out of memory */
+struct VM_PAGE***
+swap_owner_alloc(unsigned int num_slots)
+{
+	const unsigned int num_chunks = swap_owner_num_chunks(num_slots);
+	auto owner = static_cast<struct VM_PAGE***>(kmalloc(num_chunks * sizeof(struct VM_PAGE**)));
+	if (owner == nullptr)
+		return nullptr;
+	memset(owner, 0, num_chunks * sizeof(struct VM_PAGE**));
+
+	for (unsigned int n = 0; n < num_chunks; n++) {
+		owner[n] = static_cast<struct VM_PAGE**>(kmalloc(SWAP_OWNER_CHUNK * sizeof(struct VM_PAGE*)));
+		if (owner[n] == nullptr) {
+			swap_owner_free(owner, num_slots); // kfree() ignores the chunks we didn't get to
+			return nullptr;
+		}
+		memset(owner[n], 0, SWAP_OWNER_CHUNK * sizeof(struct VM_PAGE*));
+	}
+	return owner;
+}
+
+inline blocknr_t
+swap_get_block(swapslot_t slot)
+{
+	return static_cast<blocknr_t>(slot & SWAP_SLOT_INDEX_MASK) * (PAGE_SIZE / BIO_SECTOR_SIZE);
+}
+
+/*
+ * Looks for up to count free consecutive slots on sd, at the first free slot
+ * from sd_next onwards; returns the number found and sets *index to the first.
+ */
+unsigned int
+swap_find_slots(struct SWAP_DEVICE* sd, unsigned int count, unsigned int* index)
+{
+	for (unsigned int n = 0; n < sd->sd_num_slots; n++) {
+		unsigned int first = (sd->sd_next + n) % sd->sd_num_slots;
+		if (swap_owner(sd, first) != nullptr)
+			continue;
+
+		unsigned int num = 1;
+		while (num < count && first + num < sd->sd_num_slots && swap_owner(sd, first + num) == nullptr)
+			num++;
+		*index = first;
+		return num;
+	}
+	return 0;
+}
+
+errorcode_t
+swap_init()
+{
+	mutex_init(&swap_mtx, "swap");
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+INIT_FUNCTION(swap_init, SUBSYSTEM_PROCESS, ORDER_ANY);
+
+errorcode_t
+swap_on(Ananas::Device* dev, size_t size)
+{
+	if (dev->GetBIODeviceOperations() == nullptr)
+		return ANANAS_ERROR(UNSUPPORTED);
+	size_t num_slots = size / PAGE_SIZE;
+	if (num_slots == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	static_assert(SWAP_MAX_SLOTS <= SWAP_SLOT_INDEX_MASK, "swap slots do not fit in a swapslot_t");
+	if (num_slots > SWAP_MAX_SLOTS) {
+		kprintf("swap: only using the first %u pages of %s\n", static_cast<unsigned int>(SWAP_MAX_SLOTS), dev->d_Name);
+		num_slots = SWAP_MAX_SLOTS;
+	}
+
+	struct VM_PAGE*** owner = swap_owner_alloc(num_slots);
+	if (owner == nullptr)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
+	mutex_lock(&swap_mtx);
+	struct SWAP_DEVICE* sd_free = nullptr;
+	for (unsigned int n = 0; n < SWAP_MAX_DEVICES; n++) {
+		struct SWAP_DEVICE* sd = &swap_device[n];
+		if (sd->sd_device == dev) {
+			mutex_unlock(&swap_mtx);
+			swap_owner_free(owner, num_slots);
+			return ANANAS_ERROR(FILE_EXISTS);
+		}
+		if (sd->sd_device == nullptr && sd_free == nullptr)
+			sd_free = sd;
+	}
+	if (sd_free == nullptr) {
+		mutex_unlock(&swap_mtx);
+		swap_owner_free(owner, num_slots);
+		return ANANAS_ERROR(NO_RESOURCE);
+	}
+
+	sd_free->sd_device = dev;
+	sd_free->sd_flags = 0;
+	sd_free->sd_num_slots = num_slots;
+	sd_free->sd_num_used = 0;
+	sd_free->sd_next = 0;
+	sd_free->sd_owner = owner;
+	swap_num_active++;
+	mutex_unlock(&swap_mtx);
+
+	kprintf("swap: using %s, %u pages\n", dev->d_Name, static_cast<unsigned int>(num_slots));
+	return ananas_success();
+}
+
+errorcode_t
+swap_off(Ananas::Device* dev)
+{
+	mutex_lock(&swap_mtx);
+	struct SWAP_DEVICE* sd = nullptr;
+	for (unsigned int n = 0; n < SWAP_MAX_DEVICES; n++)
+		if (swap_device[n].sd_device == dev)
+			sd = &swap_device[n];
+	if (sd == nullptr || (sd->sd_flags & SWAP_DEVICE_FLAG_DRAINING)) {
+		mutex_unlock(&swap_mtx);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	sd->sd_flags |= SWAP_DEVICE_FLAG_DRAINING;
+	swap_num_active--;
+	mutex_unlock(&swap_mtx);
+
+	// Read everything back; the pages are mapped again once they are faulted
+	const swapslot_t slot_base = (sd - swap_device) << SWAP_SLOT_DEVICE_SHIFT;
+	for (unsigned int n = 0; n < sd->sd_num_slots; /* nothing */) {
+		mutex_lock(&swap_mtx);
+		struct VM_PAGE* vp = swap_owner(sd, n);
+		if (vp == nullptr) {
+			mutex_unlock(&swap_mtx);
+			n++;
+			continue;
+		}
+		if (!mutex_trylock(&vp->vp_mtx)) {
+			// Someone is busy with the page; it may well be swapping it in for us
+			mutex_unlock(&swap_mtx);
+			thread_sleep(1);
+			continue;
+		}
+		mutex_unlock(&swap_mtx);
+
+		KASSERT((vp->vp_flags & VM_PAGE_FLAG_SWAPPED) && vp->vp_swap == slot_base + n, "slot %u owner %p not swapped there", n, vp);
+		errorcode_t err = vmpage_swapin(vp);
+		vmpage_unlock(vp);
+		if (ananas_is_failure(err)) {
+			// Not enough memory to hold everything; keep using the device
+			mutex_lock(&swap_mtx);
+			sd->sd_flags &= ~SWAP_DEVICE_FLAG_DRAINING;
+			swap_num_active++;
+			mutex_unlock(&swap_mtx);
+			return err;
+		}
+	}
+
+	mutex_lock(&swap_mtx);
+	KASSERT(sd->sd_num_used == 0, "swap device still has %u slots in use", sd->sd_num_used);
+	struct VM_PAGE*** owner = sd->sd_owner;
+	sd->sd_device = nullptr;
+	sd->sd_owner = nullptr;
+	mutex_unlock(&swap_mtx);
+	swap_owner_free(owner, sd->sd_num_slots);
+	return ananas_success();
+}
+
+bool
+swap_available()
+{
+	return swap_num_active > 0;
+}
+
+unsigned int
+swap_alloc(struct VM_PAGE** vps, unsigned int count, swapslot_t* slot)
+{
+	mutex_lock(&swap_mtx);
+	for (unsigned int n = 0; n < SWAP_MAX_DEVICES; n++) {
+		struct SWAP_DEVICE* sd = &swap_device[n];
+		if (sd->sd_device == nullptr || (sd->sd_flags & SWAP_DEVICE_FLAG_DRAINING))
+			continue;
+
+		unsigned int index;
+		unsigned int num = swap_find_slots(sd, count, &index);
+		if (num == 0)
+			continue;
+		for (unsigned int i = 0; i < num; i++)
+			swap_owner(sd, index + i) = vps[i];
+		sd->sd_num_used += num;
+		sd->sd_next = (index + num) % sd->sd_num_slots;
+		mutex_unlock(&swap_mtx);
+
+		*slot = (n << SWAP_SLOT_DEVICE_SHIFT) | index;
+		return num;
+	}
+	mutex_unlock(&swap_mtx);
+	return 0;
+}
+
+void
+swap_free(swapslot_t slot)
+{
+	mutex_lock(&swap_mtx);
+	struct SWAP_DEVICE* sd = swap_get_device(slot);
+	unsigned int index = slot & SWAP_SLOT_INDEX_MASK;
+	KASSERT(index < sd->sd_num_slots && swap_owner(sd, index) != nullptr, "freeing unused swap slot %x", slot);
+	swap_owner(sd, index) = nullptr;
+	sd->sd_num_used--;
+	mutex_unlock(&swap_mtx);
+}
+
+errorcode_t
+swap_write(swapslot_t slot, struct PAGE* p)
+{
+	// The device cannot go away as long as the slot is in use
+	Ananas::Device* dev = swap_get_device(slot)->sd_device;
+	TRACE(VM, INFO, "swap_write(): slot %x, page %p", slot, p);
+
+	auto src = static_cast<char*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ));
+	if (src == NULL) {
+		__sync_fetch_and_add(&swap_failures, 1);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	struct BIO* bio = bio_get(dev, swap_get_block(slot), PAGE_SIZE, BIO_READ_NODATA);
+	memcpy(BIO_DATA(bio), src, PAGE_SIZE);
+	kmem_unmap(src, PAGE_SIZE);
+	bio_set_dirty(bio);
+	bool failed = BIO_IS_ERROR(bio);
+	bio_free(bio);
+
+	if (failed) {
+		__sync_fetch_and_add(&swap_failures, 1);
+		return ANANAS_ERROR(IO);
+	}
+	__sync_fetch_and_add(&swap_outs, 1);
+	return ananas_success();
+}
+
+errorcode_t
+swap_read(swapslot_t slot, struct PAGE* p)
+{
+	Ananas::Device* dev = swap_get_device(slot)->sd_device;
+	TRACE(VM, INFO, "swap_read(): slot %x, page %p", slot, p);
+
+	struct BIO* bio = bio_read(dev, swap_get_block(slot), PAGE_SIZE);
+	if (BIO_IS_ERROR(bio)) {
+		bio_free(bio);
+		__sync_fetch_and_add(&swap_failures, 1);
+		return ANANAS_ERROR(IO);
+	}
+	auto dst = static_cast<char*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (dst == NULL) {
+		bio_free(bio);
+		__sync_fetch_and_add(&swap_failures, 1);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	memcpy(dst, BIO_DATA(bio), PAGE_SIZE);
+	kmem_unmap(dst, PAGE_SIZE);
+	bio_free(bio);
+
+	__sync_fetch_and_add(&swap_ins, 1);
+	return ananas_success();
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(swap, NULL, "Display swap devices")
+{
+	for (unsigned int n = 0; n < SWAP_MAX_DEVICES; n++) {
+		struct SWAP_DEVICE* sd = &swap_device[n];
+		if (sd->sd_device == nullptr)
+			continue;
+		kprintf("swap%u: %s, %u/%u pages used%s\n", n, sd->sd_device->d_Name,
+		 sd->sd_num_used, sd->sd_num_slots, (sd->sd_flags & SWAP_DEVICE_FLAG_DRAINING) ? " (draining)" : "");
+	}
+	kprintf("%u pages out, %u pages in, %u failures\n", swap_outs, swap_ins, swap_failures);
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
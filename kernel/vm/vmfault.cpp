@@ -1,35 +1,60 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include "kernel/cmdline.h"
+#include "kernel/init.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/page.h"
+#include "kernel/thread.h"
 #include "kernel/trace.h"
 #include "kernel/vmspace.h"
 #include "kernel/vmpage.h"
 #include "kernel/vfs/core.h"
+#include "kernel/vfs/dentry.h"
+#include "kernel/vfs/pagecache.h"
 #include "kernel/vm.h"
 
 TRACE_SETUP;
 
-namespace {
+/*
+ * Number of pages around a file-backed fault which are considered along with
+ * the faulting page: missing ones are read using a single I/O and resident
+ * ones are mapped right away. This can be set using the 'faultaround' boot
+ * option; 1 disables the feature.
+ */
+#define VM_FAULT_AROUND_DEFAULT 16
+#define VM_FAULT_AROUND_MAX 64
 
-errorcode_t
-read_data(struct DENTRY* dentry, void* buf, off_t offset, size_t len)
-{
-	struct VFS_FILE f;
-	memset(&f, 0, sizeof(f));
-	f.f_dentry = dentry;
+/*
+ * Sequential faults in a file-backed area make the readahead thread fetch
+ * the pages beyond the fault-around window; the window starts at
+ * VM_READAHEAD_MIN pages and doubles on every sequential fault up to
+ * VM_READAHEAD_MAX. Any other fault resets it. Advice overrides this: areas
+ * expecting sequential access always use VM_READAHEAD_MAX, and those
+ * expecting random access never read ahead.
+ */
+#define VM_READAHEAD_MIN 32
+#define VM_READAHEAD_MAX 256
+#define VM_READAHEAD_QUEUE_SIZE 16
 
-	errorcode_t err = vfs_seek(&f, offset);
-	ANANAS_ERROR_RETURN(err);
+namespace {
 
-	size_t amount = len;
-	err = vfs_read(&f, buf, &amount);
-	ANANAS_ERROR_RETURN(err);
+unsigned int vm_fault_around_pages = VM_FAULT_AROUND_DEFAULT;
 
-	if (amount != len)
-		return ANANAS_ERROR(SHORT_READ);
-	return ananas_success();
-}
+struct VM_READAHEAD {
+	struct DENTRY* ra_dentry;	/* referenced while queued */
+	off_t ra_first;
+	off_t ra_last;
+	int ra_flags;			/* VM_PAGE_FLAG_... for new pages */
+};
+
+spinlock_t spl_readahead = SPINLOCK_DEFAULT_INIT;
+struct VM_READAHEAD readahead_queue[VM_READAHEAD_QUEUE_SIZE];
+unsigned int readahead_head = 0;
+unsigned int readahead_count = 0;
+bool readahead_running = false;
+semaphore_t readahead_sem;
+thread_t readahead_thread;
 
 int
 vmspace_page_flags_from_va(vmarea_t* va)
@@ -41,151 +66,412 @@ vmspace_page_flags_from_va(vmarea_t* va)
 	return flags;
 }
 
-struct VM_PAGE*
-vmspace_get_dentry_backed_page(vmarea_t* va, off_t read_off)
+/* Counts a fault of vs; major faults are those that had to read something */
+inline void
+vmspace_count_fault(vmspace_t* vs, bool major)
+{
+	if (major)
+		__sync_fetch_and_add(&vs->vs_stats.vss_major_faults, 1);
+	else
+		__sync_fetch_and_add(&vs->vs_stats.vss_minor_faults, 1);
+}
+
+/* Retrieves the locked page at read_off of va's file; major is set if it had to be read */
+errorcode_t
+vmspace_get_dentry_backed_page(vmarea_t* va, off_t read_off, off_t cluster_first, off_t cluster_last, bool& major, struct VM_PAGE** vp_out)
 {
 	// First, try to lookup the page; if we already have it, no need to read it
-	struct VM_PAGE* vmpage = vmpage_lookup_locked(va, va->va_dentry->d_inode, read_off);
-	if (vmpage == nullptr) {
-		// Page not found - we need to allocate one. This is always a shared mapping, which we'll copy if needed
-		vmpage = vmpage_create_shared(va->va_dentry->d_inode, read_off, VM_PAGE_FLAG_PENDING | vmspace_page_flags_from_va(va));
+	struct VM_PAGE* vmpage;
+	while ((vmpage = vmpage_lookup_locked(va, va->va_dentry->d_inode, read_off)) == nullptr) {
+		// Page not found - read it along with the missing pages of the cluster. This is always a
+		// shared mapping, which we'll copy if needed. Note that pageout may evict the page
+		// before we get to it, in which case we'll just have to try again
+		errorcode_t err = vfs_pagecache_fill(va->va_dentry, cluster_first, cluster_last, vmspace_page_flags_from_va(va));
+		ANANAS_ERROR_RETURN(err);
+		major = true;
 	}
 	// vmpage will be locked at this point!
+	KASSERT((vmpage->vp_flags & VM_PAGE_FLAG_PENDING) == 0, "found pending page %p", vmpage);
+	*vp_out = vmpage;
+	return ananas_success();
+}
+
+/* Returns the file offset up to which va maps complete pages of the file */
+off_t
+vmspace_dentry_full_end(vmarea_t* va)
+{
+	size_t file_len = va->va_dlength;
+	if (va->va_doffset + file_len > va->va_dentry->d_inode->i_sb.st_size)
+		file_len = va->va_dentry->d_inode->i_sb.st_size - va->va_doffset;
+	if (file_len > va->va_len)
+		file_len = va->va_len;
+	return va->va_doffset + (file_len & ~(PAGE_SIZE - 1));
+}
+
+void
+readahead_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&readahead_sem);
+
+		spinlock_lock(&spl_readahead);
+		KASSERT(readahead_count > 0, "readahead woke up with empty queue?");
+		struct VM_READAHEAD ra = readahead_queue[readahead_head];
+		readahead_head = (readahead_head + 1) % VM_READAHEAD_QUEUE_SIZE;
+		readahead_count--;
+		spinlock_unlock(&spl_readahead);
+
+		// Errors are not fatal here; the pages will be read again once they are needed
+		(void)vfs_pagecache_fill(ra.ra_dentry, ra.ra_first, ra.ra_last, ra.ra_flags);
+		dentry_deref(ra.ra_dentry);
+	}
+}
+
+/* Queues [first, last) of va's file for reading; returns false if the queue is full */
+bool
+vmspace_queue_readahead(vmarea_t* va, off_t first, off_t last)
+{
+	if (!readahead_running)
+		return false;
 
-	if ((vmpage->vp_flags & VM_PAGE_FLAG_PENDING) == 0)
-		return vmpage;
+	dentry_ref(va->va_dentry);
+	spinlock_lock(&spl_readahead);
+	if (readahead_count == VM_READAHEAD_QUEUE_SIZE) {
+		spinlock_unlock(&spl_readahead);
+		dentry_deref(va->va_dentry);
+		return false;
+	}
+	struct VM_READAHEAD* ra = &readahead_queue[(readahead_head + readahead_count) % VM_READAHEAD_QUEUE_SIZE];
+	ra->ra_dentry = va->va_dentry;
+	ra->ra_first = first;
+	ra->ra_last = last;
+	ra->ra_flags = vmspace_page_flags_from_va(va);
+	readahead_count++;
+	spinlock_unlock(&spl_readahead);
 
-	// Read the page - note that we hold the vmpage lock while doing this
-	struct PAGE* p;
-	void* page = page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE);
-	KASSERT(p != nullptr, "out of memory"); // XXX handle this
+	sem_signal(&readahead_sem);
+	return true;
+}
 
-	size_t read_length = PAGE_SIZE;
-	if (read_off + read_length > va->va_dentry->d_inode->i_sb.st_size) {
-		// This inode is simply not long enough to cover our read - adjust XXX what when it grows?
-		read_length = va->va_dentry->d_inode->i_sb.st_size - read_off;
-		// Zero out everything after the part we will read so we don't leak any data
-		memset(static_cast<char*>(page) + read_length, 0, PAGE_SIZE - read_length);
+/*
+ * Updates the readahead state of va for a fault at file offset offs, which
+ * made everything up to file offset fault_end resident, and starts
+ * readahead if the faults are sequential or the area was advised they will be.
+ */
+void
+vmspace_readahead(vmarea_t* va, off_t offs, off_t fault_end)
+{
+	bool sequential = offs > va->va_ra_prev && offs <= va->va_ra_next;
+	if (!sequential) {
+		// Forget what we read ahead; it is no longer next in line
+		va->va_ra_pages = 0;
+		va->va_ra_end = 0;
+	}
+	if (va->va_advice == VM_ADVICE_SEQUENTIAL) {
+		// Told to expect sequential access; go all the way right away
+		va->va_ra_pages = VM_READAHEAD_MAX;
+	} else if (va->va_advice == VM_ADVICE_RANDOM || !sequential) {
+		// Told not to bother, or not sequential; don't read ahead
+		va->va_ra_pages = 0;
+	} else if (va->va_ra_pages == 0) {
+		va->va_ra_pages = VM_READAHEAD_MIN;
+	} else if (va->va_ra_pages < VM_READAHEAD_MAX) {
+		va->va_ra_pages *= 2;
 	}
 
-	errorcode_t err = read_data(va->va_dentry, page, read_off, read_length);
-	kmem_unmap(page, PAGE_SIZE);
-	KASSERT(ananas_is_success(err), "cannot deal with error %d", err); // XXX
+	if (va->va_ra_pages > 0) {
+		// Only issue more once half of what we read ahead has been consumed
+		off_t ra_window = va->va_ra_pages * PAGE_SIZE;
+		off_t ra_first = va->va_ra_end > fault_end ? va->va_ra_end : fault_end;
+		off_t ra_last = fault_end + ra_window;
+		off_t limit = vmspace_dentry_full_end(va);
+		if (ra_last > limit)
+			ra_last = limit;
+		if (ra_first < ra_last && fault_end + ra_window / 2 >= va->va_ra_end &&
+		    vmspace_queue_readahead(va, ra_first, ra_last))
+			va->va_ra_end = ra_last;
+	}
+	va->va_ra_prev = offs;
+	va->va_ra_next = fault_end;
+}
 
-	// Update the vm page to contain our new address
-	vmpage->vp_page = p;
-	vmpage->vp_flags &= ~VM_PAGE_FLAG_PENDING;
-	return vmpage;
+/*
+ * Determines the range [first, last) of addresses around virt that are
+ * considered for fault-around; this is an aligned window of
+ * vm_fault_around_pages, limited to the part of va which maps complete pages
+ * of the file. Areas advised to expect random access only get the page itself.
+ */
+void
+vmspace_fault_around_window(vmarea_t* va, addr_t virt, addr_t& first, addr_t& last)
+{
+	addr_t page = virt & ~(PAGE_SIZE - 1);
+	addr_t full_end = va->va_virt + (vmspace_dentry_full_end(va) - va->va_doffset);
+	if (page >= full_end || va->va_advice == VM_ADVICE_RANDOM) {
+		// Partial page or random access; leave the neighbours alone
+		first = page;
+		last = page + PAGE_SIZE;
+		return;
+	}
+
+	const size_t window = vm_fault_around_pages * PAGE_SIZE;
+	first = page - ((page - va->va_virt) % window);
+	last = first + window;
+	if (last > full_end)
+		last = full_end;
+}
+
+/* Maps all resident file pages in [first, last) of va that aren't yet mapped */
+void
+vmspace_fault_around(vmspace_t* vs, vmarea_t* va, addr_t first, addr_t last)
+{
+	// Writable private mappings must copy their pages, which we don't want to do in advance
+	if ((va->va_flags & (VM_FLAG_PRIVATE | VM_FLAG_WRITE)) == (VM_FLAG_PRIVATE | VM_FLAG_WRITE))
+		return;
+
+	struct VFS_INODE* inode = va->va_dentry->d_inode;
+	for (addr_t vaddr = first; vaddr < last; vaddr += PAGE_SIZE) {
+		struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, vaddr);
+		if (vp != nullptr) {
+			vmpage_unlock(vp);
+			continue;
+		}
+
+		struct VM_PAGE* vmpage = vmpage_lookup_locked(va, inode, vaddr - va->va_virt + va->va_doffset);
+		if (vmpage == nullptr)
+			continue;
+		vp = vmpage_link(va, vmpage, vaddr);
+		vmpage_unlock(vmpage);
+		if (vp == nullptr)
+			break; // this is only an optimization
+
+		errorcode_t err = vmpage_map(vs, va, vp);
+		vmpage_unlock(vp);
+		if (ananas_is_failure(err))
+			break;
+	}
+}
+
+#ifdef MD_LARGE_PAGE_ORDER
+/*
+ * Attempts to back the large page surrounding virt; this is only done if it
+ * is completely covered by the area and nothing in it has been faulted yet.
+ * Returns nullptr if this is not possible, in which case the caller should
+ * fall back to a normal page.
+ */
+struct VM_PAGE*
+vmspace_create_large_page(vmarea_t* va, addr_t virt)
+{
+	const size_t large_size = PAGE_SIZE << MD_LARGE_PAGE_ORDER;
+	addr_t base = virt & ~(large_size - 1);
+	if (base < va->va_virt || base + large_size > va->va_virt + va->va_len)
+		return nullptr;
+	if (va->va_flags & VM_FLAG_MD)
+		return nullptr;
+
+	struct VM_PAGE* vp = vmpage_lookup_next(va, base);
+	if (vp != nullptr && vp->vp_vaddr < base + large_size)
+		return nullptr;
+
+	return vmpage_create_private(va, base, VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_LARGE, PAGE_ALLOC_ZERO | PAGE_ALLOC_TRY);
+}
+#endif
+
+errorcode_t
+vmfault_init()
+{
+	const char* arg = cmdline_get_string("faultaround");
+	if (arg != nullptr) {
+		unsigned long n = strtoul(arg, NULL, 10);
+		if (n < 1)
+			n = 1;
+		if (n > VM_FAULT_AROUND_MAX)
+			n = VM_FAULT_AROUND_MAX;
+		vm_fault_around_pages = n;
+	}
+	return ananas_success();
+}
+
+errorcode_t
+start_readahead()
+{
+	sem_init(&readahead_sem, 0);
+	kthread_init(&readahead_thread, "readahead", &readahead_thread_func, NULL);
+	thread_resume(&readahead_thread);
+	readahead_running = true;
+	return ananas_success();
 }
 
 } // unnamed namespace
 
+INIT_FUNCTION(vmfault_init, SUBSYSTEM_PROCESS, ORDER_ANY);
+INIT_FUNCTION(start_readahead, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+void
+vmspace_area_prefetch(vmarea_t* va, addr_t virt, addr_t end)
+{
+	off_t first = va->va_doffset + (virt - va->va_virt);
+	off_t last = va->va_doffset + (end - va->va_virt);
+	off_t limit = vmspace_dentry_full_end(va);
+	if (last > limit)
+		last = limit;
+	if (first >= last)
+		return;
+
+	// Advice is merely a hint; if the queue is full, the pages will be read as they are faulted
+	(void)vmspace_queue_readahead(va, first, last);
+}
+
 errorcode_t
 vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
 {
 	TRACE(VM, INFO, "vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x", vs, virt, flags);
 	//kprintf("vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x\n", vs, virt, flags);
 
-	/* Walk through the areas one by one */
-	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		if (!(virt >= va->va_virt && (virt < (va->va_virt + va->va_len))))
-			continue;
+	vmarea_t* va = vmspace_lookup_area(vs, virt);
+	if (va == nullptr)
+		return ANANAS_ERROR(BAD_ADDRESS);
 
-		/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
-		KASSERT((va->va_flags & VM_FLAG_FAULT) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
+	/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
+	KASSERT((va->va_flags & VM_FLAG_FAULT) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
 
-		// See if we have this page mapped
-		struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt & ~(PAGE_SIZE - 1));
-		if (vp != nullptr) {
-			if ((flags & VM_FLAG_WRITE) && (vp->vp_flags & VM_PAGE_FLAG_COW)) {
-				// Promote our copy to a writable page and update the mapping
-				vp = vmpage_promote(vs, va, vp);
-				vmpage_map(vs, va, vp);
-				vmpage_unlock(vp);
-				return ananas_success();
-			}
+	if ((flags & VM_FLAG_WRITE) && (va->va_flags & VM_FLAG_WRITE) == 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
 
-			// Page is already mapped, but not COW. Bad, reject
+	// See if we already have this page; if it was shared with us by a fork, it need not be mapped yet
+	struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt & ~(PAGE_SIZE - 1));
+	if (vp != nullptr) {
+		// If the page was swapped out, it must be read back first
+		bool major = (vp->vp_flags & VM_PAGE_FLAG_SWAPPED) != 0;
+		errorcode_t err = vmpage_swapin(vp);
+		if (ananas_is_failure(err)) {
 			vmpage_unlock(vp);
-			return ANANAS_ERROR(BAD_ADDRESS);
+			return err;
 		}
 
-		// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
-		// this needs to be enforced when making mappings!
-		KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
-
-		// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
-		if (va->va_dentry != nullptr) {
-			/*
-			 * The way dentries are mapped to virtual address is:
-			 *
-			 * 0       va_doffset                               file length
-			 * +------------+-------------+-------------------------------+
-			 * |            |XXXXXXXXXXXXX|                               |
-			 * |            |XXXXXXXXXXXXX|                               |
-			 * +------------+-------------+-------------------------------+
-			 *             /     |||      \ va_doffset + va_dlength
-			 *            /      vvv
-			 *     +-------------+---------------+
-			 *     |XXXXXXXXXXXXX|000000000000000|
-			 *     |XXXXXXXXXXXXX|000000000000000|
-			 *     +-------------+---------------+
-			 *     0            \
-			 *                   \
-			 *                    va_dlength
-			 */
-			off_t read_off = (virt & ~(PAGE_SIZE - 1)) - va->va_virt; // offset in area, still needs va_doffset added
-			if (read_off < va->va_dlength) {
-				// At least (part of) the page is to be read from the backing dentry -
-				// this means we want the entire page
-				struct VM_PAGE* vmpage = vmspace_get_dentry_backed_page(va, read_off + va->va_doffset);
-				// vmpage is locked at this point
-
-				// If the mapping is page-aligned and read-only or shared, we can re-use the
-				// mapping and avoid the entire copy
-				struct VM_PAGE* new_vp;
-				bool can_reuse_page_1on1 = true;
-				// Reusing means the page resides in the section...
-				can_reuse_page_1on1 &= (read_off + PAGE_SIZE) <= va->va_dlength;
-				// ... and we have a page-aligned offset
-				can_reuse_page_1on1 &= (va->va_doffset & (PAGE_SIZE - 1)) == 0;
-				if (can_reuse_page_1on1 && (va->va_flags & VM_FLAG_PRIVATE) == 0) {
-					new_vp = vmpage_link(va, vmpage);
-				} else {
-					// Cannot re-use; create a new VM page, with appropriate flags based on the va
-					new_vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
-
-					// Now copy the parts of the dentry-backed page
-					size_t copy_len = va->va_dlength - read_off; // this is size-left after where we read
-					if (copy_len > PAGE_SIZE)
-						copy_len = PAGE_SIZE;
-					vmpage_copy_extended(vmpage, new_vp, copy_len);
-				}
-				vmpage_unlock(vmpage);
+		// Writing to a COW page means we need our own copy
+		if ((flags & VM_FLAG_WRITE) && (vp->vp_flags & VM_PAGE_FLAG_COW)) {
+			struct VM_PAGE* new_vp = vmpage_promote(vs, va, vp);
+			if (new_vp == nullptr) {
+				vmpage_unlock(vp);
+				return ANANAS_ERROR(OUT_OF_MEMORY);
+			}
+			vp = new_vp;
+			__sync_fetch_and_add(&vs->vs_stats.vss_cow_faults, 1);
+		}
+
+		err = vmpage_map(vs, va, vp);
+		vmpage_unlock(vp);
+		ANANAS_ERROR_RETURN(err);
+		vmspace_count_fault(vs, major);
+		return ananas_success();
+	}
+
+	// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
+	// this needs to be enforced when making mappings!
+	KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
+
+	// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
+	if (va->va_dentry != nullptr) {
+		/*
+		 * The way dentries are mapped to virtual address is:
+		 *
+		 * 0       va_doffset                               file length
+		 * +------------+-------------+-------------------------------+
+		 * |            |XXXXXXXXXXXXX|                               |
+		 * |            |XXXXXXXXXXXXX|                               |
+		 * +------------+-------------+-------------------------------+
+		 *             /     |||      \ va_doffset + va_dlength
+		 *            /      vvv
+		 *     +-------------+---------------+
+		 *     |XXXXXXXXXXXXX|000000000000000|
+		 *     |XXXXXXXXXXXXX|000000000000000|
+		 *     +-------------+---------------+
+		 *     0            \
+		 *                   \
+		 *                    va_dlength
+		 */
+		off_t read_off = (virt & ~(PAGE_SIZE - 1)) - va->va_virt; // offset in area, still needs va_doffset added
+		if (read_off < va->va_dlength) {
+			// At least (part of) the page is to be read from the backing dentry -
+			// this means we want the entire page
+			addr_t around_first, around_last;
+			vmspace_fault_around_window(va, virt, around_first, around_last);
+			off_t around_first_off = around_first - va->va_virt + va->va_doffset;
+			off_t around_last_off = around_last - va->va_virt + va->va_doffset;
+			bool major = false;
+			struct VM_PAGE* vmpage;
+			errorcode_t err = vmspace_get_dentry_backed_page(va, read_off + va->va_doffset, around_first_off, around_last_off, major, &vmpage);
+			ANANAS_ERROR_RETURN(err);
+			vmspace_readahead(va, read_off + va->va_doffset, around_last_off);
+			// vmpage is locked at this point
 
-				new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+			// If the mapping is page-aligned and read-only or shared, we can re-use the
+			// mapping and avoid the entire copy
+			struct VM_PAGE* new_vp;
+			bool can_reuse_page_1on1 = true;
+			// Reusing means the page resides in the section...
+			can_reuse_page_1on1 &= (read_off + PAGE_SIZE) <= va->va_dlength;
+			// ... and we have a page-aligned offset
+			can_reuse_page_1on1 &= (va->va_doffset & (PAGE_SIZE - 1)) == 0;
+			if (can_reuse_page_1on1 && (va->va_flags & VM_FLAG_PRIVATE) == 0) {
+				new_vp = vmpage_link(va, vmpage, virt & ~(PAGE_SIZE - 1));
+				if (new_vp == nullptr) {
+					vmpage_unlock(vmpage);
+					return ANANAS_ERROR(OUT_OF_MEMORY);
+				}
+			} else {
+				// Cannot re-use; create a new VM page, with appropriate flags based on the va
+				new_vp = vmpage_create_private(va, virt & ~(PAGE_SIZE - 1), VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
+				if (new_vp == nullptr) {
+					vmpage_unlock(vmpage);
+					return ANANAS_ERROR(OUT_OF_MEMORY);
+				}
 
-				// Finally, update the permissions and we are done
-				vmpage_map(vs, va, new_vp);
-				vmpage_unlock(new_vp);
-				return ananas_success();
+				// Now copy the parts of the dentry-backed page
+				size_t copy_len = va->va_dlength - read_off; // this is size-left after where we read
+				if (copy_len > PAGE_SIZE)
+					copy_len = PAGE_SIZE;
+				vmpage_copy_extended(vmpage, new_vp, copy_len);
 			}
-		}
+			vmpage_unlock(vmpage);
 
-		// We need a new VM page here; this is an anonymous mapping which we need to back
-		struct VM_PAGE* new_vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE);
-		new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+			// Finally, update the permissions and we are done
+			err = vmpage_map(vs, va, new_vp);
+			vmpage_unlock(new_vp);
+			ANANAS_ERROR_RETURN(err);
 
-		// Ensure the page cleaned so we don't leak any information
-		vmpage_zero(vs, new_vp);
+			// Map the neighbouring pages as well, as they are likely to be used soon
+			vmspace_fault_around(vs, va, around_first, around_last);
+			vmspace_count_fault(vs, major);
+			return ananas_success();
+		}
+	}
 
-		// And now (re)map the page for the caller
-		vmpage_map(vs, va, new_vp);
-		vmpage_unlock(new_vp);
-		return ananas_success();
+	// We need a new VM page here; this is an anonymous mapping which we need to
+	// back with a cleaned page so we don't leak any information. If it is only
+	// read, the zero page will do until it is written (shared mappings need a
+	// page of their own, as this must not give them private copies later on).
+	// Otherwise, use a large page if we can as this saves a lot of faults and
+	// TLB entries
+	struct VM_PAGE* new_vp = nullptr;
+	if ((flags & VM_FLAG_WRITE) == 0 && (va->va_flags & (VM_FLAG_PRIVATE | VM_FLAG_MD)) == VM_FLAG_PRIVATE)
+		new_vp = vmpage_create_zero(va, virt & ~(PAGE_SIZE - 1));
+#ifdef MD_LARGE_PAGE_ORDER
+	if (new_vp == nullptr && va->va_dentry == nullptr)
+		new_vp = vmspace_create_large_page(va, virt);
+#endif
+	if (new_vp == nullptr) {
+		new_vp = vmpage_create_private(va, virt & ~(PAGE_SIZE - 1), VM_PAGE_FLAG_PRIVATE, PAGE_ALLOC_ZERO);
+		if (new_vp == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
 	}
 
-	return ANANAS_ERROR(BAD_ADDRESS);
+	// And now (re)map the page for the caller
+	errorcode_t err = vmpage_map(vs, va, new_vp);
+	vmpage_unlock(new_vp);
+	ANANAS_ERROR_RETURN(err);
+	vmspace_count_fault(vs, false);
+	return ananas_success();
 }
 
 /* vim:set ts=2 sw=2: */
@@ -2,13 +2,20 @@
 #include <ananas/error.h>
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/init.h"
 #include "kernel/mm.h"
+#include "kernel/pageout.h"
+#include "kernel/slab.h"
+#include "kernel/swap.h"
+#include "kernel/trace.h"
 #include "kernel/vmpage.h"
 #include "kernel/vmspace.h"
 #include "kernel/vfs/types.h"
 #include "kernel/vm.h"
 #include "kernel-md/vm.h" // for md_{,un}map_pages()
 
+TRACE_SETUP;
+
 #define DEBUG 0
 
 #if DEBUG
@@ -30,12 +37,84 @@ static inline int get_pid()
 
 namespace {
 
+struct SLAB_CACHE vmpage_cache;
+
+/*
+ * Page filled with zeroes, which anonymous memory refers to until it is
+ * written; we hold a reference so that it is never freed.
+ */
+struct VM_PAGE* vmpage_zero;
+
+/* Statistics */
+unsigned int vmpage_zero_mapped = 0;
+unsigned int vmpage_zero_promoted = 0;
+
+/*
+ * Free vmpages are kept unlocked, without links and off the pageout lists;
+ * vmpage_free() hands them back to the cache in this state.
+ */
+void
+vmpage_ctor(void* obj)
+{
+  auto vp = static_cast<struct VM_PAGE*>(obj);
+  mutex_init(&vp->vp_mtx, "vmpage");
+  LIST_INIT(&vp->vp_links);
+  vp->vp_lru = VM_PAGE_LRU_NONE;
+}
+
+inline unsigned long
+vmpage_area_index(addr_t vaddr)
+{
+  return vaddr / PAGE_SIZE;
+}
+
+inline unsigned long
+vmpage_inode_index(off_t offs)
+{
+  return offs / PAGE_SIZE;
+}
+
+/* Removes vmpage from the index of area va; the reference this held is not dropped */
+void
+vmpage_detach(vmarea_t* va, struct VM_PAGE* vmpage)
+{
+  void* removed = radix_remove(&va->va_pages, vmpage_area_index(vmpage->vp_vaddr));
+  KASSERT(removed == vmpage, "vmpage %p not indexed at %p (found %p)", vmpage, vmpage->vp_vaddr, removed);
+  vmspace_account_page(va, vmpage, -1);
+  if (vmpage->vp_vmarea == va)
+    vmpage->vp_vmarea = nullptr;
+}
+
+/* Indexes vmpage in area va, which becomes its area if it has none; this undoes vmpage_detach() */
+void
+vmpage_attach(vmarea_t* va, struct VM_PAGE* vmpage)
+{
+  radix_insert(&va->va_pages, vmpage_area_index(vmpage->vp_vaddr), vmpage);
+  vmspace_account_page(va, vmpage, 1);
+  if (vmpage->vp_vmarea == nullptr)
+    vmpage->vp_vmarea = va;
+}
+
+/*
+ * Removes page cache page vp, which is still pending because its read failed,
+ * from inode; both must be locked. vp is unlocked and freed.
+ */
+void
+vmpage_drop_pending(struct VFS_INODE* inode, struct VM_PAGE* vp)
+{
+  KASSERT(vp->vp_refcount == 1, "dropping pending page %p with refcount %d", vp, vp->vp_refcount);
+  void* removed = radix_remove(&inode->i_pages, vmpage_inode_index(vp->vp_offset));
+  KASSERT(removed == vp, "vmpage %p not indexed at offset %d (found %p)", vp, (int)vp->vp_offset, removed);
+  vmpage_deref(vp);
+}
+
 void
 vmpage_free(struct VM_PAGE* vmpage)
 {
   vmpage_assert_locked(vmpage);
 
   KASSERT(vmpage->vp_refcount == 0, "freeing page with refcount %d", vmpage->vp_refcount);
+  KASSERT(LIST_EMPTY(&vmpage->vp_links), "freeing page %p which still has links", vmpage);
 
   DPRINTF("[%d] vmpage_free(): vp %p @ %p (page %p phys %p)\n", get_pid(), vmpage, vmpage->vp_vaddr,
     (vmpage->vp_flags & VM_PAGE_FLAG_LINK) == 0 ? vmpage->vp_page : 0,
@@ -45,17 +124,28 @@ vmpage_free(struct VM_PAGE* vmpage)
   if (vmpage->vp_flags & VM_PAGE_FLAG_LINK) {
     if (vmpage->vp_link != nullptr) {
       vmpage_lock(vmpage->vp_link);
+      LIST_REMOVE_IP(&vmpage->vp_link->vp_links, link, vmpage);
       vmpage_deref(vmpage->vp_link);
     }
+  } else if (vmpage->vp_flags & VM_PAGE_FLAG_SWAPPED) {
+    swap_free(vmpage->vp_swap);
   } else {
     if (vmpage->vp_page != nullptr)
       page_free(vmpage->vp_page);
   }
 
+  /*
+   * The page must not be considered by pageout anymore; we can't tell whether
+   * it is listed without the pageout lock, as pageout briefly takes pages off
+   * the lists without locking them.
+   */
+  pageout_remove(vmpage);
+
   // If we are hooked to a vmarea, unlink us
   if (vmpage->vp_vmarea != nullptr)
-    LIST_REMOVE(&vmpage->vp_vmarea->va_pages, vmpage);
-  kfree(vmpage);
+    vmpage_detach(vmpage->vp_vmarea, vmpage);
+  vmpage_unlock(vmpage);
+  slab_free(&vmpage_cache, vmpage);
 }
 
 struct VM_PAGE*
@@ -83,12 +173,15 @@ vmpage_resolve_locked(struct VM_PAGE* vp)
 }
 
 struct VM_PAGE*
-vmpage_alloc(vmarea_t* va, struct VFS_INODE* inode, off_t offset, int flags)
+vmpage_alloc(vmarea_t* va, addr_t vaddr, struct VFS_INODE* inode, off_t offset, int flags)
 {
-  auto vp = static_cast<struct VM_PAGE*>(kmalloc(sizeof(struct VM_PAGE)));
-  memset(vp, 0, sizeof(struct VM_PAGE));
-  mutex_init(&vp->vp_mtx, "vmpage");
+  auto vp = static_cast<struct VM_PAGE*>(slab_alloc(&vmpage_cache));
+  if (vp == nullptr)
+    return nullptr;
   vp->vp_vmarea = va;
+  vp->vp_page = nullptr;
+  vp->vp_vaddr = vaddr;
+  vp->vp_swap = 0;
   vp->vp_inode = inode;
   vp->vp_offset = offset;
   vp->vp_flags = flags;
@@ -96,48 +189,100 @@ vmpage_alloc(vmarea_t* va, struct VFS_INODE* inode, off_t offset, int flags)
 
   vmpage_lock(vp);
   if (va != nullptr)
-    LIST_APPEND(&va->va_pages, vp);
+    vmpage_attach(va, vp);
   return vp;
 }
 
+#ifdef MD_LARGE_PAGE_ORDER
+/*
+ * Gives va a private copy of every page covered by large page vp, which va
+ * must no longer index; this is used if no large page is available for the
+ * copy. Returns the copy of the first page, locked, or nullptr if we ran out
+ * of memory; va is left without any of the copies then.
+ */
 struct VM_PAGE*
-vmpage_clone_cow(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
+vmpage_copy_split(vmarea_t* va, struct VM_PAGE* vp)
 {
-  //KASSERT((vp->vp_flags & VM_PAGE_FLAG_COW) == 0, "trying to clone cow page %p that is already cow", vp);
+  struct PAGE* p_src = vmpage_get_page(vp);
+  struct VM_PAGE* vp_first = nullptr;
+  for (unsigned int n = 0; n < (1U << MD_LARGE_PAGE_ORDER); n++) {
+    struct VM_PAGE* vp_new = vmpage_create_private(va, vp->vp_vaddr + n * PAGE_SIZE, VM_PAGE_FLAG_PRIVATE);
+    if (vp_new == nullptr) {
+      // Throw away the copies made so far; these are all indexed by va
+      for (unsigned int m = 1; m < n; m++)
+        vmpage_deref(vmpage_lookup_vaddr_locked(va, vp->vp_vaddr + m * PAGE_SIZE));
+      if (vp_first != nullptr)
+        vmpage_deref(vp_first);
+      return nullptr;
+    }
+    auto src = static_cast<char*>(kmem_map(page_get_paddr(p_src) + n * PAGE_SIZE, PAGE_SIZE, VM_FLAG_READ));
+    auto dst = static_cast<char*>(kmem_map(page_get_paddr(vp_new->vp_page), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+    memcpy_pages(dst, src, PAGE_SIZE);
+    kmem_unmap(dst, PAGE_SIZE);
+    kmem_unmap(src, PAGE_SIZE);
+
+    if (n == 0)
+      vp_first = vp_new;
+    else
+      vmpage_unlock(vp_new);
+  }
+  return vp_first;
+}
 
-  // Get the virtual address before dereferencing links as the source is never mapped
-  addr_t vaddr = vp->vp_vaddr;
-  vp = vmpage_resolve_locked(vp);
+/* Frees the unlocked vmpages on vps, which nobody else knows about */
+void
+vmpage_free_unused(struct VM_PAGE_LINKS* vps)
+{
+  LIST_FOREACH_SAFE_IP(vps, link, it, struct VM_PAGE) {
+    vmpage_lock(it);
+    vmpage_deref(it);
+  }
+}
+#endif
 
-  // Mark the source page as COW and update the mapping - this makes it read-only
-  vp->vp_flags |= VM_PAGE_FLAG_COW;
-  vmpage_map(vs, va, vp);
+errorcode_t
+vmpage_init()
+{
+  slab_cache_init(&vmpage_cache, "vmpage", sizeof(struct VM_PAGE), vmpage_ctor, NULL);
+
+  // This is never written as it is only mapped through copy-on-write links; those inherit our flags
+  vmpage_zero = vmpage_alloc(nullptr, 0, nullptr, 0, 0);
+  KASSERT(vmpage_zero != nullptr, "out of vm pages");
+  vmpage_zero->vp_page = page_alloc_order_flags(0, PAGE_ALLOC_ZERO);
+  KASSERT(vmpage_zero->vp_page != nullptr, "out of pages");
+  vmpage_unlock(vmpage_zero);
+  return ananas_success();
+}
 
-  // Return a link to the page, but do mark it as COW as well
-  struct VM_PAGE* vp_new = vmpage_link(va, vp);
-  vp_new->vp_flags |= VM_PAGE_FLAG_COW;
-  vp_new->vp_vaddr = vaddr;
-  return vp_new;
+/* Makes locked page vp a candidate for swapping it out, if it qualifies */
+void
+vmpage_consider_swap(struct VM_PAGE* vp)
+{
+  if (swap_available() && vp->vp_lru == VM_PAGE_LRU_NONE && vmpage_swappable(vp, true))
+    pageout_insert_anonymous(vp);
 }
 
 } // unnamed namespace
 
+INIT_FUNCTION(vmpage_init, SUBSYSTEM_PROCESS, ORDER_FIRST);
+
 struct VM_PAGE*
-vmpage_link(vmarea_t* va, struct VM_PAGE* vp)
+vmpage_link(vmarea_t* va, struct VM_PAGE* vp, addr_t vaddr)
 {
   vmpage_assert_locked(vp);
   struct VM_PAGE* vp_source = vmpage_resolve_locked(vp);
 
-  // Increase source refcount as we will be linked towards it
-  vmpage_ref(vp_source);
-
   int flags = VM_PAGE_FLAG_LINK;
   if (vp_source->vp_flags & VM_PAGE_FLAG_READONLY)
     flags |= VM_PAGE_FLAG_READONLY;
 
-  struct VM_PAGE* vp_new = vmpage_alloc(va, vp_source->vp_inode, vp_source->vp_offset, flags);
-  vp_new->vp_link = vp_source;
-  vp_new->vp_vaddr = vp_source->vp_vaddr;
+  struct VM_PAGE* vp_new = vmpage_alloc(va, vaddr, vp_source->vp_inode, vp_source->vp_offset, flags);
+  if (vp_new != nullptr) {
+    // Increase source refcount as we are linked towards it
+    vmpage_ref(vp_source);
+    vp_new->vp_link = vp_source;
+    LIST_APPEND_IP(&vp_source->vp_links, link, vp_new);
+  }
 
   if (vp_source != vp) {
     vmpage_unlock(vp_source);
@@ -146,27 +291,51 @@ vmpage_link(vmarea_t* va, struct VM_PAGE* vp)
   return vp_new;
 }
 
+struct VM_PAGE*
+vmpage_create_zero(vmarea_t* va, addr_t vaddr)
+{
+  vmpage_lock(vmpage_zero);
+  struct VM_PAGE* vp = vmpage_link(va, vmpage_zero, vaddr);
+  vmpage_unlock(vmpage_zero);
+  if (vp == nullptr)
+    return nullptr;
+  vp->vp_flags |= VM_PAGE_FLAG_COW;
+  __sync_fetch_and_add(&vmpage_zero_mapped, 1);
+  return vp;
+}
+
+void
+vmpage_get_zero_stats(unsigned int* mapped, unsigned int* promoted)
+{
+  *mapped = vmpage_zero_mapped;
+  *promoted = vmpage_zero_promoted;
+}
+
 void
 vmpage_copy_extended(struct VM_PAGE* vp_src, struct VM_PAGE* vp_dst, size_t len)
 {
   vmpage_assert_locked(vp_src);
   vmpage_assert_locked(vp_dst);
   KASSERT(vp_src != vp_dst, "copying same vmpage %p", vp_src);
-  KASSERT(len <= PAGE_SIZE, "copying more than a page");
+  const size_t size = vmpage_size(vp_dst);
+  KASSERT(len <= size, "copying more than the destination page");
 
   struct PAGE* p_src = vmpage_get_page(vp_src);
   struct PAGE* p_dst = vmpage_get_page(vp_dst);
   KASSERT(p_src != p_dst, "copying same page %p", p_src);
 
-  auto src = static_cast<char*>(kmem_map(page_get_paddr(p_src), PAGE_SIZE, VM_FLAG_READ));
-  auto dst = static_cast<char*>(kmem_map(page_get_paddr(p_dst), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+  auto src = static_cast<char*>(kmem_map(page_get_paddr(p_src), len, VM_FLAG_READ));
+  auto dst = static_cast<char*>(kmem_map(page_get_paddr(p_dst), size, VM_FLAG_READ | VM_FLAG_WRITE));
 
-	memcpy(dst, src, len);
-  if (len < PAGE_SIZE)
-    memset(dst + len, 0, PAGE_SIZE - len); // zero-fill after the data to be copied
+  if (len == size)
+    memcpy_pages(dst, src, size);
+  else {
+    memcpy(dst, src, len);
+    memset(dst + len, 0, size - len); // zero-fill after the data to be copied
+  }
 
-  kmem_unmap(dst, PAGE_SIZE);
-  kmem_unmap(src, PAGE_SIZE);
+  kmem_unmap(dst, size);
+  kmem_unmap(src, len);
 }
 
 struct VM_PAGE*
@@ -175,16 +344,54 @@ vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
   // This promotes a COW page to a new writable page
   vmpage_assert_locked(vp);
   KASSERT((vp->vp_flags & VM_PAGE_FLAG_COW) != 0, "attempt to promote non-COW page");
+  KASSERT(vp->vp_refcount > 0, "invalid refcount of vp");
+
+  /*
+   * If other areas share vp with us (this is what fork does), it must stay as
+   * it is for their sake: we need a copy of our own and let go of vp.
+   */
+  if (vp->vp_refcount > 1) {
+    vmpage_detach(va, vp);
+    if (vmpage_resolve(vp) == vmpage_zero) {
+      // Nothing to copy; a zeroed page will do
+      struct VM_PAGE* vp_new = vmpage_create_private(va, vp->vp_vaddr, VM_PAGE_FLAG_PRIVATE, PAGE_ALLOC_ZERO);
+      if (vp_new == nullptr) {
+        vmpage_attach(va, vp);
+        return nullptr;
+      }
+      __sync_fetch_and_add(&vmpage_zero_promoted, 1);
+      vmpage_deref(vp);
+      return vp_new;
+    }
+    const int flags = (vp->vp_flags & VM_PAGE_FLAG_LARGE) | VM_PAGE_FLAG_PRIVATE;
+    struct VM_PAGE* vp_new = vmpage_create_private(va, vp->vp_vaddr, flags, (flags & VM_PAGE_FLAG_LARGE) ? PAGE_ALLOC_TRY : 0);
+    if (vp_new != nullptr)
+      vmpage_copy(vp, vp_new);
+#ifdef MD_LARGE_PAGE_ORDER
+    else if (flags & VM_PAGE_FLAG_LARGE)
+      vp_new = vmpage_copy_split(va, vp);
+#endif
+    if (vp_new == nullptr) {
+      // Out of memory; va keeps using vp
+      vmpage_attach(va, vp);
+      return nullptr;
+    }
+    DPRINTF("%d: vmpage_promote(): vp %p is shared, copied to vp %p @ %p\n", get_pid(), vp, vp_new, vp_new->vp_vaddr);
+    vmpage_deref(vp);
+    return vp_new;
+  }
+
+  // vp may be about to change from a link to a page of our own; account for it once we know
+  vmspace_account_page(va, vp, -1);
 
   // Get a reference to the source page - this is what we need to copy
   struct VM_PAGE* vp_source = vmpage_resolve(vp);
   if (vp_source != vp)
     vmpage_lock(vp_source); // freed by vmpage_deref()
-  KASSERT(vp->vp_refcount > 0, "invalid refcount of vp");
   KASSERT(vp_source->vp_refcount > 0, "invalid refcount of source");
 
   /*
-   * Multiple scenario's here:
+   * We are the only user of vp, so multiple scenario's remain:
    *
    * (1) We hold the last reference to to the source page
    *     This means we can re-use the page it contains and free the source.
@@ -201,6 +408,7 @@ vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
       // Steal the page from the source...
       vp->vp_page = vp_source->vp_page;
       vp_source->vp_page = nullptr;
+      LIST_REMOVE_IP(&vp_source->vp_links, link, vp);
 
       // ... which we can now destroy
       vmpage_deref(vp_source);
@@ -208,40 +416,41 @@ vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
       // We're no longer linked, either
       vp->vp_flags &= ~VM_PAGE_FLAG_LINK;
     } else /* vp_source == vp - we are not linked */ {
-      // We *are* the source page! We can just use it
+      // We *are* the source page! We can just use it; the area it came from may be gone
       DPRINTF("%d: vmpage_promote(): vp %p, we are the last page - using it! (page %p @ %p)\n", get_pid(), vp, vp->vp_page, vp->vp_vaddr);
+      vp->vp_vmarea = va;
     }
   } else /* vp_source->vp_refcount > 1 */ {
-    /* (2) - multiple references, need to make a copy */
-    if (vp_source == vp) {
-      // We have the original page - must allocate a new one, as we can't touch this one
-      vp = vmpage_create_private(va, vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE);
-      vp->vp_vaddr = vp_source->vp_vaddr;
-
-      // Remove the original source from the vmarea
-      LIST_REMOVE(&vp_source->vp_vmarea->va_pages, vp_source);
-      vp_source->vp_vmarea = nullptr;
-
-      DPRINTF("%d: vmpage_promote(): made new vp %p page %p for %p @ %p\n", get_pid(), vp, vp->vp_page, vp_source, vp->vp_vaddr);
-    } else /* vp_source != vp */ {
-      KASSERT((vp->vp_flags & VM_PAGE_FLAG_LINK) != 0, "destination vp not linked?");
-
-      // We need t allocate a new page for the destination and hook it up
-      vp->vp_page = page_alloc_single();
-      KASSERT(vp->vp_page != nullptr, "out of pages");
-      vp->vp_flags &= ~VM_PAGE_FLAG_LINK;
-
-      // And we can continue copying things into it
-      DPRINTF("%d: vmpage_promote(): vp %p, must copy page %p -> page %p @ %p!\n", get_pid(), vp, vp_source->vp_page, vp->vp_page, vp->vp_vaddr);
+    /* (2) - multiple references to the page we link to, need to make a copy */
+    KASSERT((vp->vp_flags & VM_PAGE_FLAG_LINK) != 0, "destination vp not linked?");
+
+    // We need t allocate a new page for the destination and hook it up; the zero page needs no copying
+    const bool zero = vp_source == vmpage_zero;
+    struct PAGE* p = page_alloc_order_flags(0, zero ? PAGE_ALLOC_ZERO : 0);
+    if (p == nullptr) {
+      // Leave vp linked as it was
+      vmpage_unlock(vp_source);
+      vmspace_account_page(va, vp, 1);
+      return nullptr;
     }
+    vp->vp_page = p;
+    vp->vp_flags &= ~VM_PAGE_FLAG_LINK;
+    LIST_REMOVE_IP(&vp_source->vp_links, link, vp);
+
+    // And we can continue copying things into it
+    DPRINTF("%d: vmpage_promote(): vp %p, must copy page %p -> page %p @ %p!\n", get_pid(), vp, vp_source->vp_page, vp->vp_page, vp->vp_vaddr);
 
     // Copy the data over and throw away the source; this never deletes it
-    vmpage_copy(vp_source, vp);
+    if (zero)
+      __sync_fetch_and_add(&vmpage_zero_promoted, 1);
+    else
+      vmpage_copy(vp_source, vp);
     vmpage_deref(vp_source);
   }
 
   // Our page is no longer COW, but it is private. Note that we never unlock vp here
   vp->vp_flags = (vp->vp_flags & ~VM_PAGE_FLAG_COW) | VM_PAGE_FLAG_PRIVATE;
+  vmspace_account_page(va, vp, 1);
   return vp;
 }
 
@@ -271,25 +480,36 @@ vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs)
 {
   /*
    * First step is to see if we can locate this page for the given vmspace - the private mappings
-   * are stored there and override global ones.
+   * are stored there and override global ones. Offset offs is mapped at a fixed place in the area.
    */
-  LIST_FOREACH(&va->va_pages, vmpage, struct VM_PAGE) {
-    if (vmpage->vp_inode != inode || vmpage->vp_offset != offs)
-      continue;
-
-    vmpage_lock(vmpage);
-    return vmpage;
+  if (va->va_dentry != nullptr && va->va_dentry->d_inode == inode && offs >= va->va_doffset) {
+    auto vmpage = static_cast<struct VM_PAGE*>(radix_lookup(&va->va_pages, vmpage_area_index(va->va_virt + (offs - va->va_doffset))));
+    if (vmpage != nullptr && vmpage->vp_inode == inode && vmpage->vp_offset == offs) {
+      vmpage_lock(vmpage);
+      return vmpage;
+    }
   }
 
   // Try all inode-private pages
-	INODE_LOCK(inode);
-  LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
-    // We don't check vp_inode here as this is the per-inode list already
-    if (vmpage->vp_offset != offs)
-      continue;
+  return vmpage_lookup_inode_locked(inode, offs);
+}
 
+struct VM_PAGE*
+vmpage_lookup_inode_locked(struct VFS_INODE* inode, off_t offs)
+{
+	INODE_LOCK(inode);
+  auto vmpage = static_cast<struct VM_PAGE*>(radix_lookup(&inode->i_pages, vmpage_inode_index(offs)));
+  if (vmpage != nullptr) {
     vmpage_lock(vmpage); // XXX is this order wise?
+    if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
+      // Pages are only unlocked while pending if their read failed; throw it away so it is read again
+      vmpage_drop_pending(inode, vmpage);
+      INODE_UNLOCK(inode);
+      return nullptr;
+    }
     INODE_UNLOCK(inode);
+    // Looking a page up means it is about to be used; this keeps it from being paged out
+    vmpage->vp_flags |= VM_PAGE_FLAG_REFERENCED;
     return vmpage;
   }
 	INODE_UNLOCK(inode);
@@ -301,49 +521,40 @@ vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs)
 struct VM_PAGE*
 vmpage_lookup_vaddr_locked(vmarea_t* va, addr_t vaddr)
 {
-  LIST_FOREACH(&va->va_pages, vmpage, struct VM_PAGE) {
-    if (vmpage->vp_vaddr != vaddr)
-      continue;
-
-    vmpage_lock(vmpage);
-    return vmpage;
+  auto vmpage = static_cast<struct VM_PAGE*>(radix_lookup(&va->va_pages, vmpage_area_index(vaddr)));
+#ifdef MD_LARGE_PAGE_ORDER
+  if (vmpage == nullptr) {
+    // A large page is only indexed by its first page; see if vaddr is inside one
+    const size_t large_size = PAGE_SIZE << MD_LARGE_PAGE_ORDER;
+    vmpage = static_cast<struct VM_PAGE*>(radix_lookup(&va->va_pages, vmpage_area_index(vaddr & ~(large_size - 1))));
+    if (vmpage != nullptr && (vmpage->vp_flags & VM_PAGE_FLAG_LARGE) == 0)
+      vmpage = nullptr;
   }
+#endif
+  if (vmpage != nullptr)
+    vmpage_lock(vmpage);
+  return vmpage;
+}
 
-  // Nothing was found
-  return nullptr;
+struct VM_PAGE*
+vmpage_lookup_next(vmarea_t* va, addr_t vaddr)
+{
+  unsigned long index;
+  return static_cast<struct VM_PAGE*>(radix_next(&va->va_pages, vmpage_area_index(vaddr), &index));
 }
 
 struct VM_PAGE*
-vmpage_clone(vmspace_t* vs, vmarea_t* va_source, vmarea_t* va_dest, struct VM_PAGE* vp_source)
+vmpage_clone(vmarea_t* va_dest, struct VM_PAGE* vp_source)
 {
   vmpage_assert_locked(vp_source);
   struct VM_PAGE* vp_orig = vp_source;
-
-  /*
-   * Cloning a page may results in different scenarios:
-   *
-   * 1) We can create a link to the source page, using the same access
-   * 2) We can create a link to the source page, yet employ COW
-   *    This consists of marking the original page as read-only.
-   * 3) We need to duplicate the source page
-   */
   vp_source = vmpage_resolve_locked(vp_source);
   KASSERT((vp_source->vp_flags & VM_PAGE_FLAG_PENDING) == 0, "trying to clone a pending page");
 
-  // (3) If this is a MD-specific page, just duplicate it - we don't want to share things like
-  // pagetables and the like
-  struct VM_PAGE* vp_dst;
-  if (va_source->va_flags & VM_FLAG_MD) {
-    vp_dst = vmpage_create_private(va_dest, vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE);
-    vp_dst->vp_vaddr = vp_source->vp_vaddr;
+  int flags = (vp_source->vp_flags & ~(VM_PAGE_FLAG_COW | VM_PAGE_FLAG_REFERENCED)) | VM_PAGE_FLAG_PRIVATE;
+  struct VM_PAGE* vp_dst = vmpage_create_private(va_dest, vp_orig->vp_vaddr, flags);
+  if (vp_dst != nullptr)
     vmpage_copy(vp_source, vp_dst);
-  } else if (vp_source->vp_flags & VM_PAGE_FLAG_READONLY) {
-    // (1) If the source is read-only, we can always share it
-    vp_dst = vmpage_link(va_dest, vp_source);
-  } else {
-    // (2) Clone the page using COW
-    vp_dst = vmpage_clone_cow(vs, va_dest, vp_source);
-  }
 
   if (vp_orig != vp_source) {
     vmpage_unlock(vp_source);
@@ -352,6 +563,20 @@ vmpage_clone(vmspace_t* vs, vmarea_t* va_source, vmarea_t* va_dest, struct VM_PA
   return vp_dst;
 }
 
+void
+vmpage_share(vmarea_t* va_dest, struct VM_PAGE* vp, bool cow)
+{
+  vmpage_assert_locked(vp);
+  KASSERT((vp->vp_flags & VM_PAGE_FLAG_PENDING) == 0, "trying to share a pending page");
+
+  // The page keeps its original area, if any; it just gains a reference
+  vmpage_ref(vp);
+  if (cow)
+    vp->vp_flags |= VM_PAGE_FLAG_COW;
+  radix_insert(&va_dest->va_pages, vmpage_area_index(vp->vp_vaddr), vp);
+  vmspace_account_page(va_dest, vp, 1);
+}
+
 struct PAGE*
 vmpage_get_page(struct VM_PAGE* vp)
 {
@@ -363,45 +588,247 @@ vmpage_get_page(struct VM_PAGE* vp)
   return vp->vp_page;
 }
 
-struct VM_PAGE*
-vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags)
+errorcode_t
+vmpage_create_pending(struct VFS_INODE* inode, off_t offs, unsigned int* count, int flags, struct VM_PAGE** vps)
 {
-  struct VM_PAGE* new_page = vmpage_alloc(nullptr, inode, offs, flags);
+  // Allocate everything first; we mustn't block once we hold the inode lock
+  unsigned int num_alloced = 0;
+  for (/* nothing */; num_alloced < *count; num_alloced++) {
+    vps[num_alloced] = vmpage_alloc(nullptr, 0, inode, offs + num_alloced * PAGE_SIZE, flags | VM_PAGE_FLAG_PENDING);
+    if (vps[num_alloced] == nullptr)
+      break;
+  }
+  if (num_alloced == 0)
+    return ANANAS_ERROR(OUT_OF_MEMORY);
 
-  // Hook the vm page to the inode
+  // Hook the pages to the inode, up to the first which is already present
   INODE_LOCK(inode);
-  LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
-    if (vmpage->vp_offset != offs || vmpage == new_page)
-      continue;
+  unsigned int num_created = 0;
+  for (/* nothing */; num_created < num_alloced; num_created++) {
+    const unsigned long index = vmpage_inode_index(offs) + num_created;
+    if (radix_lookup(&inode->i_pages, index) != nullptr)
+      break;
+    radix_insert(&inode->i_pages, index, vps[num_created]);
+    pageout_insert(vps[num_created]);
+  }
+  INODE_UNLOCK(inode);
 
-    // Page is already present - return the one already in use
-    vmpage_lock(vmpage); // XXX is this order wise?
-    INODE_UNLOCK(inode);
+  // Throw away the pages we won't need; they were never listed anywhere
+  for (unsigned int n = num_created; n < num_alloced; n++) {
+    vmpage_unlock(vps[n]);
+    slab_free(&vmpage_cache, vps[n]);
+  }
+  *count = num_created;
+  return ananas_success();
+}
 
-    // And throw the new page away, we won't need it
-    vmpage_unlock(new_page);
-    kfree(new_page);
-    return vmpage;
+void
+vmpage_abort_pending(struct VM_PAGE* vp)
+{
+  vmpage_assert_locked(vp);
+  KASSERT(vp->vp_flags & VM_PAGE_FLAG_PENDING, "aborting page %p which isn't pending", vp);
+  struct VFS_INODE* inode = vp->vp_inode;
+  const off_t offs = vp->vp_offset;
+
+  /*
+   * The inode lock must be taken first; once we let go of vp, anyone looking
+   * it up may remove it before us, so look it up again.
+   */
+  vmpage_unlock(vp);
+  INODE_LOCK(inode);
+  vp = static_cast<struct VM_PAGE*>(radix_lookup(&inode->i_pages, vmpage_inode_index(offs)));
+  if (vp != nullptr) {
+    vmpage_lock(vp);
+    if (vp->vp_flags & VM_PAGE_FLAG_PENDING)
+      vmpage_drop_pending(inode, vp);
+    else
+      vmpage_unlock(vp);
   }
+  INODE_UNLOCK(inode);
+}
 
-  // Not yet present; add the new page and return it
-  LIST_APPEND(&inode->i_pages, new_page);
+void
+vmpage_evict(struct VM_PAGE* vp)
+{
+  vmpage_assert_locked(vp);
+  struct VFS_INODE* inode = vp->vp_inode;
+  mutex_assert(&inode->i_mutex, MTX_LOCKED);
+  KASSERT(vp->vp_refcount == 1, "evicting page %p with refcount %d", vp, vp->vp_refcount);
+  KASSERT((vp->vp_flags & VM_PAGE_FLAG_PENDING) == 0, "evicting pending page %p", vp);
+
+  void* removed = radix_remove(&inode->i_pages, vmpage_inode_index(vp->vp_offset));
+  KASSERT(removed == vp, "vmpage %p not indexed at offset %d (found %p)", vp, (int)vp->vp_offset, removed);
+  vmpage_deref(vp);
+}
+
+bool
+vmpage_is_cached(struct VFS_INODE* inode, off_t offs)
+{
+  INODE_LOCK(inode);
+  bool cached = radix_lookup(&inode->i_pages, vmpage_inode_index(offs)) != nullptr;
   INODE_UNLOCK(inode);
-  return new_page;
+  return cached;
 }
 
 struct VM_PAGE*
-vmpage_create_private(vmarea_t* va, int flags)
+vmpage_create_private(vmarea_t* va, addr_t vaddr, int flags, int page_flags)
 {
-  auto new_page = vmpage_alloc(va, nullptr, 0, flags);
+  auto new_page = vmpage_alloc(va, vaddr, nullptr, 0, flags);
+  if (new_page == nullptr)
+    return nullptr;
 
   // Hook a page to here as well, as the caller needs it anyway
-  new_page->vp_page = page_alloc_single();
-	KASSERT(new_page->vp_page != nullptr, "out of pages");
+  int order = 0;
+#ifdef MD_LARGE_PAGE_ORDER
+  if (flags & VM_PAGE_FLAG_LARGE)
+    order = MD_LARGE_PAGE_ORDER;
+#endif
+  new_page->vp_page = page_alloc_order_flags(order, page_flags);
+  if (new_page->vp_page == nullptr) {
+    vmpage_deref(new_page);
+    return nullptr;
+  }
   return new_page;
 }
 
-void
+bool
+vmpage_swappable(struct VM_PAGE* vp, bool allow_large)
+{
+  vmpage_assert_locked(vp);
+
+  /*
+   * Only private anonymous pages used by a single area qualify; areas which
+   * aren't filled by faulting wouldn't get them back. Note that the zero page
+   * is not private.
+   */
+  int flags = VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_PENDING | VM_PAGE_FLAG_SWAPPED;
+  if (!allow_large)
+    flags |= VM_PAGE_FLAG_LARGE;
+  if ((vp->vp_flags & flags) != VM_PAGE_FLAG_PRIVATE || vp->vp_inode != nullptr)
+    return false;
+  if (vp->vp_refcount != 1 || !LIST_EMPTY(&vp->vp_links))
+    return false;
+  vmarea_t* va = vp->vp_vmarea;
+  return va != nullptr && (va->va_flags & (VM_FLAG_FAULT | VM_FLAG_MD)) == VM_FLAG_FAULT;
+}
+
+errorcode_t
+vmpage_swapout(struct VM_PAGE* vp, swapslot_t slot)
+{
+  vmpage_assert_locked(vp);
+  KASSERT(vmpage_swappable(vp), "swapping out page %p which cannot be swapped", vp);
+  vmarea_t* va = vp->vp_vmarea;
+
+  // Take the mapping away first, so that the page cannot change while it is written
+  md_unmap_pages(va->va_vmspace, vp->vp_vaddr, 1);
+  errorcode_t err = swap_write(slot, vp->vp_page);
+  ANANAS_ERROR_RETURN(err);
+
+  DPRINTF("[%d] vmpage_swapout(): vp %p @ %p -> slot %x\n", get_pid(), vp, vp->vp_vaddr, slot);
+  vmspace_account_page(va, vp, -1);
+  page_free(vp->vp_page);
+  vp->vp_page = nullptr;
+  vp->vp_swap = slot;
+  vp->vp_flags |= VM_PAGE_FLAG_SWAPPED;
+  return ananas_success();
+}
+
+errorcode_t
+vmpage_swapin(struct VM_PAGE* vp)
+{
+  vmpage_assert_locked(vp);
+  if ((vp->vp_flags & VM_PAGE_FLAG_SWAPPED) == 0)
+    return ananas_success();
+
+  struct PAGE* p = page_alloc_single();
+  if (p == nullptr)
+    return ANANAS_ERROR(OUT_OF_MEMORY);
+  errorcode_t err = swap_read(vp->vp_swap, p);
+  if (ananas_is_failure(err)) {
+    page_free(p);
+    return err;
+  }
+
+  DPRINTF("[%d] vmpage_swapin(): vp %p @ %p <- slot %x\n", get_pid(), vp, vp->vp_vaddr, vp->vp_swap);
+  swap_free(vp->vp_swap);
+  vp->vp_page = p;
+  vp->vp_flags &= ~VM_PAGE_FLAG_SWAPPED;
+  if (vp->vp_vmarea != nullptr)
+    vmspace_account_page(vp->vp_vmarea, vp, 1);
+  return ananas_success();
+}
+
+errorcode_t
+vmpage_split(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
+{
+  vmpage_assert_locked(vp);
+  KASSERT((vp->vp_flags & (VM_PAGE_FLAG_LARGE | VM_PAGE_FLAG_LINK)) == VM_PAGE_FLAG_LARGE, "splitting non-large page %p", vp);
+#ifdef MD_LARGE_PAGE_ORDER
+  if (vp->vp_refcount > 1) {
+    /*
+     * Other areas share vp (we were forked) and still need it as a whole; all
+     * we can do is give va copies of its pages, which it maps as they are
+     * faulted. This means the range is no longer shared with the others.
+     */
+    vmpage_detach(va, vp);
+    struct VM_PAGE* vp_first = vmpage_copy_split(va, vp);
+    if (vp_first == nullptr) {
+      vmpage_attach(va, vp);
+      vmpage_unlock(vp);
+      return ANANAS_ERROR(OUT_OF_MEMORY);
+    }
+    md_unmap_pages(vs, vp->vp_vaddr, 1U << MD_LARGE_PAGE_ORDER);
+    vmpage_unlock(vp_first);
+    vmpage_deref(vp);
+    return ananas_success();
+  }
+
+  // Get the vmpages for the other pages first, so that we can back out if there aren't enough
+  const int flags = vp->vp_flags & ~VM_PAGE_FLAG_LARGE;
+  struct VM_PAGE_LINKS new_vps;
+  LIST_INIT(&new_vps);
+  for (unsigned int n = 1; n < (1U << MD_LARGE_PAGE_ORDER); n++) {
+    struct VM_PAGE* new_vp = vmpage_alloc(nullptr, vp->vp_vaddr + n * PAGE_SIZE, nullptr, 0, flags);
+    if (new_vp == nullptr) {
+      vmpage_free_unused(&new_vps);
+      vmpage_consider_swap(vp);
+      vmpage_unlock(vp);
+      return ANANAS_ERROR(OUT_OF_MEMORY);
+    }
+    vmpage_unlock(new_vp); // nobody else knows about it yet
+    LIST_APPEND_IP(&new_vps, link, new_vp);
+  }
+
+  // Change the mapping first; it keeps pointing at the same pages
+  errorcode_t err = md_split_large_page(vs, vp->vp_vaddr);
+  if (ananas_is_failure(err)) {
+    vmpage_free_unused(&new_vps);
+    vmpage_consider_swap(vp);
+    vmpage_unlock(vp);
+    return err;
+  }
+
+  struct PAGE* p = vp->vp_page;
+  page_split(p);
+  vmspace_account_page(va, vp, -1);
+  vp->vp_flags = flags;
+  vmspace_account_page(va, vp, 1);
+  vp->vp_vmarea = va;
+  vmpage_consider_swap(vp);
+  unsigned int n = 1;
+  LIST_FOREACH_SAFE_IP(&new_vps, link, it, struct VM_PAGE) {
+    vmpage_lock(it);
+    it->vp_page = p + n++;
+    vmpage_attach(va, it);
+    vmpage_consider_swap(it);
+    vmpage_unlock(it);
+  }
+#endif
+  vmpage_unlock(vp);
+  return ananas_success();
+}
+
+errorcode_t
 vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
 {
 	vmpage_assert_locked(vp);
@@ -411,34 +838,40 @@ vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
 	if (vp->vp_flags & VM_PAGE_FLAG_COW)
 		flags &= ~VM_FLAG_WRITE;
 	struct PAGE* p = vmpage_get_page(vp);
-	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(p), 1, flags);
-}
+	errorcode_t err;
+#ifdef MD_LARGE_PAGE_ORDER
+	if (vp->vp_flags & VM_PAGE_FLAG_LARGE)
+		err = md_map_large_page(vs, vp->vp_vaddr, page_get_paddr(p), flags);
+	else
+#endif
+		err = md_map_pages(vs, vp->vp_vaddr, page_get_paddr(p), 1, flags);
+	ANANAS_ERROR_RETURN(err);
 
-void
-vmpage_zero(vmspace_t* vs, struct VM_PAGE* vp)
-{
-	// Clear the page XXX This is unfortunate, we should have a supply of pre-zeroed pages
-	struct PAGE* p = vmpage_get_page(vp);
-	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(p), 1, VM_FLAG_READ | VM_FLAG_WRITE);
-	memset((void*)vp->vp_vaddr, 0, PAGE_SIZE);
+	// Anonymous pages in use become candidates for swapping them out
+	vmpage_consider_swap(vp);
+	return ananas_success();
 }
 
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix)
 {
-  kprintf("%s%p: refcount %d vaddr %p flags %s/%s/%s/%c ",
+  kprintf("%s%p: refcount %d vaddr %p flags %s/%s/%s/%c%c%c ",
     prefix, vp, vp->vp_refcount,
     vp->vp_vaddr,
     (vp->vp_flags & VM_PAGE_FLAG_PRIVATE) ? "prv" : "pub",
     (vp->vp_flags & VM_PAGE_FLAG_READONLY) ? "ro" : "rw",
     (vp->vp_flags & VM_PAGE_FLAG_COW) ? "cow" : "---",
-    (vp->vp_flags & VM_PAGE_FLAG_PENDING) ? 'p' : '.');
+    (vp->vp_flags & VM_PAGE_FLAG_PENDING) ? 'p' : '.',
+    (vp->vp_flags & VM_PAGE_FLAG_LARGE) ? 'L' : '.',
+    (vp->vp_flags & VM_PAGE_FLAG_SWAPPED) ? 's' : '.');
   if (vp->vp_flags & VM_PAGE_FLAG_LINK) {
     vp = vp->vp_link;
     kprintf(" -> ");
     vmpage_dump(vp, "");
     return;
   }
-  if (vp->vp_page != nullptr)
+  if (vp->vp_flags & VM_PAGE_FLAG_SWAPPED)
+    kprintf("%sswap slot %x", prefix, vp->vp_swap);
+  else if (vp->vp_page != nullptr)
     kprintf("%spage %p phys %p order %d", prefix, vp->vp_page, page_get_paddr(vp->vp_page), vp->vp_page->p_order);
   kprintf("\n");
 }
@@ -2,14 +2,17 @@
 #include <ananas/error.h>
 #include "kernel/lib.h"
 #include "kernel/mm.h"
+#include "kernel/pcpu.h"
+#include "kernel/thread.h"
 #include "kernel/trace.h"
 #include "kernel/vmpage.h"
 #include "kernel/vmspace.h"
 #include "kernel/vfs/dentry.h"
+#include "kernel/vfs/pagecache.h"
 #include "kernel/vfs/types.h"
 #include "kernel/vm.h"
 #include "kernel-md/param.h" // for THREAD_INITIAL_MAPPING_ADDR
-#include "kernel-md/vm.h" // for md_{,un}map_pages()
+#include "kernel-md/vm.h" // for md_{unmap,write_protect}_pages()
 
 TRACE_SETUP;
 
@@ -29,18 +32,328 @@ addr_t RoundUp(addr_t addr)
 	return (addr | (PAGE_SIZE - 1)) + 1;
 }
 
+addr_t RoundUpTo(addr_t addr, size_t align)
+{
+	return (addr + align - 1) & ~(addr_t)(align - 1);
+}
+
+/* Source of vs_area_gen values; never re-used so stale thread caches can't match */
+unsigned long vmspace_area_gen_next = 0;
+
+inline vmarea_t*
+AreaFromNode(struct RB_NODE* node)
+{
+	return RB_ITEM(node, vmarea_t, va_rb);
+}
+
+/* Returns the first address after va, which is where the next gap starts */
+inline addr_t
+AreaEnd(const vmarea_t* va)
+{
+	return RoundUp(va->va_virt + va->va_len);
+}
+
+void
+vmspace_area_augment(struct RB_NODE* node)
+{
+	vmarea_t* va = AreaFromNode(node);
+	size_t gap = va->va_gap;
+	if (node->rb_left != nullptr && AreaFromNode(node->rb_left)->va_subtree_gap > gap)
+		gap = AreaFromNode(node->rb_left)->va_subtree_gap;
+	if (node->rb_right != nullptr && AreaFromNode(node->rb_right)->va_subtree_gap > gap)
+		gap = AreaFromNode(node->rb_right)->va_subtree_gap;
+	va->va_subtree_gap = gap;
+}
+
+void
+vmspace_invalidate_area_cache(vmspace_t* vs)
+{
+	vs->vs_area_gen = __sync_add_and_fetch(&vmspace_area_gen_next, 1);
+}
+
+/* Recalculates the gap before va, i.e. after its predecessor */
+void
+vmspace_update_gap(vmspace_t* vs, vmarea_t* va)
+{
+	vmarea_t* prev = AreaFromNode(rb_prev(&va->va_rb));
+	addr_t start = prev != nullptr ? AreaEnd(prev) : 0;
+	va->va_gap = va->va_virt > start ? va->va_virt - start : 0;
+	rb_propagate(&vs->vs_area_tree, &va->va_rb);
+}
+
+void
+vmspace_insert_area(vmspace_t* vs, vmarea_t* va)
+{
+	struct RB_NODE** link = &vs->vs_area_tree.rb_root;
+	struct RB_NODE* parent = nullptr;
+	while (*link != nullptr) {
+		parent = *link;
+		link = va->va_virt < AreaFromNode(parent)->va_virt ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_insert(&vs->vs_area_tree, &va->va_rb, parent, link);
+
+	// Both our gap and the gap of the area after us are new
+	vmspace_update_gap(vs, va);
+	vmarea_t* next = AreaFromNode(rb_next(&va->va_rb));
+	if (next != nullptr)
+		vmspace_update_gap(vs, next);
+}
+
+void
+vmspace_remove_area(vmspace_t* vs, vmarea_t* va)
+{
+	vmarea_t* next = AreaFromNode(rb_next(&va->va_rb));
+	rb_remove(&vs->vs_area_tree, &va->va_rb);
+	if (next != nullptr)
+		vmspace_update_gap(vs, next);
+	vmspace_invalidate_area_cache(vs);
+}
+
+/* Returns the lowest area ending after virt, or nullptr if there is none */
+vmarea_t*
+vmspace_find_area_after(vmspace_t* vs, addr_t virt)
+{
+	vmarea_t* found = nullptr;
+	struct RB_NODE* node = vs->vs_area_tree.rb_root;
+	while (node != nullptr) {
+		vmarea_t* va = AreaFromNode(node);
+		if (va->va_virt + va->va_len > virt) {
+			found = va;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+	return found;
+}
+
+/*
+ * Looks for the smallest gap in the subtree of node which can hold an
+ * align-aligned range of len bytes at or above lower; result and best_waste
+ * describe the best fit so far (best_waste being the number of bytes of its
+ * gap that would remain unused). Subtrees whose largest gap is too small are
+ * skipped entirely, and we stop once a gap fits exactly. Gaps are visited in
+ * address order, so of equally good fits the lowest is used.
+ */
+void
+vmspace_find_gap(struct RB_NODE* node, addr_t lower, size_t len, size_t align, addr_t& result, size_t& best_waste)
+{
+	if (node == nullptr || best_waste == 0)
+		return;
+	vmarea_t* va = AreaFromNode(node);
+	if (va->va_subtree_gap < len)
+		return;
+
+	// Our gap and those on our left end at va_virt; they're useless if that is too low
+	if (va->va_virt >= lower + len) {
+		vmspace_find_gap(node->rb_left, lower, len, align, result, best_waste);
+
+		addr_t start = va->va_virt - va->va_gap;
+		if (start < lower)
+			start = lower;
+		start = RoundUpTo(start, align);
+		if (start + len <= va->va_virt && va->va_gap - len < best_waste) {
+			result = start;
+			best_waste = va->va_gap - len;
+		}
+	}
+	vmspace_find_gap(node->rb_right, lower, len, align, result, best_waste);
+}
+
+/*
+ * Ensures no large page in va straddles virt, so that the area can be cut
+ * there; large pages are broken up into normal pages if needed, which may
+ * fail if we are out of memory.
+ */
+errorcode_t
+vmspace_split_large_at(vmspace_t* vs, vmarea_t* va, addr_t virt)
+{
+	struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt);
+	if (vp == nullptr)
+		return ananas_success();
+	if ((vp->vp_flags & VM_PAGE_FLAG_LARGE) && virt != vp->vp_vaddr)
+		return vmpage_split(vs, va, vp);
+	vmpage_unlock(vp);
+	return ananas_success();
+}
+
+/* Updates the gaps before and after va, which was moved or resized */
+void
+vmspace_update_gaps_around(vmspace_t* vs, vmarea_t* va)
+{
+	vmspace_update_gap(vs, va);
+	vmarea_t* next = AreaFromNode(rb_next(&va->va_rb));
+	if (next != nullptr)
+		vmspace_update_gap(vs, next);
+	vmspace_invalidate_area_cache(vs);
+}
+
+/*
+ * Removes the pages of va in [virt, end) along with their mappings; the
+ * range must not cut through a large page.
+ */
+void
+vmspace_area_drop_pages(vmspace_t* vs, vmarea_t* va, addr_t virt, addr_t end)
+{
+	md_unmap_pages(vs, virt, (end - virt) / PAGE_SIZE);
+
+	// Pages may outlive us if they are referenced elsewhere, so they must be unhooked
+	unsigned long index;
+	void* item;
+	while ((item = radix_next(&va->va_pages, virt / PAGE_SIZE, &index)) != nullptr && index < end / PAGE_SIZE) {
+		radix_remove(&va->va_pages, index);
+		auto vp = static_cast<struct VM_PAGE*>(item);
+		vmpage_lock(vp);
+		vmspace_account_page(va, vp, -1);
+		if (vp->vp_vmarea == va)
+			vp->vp_vmarea = nullptr;
+		vmpage_deref(vp);
+	}
+}
+
+/* Removes everything of va before virt, which must be page-aligned and inside va */
+errorcode_t
+vmspace_area_trim_head(vmspace_t* vs, vmarea_t* va, addr_t virt)
+{
+	errorcode_t err = vmspace_split_large_at(vs, va, virt);
+	ANANAS_ERROR_RETURN(err);
+	vmspace_area_drop_pages(vs, va, va->va_virt, virt);
+
+	size_t len = virt - va->va_virt;
+	if (va->va_dentry != nullptr) {
+		// Backed by an inode; correct the offsets
+		va->va_doffset += len;
+		va->va_dlength = va->va_dlength > len ? va->va_dlength - len : 0;
+		KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
+	}
+	va->va_virt = virt;
+	va->va_len -= len;
+	vmspace_update_gaps_around(vs, va);
+	return ananas_success();
+}
+
+/* Removes everything of va from virt onwards; virt must be page-aligned and inside va */
+errorcode_t
+vmspace_area_trim_tail(vmspace_t* vs, vmarea_t* va, addr_t virt)
+{
+	errorcode_t err = vmspace_split_large_at(vs, va, virt);
+	ANANAS_ERROR_RETURN(err);
+	vmspace_area_drop_pages(vs, va, virt, AreaEnd(va));
+
+	va->va_len = virt - va->va_virt;
+	if (va->va_dlength > va->va_len)
+		va->va_dlength = va->va_len;
+	vmspace_update_gaps_around(vs, va);
+	return ananas_success();
+}
+
+/*
+ * Cuts va in two at virt, which must be page-aligned and inside va; the part
+ * from virt onwards becomes a new area, which takes over the pages and their
+ * mappings.
+ */
+errorcode_t
+vmspace_area_split(vmspace_t* vs, vmarea_t* va, addr_t virt)
+{
+	errorcode_t err = vmspace_split_large_at(vs, va, virt);
+	ANANAS_ERROR_RETURN(err);
+
+	auto va_new = new vmarea_t;
+	memset(va_new, 0, sizeof(*va_new));
+	radix_tree_init(&va_new->va_pages);
+	size_t offset = virt - va->va_virt;
+	va_new->va_vmspace = vs;
+	va_new->va_virt = virt;
+	va_new->va_len = va->va_len - offset;
+	va_new->va_flags = va->va_flags;
+	va_new->va_advice = va->va_advice;
+	if (va->va_dentry != nullptr) {
+		va_new->va_dentry = va->va_dentry;
+		dentry_ref(va_new->va_dentry);
+		va_new->va_doffset = va->va_doffset + offset;
+		if (va->va_dlength > offset) {
+			va_new->va_dlength = va->va_dlength - offset;
+			va->va_dlength = offset;
+		}
+	}
+	va->va_len = offset;
+
+	unsigned long index;
+	void* item;
+	while ((item = radix_next(&va->va_pages, virt / PAGE_SIZE, &index)) != nullptr) {
+		radix_remove(&va->va_pages, index);
+		radix_insert(&va_new->va_pages, index, item);
+		auto vp = static_cast<struct VM_PAGE*>(item);
+		vmpage_lock(vp);
+		if (vp->vp_vmarea == va)
+			vp->vp_vmarea = va_new;
+		vmpage_unlock(vp);
+	}
+
+	LIST_APPEND(&vs->vs_areas, va_new);
+	vmspace_insert_area(vs, va_new);
+	vmspace_invalidate_area_cache(vs);
+	return ananas_success();
+}
+
 } // unnamed namespace
 
 addr_t
 vmspace_determine_va(vmspace_t* vs, size_t len)
 {
+	len = RoundUp(len);
+
+	/*
+	 * Mappings that can hold a large page are aligned so that they can
+	 * actually use them.
+	 */
+	size_t align = PAGE_SIZE;
+#ifdef MD_LARGE_PAGE_ORDER
+	if (len >= (PAGE_SIZE << MD_LARGE_PAGE_ORDER))
+		align = PAGE_SIZE << MD_LARGE_PAGE_ORDER;
+#endif
+
 	/*
-	 * XXX This is a bit of a kludge - besides, we currently never re-use old
-	 * addresses which may get ugly.
+	 * Take the gap that fits best; this keeps large gaps intact for large
+	 * mappings, so that address space freed by unmapping can be re-used.
 	 */
-	addr_t virt = vs->vs_next_mapping;
-	vs->vs_next_mapping = RoundUp(vs->vs_next_mapping + len);
-	return virt;
+	addr_t virt;
+	size_t waste = static_cast<size_t>(-1);
+	vmspace_find_gap(vs->vs_area_tree.rb_root, THREAD_INITIAL_MAPPING_ADDR, len, align, virt, waste);
+	if (waste != static_cast<size_t>(-1))
+		return virt;
+
+	// Nothing fits in between; place it after the final area
+	virt = THREAD_INITIAL_MAPPING_ADDR;
+	vmarea_t* last = AreaFromNode(rb_last(&vs->vs_area_tree));
+	if (last != nullptr && AreaEnd(last) > virt)
+		virt = AreaEnd(last);
+	return RoundUpTo(virt, align);
+}
+
+vmarea_t*
+vmspace_lookup_area(vmspace_t* vs, addr_t virt)
+{
+	// Faults tend to hit the same area over and over; try our previous result first
+	thread_t* curthread = PCPU_GET(curthread);
+	vmarea_t* va = curthread->t_va_cache;
+	if (va != nullptr && curthread->t_va_cache_gen == vs->vs_area_gen &&
+	    virt >= va->va_virt && virt < va->va_virt + va->va_len)
+		return va;
+
+	struct RB_NODE* node = vs->vs_area_tree.rb_root;
+	while (node != nullptr) {
+		va = AreaFromNode(node);
+		if (virt < va->va_virt)
+			node = node->rb_left;
+		else if (virt >= va->va_virt + va->va_len)
+			node = node->rb_right;
+		else {
+			curthread->t_va_cache = va;
+			curthread->t_va_cache_gen = vs->vs_area_gen;
+			return va;
+		}
+	}
+	return nullptr;
 }
 
 errorcode_t
@@ -49,7 +362,8 @@ vmspace_create(vmspace_t** vmspace)
 	auto vs = new vmspace_t;
 	memset(vs, 0, sizeof(*vs));
 	LIST_INIT(&vs->vs_pages);
-	vs->vs_next_mapping = THREAD_INITIAL_MAPPING_ADDR;
+	rb_tree_init(&vs->vs_area_tree, vmspace_area_augment);
+	vmspace_invalidate_area_cache(vs);
 
 	errorcode_t err = md_vmspace_init(vs);
 	ANANAS_ERROR_RETURN(err);
@@ -84,56 +398,108 @@ vmspace_destroy(vmspace_t* vs)
 	kfree(vs);
 }
 
-static bool
-vmspace_free_range(vmspace_t* vs, addr_t virt, size_t len)
+errorcode_t
+vmspace_unmap(vmspace_t* vs, addr_t virt, size_t len)
 {
-	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		/*
-		 * To keep things simple, we will only break up mappings if they occur
-		 * completely within a single - this avoids complicated merging logic.
-		 */
-		if (virt >= va->va_virt + va->va_len || virt + len <= va->va_virt)
-			continue; // not within our area, skip
+	if ((virt & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	addr_t end = RoundUp(virt + len);
+	if (len == 0 || end <= virt)
+		return ANANAS_ERROR(BAD_LENGTH);
 
-		// See if this range extends before or beyond our va - if that is the case, we
-		// will reject it
-		if (virt < va->va_virt || virt + len > va->va_virt + va->va_len)
-			return false;
+	// Areas the kernel maintains for the process must stay; check before we change anything
+	for (vmarea_t* va = vmspace_find_area_after(vs, virt); va != nullptr && va->va_virt < end; va = AreaFromNode(rb_next(&va->va_rb))) {
+		if (va->va_flags & VM_FLAG_NO_CLONE)
+			return ANANAS_ERROR(BAD_ADDRESS);
+	}
 
-		// Okay, we can alter this va to exclude our mapping. If it matches 1-to-1, just throw it away
-		if (virt == va->va_virt && len == va->va_len) {
+	// Now deal with every area overlapping the range; cutting a large page may fail
+	vmarea_t* va;
+	while ((va = vmspace_find_area_after(vs, virt)) != nullptr && va->va_virt < end) {
+		errorcode_t err = ananas_success();
+		if (virt <= va->va_virt && end >= AreaEnd(va)) {
 			vmspace_area_free(vs, va);
-			return true;
+		} else if (virt <= va->va_virt) {
+			err = vmspace_area_trim_head(vs, va, end);
+		} else if (end >= AreaEnd(va)) {
+			err = vmspace_area_trim_tail(vs, va, virt);
+		} else {
+			// Range is in the middle; split off the part after it first
+			err = vmspace_area_split(vs, va, end);
+			if (ananas_is_success(err))
+				err = vmspace_area_trim_tail(vs, va, virt);
 		}
+		ANANAS_ERROR_RETURN(err);
+	}
+	return ananas_success();
+}
 
-		// Not a full match; maybe at the start?
-		if (virt == va->va_virt) {
-			// Shift the entire range, but ensure we'll honor page-boundaries
-			va->va_virt = RoundUp(va->va_virt + len);
-			va->va_len = RoundUp(va->va_len - len);
-			if (va->va_dentry != nullptr) {
-				// Backed by an inode; correct the offsets
-				va->va_doffset += len;
-				if (va->va_dlength >= len)
-					va->va_dlength -= len;
-				else
-					va->va_dlength = 0;
-				KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
-			}
+errorcode_t
+vmspace_advise(vmspace_t* vs, addr_t virt, size_t len, int advice)
+{
+	if ((virt & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	addr_t end = RoundUp(virt + len);
+	if (len == 0 || end <= virt)
+		return ANANAS_ERROR(BAD_LENGTH);
+	if (advice < VM_ADVICE_NORMAL || advice > VM_ADVICE_DONTNEED)
+		return ANANAS_ERROR(BAD_FLAG);
+
+	// Kernel-maintained areas are left alone, and only faulting areas can lose their pages
+	for (vmarea_t* va = vmspace_find_area_after(vs, virt); va != nullptr && va->va_virt < end; va = AreaFromNode(rb_next(&va->va_rb))) {
+		if (va->va_flags & VM_FLAG_NO_CLONE)
+			return ANANAS_ERROR(BAD_ADDRESS);
+		if (advice == VM_ADVICE_DONTNEED && (va->va_flags & VM_FLAG_FAULT) == 0)
+			return ANANAS_ERROR(BAD_ADDRESS);
+	}
 
-			// Make sure we will have space for our next mapping XXX
-			addr_t next_addr = va->va_virt + va->va_len;
-			if (vs->vs_next_mapping < next_addr)
-				vs->vs_next_mapping = next_addr;
-			return true;
+	vmarea_t* va;
+	while ((va = vmspace_find_area_after(vs, virt)) != nullptr && va->va_virt < end) {
+		addr_t first = virt > va->va_virt ? virt : va->va_virt;
+		addr_t last = end < AreaEnd(va) ? end : AreaEnd(va);
+		switch(advice) {
+			case VM_ADVICE_WILLNEED:
+				// Anonymous memory has nowhere to be read from
+				if (va->va_dentry != nullptr)
+					vmspace_area_prefetch(va, first, last);
+				break;
+			case VM_ADVICE_DONTNEED: {
+				// Whatever is faulted in next is zero-filled or read from the file again
+				errorcode_t err = vmspace_split_large_at(vs, va, first);
+				if (ananas_is_success(err))
+					err = vmspace_split_large_at(vs, va, last);
+				ANANAS_ERROR_RETURN(err);
+				vmspace_area_drop_pages(vs, va, first, last);
+				if (va->va_dentry != nullptr && first - va->va_virt < va->va_dlength) {
+					off_t file_first = va->va_doffset + (first - va->va_virt);
+					off_t file_last = va->va_doffset + (last - va->va_virt);
+					if (file_last > va->va_doffset + static_cast<off_t>(va->va_dlength))
+						file_last = va->va_doffset + va->va_dlength;
+					vfs_pagecache_drop(va->va_dentry->d_inode, file_first, file_last);
+				}
+				break;
+			}
+			default:
+				// The advice is kept by the area, so it needs one covering just this range
+				if (va->va_advice == advice)
+					break;
+				if (first > va->va_virt) {
+					errorcode_t err = vmspace_area_split(vs, va, first);
+					ANANAS_ERROR_RETURN(err);
+					continue; // picks up the new area next
+				}
+				if (last < AreaEnd(va)) {
+					errorcode_t err = vmspace_area_split(vs, va, last);
+					ANANAS_ERROR_RETURN(err);
+				}
+				va->va_advice = advice;
+				va->va_ra_pages = 0;
+				va->va_ra_end = 0;
+				break;
 		}
-
-		// XXX we need to cover the other use cases here as well (range at end, range in the middle)
-		panic("implement me! virt=%p..%p, va=%p..%p", virt, virt+len, va->va_virt, va->va_virt+va->va_len);
+		virt = last;
 	}
-
-	// No ranges match; this is okay
-	return true;
+	return ananas_success();
 }
 
 errorcode_t
@@ -142,9 +508,9 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, size_t len /* bytes */, uint32_t flags
 	if (len == 0)
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	// If the virtual address space is already in use, we need to break it up
-	if (!vmspace_free_range(vs, virt, len))
-		return ANANAS_ERROR(NO_SPACE);
+	// If the virtual address space is already in use, the new mapping replaces it
+	errorcode_t err = vmspace_unmap(vs, virt, len);
+	ANANAS_ERROR_RETURN(err);
 
 	auto va = new vmarea_t;
 	memset(va, 0, sizeof(*va));
@@ -154,16 +520,17 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, size_t len /* bytes */, uint32_t flags
 	 * THREAD_MAP_ALLOC flag is set; now we'll just assume that the
 	 * memory is there...
 	 */
-	LIST_INIT(&va->va_pages);
+	radix_tree_init(&va->va_pages);
+	va->va_vmspace = vs;
 	va->va_virt = virt;
 	va->va_len = len;
 	va->va_flags = flags;
 	LIST_APPEND(&vs->vs_areas, va);
+	vmspace_insert_area(vs, va);
 	TRACE(VM, INFO, "vmspace_mapto(): vs=%p, va=%p, virt=%p, flags=0x%x", vs, va, virt, flags);
 	*va_out = va;
 
-	/* Provide a mapping for the pages */
-	md_map_pages(vs, va->va_virt, 0, BytesToPages(len), 0); //(flags & VM_FLAG_FAULT) ? 0 : flags);
+	/* Page tables are not created until something is mapped in the area */
 	return ananas_success();
 }
 
@@ -254,32 +621,51 @@ vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags)
 			va_dst->va_dentry = va_src->va_dentry;
 			dentry_ref(va_dst->va_dentry);
 		}
+		va_dst->va_advice = va_src->va_advice;
+
+		// MD-specific pages are copied right away; we don't want to share things like stacks
+		if (va_src->va_flags & VM_FLAG_MD) {
+			for (struct VM_PAGE* vp = vmpage_lookup_next(va_src, 0); vp != nullptr; vp = vmpage_lookup_next(va_src, vp->vp_vaddr + vmpage_size(vp))) {
+				vmpage_lock(vp);
+				struct VM_PAGE* new_vp = vmpage_clone(va_dst, vp);
+				if (new_vp == nullptr) {
+					vmpage_unlock(vp);
+					return ANANAS_ERROR(OUT_OF_MEMORY);
+				}
+				err = vmpage_map(vs_dest, va_dst, new_vp);
+				vmpage_unlock(new_vp);
+				vmpage_unlock(vp);
+				ANANAS_ERROR_RETURN(err);
+			}
+			continue;
+		}
 
-		// Copy the area page-wise
-		LIST_FOREACH(&va_src->va_pages, vp, struct VM_PAGE) {
+		/*
+		 * Everything else is shared with the destination, which maps the pages
+		 * as it faults on them; this saves creating page tables for whatever is
+		 * never touched. Writable private pages become copy-on-write, which
+		 * means the source loses write access to all of them in one go.
+		 * Swapped out pages are read back first, as only pages used by a
+		 * single area can be in swap.
+		 */
+		bool cow = (va_src->va_flags & (VM_FLAG_PRIVATE | VM_FLAG_WRITE)) == (VM_FLAG_PRIVATE | VM_FLAG_WRITE);
+		for (struct VM_PAGE* vp = vmpage_lookup_next(va_src, 0); vp != nullptr; vp = vmpage_lookup_next(va_src, vp->vp_vaddr + vmpage_size(vp))) {
 			vmpage_lock(vp);
-			KASSERT(vmpage_get_page(vp)->p_order == 0, "unexpected %d order page here", vmpage_get_page(vp)->p_order);
-
-			// Create a clone of the data; it is up to the vmpage how to do this (it may go for COW)
-			struct VM_PAGE* new_vp = vmpage_clone(vs_source, va_src, va_dst, vp);
-
-			// Map the page into the cloned vmspace
-			vmpage_map(vs_dest, va_dst, new_vp);
-			vmpage_unlock(new_vp);
+			err = vmpage_swapin(vp);
+			if (ananas_is_failure(err)) {
+				vmpage_unlock(vp);
+				break;
+			}
+			vmpage_share(va_dst, vp, cow);
+			if ((va_dst->va_flags & VM_FLAG_FAULT) == 0)
+				err = vmpage_map(vs_dest, va_dst, vp);
 			vmpage_unlock(vp);
+			if (ananas_is_failure(err))
+				break;
 		}
-	}
-
-	/*
-	 * See where the next mapping can be placed; we should use something more
-	 * clever than vs_next_mapping someday but this will have to suffice for
-	 * now.
-	 */
-	vs_dest->vs_next_mapping = 0;
-	LIST_FOREACH(&vs_dest->vs_areas, va, vmarea_t) {
-		addr_t next = RoundUp(va->va_virt + va->va_len);
-		if (vs_dest->vs_next_mapping < next)
-			vs_dest->vs_next_mapping = next;
+		if (cow)
+			md_write_protect_pages(vs_source, va_src->va_virt, BytesToPages(va_src->va_len));
+		ANANAS_ERROR_RETURN(err);
 	}
 
 	return ananas_success();
@@ -289,19 +675,56 @@ void
 vmspace_area_free(vmspace_t* vs, vmarea_t* va)
 {
 	LIST_REMOVE(&vs->vs_areas, va);
+	vmspace_remove_area(vs, va);
 
 	/* Free any backing dentry, if we have one */
 	if (va->va_dentry != nullptr)
 		dentry_deref(va->va_dentry);
 
-	/* If the pages were allocated, we need to free them one by one */
-	LIST_FOREACH_SAFE(&va->va_pages, vp, struct VM_PAGE) {
-		vmpage_lock(vp);
-		vmpage_deref(vp);
-	}
+	/*
+	 * Remove whatever is mapped; as the pages are mapped as they are faulted,
+	 * the range may be re-used by an area which expects nothing to be there.
+	 */
+	vmspace_area_drop_pages(vs, va, va->va_virt, AreaEnd(va));
 	kfree(va);
 }
 
+void
+vmspace_account_page(vmarea_t* va, struct VM_PAGE* vp, int delta)
+{
+	// Swapped out pages aren't resident; they are accounted for once read back
+	if (vp->vp_flags & VM_PAGE_FLAG_SWAPPED)
+		return;
+
+	// Links to anything but the page cache refer to the zero page, which takes up nothing
+	struct VM_SPACE_STATS* stats = &va->va_vmspace->vs_stats;
+	unsigned long* counter = &stats->vss_anon_pages;
+	if (vp->vp_flags & VM_PAGE_FLAG_LINK) {
+		if (vp->vp_inode == nullptr)
+			return;
+		counter = &stats->vss_file_pages;
+	}
+
+	long pages = delta * static_cast<long>(vmpage_size(vp) / PAGE_SIZE);
+	__sync_fetch_and_add(counter, pages);
+	if (pages > 0) {
+		// The peak may be off by a bit if we race with another fault; that is fine
+		unsigned long resident = stats->vss_anon_pages + stats->vss_file_pages;
+		if (resident > stats->vss_max_resident)
+			stats->vss_max_resident = resident;
+	}
+}
+
+void
+vmspace_add_stats(struct VM_SPACE_STATS* dst, const struct VM_SPACE_STATS* src)
+{
+	dst->vss_minor_faults += src->vss_minor_faults;
+	dst->vss_major_faults += src->vss_major_faults;
+	dst->vss_cow_faults += src->vss_cow_faults;
+	if (src->vss_max_resident > dst->vss_max_resident)
+		dst->vss_max_resident = src->vss_max_resident;
+}
+
 void
 vmspace_dump(vmspace_t* vs)
 {
@@ -317,9 +740,8 @@ vmspace_dump(vmspace_t* vs)
 		 (va->va_flags & VM_FLAG_NO_CLONE) ? 'n' : '.',
 		 (va->va_flags & VM_FLAG_MD) ? 'm' : '.');
 		kprintf("    pages:\n");
-		LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+		for (struct VM_PAGE* vp = vmpage_lookup_next(va, 0); vp != nullptr; vp = vmpage_lookup_next(va, vp->vp_vaddr + PAGE_SIZE))
 			vmpage_dump(vp, "      ");
-		}
 	}
 }
 
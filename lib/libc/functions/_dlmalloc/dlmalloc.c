@@ -501,6 +501,13 @@ DEFAULT_MMAP_THRESHOLD       default: 256K
   empirically derived value that works well in most systems. You can
   disable mmap by setting to MAX_SIZE_T.
 
+DEFAULT_DISCARD_THRESHOLD    default: 64K
+  If DISCARD(addr, size) is defined, free chunks of at least this size
+  that end up in a bin have the whole pages inside them handed back to
+  the system using it (for example, using madvise(MADV_DONTNEED)), so
+  that they no longer take up memory; the space stays part of the heap
+  and its contents are lost. To disable, set to MAX_SIZE_T.
+
 MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
   The number of consolidated frees between checks to release
   unused segments when freeing. When using non-contiguous segments,
@@ -687,6 +694,9 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define DEFAULT_MMAP_THRESHOLD MAX_SIZE_T
 #endif  /* HAVE_MMAP */
 #endif  /* DEFAULT_MMAP_THRESHOLD */
+#ifndef DEFAULT_DISCARD_THRESHOLD
+#define DEFAULT_DISCARD_THRESHOLD ((size_t)64U * (size_t)1024U)
+#endif  /* DEFAULT_DISCARD_THRESHOLD */
 #ifndef MAX_RELEASE_CHECK_RATE
 #if HAVE_MMAP
 #define MAX_RELEASE_CHECK_RATE 4095
@@ -4342,6 +4352,24 @@ static int sys_trim(mstate m, size_t pad) {
   return (released != 0)? 1 : 0;
 }
 
+/*
+  Hand the pages inside free chunk p back to the system, leaving the
+  tree chunk fields at its start and the footer after it alone. The
+  chunk must be large enough to be a tree chunk.
+*/
+#ifdef DISCARD
+static void release_free_pages(mchunkptr p, size_t psize) {
+  if (psize >= DEFAULT_DISCARD_THRESHOLD) {
+    char* start = (char*)page_align((size_t)p + sizeof(struct malloc_tree_chunk));
+    char* end = (char*)(((size_t)p + psize) & ~(mparams.page_size - SIZE_T_ONE));
+    if (start < end)
+      DISCARD(start, (size_t)(end - start));
+  }
+}
+#else /* DISCARD */
+#define release_free_pages(p, psize)
+#endif /* DISCARD */
+
 /* Consolidate and bin a chunk. Differs from exported versions
    of free mainly in that the chunk need not be marked as inuse.
 */
@@ -4407,6 +4435,8 @@ static void dispose_chunk(mstate m, mchunkptr p, size_t psize) {
       set_free_with_pinuse(p, psize, next);
     }
     insert_chunk(m, p, psize);
+    if (!is_small(psize))
+      release_free_pages(p, psize);
   }
   else {
     CORRUPTION_ERROR_ACTION(m);
@@ -4756,6 +4786,7 @@ void dlfree(void* mem) {
             tchunkptr tp = (tchunkptr)p;
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
+            release_free_pages(p, psize);
             if (--fm->release_checks == 0)
               release_unused_segments(fm);
           }
@@ -5680,6 +5711,7 @@ void mspace_free(mspace msp, void* mem) {
             tchunkptr tp = (tchunkptr)p;
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
+            release_free_pages(p, psize);
             if (--fm->release_checks == 0)
               release_unused_segments(fm);
           }
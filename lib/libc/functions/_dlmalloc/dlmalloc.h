@@ -26,6 +26,10 @@ static inline void *MMAP( size_t nbytes )
 #define DIRECT_MMAP(s) MMAP(s)
 #define MUNMAP(a, s) ((_PDCLIB_freepages((a), (s)/_PDCLIB_MALLOC_PAGESIZE)), 0)
 #define MREMAP(a, osz, nsz, mv) _PDCLIB_reallocpages((a), (osz)/_PDCLIB_MALLOC_PAGESIZE, (nsz)/_PDCLIB_MALLOC_PAGESIZE, (mv))
+#if defined(_PDCLIB_HAVE_DISCARDPAGES)
+#define DISCARD(a, s) _PDCLIB_discardpages((a), (s)/_PDCLIB_MALLOC_PAGESIZE)
+#define DEFAULT_DISCARD_THRESHOLD _PDCLIB_MALLOC_DISCARD_THRESHOLD
+#endif
 
 #undef WIN32
 #undef _WIN32
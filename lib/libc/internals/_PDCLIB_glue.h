@@ -51,6 +51,13 @@ void _PDCLIB_freepages( void * p, size_t n );
 void * _PDCLIB_reallocpages( void* p, size_t on, size_t nn, bool mayMove);
 #endif
 
+#ifdef _PDCLIB_HAVE_DISCARDPAGES
+/* A system call which releases the memory backing the n pages pointed to by
+   p, which stay allocated; their contents are lost and read back as zero.
+*/
+void _PDCLIB_discardpages( void * p, size_t n );
+#endif
+
 /* stdio.h */
 
 /* Open the file with the given name and mode. Return the file descriptor in 
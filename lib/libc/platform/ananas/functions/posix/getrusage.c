@@ -0,0 +1,41 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscall-rusage.h>
+#include <ananas/syscalls.h>
+#include <machine/param.h>
+#include <_posix/error.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <errno.h>
+
+int getrusage(int who, struct rusage* r_usage)
+{
+	struct RUSAGE_INFO ri;
+	int ri_who;
+	switch(who) {
+		case RUSAGE_SELF:
+			ri_who = RUSAGE_INFO_SELF;
+			break;
+		case RUSAGE_CHILDREN:
+			ri_who = RUSAGE_INFO_CHILDREN;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	memset(&ri, 0, sizeof(ri));
+	ri.ri_size = sizeof(ri);
+	errorcode_t err = sys_rusage(ri_who, &ri);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+
+	/* XXX we do not keep track of CPU time yet */
+	memset(r_usage, 0, sizeof(*r_usage));
+	r_usage->ru_maxrss = ri.ri_max_resident * (PAGE_SIZE / 1024);
+	r_usage->ru_minflt = ri.ri_minor_faults;
+	r_usage->ru_majflt = ri.ri_major_faults;
+	return 0;
+}
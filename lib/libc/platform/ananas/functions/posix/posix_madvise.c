@@ -0,0 +1,13 @@
+#include <sys/mman.h>
+#include <errno.h>
+
+int posix_madvise(void* addr, size_t len, int advice)
+{
+	/* Unlike madvise(), errors are returned and errno is left alone */
+	int saved_errno = errno;
+	int result = 0;
+	if (madvise(addr, len, advice) < 0)
+		result = errno;
+	errno = saved_errno;
+	return result;
+}
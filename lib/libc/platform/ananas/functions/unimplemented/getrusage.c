@@ -1,8 +0,0 @@
-#include <sys/resource.h>
-#include <_posix/todo.h>
-
-int getrusage(int who, struct rusage *r_usage)
-{
-	TODO;
-	return -1;
-}
@@ -328,6 +328,10 @@ typedef __builtin_va_list _PDCLIB_va_list;
 #define _PDCLIB_MALLOC_MMAP_THRESHOLD 256*1024
 #define _PDCLIB_MALLOC_RELEASE_CHECK_RATE 4095
 
+/* Free chunks of at least this size have their pages discarded */
+#define _PDCLIB_HAVE_DISCARDPAGES
+#define _PDCLIB_MALLOC_DISCARD_THRESHOLD 64*1024
+
 /* TODO: Better document these */
 
 /* Locale --------------------------------------------------------------------*/
@@ -0,0 +1,58 @@
+// SUMMARY:Private mappings are copied on write after fork
+// PROVIDE-FILE: "mmap-7.txt" "ABCD"
+
+#include "framework.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+TEST_BODY_BEGIN
+{
+	int fd = open("mmap-7.txt", O_RDONLY);
+	ASSERT_NE(-1, fd);
+
+	char* anon = (char*)mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(MAP_FAILED, anon);
+	char* file = (char*)mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	ASSERT_NE(MAP_FAILED, file);
+
+	// Make sure both mappings are resident before the fork
+	for (int n = 0; n < 4; n++)
+		anon[n] = 'a' + n;
+	ASSERT_EQ('A', file[0]);
+
+	int pid = fork();
+	ASSERT_NE(-1, pid);
+
+	// Have both child and parent write their own data and check it
+	char c = (pid == 0) ? 'C' : 'P';
+	anon[0] = c;
+	file[0] = c;
+	if (pid != 0) {
+		// Let the child write first, so that we'd see its data if it is shared
+		int stat;
+		wait(&stat);
+
+		// We expect the child to exit gracefully
+		EXPECT_NE(0, WIFEXITED(stat));
+		EXPECT_EQ(0, WEXITSTATUS(stat));
+	}
+
+	ASSERT_EQ(c, anon[0]);
+	ASSERT_EQ(c, file[0]);
+	for (int n = 1; n < 4; n++) {
+		ASSERT_EQ('a' + n, anon[n]);
+		ASSERT_EQ('A' + n, file[n]);
+	}
+
+	if (pid == 0)
+		exit(0);
+
+	// Neither write may have ended up in the file itself
+	char buf[4];
+	ASSERT_EQ(4, read(fd, buf, sizeof(buf)));
+	EXPECT_EQ('A', buf[0]);
+}
+TEST_BODY_END
@@ -0,0 +1,50 @@
+// SUMMARY:Parts of a mapping can be unmapped and mapped again
+
+#include "framework.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+TEST_BODY_BEGIN
+{
+	const int num_pages = 5;
+	char* p = (char*)mmap(nullptr, num_pages * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(MAP_FAILED, p);
+	for (int n = 0; n < num_pages; n++)
+		p[n * 4096] = 'A' + n;
+
+	// Throw away the head, the tail and a page in the middle
+	const int holes[] = { 0, num_pages - 1, 2 };
+	for (int hole: holes) {
+		ASSERT_EQ(0, munmap(p + hole * 4096, 4096));
+	}
+
+	// The pages in between must still hold their data
+	EXPECT_EQ('B', p[1 * 4096]);
+	EXPECT_EQ('D', p[3 * 4096]);
+
+	// Touching any of the holes must fault
+	for (int hole: holes) {
+		int pid = fork();
+		ASSERT_NE(-1, pid);
+		if (pid == 0) {
+			volatile char* c = p + hole * 4096;
+			*c = 'X'; // this should crash
+			exit(0);
+		}
+
+		int stat;
+		wait(&stat);
+
+		// We expect the child to exit with a signal
+		EXPECT_NE(0, WIFSIGNALED(stat));
+	}
+
+	// A new page must be placed in one of the holes, and it must be empty
+	char* q = (char*)mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(MAP_FAILED, q);
+	EXPECT_NE(0, q == p || q == p + 2 * 4096 || q == p + (num_pages - 1) * 4096);
+	EXPECT_EQ(0, q[0]);
+}
+TEST_BODY_END
@@ -0,0 +1,35 @@
+// SUMMARY:Discarded pages read back as zeroes or as file data
+// PROVIDE-FILE: "mmap-9.txt" "ABCD"
+
+#include "framework.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+TEST_BODY_BEGIN
+{
+	char* anon = (char*)mmap(nullptr, 2 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(MAP_FAILED, anon);
+	for (int n = 0; n < 2 * 4096; n++)
+		anon[n] = 'X';
+
+	// Anonymous memory must come back zeroed
+	ASSERT_EQ(0, madvise(anon, 2 * 4096, MADV_DONTNEED));
+	for (int n = 0; n < 2 * 4096; n++) {
+		ASSERT_EQ(0, anon[n]);
+	}
+
+	int fd = open("mmap-9.txt", O_RDONLY);
+	ASSERT_NE(-1, fd);
+	char* file = (char*)mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	ASSERT_NE(MAP_FAILED, file);
+	for (int n = 0; n < 4; n++)
+		file[n] = 'X';
+
+	// File-backed memory must come back with the file data
+	ASSERT_EQ(0, madvise(file, 4096, MADV_DONTNEED));
+	for (int n = 0; n < 4; n++) {
+		ASSERT_EQ('A' + n, file[n]);
+	}
+}
+TEST_BODY_END